@@ -50,6 +50,8 @@ uint32_t hash_md5(const char *key, size_t key_length);
 uint32_t hash_crc16(const char *key, size_t key_length);
 uint32_t hash_crc32(const char *key, size_t key_length);
 uint32_t hash_crc32a(const char *key, size_t key_length);
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
 uint32_t hash_fnv1_64(const char *key, size_t key_length);
 uint32_t hash_fnv1a_64(const char *key, size_t key_length);
 uint32_t hash_fnv1_32(const char *key, size_t key_length);
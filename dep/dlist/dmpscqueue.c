@@ -0,0 +1,146 @@
+#include <stdlib.h>
+
+#include <dmalloc.h>
+
+#include <dmpscqueue.h>
+
+/* The cells sequence numbers tell the producers and the consumer
+ * who owns the cell, see Dmitry Vyukov's bounded MPMC queue:
+ * seq == pos: the cell is free for the producer at position 'pos';
+ * seq == pos+1: the cell is filled for the consumer at position 'pos'. */
+
+#if defined(__ATOMIC_ACQUIRE)
+#define dmpsc_load_relaxed(_ptr) __atomic_load_n(_ptr, __ATOMIC_RELAXED)
+#define dmpsc_load_acquire(_ptr) __atomic_load_n(_ptr, __ATOMIC_ACQUIRE)
+#define dmpsc_store_release(_ptr, _v) __atomic_store_n(_ptr, _v, __ATOMIC_RELEASE)
+#define dmpsc_cas(_ptr, _old, _new) \
+    __atomic_compare_exchange_n(_ptr, &(_old), _new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define dmpsc_load_relaxed(_ptr) (*(volatile typeof(*(_ptr)) *)(_ptr))
+#define dmpsc_load_acquire(_ptr) __sync_add_and_fetch(_ptr, 0)
+#define dmpsc_store_release(_ptr, _v) do {      \
+    __sync_synchronize();                       \
+    *(volatile typeof(*(_ptr)) *)(_ptr) = (_v); \
+} while(0)
+#define dmpsc_cas(_ptr, _old, _new) __sync_bool_compare_and_swap(_ptr, _old, _new)
+#endif
+
+/* The size is rounded up to the next power of two. */
+dmpscqueue *dmpscqueue_create(long long size)
+{
+    dmpscqueue *queue;
+    unsigned long long capacity = 2, j;
+
+    if (size <= 0) {
+        return NULL;
+    }
+
+    while (capacity < (unsigned long long)size) {
+        capacity <<= 1;
+    }
+
+    queue = dalloc(sizeof(*queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->cells = dalloc(sizeof(dmpscqueue_cell)*capacity);
+    if (queue->cells == NULL) {
+        dfree(queue);
+        return NULL;
+    }
+
+    for (j = 0; j < capacity; j ++) {
+        queue->cells[j].seq = j;
+        queue->cells[j].value = NULL;
+    }
+    queue->mask = capacity - 1;
+    queue->tail = 0;
+    queue->head = 0;
+
+    return queue;
+}
+
+/* Safe to be called by any thread. Return -1 if the queue is full,
+ * otherwise the queue length after the push. */
+long long dmpscqueue_push(void *q, void *value)
+{
+    dmpscqueue *queue = q;
+    dmpscqueue_cell *cell;
+    unsigned long long pos, seq;
+    long long diff;
+
+    pos = dmpsc_load_relaxed(&queue->tail);
+    while (1) {
+        cell = &queue->cells[pos&queue->mask];
+        seq = dmpsc_load_acquire(&cell->seq);
+        diff = (long long)(seq - pos);
+        if (diff == 0) {
+            if (dmpsc_cas(&queue->tail, pos, pos+1)) break;
+        } else if (diff < 0) {
+            /* The consumer did not free this cell yet. */
+            return -1;
+        } else {
+            pos = dmpsc_load_relaxed(&queue->tail);
+        }
+    }
+
+    cell->value = value;
+    dmpsc_store_release(&cell->seq, pos+1);
+
+    return (long long)(pos + 1 - dmpsc_load_relaxed(&queue->head));
+}
+
+/* Must be called just by the consumer thread.
+ * Return NULL if the queue is empty. */
+void *dmpscqueue_pop(void *q)
+{
+    dmpscqueue *queue = q;
+    dmpscqueue_cell *cell;
+    unsigned long long pos, seq;
+    void *value;
+
+    pos = queue->head;
+    cell = &queue->cells[pos&queue->mask];
+    seq = dmpsc_load_acquire(&cell->seq);
+    if (seq != pos+1) {
+        return NULL;
+    }
+
+    value = cell->value;
+    dmpsc_store_release(&cell->seq, pos+queue->mask+1);
+    dmpsc_store_release(&queue->head, pos+1);
+
+    return value;
+}
+
+void dmpscqueue_destroy(void *q)
+{
+    dmpscqueue *queue = q;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    if (queue->cells != NULL) {
+        dfree(queue->cells);
+    }
+
+    dfree(queue);
+}
+
+/* The length is exact just if called by the consumer thread. */
+long long dmpscqueue_length(void *q)
+{
+    dmpscqueue *queue = q;
+    unsigned long long head, tail;
+
+    if (queue == NULL) {
+        return -1;
+    }
+
+    head = dmpsc_load_acquire(&queue->head);
+    tail = dmpsc_load_acquire(&queue->tail);
+
+    return tail > head ? (long long)(tail - head) : 0;
+}
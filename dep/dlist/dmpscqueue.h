@@ -0,0 +1,29 @@
+#ifndef _DMPSCQUEUE_H_
+#define _DMPSCQUEUE_H_
+
+#define DMPSCQUEUE_CACHELINE_SIZE   64
+
+typedef struct dmpscqueue_cell{
+    unsigned long long seq;
+    void *value;
+} dmpscqueue_cell;
+
+/* Bounded lock-free queue with multiple producers and a single consumer.
+ * The producers and the consumer index live in different cache lines. */
+typedef struct dmpscqueue{
+    dmpscqueue_cell *cells;
+    unsigned long long mask;
+    char pad0[DMPSCQUEUE_CACHELINE_SIZE];
+    unsigned long long tail;    /* Next position to push, the producers */
+    char pad1[DMPSCQUEUE_CACHELINE_SIZE];
+    unsigned long long head;    /* Next position to pop, the consumer */
+    char pad2[DMPSCQUEUE_CACHELINE_SIZE];
+} dmpscqueue;
+
+dmpscqueue *dmpscqueue_create(long long size);
+long long dmpscqueue_push(void *q, void *value);
+void *dmpscqueue_pop(void *q);
+void dmpscqueue_destroy(void *q);
+long long dmpscqueue_length(void *q);
+
+#endif
@@ -5,6 +5,7 @@
 #include <dlist.h>
 #include <dmtqueue.h>
 #include <dlockqueue.h>
+#include <dmpscqueue.h>
 
 /******** multi-thread safe queue interface ********/
 dmtqueue *dmtqueue_create(void)
@@ -116,3 +117,29 @@ int dmtqueue_init_with_lockqueue(dmtqueue *q, dlockqueue_freefunc freefunc)
     
     return 0;
 }
+
+/**
+* This is bounded lock-free queue, multiple threads can push
+* but only one thread can pop. Push fails if the queue is full.
+*/
+int dmtqueue_init_with_mpscqueue(dmtqueue *q, long long size)
+{
+    dmpscqueue *mq;
+
+    if (q == NULL) {
+        return -1;
+    }
+
+    mq = dmpscqueue_create(size);
+    if (mq == NULL) {
+        return -1;
+    }
+
+    q->l = mq;
+    q->lock_push = dmpscqueue_push;
+    q->lock_pop = dmpscqueue_pop;
+    q->destroy = dmpscqueue_destroy;
+    q->length = dmpscqueue_length;
+
+    return 0;
+}
@@ -32,5 +32,6 @@ long long dmtqueue_length(dmtqueue *q);
 
 typedef void (*dlockqueue_freefunc)(void *);
 int dmtqueue_init_with_lockqueue(dmtqueue *l, dlockqueue_freefunc freefunc);
+int dmtqueue_init_with_mpscqueue(dmtqueue *l, long long size);
 
 #endif
@@ -12,17 +12,72 @@
 #include <dmalloc.h>
 
 /*memory api*/
-static size_t used_memory = 0;
+
+/* The used memory is counted in per thread shards, every shard in its
+ * own cache line, so the threads allocating and freeing memory do not
+ * bounce a single global counter between the cpus. A shard is folded
+ * into used_memory once its value drifts more than DMALLOC_SHARD_DRIFT
+ * bytes, so used_memory alone is a fast read with an error of at most
+ * DMALLOC_SHARD_DRIFT bytes per shard, while dalloc_used_memory() also
+ * sums the shards. Threads beyond DMALLOC_SHARDS share the shards. */
+#define DMALLOC_SHARDS          64
+#define DMALLOC_SHARD_DRIFT     (64*1024)
+#define DMALLOC_CACHELINE_SIZE  64
+
+typedef struct dmalloc_shard {
+    long long used;
+    char pad[DMALLOC_CACHELINE_SIZE-sizeof(long long)];
+} dmalloc_shard;
+
+static long long used_memory = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+static dmalloc_shard used_memory_shards[DMALLOC_SHARDS] 
+    __attribute__((aligned(DMALLOC_CACHELINE_SIZE)));
+static unsigned int used_memory_next_shard = 0;
+static __thread dmalloc_shard *used_memory_shard = NULL;
+#endif
+
 #if defined(__ATOMIC_RELAXED)
-#define update_used_mem_stat_add(__n) __atomic_add_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
-#define update_used_mem_stat_sub(__n) __atomic_sub_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
+#define dmalloc_atomic_add(_ptr, _n) __atomic_add_fetch(_ptr, (_n), __ATOMIC_RELAXED)
+#define dmalloc_atomic_xchg(_ptr, _n) __atomic_exchange_n(_ptr, (_n), __ATOMIC_RELAXED)
+#define dmalloc_atomic_get(_ptr) __atomic_load_n(_ptr, __ATOMIC_RELAXED)
 char *malloc_lock_type(void) {return "__ATOMIC_RELAXED";}
 #elif defined(HAVE_ATOMIC)
-#define update_used_mem_stat_add(__n) __sync_add_and_fetch(&used_memory, (__n))
-#define update_used_mem_stat_sub(__n) __sync_sub_and_fetch(&used_memory, (__n))
+#define dmalloc_atomic_add(_ptr, _n) __sync_add_and_fetch(_ptr, (_n))
+#define dmalloc_atomic_xchg(_ptr, _n) __sync_lock_test_and_set(_ptr, (_n))
+#define dmalloc_atomic_get(_ptr) __sync_add_and_fetch(_ptr, 0)
 char *malloc_lock_type(void) {return "HAVE_ATOMIC";}
+#endif
+
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+static inline dmalloc_shard *
+dmalloc_shard_get(void)
+{
+    if (used_memory_shard == NULL) {
+        unsigned int idx = dmalloc_atomic_add(&used_memory_next_shard, 1);
+        used_memory_shard = &used_memory_shards[(idx-1)%DMALLOC_SHARDS];
+    }
+
+    return used_memory_shard;
+}
+
+static inline void
+dmalloc_shard_update(long long n)
+{
+    dmalloc_shard *shard = dmalloc_shard_get();
+    long long used;
+
+    used = dmalloc_atomic_add(&shard->used, n);
+    if (used > DMALLOC_SHARD_DRIFT || used < -DMALLOC_SHARD_DRIFT) {
+        used = dmalloc_atomic_xchg(&shard->used, 0);
+        dmalloc_atomic_add(&used_memory, used);
+    }
+}
+
+#define update_used_mem_stat_add(__n) dmalloc_shard_update((long long)(__n))
+#define update_used_mem_stat_sub(__n) dmalloc_shard_update(-(long long)(__n))
 #else
 #define update_used_mem_stat_add(__n) do {      \
     pthread_mutex_lock(&used_memory_mutex);     \
@@ -203,20 +258,74 @@ _dfree(void *ptr, const char *name, int line)
 #endif
 }
 
+/* Account memory not coming from dalloc(), like the slots of the slab
+ * pools, so that used_memory and maxmemory still see it. */
+void
+dalloc_stat_alloc(size_t size)
+{
+    update_dmalloc_stat_alloc(size);
+}
+
+void
+dalloc_stat_free(size_t size)
+{
+    update_dmalloc_stat_free(size);
+}
+
+/* Return the used memory summing all the shards, exact but for the
+ * updates racing with the call. */
 size_t
 dalloc_used_memory(void)
 {
-    size_t um;
+    long long um;
 
 #if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
-    um = update_used_mem_stat_add(0);
+    int j;
+
+    um = dmalloc_atomic_get(&used_memory);
+    for (j = 0; j < DMALLOC_SHARDS; j ++) {
+        um += dmalloc_atomic_get(&used_memory_shards[j].used);
+    }
 #else
     pthread_mutex_lock(&used_memory_mutex);
     um = used_memory;
     pthread_mutex_unlock(&used_memory_mutex);
 #endif
 
-    return um;
+    return um > 0 ? (size_t)um : 0;
+}
+
+/* Return the used memory without reading the shards, for the hot paths
+ * like the maxmemory checks. It is off by at most dalloc_used_memory_error()
+ * bytes. */
+size_t
+dalloc_used_memory_fast(void)
+{
+    long long um;
+
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+    um = dmalloc_atomic_get(&used_memory);
+#else
+    pthread_mutex_lock(&used_memory_mutex);
+    um = used_memory;
+    pthread_mutex_unlock(&used_memory_mutex);
+#endif
+
+    return um > 0 ? (size_t)um : 0;
+}
+
+/* The max error of dalloc_used_memory_fast(), given the shards in use. */
+size_t
+dalloc_used_memory_error(void)
+{
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+    unsigned int shards = dmalloc_atomic_get(&used_memory_next_shard);
+
+    if (shards > DMALLOC_SHARDS) shards = DMALLOC_SHARDS;
+    return (size_t)shards*DMALLOC_SHARD_DRIFT;
+#else
+    return 0;
+#endif
 }
 
 /* Returns the size of physical memory (RAM) in bytes.
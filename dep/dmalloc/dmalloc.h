@@ -64,7 +64,12 @@ void *_dcalloc(size_t nmemb, size_t size, const char *name, int line);
 void *_drealloc(void *ptr, size_t size, const char *name, int line);
 void _dfree(void *ptr, const char *name, int line);
 
+void dalloc_stat_alloc(size_t size);
+void dalloc_stat_free(size_t size);
+
 size_t dalloc_used_memory(void);
+size_t dalloc_used_memory_fast(void);
+size_t dalloc_used_memory_error(void);
 
 size_t dalloc_get_memory_size(void);
 
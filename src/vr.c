@@ -458,6 +458,16 @@ vr_pre_run(struct instance *nci)
         return VR_ERROR;
     }
 
+    ret = loadDataFromDisk();
+    if (ret != VR_OK) {
+        return VR_ERROR;
+    }
+
+    ret = aofInit();
+    if (ret != VR_OK) {
+        return VR_ERROR;
+    }
+
     vr_print_run(nci);
 
     return VR_OK;
@@ -497,6 +507,7 @@ vr_run(struct instance *nci)
     master_run();
     workers_run();
     backends_run();
+    replication_run();
 
     /* wait for the threads finish */
     workers_wait();
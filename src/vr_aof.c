@@ -1,3 +1,6 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <vr_core.h>
 
 /* Return the current size of the AOF rewrite buffer. */
@@ -23,11 +26,12 @@ unsigned long aofRewriteBufferSize(void) {
  * file, and the time is always absolute and not relative. */
 sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, robj *seconds) {
     long long when;
-    robj *argv[3];
+    robj *argv[3], *decoded;
 
     /* Make sure we can use strtoll */
-    seconds = getDecodedObject(seconds);
-    when = strtoll(seconds->ptr,NULL,10);
+    decoded = getDecodedObject(seconds);
+    when = strtoll(decoded->ptr,NULL,10);
+    if (decoded != seconds) freeObject(decoded);
     /* Convert argument into milliseconds for EXPIRE, SETEX, EXPIREAT */
     if (cmd->proc == expireCommand || cmd->proc == setexCommand ||
         cmd->proc == expireatCommand)
@@ -40,14 +44,13 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
     {
         when += vr_msec_now();
     }
-    decrRefCount(seconds);
 
     argv[0] = createStringObject("PEXPIREAT",9);
     argv[1] = key;
     argv[2] = createStringObjectFromLongLong(when);
     buf = catAppendOnlyGenericCommand(buf, 3, argv);
-    decrRefCount(argv[0]);
-    decrRefCount(argv[2]);
+    freeObject(argv[0]);
+    freeObject(argv[2]);
     return buf;
 }
 
@@ -71,43 +74,17 @@ sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
         dst = sdscatlen(dst,buf,len);
         dst = sdscatlen(dst,o->ptr,sdslen(o->ptr));
         dst = sdscatlen(dst,"\r\n",2);
-        decrRefCount(o);
+        if (o != argv[j]) freeObject(o);
     }
     return dst;
 }
 
-/* Event handler used to send data to the child process doing the AOF
- * rewrite. We send pieces of our AOF differences buffer so that the final
- * write when the child finishes the rewrite will be small. */
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
-    dlistNode *ln;
-    aofrwblock *block;
-    ssize_t nwritten;
-    UNUSED(el);
-    UNUSED(fd);
-    UNUSED(privdata);
-    UNUSED(mask);
-
-    while(1) {
-        ln = dlistFirst(server.aof_rewrite_buf_blocks);
-        block = ln ? ln->value : NULL;
-        if (server.aof_stop_sending_diff || !block) {
-            aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,
-                              AE_WRITABLE);
-            return;
-        }
-        if (block->used > 0) {
-            nwritten = vr_write(server.aof_pipe_write_data_to_child,
-                             block->buf,block->used);
-            if (nwritten <= 0) return;
-            memmove(block->buf,block->buf+nwritten,block->used-nwritten);
-            block->used -= nwritten;
-        }
-        if (block->used == 0) dlistDelNode(server.aof_rewrite_buf_blocks,ln);
-    }
+static void aofRewriteBlockFree(void *block) {
+    dfree(block);
 }
 
-/* Append data to the AOF rewrite buffer, allocating new blocks if needed. */
+/* Append data to the AOF rewrite buffer, allocating new blocks if needed.
+ * Called with aof_rw_lock held. */
 void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
     dlistNode *ln = dlistLast(server.aof_rewrite_buf_blocks);
     aofrwblock *block = ln ? ln->value : NULL;
@@ -145,62 +122,1851 @@ void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
             }
         }
     }
+}
 
-    /* Install a file event to send data to the rewrite child if there is
-     * not one already. */
-    if (aeGetFileEvents(server.el,server.aof_pipe_write_data_to_child) == 0) {
-        aeCreateFileEvent(server.el, server.aof_pipe_write_data_to_child,
-            AE_WRITABLE, aofChildWriteDiffData, NULL);
-    }
+/* ----------------------------------------------------------------------------
+ * Multithreaded AOF
+ *
+ * Every worker appends the commands propagated by a call() to its own
+ * record, and hands the record to the writer thread with a lock free
+ * queue at the end of the call. The writer merges the queues of all the
+ * workers in one stream, appends it to the file and fsyncs it.
+ *
+ * The records are merged by sequence number: a worker takes the next
+ * number of the global counter every time it locks a db for writing, so
+ * two writes of the same key are numbered in the order they were done.
+ * While a worker is inside a call it publishes in 'aof_pending' the lowest
+ * number its record can get, and the writer does not append the records
+ * of the other workers numbered from it on until the record is queued.
+ *
+ * The same stream feeds the replication backlog, so the stream runs when
+ * the AOF is on or once a slave connected, see aofStartStream(). The
+ * replication thread of a slave queues the writes of its master as the
+ * workers do. The backends queue the DELs of the keys they expire or
+ * evict, numbered when fed since most of their jobs write nothing.
+ * ------------------------------------------------------------------------- */
+
+#if defined(__ATOMIC_SEQ_CST)
+#define aof_atomic_load(_ptr) __atomic_load_n(_ptr,__ATOMIC_SEQ_CST)
+#define aof_atomic_store(_ptr,_val) __atomic_store_n(_ptr,_val,__ATOMIC_SEQ_CST)
+#define aof_atomic_incr(_ptr) __atomic_add_fetch(_ptr,1,__ATOMIC_SEQ_CST)
+#define aof_atomic_decr(_ptr) __atomic_sub_fetch(_ptr,1,__ATOMIC_SEQ_CST)
+#else
+#define aof_atomic_load(_ptr) (__sync_synchronize(),*(volatile typeof(*(_ptr))*)(_ptr))
+#define aof_atomic_store(_ptr,_val) do {            \
+    *(volatile typeof(*(_ptr))*)(_ptr) = (_val);    \
+    __sync_synchronize();                           \
+} while(0)
+#define aof_atomic_incr(_ptr) __sync_add_and_fetch(_ptr,1)
+#define aof_atomic_decr(_ptr) __sync_sub_and_fetch(_ptr,1)
+#endif
+
+static unsigned long long aof_seq = 0;     /* Last sequence number taken */
+
+static vr_thread aof_writer;
+static int aof_writer_started = 0;
+static vr_eventloop **aof_writer_vels;    /* Eventloops queueing records */
+static uint32_t aof_writer_nvels;
+static pthread_mutex_t aof_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aof_writer_cond = PTHREAD_COND_INITIALIZER;   /* Wakes up the writer */
+static pthread_cond_t aof_synced_cond = PTHREAD_COND_INITIALIZER;   /* Records written */
+static int aof_writer_signaled = 0;
+static aofRecord **aof_writer_heads;       /* Next record of every eventloop */
+static unsigned long long *aof_writer_last; /* Last seq appended of every eventloop */
+static conf_cache aof_writer_cc;
+
+/* AOF rewrite state, see aofRewriteStart(). Shared by the backend that
+ * drives the dump of the dataset and the writer that buffers the diff,
+ * the fields are protected by aof_rw_lock. */
+static pthread_mutex_t aof_rw_lock = PTHREAD_MUTEX_INITIALIZER;
+static int aof_rw_state = AOF_RW_NONE;
+static int aof_rw_scheduled = 0;           /* AOF_RW_FOR_* waiting to start */
+static int aof_rw_purpose;                 /* AOF_RW_FOR_* of this rewrite */
+static long long aof_rw_repl_offset;       /* Stream offset of a snapshot, or -1 */
+static unsigned long long aof_rw_id = 0;   /* Incremented by every rewrite */
+static unsigned long long aof_rw_seq;      /* Last record in the base */
+static int aof_rw_diff_db;                 /* DB selected in the diff, writer only */
+static int aof_rw_fd = -1;                 /* Temp file of the rewrite */
+static sds aof_rw_tmpfile;
+static aofRewriteDb *aof_rw_dbs;           /* Backend only */
+static long long *aof_rw_chunks;           /* Length of the dump of every db */
+static int aof_rw_nchunks;
+
+/* Threads dumping the dbs, see aofRewriteDumperRun(). */
+static struct aofRewriteDumper *aof_rw_dumpers;    /* Backend only */
+static int aof_rw_ndumpers;
+static int aof_rw_next_db;                 /* Next db to dump */
+static int aof_rw_dumpers_left;            /* Dumpers still running */
+static int aof_rw_dumped;                  /* The dumps are joined */
+static int aof_rw_dump_status;             /* VR_OK if they were joined */
+
+static int aofWriteAll(int fd, const char *buf, size_t len);
+static void aofRewriteSwitch(void);
+
+static sds catAppendOnlySelectCommand(sds buf, int dictid) {
+    char seldb[64];
+
+    snprintf(seldb,sizeof(seldb),"%d",dictid);
+    return sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
+        (unsigned long)strlen(seldb),seldb);
+}
+
+/* Called with a db write lock held, see lockDbWrite(). */
+void aofWriteLocked(vr_eventloop *vel) {
+    /* Publish the lower bound before taking the number, so the writer
+     * either sees the bound or a counter still below our number. */
+    if (vel->aof_pending == 0)
+        aof_atomic_store(&vel->aof_pending,aof_atomic_load(&aof_seq)+1);
+    vel->aof_seq = aof_atomic_incr(&aof_seq);
 }
 
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
-    sds buf = sdsempty();
+    vr_eventloop *vel = current_vel;
+    aofRecord *rec;
     robj *tmpargv[3];
 
-    /* The DB this command was targeting is not the same as the last command
-     * we appended. To issue a SELECT command is needed. */
-    if (dictid != server.aof_selected_db) {
-        char seldb[64];
+    if (vel == NULL || vel->aof_queue == NULL) return;
 
-        snprintf(seldb,sizeof(seldb),"%d",dictid);
-        buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
-            (unsigned long)strlen(seldb),seldb);
-        server.aof_selected_db = dictid;
+    /* Commands propagated without writing a db, like the forced ones,
+     * are ordered after everything done before them. */
+    if (vel->aof_pending == 0) aofWriteLocked(vel);
+
+    rec = vel->aof_record;
+    if (rec == NULL) {
+        rec = dalloc(sizeof(*rec));
+        rec->seq = 0;
+        rec->dbid = rec->lastdbid = dictid;
+        rec->buf = sdsempty();
+        vel->aof_record = rec;
+    } else if (dictid != rec->lastdbid) {
+        /* The DB this command was targeting is not the same as the last
+         * command we appended. To issue a SELECT command is needed. The
+         * writer selects the DB of the first command. */
+        rec->buf = catAppendOnlySelectCommand(rec->buf,dictid);
+        rec->lastdbid = dictid;
     }
 
     if (cmd->proc == expireCommand || cmd->proc == pexpireCommand ||
         cmd->proc == expireatCommand) {
         /* Translate EXPIRE/PEXPIRE/EXPIREAT into PEXPIREAT */
-        buf = catAppendOnlyExpireAtCommand(buf,cmd,argv[1],argv[2]);
+        rec->buf = catAppendOnlyExpireAtCommand(rec->buf,cmd,argv[1],argv[2]);
     } else if (cmd->proc == setexCommand || cmd->proc == psetexCommand) {
         /* Translate SETEX/PSETEX to SET and PEXPIREAT */
         tmpargv[0] = createStringObject("SET",3);
         tmpargv[1] = argv[1];
         tmpargv[2] = argv[3];
-        buf = catAppendOnlyGenericCommand(buf,3,tmpargv);
-        decrRefCount(tmpargv[0]);
-        buf = catAppendOnlyExpireAtCommand(buf,cmd,argv[1],argv[2]);
+        rec->buf = catAppendOnlyGenericCommand(rec->buf,3,tmpargv);
+        freeObject(tmpargv[0]);
+        rec->buf = catAppendOnlyExpireAtCommand(rec->buf,cmd,argv[1],argv[2]);
     } else {
         /* All the other commands don't need translation or need the
          * same translation already operated in the command vector
          * for the replication itself. */
-        buf = catAppendOnlyGenericCommand(buf,argc,argv);
+        rec->buf = catAppendOnlyGenericCommand(rec->buf,argc,argv);
+    }
+}
+
+/* Hand the record of the current call to the writer thread, and let
+ * the writer go on with the records of the other workers. */
+void aofCallDone(vr_eventloop *vel) {
+    aofRecord *rec = vel->aof_record;
+
+    if (vel->aof_queue == NULL) return;
+
+    if (rec != NULL) {
+        rec->seq = vel->aof_seq;
+        vel->aof_fed_seq = rec->seq;
+        vel->aof_record = NULL;
+        while (dmtqueue_push(vel->aof_queue,rec) < 0) {
+            /* The writer is behind, give it some time. */
+            pthread_mutex_lock(&aof_writer_lock);
+            aof_writer_signaled = 1;
+            pthread_cond_signal(&aof_writer_cond);
+            pthread_mutex_unlock(&aof_writer_lock);
+            usleep(100);
+        }
+        vel->aof_wake = 1;
+    }
+
+    if (vel->aof_pending != 0) aof_atomic_store(&vel->aof_pending,0);
+}
+
+/* Called by the workers before sleeping, so before the replies of the
+ * commands of this loop are written. With appendfsync always the worker
+ * waits its records to be on disk. All the workers waiting at the same
+ * time share the same write and fsync. */
+void aofBeforeSleep(vr_eventloop *vel) {
+    if (vel->aof_queue == NULL) return;
+
+    aofCallDone(vel);
+    if (!vel->aof_wake) return;
+    vel->aof_wake = 0;
+
+    pthread_mutex_lock(&aof_writer_lock);
+    aof_writer_signaled = 1;
+    pthread_cond_signal(&aof_writer_cond);
+    if (server.aof_state == AOF_ON &&
+        vel->cc.appendfsync == AOF_FSYNC_ALWAYS) {
+        while (vel->aof_synced_seq < vel->aof_fed_seq)
+            pthread_cond_wait(&aof_synced_cond,&aof_writer_lock);
+    }
+    pthread_mutex_unlock(&aof_writer_lock);
+}
+
+/* Move the records that can be appended from the queues to the AOF
+ * buffer and to the replication backlog, in sequence number order. The
+ * records of an eventloop are queued in order, so the head of every
+ * queue is its lowest record. A record is appended once no other
+ * eventloop can still queue a lower one, that is its number is below the
+ * bound published by the eventloops inside a call, and not above the
+ * counter read before the bounds. So after a merge every record numbered
+ * up to the lowest bound is appended.
+ *
+ * Return 1 if some records have to wait for the other eventloops. */
+static int aofWriterMerge(void) {
+    uint32_t idx, nvels = aof_writer_nvels;
+    unsigned long long top, pending, bound, min1 = ULLONG_MAX, min2 = ULLONG_MAX;
+    unsigned long long *bounds;
+    uint32_t min1idx = nvels;
+    vr_eventloop *vel;
+    aofRecord *rec;
+    int pick, rewriting, snapshot, replon;
+    unsigned long long rwid, rwseq;
+    long long reploff = 0, snapoff = -1;
+    sds diff = NULL, replbuf = NULL;
+
+    bounds = dalloc(sizeof(*bounds)*nvels);
+    top = aof_atomic_load(&aof_seq);
+
+    /* The records taken after a rewrite started are buffered also for the
+     * new file, and the snapshot of a full resync starts from the stream
+     * offset of the first of them. Read after the counter, so a record
+     * below 'top' numbered after the start is seen here as part of it. */
+    pthread_mutex_lock(&aof_rw_lock);
+    rewriting = aof_rw_state == AOF_RW_BASE || aof_rw_state == AOF_RW_SWITCH;
+    snapshot = rewriting && aof_rw_purpose == AOF_RW_FOR_REPL &&
+        aof_rw_repl_offset == -1;
+    rewriting = rewriting && aof_rw_purpose == AOF_RW_FOR_AOF;
+    rwid = aof_rw_id;
+    rwseq = aof_rw_seq;
+    pthread_mutex_unlock(&aof_rw_lock);
+    if (rewriting) diff = sdsempty();
+
+    replon = replicationBacklogEnabled();
+    if (replon) {
+        replbuf = sdsempty();
+        reploff = repl.master_repl_offset;
+    } else {
+        snapshot = 0;
+    }
+
+    for (idx = 0; idx < nvels; idx ++) {
+        vel = aof_writer_vels[idx];
+        pending = aof_atomic_load(&vel->aof_pending);
+        if (pending == 0) continue;
+        if (pending-1 < min1) {
+            min2 = min1;
+            min1 = pending-1;
+            min1idx = idx;
+        } else if (pending-1 < min2) {
+            min2 = pending-1;
+        }
+    }
+
+    /* The records of an eventloop are never held back by its own bound. */
+    for (idx = 0; idx < nvels; idx ++) {
+        bound = idx == min1idx ? min2 : min1;
+        bounds[idx] = bound < top ? bound : top;
+    }
+
+    while (1) {
+        pick = -1;
+        for (idx = 0; idx < nvels; idx ++) {
+            vel = aof_writer_vels[idx];
+            if (aof_writer_heads[idx] == NULL)
+                aof_writer_heads[idx] = dmtqueue_pop(vel->aof_queue);
+            rec = aof_writer_heads[idx];
+            if (rec == NULL || rec->seq > bounds[idx]) continue;
+            if (pick == -1 || rec->seq < aof_writer_heads[pick]->seq)
+                pick = (int)idx;
+        }
+        if (pick == -1) break;
+
+        rec = aof_writer_heads[pick];
+        if (server.aof_state == AOF_ON) {
+            if (rec->dbid != server.aof_selected_db)
+                server.aof_buf = catAppendOnlySelectCommand(server.aof_buf,rec->dbid);
+            server.aof_buf = sdscatsds(server.aof_buf,rec->buf);
+            server.aof_selected_db = rec->lastdbid;
+        }
+        if (rewriting && rec->seq > rwseq) {
+            if (rec->dbid != aof_rw_diff_db)
+                diff = catAppendOnlySelectCommand(diff,rec->dbid);
+            diff = sdscatsds(diff,rec->buf);
+            aof_rw_diff_db = rec->lastdbid;
+        }
+        if (replon) {
+            /* The slaves loading the snapshot start here, with no DB
+             * selected yet. */
+            if (snapshot && snapoff == -1 && rec->seq > rwseq) {
+                snapoff = reploff+(long long)sdslen(replbuf);
+                repl.slaveseldb = -1;
+            }
+            if (rec->dbid != repl.slaveseldb)
+                replbuf = catAppendOnlySelectCommand(replbuf,rec->dbid);
+            replbuf = sdscatsds(replbuf,rec->buf);
+            repl.slaveseldb = rec->lastdbid;
+        }
+        aof_writer_last[pick] = rec->seq;
+        aof_writer_heads[pick] = NULL;
+        sdsfree(rec->buf);
+        dfree(rec);
+    }
+    dfree(bounds);
+
+    /* No record after the snapshot yet, but all the ones before it are
+     * in the stream. */
+    if (snapshot && snapoff == -1 && rwseq <= min1 && rwseq <= top) {
+        snapoff = reploff+(long long)sdslen(replbuf);
+        repl.slaveseldb = -1;
+    }
+
+    if (diff != NULL) {
+        pthread_mutex_lock(&aof_rw_lock);
+        if (aof_rw_id == rwid && aof_rw_state != AOF_RW_NONE)
+            aofRewriteBufferAppend((unsigned char*)diff,sdslen(diff));
+        pthread_mutex_unlock(&aof_rw_lock);
+        sdsfree(diff);
+    }
+
+    if (replbuf != NULL) {
+        if (sdslen(replbuf) > 0) {
+            replicationBacklogAppend(replbuf,sdslen(replbuf));
+            replicationWakeSlaves();
+        }
+        sdsfree(replbuf);
+    }
+
+    if (snapoff != -1) {
+        pthread_mutex_lock(&aof_rw_lock);
+        if (aof_rw_id == rwid && aof_rw_state != AOF_RW_NONE)
+            aof_rw_repl_offset = snapoff;
+        pthread_mutex_unlock(&aof_rw_lock);
+    }
+
+    for (idx = 0; idx < nvels; idx ++) {
+        if (aof_writer_heads[idx] != NULL) return 1;
+    }
+    return 0;
+}
+
+/* Write the AOF buffer on disk. What was not written stays in the buffer
+ * and is written first the next time, so the file never gets holes. */
+static int aofWriterWrite(void) {
+    ssize_t nwritten;
+
+    while (sdslen(server.aof_buf) > 0) {
+        nwritten = write(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
+        if (nwritten < 0 && errno == EINTR) continue;
+        if (nwritten <= 0) {
+            if (nwritten == 0) errno = ENOSPC;
+            if (aof_writer_cc.appendfsync == AOF_FSYNC_ALWAYS) {
+                /* We can't recover when the fsync policy is ALWAYS since the
+                 * reply for the client is already in the output buffers, and we
+                 * have the contract with the user that on acknowledged write data
+                 * is synced on disk. */
+                log_error("Can't recover from AOF write error when the AOF "
+                    "fsync policy is 'always': %s. Exiting...",strerror(errno));
+                exit(1);
+            }
+            if (server.aof_last_write_status == VR_OK) {
+                log_warn("Error writing to the AOF file: %s",strerror(errno));
+            }
+            server.aof_last_write_errno = errno;
+            server.aof_last_write_status = VR_ERROR;
+            return VR_ERROR;
+        }
+        sdsrange(server.aof_buf,(int)nwritten,-1);
+        server.aof_current_size += nwritten;
+    }
+
+    if (server.aof_last_write_status == VR_ERROR) {
+        log_warn("AOF write error looks solved, Vire can write again.");
+        server.aof_last_write_status = VR_OK;
+    }
+
+    /* Re-use the AOF buffer when it is small enough. */
+    if (sdsalloc(server.aof_buf) >= 4000) {
+        sdsfree(server.aof_buf);
+        server.aof_buf = sdsempty();
+    }
+    return VR_OK;
+}
+
+static void *aofWriterRun(void *args) {
+    uint32_t idx;
+    long long now, waitus;
+    struct timespec deadline;
+    struct timeval tv;
+    int blocked = 0, unsynced = 0, switching;
+
+    UNUSED(args);
+
+    while (1) {
+        /* Records held back by a worker inside a call wait just the end
+         * of that call, so check again soon. */
+        waitus = blocked ? 100 : 100000;
+        pthread_mutex_lock(&aof_writer_lock);
+        if (!aof_writer_signaled) {
+            gettimeofday(&tv,NULL);
+            now = (long long)tv.tv_usec+waitus;
+            deadline.tv_sec = tv.tv_sec+now/1000000;
+            deadline.tv_nsec = (now%1000000)*1000;
+            pthread_cond_timedwait(&aof_writer_cond,&aof_writer_lock,&deadline);
+        }
+        aof_writer_signaled = 0;
+        pthread_mutex_unlock(&aof_writer_lock);
+
+        conf_cache_update(&aof_writer_cc);
+        blocked = aofWriterMerge();
+        pthread_mutex_lock(&aof_rw_lock);
+        switching = aof_rw_state == AOF_RW_SWITCH;
+        pthread_mutex_unlock(&aof_rw_lock);
+        if (server.aof_state != AOF_ON) {
+            /* Just the replication stream. */
+            if (switching) aofRewriteSwitch();
+            continue;
+        }
+        if (sdslen(server.aof_buf) == 0 && !unsynced && !switching) continue;
+        if (aofWriterWrite() != VR_OK) continue;
+        if (switching) aofRewriteSwitch();
+        unsynced = 1;
+
+        now = vr_msec_now();
+        if (aof_writer_cc.appendfsync == AOF_FSYNC_ALWAYS) {
+            if (vr_fsync(server.aof_fd) == -1) {
+                log_error("Can't persist AOF for fsync error when the "
+                    "AOF fsync policy is 'always': %s. Exiting...",
+                    strerror(errno));
+                exit(1);
+            }
+            server.aof_last_fsync = now/1000;
+            unsynced = 0;
+        } else if (aof_writer_cc.appendfsync == AOF_FSYNC_EVERYSEC &&
+            now/1000 > server.aof_last_fsync) {
+            vr_fsync(server.aof_fd);
+            server.aof_last_fsync = now/1000;
+            unsynced = 0;
+        } else if (aof_writer_cc.appendfsync == AOF_FSYNC_NO) {
+            unsynced = 0;
+        }
+
+        /* Let the workers send the replies. */
+        pthread_mutex_lock(&aof_writer_lock);
+        for (idx = 0; idx < aof_writer_nvels; idx ++) {
+            aof_writer_vels[idx]->aof_synced_seq = aof_writer_last[idx];
+        }
+        pthread_cond_broadcast(&aof_synced_cond);
+        pthread_mutex_unlock(&aof_writer_lock);
+    }
+
+    return NULL;
+}
+
+sds aofGetFilename(void) {
+    sds dir, appendfilename, filename;
+
+    conf_server_get(CONFIG_SOPN_DIR,&dir);
+    conf_server_get(CONFIG_SOPN_APPENDFILENAME,&appendfilename);
+    filename = sdscatfmt(sdsempty(),"%S/%S",dir,appendfilename);
+    sdsfree(dir);
+    sdsfree(appendfilename);
+    return filename;
+}
+
+/* Give every eventloop writing the dbs its record queue and start the
+ * writer thread, the first time it is called. The queues are published
+ * after the writer runs, so an eventloop just starts to queue records. */
+int aofStartStream(void) {
+    uint32_t idx, nworkers = (uint32_t)darray_n(&workers);
+    uint32_t nbackends = (uint32_t)darray_n(&backends);
+    vr_worker *worker;
+    vr_backend *backend;
+    dmtqueue **queues;
+    int ret = VR_OK;
+
+    pthread_mutex_lock(&aof_writer_lock);
+    if (aof_writer_started) goto done;
+
+    aof_writer_nvels = nworkers+1+nbackends;
+    aof_writer_vels = dalloc(sizeof(vr_eventloop*)*aof_writer_nvels);
+    for (idx = 0; idx < nworkers; idx ++) {
+        worker = darray_get(&workers, idx);
+        aof_writer_vels[idx] = &worker->vel;
+    }
+    aof_writer_vels[nworkers] = &repl.vel;
+    for (idx = 0; idx < nbackends; idx ++) {
+        backend = darray_get(&backends, idx);
+        aof_writer_vels[nworkers+1+idx] = &backend->vel;
+    }
+
+    aof_writer_heads = dalloc(sizeof(aofRecord*)*aof_writer_nvels);
+    aof_writer_last = dalloc(sizeof(unsigned long long)*aof_writer_nvels);
+    queues = dalloc(sizeof(dmtqueue*)*aof_writer_nvels);
+    for (idx = 0; idx < aof_writer_nvels; idx ++) {
+        queues[idx] = dmtqueue_create();
+        if (queues[idx] == NULL ||
+            dmtqueue_init_with_mpscqueue(queues[idx],AOF_QUEUE_SIZE) != 0) {
+            log_error("create aof queue failed: out of memory");
+            ret = VR_ENOMEM;
+            goto done;
+        }
+        aof_writer_heads[idx] = NULL;
+        aof_writer_last[idx] = 0;
+    }
+
+    server.aof_rewrite_buf_blocks = dlistCreate();
+    dlistSetFreeMethod(server.aof_rewrite_buf_blocks,aofRewriteBlockFree);
+    conf_cache_init(&aof_writer_cc);
+    conf_cache_update(&aof_writer_cc);
+
+    vr_thread_init(&aof_writer);
+    aof_writer.fun_run = aofWriterRun;
+    aof_writer.data = NULL;
+    vr_thread_start(&aof_writer);
+
+    for (idx = 0; idx < aof_writer_nvels; idx ++)
+        aof_atomic_store(&aof_writer_vels[idx]->aof_queue,queues[idx]);
+    dfree(queues);
+    aof_atomic_store(&aof_writer_started,1);
+
+done:
+    pthread_mutex_unlock(&aof_writer_lock);
+    return ret;
+}
+
+/* Open the AOF and start the stream. Called after the data was loaded
+ * and before the workers run. */
+int aofInit(void) {
+    struct stat sb;
+    int appendonly;
+
+    conf_server_get(CONFIG_SOPN_APPENDONLY,&appendonly);
+    if (!appendonly) return VR_OK;
+
+    server.aof_filename = aofGetFilename();
+    server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (server.aof_fd == -1) {
+        log_error("Can't open the append-only file %s: %s",
+            server.aof_filename,strerror(errno));
+        return VR_ERROR;
+    }
+    if (fstat(server.aof_fd,&sb) == 0) server.aof_current_size = sb.st_size;
+    server.aof_buf = sdsempty();
+    server.aof_selected_db = -1;
+    server.aof_last_fsync = time(NULL);
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_state = AOF_ON;
+
+    return aofStartStream();
+}
+
+/* Results of aofReplay(). */
+#define AOF_REPLAY_OK 0         /* Replayed up to the end */
+#define AOF_REPLAY_SHORT 1      /* The last command is cut */
+#define AOF_REPLAY_READERR 2    /* I/O error */
+#define AOF_REPLAY_FMTERR 3     /* Not an AOF */
+
+/* Run the commands read from 'fp' in the fake client 'c', up to the end
+ * of the file, or to the offset 'end' if it is not -1. The offset after
+ * the last whole command is stored in 'valid_up_to'. */
+static int aofReplay(struct client *c, FILE *fp, off_t end,
+                     long long *loaded, off_t *valid_up_to) {
+    struct redisCommand *cmd;
+    robj **argv;
+    char buf[128];
+    sds argsds;
+    int argc, j, ret;
+    unsigned long len;
+
+    while (end == -1 || *valid_up_to < end) {
+        if (fgets(buf,sizeof(buf),fp) == NULL) {
+            if (feof(fp)) {
+                ret = end == -1 ? AOF_REPLAY_OK : AOF_REPLAY_SHORT;
+                goto done;
+            }
+            ret = AOF_REPLAY_READERR;
+            goto done;
+        }
+        if (buf[0] != '*') {
+            ret = AOF_REPLAY_FMTERR;
+            goto done;
+        }
+        if (buf[1] == '\0') {
+            ret = AOF_REPLAY_READERR;
+            goto done;
+        }
+        argc = atoi(buf+1);
+        if (argc < 1) {
+            ret = AOF_REPLAY_FMTERR;
+            goto done;
+        }
+
+        argv = dalloc(sizeof(robj*)*(size_t)argc);
+        c->argc = 0;
+        c->argv = argv;
+        for (j = 0; j < argc; j++) {
+            if (fgets(buf,sizeof(buf),fp) == NULL ||
+                buf[0] != '$' || buf[1] == '\0') {
+                ret = feof(fp) ? AOF_REPLAY_SHORT : AOF_REPLAY_READERR;
+                goto done;
+            }
+            len = (unsigned long)strtol(buf+1,NULL,10);
+            argsds = sdsnewlen(NULL,len);
+            if ((len && fread(argsds,len,1,fp) == 0) ||
+                fread(buf,2,1,fp) == 0) {
+                sdsfree(argsds);
+                ret = feof(fp) ? AOF_REPLAY_SHORT : AOF_REPLAY_READERR;
+                goto done;
+            }
+            argv[j] = createObject(OBJ_STRING,argsds);
+            c->argc ++;
+        }
+
+        cmd = lookupCommand(argv[0]->ptr);
+        if (!cmd) {
+            log_error("Unknown command '%s' reading the append only file",
+                (char*)argv[0]->ptr);
+            ret = AOF_REPLAY_FMTERR;
+            goto done;
+        }
+
+        /* Run the command in the context of a fake client */
+        c->cmd = cmd;
+        cmd->proc(c);
+        (*loaded) ++;
+
+        for (j = 0; j < c->argc; j++)
+            freeObject(c->argv[j]);
+        dfree(c->argv);
+        c->argv = NULL;
+        c->argc = 0;
+        c->cmd = NULL;
+        *valid_up_to = ftello(fp);
+    }
+    ret = *valid_up_to == end ? AOF_REPLAY_OK : AOF_REPLAY_FMTERR;
+
+done:
+    for (j = 0; j < c->argc; j++)
+        freeObject(c->argv[j]);
+    if (c->argv) dfree(c->argv);
+    c->argv = NULL;
+    c->argc = 0;
+    c->cmd = NULL;
+    return ret;
+}
+
+/* Create the eventloop and the fake client replaying an AOF in the
+ * calling thread. */
+static struct client *aofCreateLoadClient(vr_eventloop *vel) {
+    struct client *c;
+
+    if (vr_eventloop_init(vel,1024) != VR_OK) {
+        vr_eventloop_deinit(vel);
+        return NULL;
+    }
+    vel->hz = server.hz;
+    conf_cache_update(&vel->cc);
+    vr_eventloop_bind(vel);
+    c = createClient(vel,conn_get(vel->cb));
+    if (c == NULL) {
+        vr_eventloop_bind(NULL);
+        vr_eventloop_deinit(vel);
+    }
+    return c;
+}
+
+static void aofReleaseLoadClient(vr_eventloop *vel, struct client *c) {
+    freeClient(c);
+    vr_eventloop_bind(NULL);
+    vr_eventloop_deinit(vel);
+}
+
+/* Replay the AOF in a fake client. A file truncated in the middle of a
+ * command, as after a crash, is loaded up to the last whole command and
+ * truncated there. Return VR_ERROR with errno ENOENT if there is no file. */
+int loadAppendOnlyFile(char *filename) {
+    vr_eventloop vel;
+    struct client *c;
+    FILE *fp;
+    off_t valid_up_to = 0;
+    long long loaded = 0;
+    int ret = VR_ERROR;
+
+    fp = fopen(filename,"r");
+    if (fp == NULL) return VR_ERROR;
+
+    c = aofCreateLoadClient(&vel);
+    if (c == NULL) {
+        fclose(fp);
+        return VR_ERROR;
+    }
+
+    server.loading = 1;
+    server.loading_start_time = time(NULL);
+
+    switch (aofReplay(c,fp,-1,&loaded,&valid_up_to)) {
+    case AOF_REPLAY_OK:
+        log_notice("AOF %s loaded: %lld commands",filename,loaded);
+        ret = VR_OK;
+        break;
+    case AOF_REPLAY_SHORT:
+        /* The last command was cut by a crash, drop it. */
+        log_warn("!!! Warning: short read while loading the AOF file %s!!!",
+            filename);
+        if (truncate(filename,valid_up_to) == -1) {
+            log_error("Error truncating the AOF file: %s",strerror(errno));
+            break;
+        }
+        log_warn("AOF loaded anyway because of a truncated tail, "
+            "%lld commands, the file was truncated to %lld bytes",
+            loaded,(long long)valid_up_to);
+        ret = VR_OK;
+        break;
+    case AOF_REPLAY_READERR:
+        log_error("Unrecoverable error reading the append only file: %s",
+            strerror(errno));
+        errno = EIO;
+        break;
+    default:
+        log_error("Bad file format reading the append only file: make a backup "
+            "of your AOF file, then use ./redis-check-aof --fix <filename>");
+        errno = EINVAL;
+        break;
+    }
+
+    aofReleaseLoadClient(&vel,c);
+    fclose(fp);
+    server.loading = 0;
+    return ret;
+}
+
+/* A file made of chunks, each one replayable on its own, as the snapshots
+ * the rewrite sends to the slaves, see aofRewriteJoinDumps(). The loaders
+ * take the chunks in turn and replay them concurrently, the db locks of
+ * the commands serialize them where they touch the same internal db. */
+typedef struct aofChunksJob {
+    char *filename;
+    long long *chunks;      /* Length of every chunk, in file order */
+    off_t *offsets;         /* Offset of every chunk */
+    int nchunks;
+    int next_chunk;         /* Next chunk to load */
+    long long loaded;       /* Commands run by the loaders */
+} aofChunksJob;
+
+typedef struct aofChunksLoader {
+    vr_thread thread;
+    aofChunksJob *job;
+    int status;             /* VR_OK or VR_ERROR */
+} aofChunksLoader;
+
+static void *aofChunksLoaderRun(void *data) {
+    aofChunksLoader *loader = data;
+    aofChunksJob *job = loader->job;
+    vr_eventloop vel;
+    struct client *c;
+    long long loaded = 0;
+    off_t valid_up_to;
+    FILE *fp;
+    int j;
+
+    loader->status = VR_ERROR;
+    fp = fopen(job->filename,"r");
+    if (fp == NULL) {
+        log_error("Failed opening the AOF file %s: %s",
+            job->filename,strerror(errno));
+        return NULL;
+    }
+    c = aofCreateLoadClient(&vel);
+    if (c == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    loader->status = VR_OK;
+    while ((j = atomic_add(job->next_chunk,1)-1) < job->nchunks) {
+        valid_up_to = job->offsets[j];
+        if (fseeko(fp,job->offsets[j],SEEK_SET) == -1 ||
+            aofReplay(c,fp,job->offsets[j]+job->chunks[j],
+                &loaded,&valid_up_to) != AOF_REPLAY_OK) {
+            log_error("Short read or bad format of the chunk %d of the "
+                "AOF file %s", j, job->filename);
+            loader->status = VR_ERROR;
+            break;
+        }
+    }
+
+    aofReleaseLoadClient(&vel,c);
+    fclose(fp);
+    atomic_add(job->loaded,loaded);
+    return NULL;
+}
+
+/* Load the AOF 'filename' made of the 'nchunks' chunks of the lengths in
+ * 'chunks' with up to 'threads' loader threads. Unlike
+ * loadAppendOnlyFile() a short file is an error. */
+int loadAppendOnlyFileChunks(char *filename, long long *chunks, int nchunks,
+                             int threads) {
+    aofChunksJob job;
+    aofChunksLoader *loaders;
+    off_t offset = 0;
+    int j, ret = VR_OK;
+
+    if (threads > nchunks) threads = nchunks;
+    if (threads <= 1) return loadAppendOnlyFile(filename);
+
+    job.filename = filename;
+    job.chunks = chunks;
+    job.offsets = dalloc(sizeof(off_t)*(size_t)nchunks);
+    job.nchunks = nchunks;
+    job.next_chunk = 0;
+    job.loaded = 0;
+    for (j = 0; j < nchunks; j ++) {
+        job.offsets[j] = offset;
+        offset += chunks[j];
+    }
+
+    server.loading = 1;
+    server.loading_start_time = time(NULL);
+
+    loaders = dcalloc(threads,sizeof(aofChunksLoader));
+    for (j = 0; j < threads; j ++) {
+        loaders[j].job = &job;
+        loaders[j].status = VR_ERROR;
+        vr_thread_init(&loaders[j].thread);
+        loaders[j].thread.fun_run = aofChunksLoaderRun;
+        loaders[j].thread.data = &loaders[j];
+        vr_thread_start(&loaders[j].thread);
+    }
+    for (j = 0; j < threads; j ++) {
+        pthread_join(loaders[j].thread.thread_id, NULL);
+        if (loaders[j].status != VR_OK) ret = VR_ERROR;
+    }
+    dfree(loaders);
+    dfree(job.offsets);
+
+    server.loading = 0;
+    if (ret == VR_OK) {
+        log_notice("AOF %s loaded: %lld commands in %d chunks by %d threads",
+            filename,job.loaded,nchunks,threads);
+    } else {
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+/* ----------------------------------------------------------------------------
+ * AOF rewrite
+ *
+ * The rewrite builds a new AOF with the smallest sequence of commands
+ * recreating the dataset, without fork(). rdb-threads dumper threads scan
+ * the internal dbs with dictScan(), a batch at a time under the db lock,
+ * while the workers keep writing: every dumper takes the next db not yet
+ * dumped and appends its keys to its own temp file. The dump of a db is
+ * a chunk that starts with a SELECT and does not depend on the others, so
+ * a slave can load the chunks of a snapshot in parallel. Once all the dbs
+ * are dumped the temp files are joined in the 'base' of the new file.
+ *
+ * The base is the dataset at the instant the rewrite started: a worker
+ * about to write a key the scan did not reach yet dumps the key as it is
+ * first (see aofRewriteTouchKey()), and the scan skips it later. The
+ * writer thread buffers the records numbered after the start, the 'diff',
+ * and once the base is complete it appends the diff to the new file and
+ * renames it over the old one.
+ *
+ * So the memory used by the rewrite is the diff and the keys written
+ * during the scan, and not a copy of the dataset. The rehashing of the
+ * db dicts is paused while they are scanned, to know which keys the scan
+ * already passed.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_REWRITE_POLL_MS 10      /* The backend checks the dumpers */
+#define AOF_REWRITE_SCAN_BATCH 64   /* dictScan() calls under a db lock */
+#define AOF_REWRITE_FLUSH_BYTES (1024*1024*4)   /* Write a dump every 4MB */
+#define AOF_REWRITE_COPY_BYTES (1024*1024)      /* Copy buffer joining the dumps */
+
+typedef struct aofRewriteDumper {
+    vr_thread thread;
+    sds tmpfile;
+    int fd;
+    off_t size;                 /* Temp file size */
+    long long *chunks;          /* Length of the dump of every db taken */
+    int nchunks;
+    int status;                 /* VR_OK or VR_ERROR */
+} aofRewriteDumper;
+
+/* Set of the keys dumped out of the scan, the keys are sds copies. */
+static dictType aofRewriteDumpedDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Write the whole buffer, retrying the partial writes. */
+static int aofWriteAll(int fd, const char *buf, size_t len) {
+    ssize_t nwritten;
+
+    while (len > 0) {
+        nwritten = write(fd,buf,len);
+        if (nwritten < 0 && errno == EINTR) continue;
+        if (nwritten <= 0) {
+            if (nwritten == 0) errno = ENOSPC;
+            return VR_ERROR;
+        }
+        buf += nwritten;
+        len -= (size_t)nwritten;
+    }
+    return VR_OK;
+}
+
+/* Delegate writing an object to writing a bulk string or bulk long long.
+ * This is not placed in rio.c since that adds the server.h dependency. */
+static int rioWriteBulkObject(rio *r, robj *obj) {
+    if (obj->encoding == OBJ_ENCODING_INT) {
+        return (int)rioWriteBulkLongLong(r,(long)obj->ptr);
+    } else if (sdsEncodedObject(obj)) {
+        return (int)rioWriteBulkString(r,obj->ptr,sdslen(obj->ptr));
+    } else {
+        serverPanic("Unknown string encoding");
+    }
+    return 0;
+}
+
+/* Emit the commands needed to rebuild a list object.
+ * The function returns 0 on error, 1 on success. */
+static int rewriteListObject(rio *r, sds key, robj *o) {
+    long long count = 0, items = (long long)listTypeLength(o);
+
+    if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+        quicklist *list = o->ptr;
+        quicklistIter *li = quicklistGetIterator(list, AL_START_HEAD);
+        quicklistEntry entry;
+
+        while (quicklistNext(li,&entry)) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : (int)items;
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0 ||
+                    rioWriteBulkString(r,"RPUSH",5) == 0 ||
+                    rioWriteBulkString(r,key,sdslen(key)) == 0) {
+                    quicklistReleaseIterator(li);
+                    return 0;
+                }
+            }
+
+            if (entry.value) {
+                if (rioWriteBulkString(r,(char*)entry.value,entry.sz) == 0) {
+                    quicklistReleaseIterator(li);
+                    return 0;
+                }
+            } else {
+                if (rioWriteBulkLongLong(r,entry.longval) == 0) {
+                    quicklistReleaseIterator(li);
+                    return 0;
+                }
+            }
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+        quicklistReleaseIterator(li);
+    } else {
+        serverPanic("Unknown list encoding");
+    }
+    return 1;
+}
+
+/* Emit the commands needed to rebuild a set object.
+ * The function returns 0 on error, 1 on success. */
+static int rewriteSetObject(rio *r, sds key, robj *o) {
+    long long count = 0, items = (long long)setTypeSize(o);
+
+    if (o->encoding == OBJ_ENCODING_INTSET) {
+        uint32_t ii = 0;
+        int64_t llval;
+
+        while(intsetGet(o->ptr,ii++,&llval)) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : (int)items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0 ||
+                    rioWriteBulkString(r,"SADD",4) == 0 ||
+                    rioWriteBulkString(r,key,sdslen(key)) == 0) return 0;
+            }
+            if (rioWriteBulkLongLong(r,llval) == 0) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+    } else if (o->encoding == OBJ_ENCODING_HT) {
+        dictIterator *di = dictGetIterator(o->ptr);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            robj *eleobj = dictGetKey(de);
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : (int)items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0 ||
+                    rioWriteBulkString(r,"SADD",4) == 0 ||
+                    rioWriteBulkString(r,key,sdslen(key)) == 0) {
+                    dictReleaseIterator(di);
+                    return 0;
+                }
+            }
+            if (rioWriteBulkObject(r,eleobj) == 0) {
+                dictReleaseIterator(di);
+                return 0;
+            }
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+        dictReleaseIterator(di);
+    } else {
+        serverPanic("Unknown set encoding");
+    }
+    return 1;
+}
+
+/* Emit the commands needed to rebuild a sorted set object.
+ * The function returns 0 on error, 1 on success. */
+static int rewriteSortedSetObject(rio *r, sds key, robj *o) {
+    long long count = 0, items = zsetLength(o);
+
+    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+        unsigned char *zl = o->ptr;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+        double score;
+
+        eptr = ziplistIndex(zl,0);
+        ASSERT(eptr != NULL);
+        sptr = ziplistNext(zl,eptr);
+        ASSERT(sptr != NULL);
+
+        while (eptr != NULL) {
+            vstr = NULL;
+            ziplistGet(eptr,&vstr,&vlen,&vll);
+            score = zzlGetScore(sptr);
+
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : (int)items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0 ||
+                    rioWriteBulkString(r,"ZADD",4) == 0 ||
+                    rioWriteBulkString(r,key,sdslen(key)) == 0) return 0;
+            }
+            if (rioWriteBulkDouble(r,score) == 0) return 0;
+            if (vstr != NULL) {
+                if (rioWriteBulkString(r,(char*)vstr,vlen) == 0) return 0;
+            } else {
+                if (rioWriteBulkLongLong(r,vll) == 0) return 0;
+            }
+            zzlNext(zl,&eptr,&sptr);
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        zset *zs = o->ptr;
+        dictIterator *di = dictGetIterator(zs->dict);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            robj *eleobj = dictGetKey(de);
+            double *score = dictGetVal(de);
+
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : (int)items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0 ||
+                    rioWriteBulkString(r,"ZADD",4) == 0 ||
+                    rioWriteBulkString(r,key,sdslen(key)) == 0) {
+                    dictReleaseIterator(di);
+                    return 0;
+                }
+            }
+            if (rioWriteBulkDouble(r,*score) == 0 ||
+                rioWriteBulkObject(r,eleobj) == 0) {
+                dictReleaseIterator(di);
+                return 0;
+            }
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+        dictReleaseIterator(di);
+    } else {
+        serverPanic("Unknown sorted zset encoding");
+    }
+    return 1;
+}
+
+/* Write either the key or the value of the currently selected item of a hash.
+ * The 'hi' argument passes a valid Redis hash iterator.
+ * The 'what' filed specifies if to write a key or a value and can be
+ * either OBJ_HASH_KEY or OBJ_HASH_VALUE.
+ *
+ * The function returns 0 on error, non-zero on success. */
+static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
+    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+        unsigned char *vstr = NULL;
+        unsigned int vlen = UINT_MAX;
+        long long vll = LLONG_MAX;
+
+        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        if (vstr) {
+            return (int)rioWriteBulkString(r, (char*)vstr, vlen);
+        } else {
+            return (int)rioWriteBulkLongLong(r, vll);
+        }
+
+    } else if (hi->encoding == OBJ_ENCODING_HT) {
+        robj *value;
+
+        hashTypeCurrentFromHashTable(hi, what, &value);
+        return rioWriteBulkObject(r, value);
+    }
+
+    serverPanic("Unknown hash encoding");
+    return 0;
+}
+
+/* Emit the commands needed to rebuild a hash object.
+ * The function returns 0 on error, 1 on success. */
+static int rewriteHashObject(rio *r, sds key, robj *o) {
+    hashTypeIterator *hi;
+    long long count = 0, items = (long long)hashTypeLength(o);
+
+    hi = hashTypeInitIterator(o);
+    while (hashTypeNext(hi) != VR_ERROR) {
+        if (count == 0) {
+            int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                AOF_REWRITE_ITEMS_PER_CMD : (int)items;
+
+            if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0 ||
+                rioWriteBulkString(r,"HMSET",5) == 0 ||
+                rioWriteBulkString(r,key,sdslen(key)) == 0) {
+                hashTypeReleaseIterator(hi);
+                return 0;
+            }
+        }
+
+        if (rioWriteHashIteratorCursor(r, hi, OBJ_HASH_KEY) == 0 ||
+            rioWriteHashIteratorCursor(r, hi, OBJ_HASH_VALUE) == 0) {
+            hashTypeReleaseIterator(hi);
+            return 0;
+        }
+        if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+        items--;
+    }
+
+    hashTypeReleaseIterator(hi);
+
+    return 1;
+}
+
+/* Append to 'buf' the commands rebuilding the key, and its expire if
+ * 'expiretime' is not -1. Called with the db of the key locked. */
+static sds aofRewriteCatKey(sds buf, sds key, robj *o, long long expiretime) {
+    rio aof;
+
+    rioInitWithBuffer(&aof,buf);
+    if (o->type == OBJ_STRING) {
+        /* Emit a SET command */
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        rioWrite(&aof,cmd,sizeof(cmd)-1);
+        rioWriteBulkString(&aof,key,sdslen(key));
+        rioWriteBulkObject(&aof,o);
+    } else if (o->type == OBJ_LIST) {
+        rewriteListObject(&aof,key,o);
+    } else if (o->type == OBJ_SET) {
+        rewriteSetObject(&aof,key,o);
+    } else if (o->type == OBJ_ZSET) {
+        rewriteSortedSetObject(&aof,key,o);
+    } else if (o->type == OBJ_HASH) {
+        rewriteHashObject(&aof,key,o);
+    } else {
+        serverPanic("Unknown object type");
+    }
+
+    /* Save the expire time */
+    if (expiretime != -1) {
+        char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
+        rioWrite(&aof,cmd,sizeof(cmd)-1);
+        rioWriteBulkString(&aof,key,sdslen(key));
+        rioWriteBulkLongLong(&aof,expiretime);
+    }
+    return aof.io.buffer.ptr;
+}
+
+/* Called with the db write lock held before a key is changed. If the
+ * rewrite did not dump the key yet, dump it now as it was when the
+ * rewrite started, that is as it is now, since the key was not changed
+ * before. */
+void aofRewriteTouchKey(redisDb *db, robj *key) {
+    aofRewriteDb *rwdb = db->aof_rewrite;
+    dictEntry *de;
+    long long when;
+
+    if (rwdb == NULL || rwdb->state == AOF_RW_DB_DONE) return;
+    if (rwdb->state == AOF_RW_DB_SCAN &&
+        dictScanPassed(db->dict,rwdb->cursor,key->ptr)) return;
+    if (dictFind(rwdb->dumped,key->ptr) != NULL) return;
+
+    dictAdd(rwdb->dumped,sdsdup(key->ptr),NULL);
+    de = dictFind(db->dict,key->ptr);
+    if (de == NULL) return;
+
+    when = dbKeyGetExpire(dictGetKey(de));
+    if (when != -1 && when < vr_msec_now()) return;
+
+    rwdb->buf = aofRewriteCatKey(rwdb->buf,dictGetKey(de),dictGetVal(de),when);
+}
+
+/* Called with the db write lock held before the db is emptied. The FLUSH
+ * command in the diff wipes what the base has of the db anyway. The
+ * dumper of the db writes what is already in its chunk. */
+void aofRewriteFlushDb(redisDb *db) {
+    aofRewriteDb *rwdb = db->aof_rewrite;
+
+    if (rwdb == NULL) return;
+    if (rwdb->paused) {
+        dictResumeRehashing(db->dict);
+        rwdb->paused = 0;
+    }
+    rwdb->state = AOF_RW_DB_DONE;
+}
+
+typedef struct aofRewriteScanData {
+    redisDb *db;
+    aofRewriteDb *rwdb;
+    long long now;
+    sds buf;
+} aofRewriteScanData;
+
+static void aofRewriteScanCallback(void *privdata, const dictEntry *de) {
+    aofRewriteScanData *data = privdata;
+    sds key = dictGetKey(de);
+    long long when = dbKeyGetExpire(key);
+
+    if (dictSize(data->rwdb->dumped) > 0 &&
+        dictFind(data->rwdb->dumped,key) != NULL) return;
+
+    /* Don't dump the keys already expired */
+    if (when != -1 && when < data->now) return;
+
+    data->buf = aofRewriteCatKey(data->buf,key,dictGetVal(de),when);
+}
+
+/* Detach the rewrite state from the dbs. */
+static void aofRewriteReleaseDbs(void) {
+    redisDb *db;
+    aofRewriteDb *rwdb;
+    int j;
+
+    if (aof_rw_dbs == NULL) return;
+
+    for (j = 0; j < server.dbnum; j ++) {
+        db = darray_get(&server.dbs, (uint32_t)j);
+        rwdb = &aof_rw_dbs[j];
+        lockDbWrite(db);
+        if (rwdb->paused) {
+            dictResumeRehashing(db->dict);
+            rwdb->paused = 0;
+        }
+        db->aof_rewrite = NULL;
+        unlockDb(db);
+        dictRelease(rwdb->dumped);
+        sdsfree(rwdb->buf);
+    }
+    dfree(aof_rw_dbs);
+    aof_rw_dbs = NULL;
+}
+
+/* Reset the rewrite state, on error remove the temp file. */
+static void aofRewriteEnd(int status) {
+    int purpose;
+
+    if (status != VR_OK && aof_rw_fd != -1) {
+        close(aof_rw_fd);
+        unlink(aof_rw_tmpfile);
+    }
+
+    pthread_mutex_lock(&aof_rw_lock);
+    purpose = aof_rw_purpose;
+    aof_rw_fd = -1;
+    if (aof_rw_tmpfile != NULL) {
+        sdsfree(aof_rw_tmpfile);
+        aof_rw_tmpfile = NULL;
+    }
+    if (aof_rw_chunks != NULL) {
+        dfree(aof_rw_chunks);
+        aof_rw_chunks = NULL;
+    }
+    dlistRelease(server.aof_rewrite_buf_blocks);
+    server.aof_rewrite_buf_blocks = dlistCreate();
+    dlistSetFreeMethod(server.aof_rewrite_buf_blocks,aofRewriteBlockFree);
+    if (purpose == AOF_RW_FOR_AOF) {
+        server.aof_lastbgrewrite_status = status;
+        server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
+        server.aof_rewrite_time_start = -1;
+    }
+    aof_rw_state = AOF_RW_NONE;
+    pthread_mutex_unlock(&aof_rw_lock);
+
+    if (purpose == AOF_RW_FOR_REPL && status != VR_OK)
+        replicationSnapshotDone(NULL,-1,NULL,0);
+}
+
+static void aofRewriteAbort(void) {
+    aofRewriteReleaseDbs();
+    aofRewriteEnd(VR_ERROR);
+}
+
+/* The base is complete: write most of the diff buffered so far, and let
+ * the writer append the rest and switch the files. */
+static void aofRewriteFinish(void) {
+    dlist *blocks;
+    dlistNode *ln;
+    aofrwblock *block;
+    unsigned long written;
+    int j;
+
+    aofRewriteReleaseDbs();
+
+    /* The writer keeps adding to the diff, so the loop stops when the
+     * writes catch up, the remaining part is written by the writer. */
+    for (j = 0; j < 10; j ++) {
+        pthread_mutex_lock(&aof_rw_lock);
+        blocks = server.aof_rewrite_buf_blocks;
+        server.aof_rewrite_buf_blocks = dlistCreate();
+        dlistSetFreeMethod(server.aof_rewrite_buf_blocks,aofRewriteBlockFree);
+        pthread_mutex_unlock(&aof_rw_lock);
+
+        written = 0;
+        while ((ln = dlistFirst(blocks)) != NULL) {
+            block = dlistNodeValue(ln);
+            if (aofWriteAll(aof_rw_fd,block->buf,block->used) != VR_OK) {
+                dlistRelease(blocks);
+                goto werr;
+            }
+            written += block->used;
+            dlistDelNode(blocks,ln);
+        }
+        dlistRelease(blocks);
+        if (written < AOF_REWRITE_FLUSH_BYTES) break;
+    }
+
+    /* A snapshot is read by the slaves from the page cache. */
+    if (aof_rw_purpose == AOF_RW_FOR_AOF && vr_fsync(aof_rw_fd) == -1)
+        goto werr;
+
+    pthread_mutex_lock(&aof_rw_lock);
+    aof_rw_state = AOF_RW_SWITCH;
+    pthread_mutex_unlock(&aof_rw_lock);
+
+    pthread_mutex_lock(&aof_writer_lock);
+    aof_writer_signaled = 1;
+    pthread_cond_signal(&aof_writer_cond);
+    pthread_mutex_unlock(&aof_writer_lock);
+    return;
+
+werr:
+    log_warn("Error trying to rewrite the AOF: %s", strerror(errno));
+    aofRewriteAbort();
+}
+
+/* Hand a complete snapshot to the slaves, once the writer knows the
+ * stream offset it starts from. */
+static void aofRewriteSwitchSnapshot(void) {
+    long long offset, *chunks;
+    int nchunks;
+    sds filename;
+
+    pthread_mutex_lock(&aof_rw_lock);
+    offset = aof_rw_repl_offset;
+    chunks = aof_rw_chunks;
+    nchunks = aof_rw_nchunks;
+    if (offset != -1) aof_rw_chunks = NULL;
+    pthread_mutex_unlock(&aof_rw_lock);
+    if (offset == -1) return;
+
+    close(aof_rw_fd);
+    aof_rw_fd = -1;
+    filename = sdsdup(aof_rw_tmpfile);
+    aofRewriteEnd(VR_OK);
+    log_notice("Snapshot for the slaves finished successfully, offset %lld, "
+        "%d chunks", offset, nchunks);
+    replicationSnapshotDone(filename,offset,chunks,nchunks);
+}
+
+/* Called by the writer once the diff buffered so far is in the old file.
+ * Complete the new file with the rest of the diff and rename it over the
+ * old one, the next records go to the new file. */
+static void aofRewriteSwitch(void) {
+    dlist *blocks;
+    dlistNode *ln;
+    aofrwblock *block;
+    struct stat sb;
+    int oldfd;
+
+    if (aof_rw_purpose == AOF_RW_FOR_REPL) {
+        aofRewriteSwitchSnapshot();
+        return;
+    }
+
+    pthread_mutex_lock(&aof_rw_lock);
+    blocks = server.aof_rewrite_buf_blocks;
+    server.aof_rewrite_buf_blocks = dlistCreate();
+    dlistSetFreeMethod(server.aof_rewrite_buf_blocks,aofRewriteBlockFree);
+    pthread_mutex_unlock(&aof_rw_lock);
+
+    while ((ln = dlistFirst(blocks)) != NULL) {
+        block = dlistNodeValue(ln);
+        if (aofWriteAll(aof_rw_fd,block->buf,block->used) != VR_OK) break;
+        dlistDelNode(blocks,ln);
+    }
+    if (dlistLength(blocks) > 0) {
+        dlistRelease(blocks);
+        goto werr;
+    }
+    dlistRelease(blocks);
+
+    if (vr_fsync(aof_rw_fd) == -1) goto werr;
+    if (rename(aof_rw_tmpfile,server.aof_filename) == -1) goto werr;
+
+    oldfd = server.aof_fd;
+    server.aof_fd = aof_rw_fd;
+    server.aof_selected_db = aof_rw_diff_db;
+    if (fstat(server.aof_fd,&sb) == 0) server.aof_current_size = sb.st_size;
+    server.aof_rewrite_base_size = server.aof_current_size;
+    close(oldfd);
+
+    aof_rw_fd = -1;
+    aofRewriteEnd(VR_OK);
+    log_notice("Background AOF rewrite finished successfully");
+    return;
+
+werr:
+    log_warn("Error trying to complete the AOF rewrite: %s", strerror(errno));
+    aofRewriteEnd(VR_ERROR);
+}
+
+/* Dump the internal db 'idx' at the end of the temp file of the dumper,
+ * and set 'len' to the length of the dump. */
+static int aofRewriteDumpDb(aofRewriteDumper *dumper, int idx, long long *len) {
+    redisDb *db = darray_get(&server.dbs, (uint32_t)idx);
+    aofRewriteDb *rwdb = &aof_rw_dbs[idx];
+    aofRewriteScanData data;
+    off_t start = dumper->size;
+    sds buf;
+    int j, done, ret;
+
+    /* Pause the rehashing, so the keys the scan passed stay in the
+     * buckets before the cursor, see dictScanPassed(). Just the dumper
+     * of the db moves the cursor. */
+    lockDbWrite(db);
+    if (rwdb->state == AOF_RW_DB_WAIT) {
+        dictPauseRehashing(db->dict);
+        rwdb->paused = 1;
+        rwdb->state = AOF_RW_DB_SCAN;
+    }
+    unlockDb(db);
+
+    data.db = db;
+    data.rwdb = rwdb;
+    do {
+        /* The workers add to the chunk with the write lock held, the
+         * dumper with the read lock. */
+        lockDbRead(db);
+        if (rwdb->state == AOF_RW_DB_SCAN) {
+            data.now = vr_msec_now();
+            data.buf = rwdb->buf;
+            for (j = 0; j < AOF_REWRITE_SCAN_BATCH; j ++) {
+                rwdb->cursor = dictScan(db->dict,rwdb->cursor,
+                    aofRewriteScanCallback,&data);
+                if (rwdb->cursor == 0) {
+                    rwdb->state = AOF_RW_DB_DONE;
+                    break;
+                }
+            }
+            rwdb->buf = data.buf;
+        }
+        done = rwdb->state == AOF_RW_DB_DONE;
+        buf = NULL;
+        if (done || sdslen(rwdb->buf) >= AOF_REWRITE_FLUSH_BYTES) {
+            buf = rwdb->buf;
+            rwdb->buf = sdsempty();
+        }
+        unlockDb(db);
+
+        if (buf != NULL) {
+            ret = aofWriteAll(dumper->fd,buf,sdslen(buf));
+            dumper->size += (off_t)sdslen(buf);
+            sdsfree(buf);
+            if (ret != VR_OK) return VR_ERROR;
+        }
+    } while (!done);
+
+    lockDbWrite(db);
+    if (rwdb->paused) {
+        dictResumeRehashing(db->dict);
+        rwdb->paused = 0;
+    }
+    unlockDb(db);
+
+    *len = (long long)(dumper->size-start);
+    return VR_OK;
+}
+
+/* Called by the last dumper: copy the temp files of the dumpers in the
+ * temp file of the rewrite, and list the length of the chunks in the
+ * same order. */
+static int aofRewriteJoinDumps(void) {
+    aofRewriteDumper *dumper;
+    char *buf;
+    ssize_t nread;
+    int j, k;
+
+    for (j = 0; j < aof_rw_ndumpers; j ++) {
+        if (aof_rw_dumpers[j].status != VR_OK) return VR_ERROR;
+    }
+
+    buf = dalloc(AOF_REWRITE_COPY_BYTES);
+    aof_rw_chunks = dalloc(sizeof(long long)*(size_t)server.dbnum);
+    aof_rw_nchunks = 0;
+    for (j = 0; j < aof_rw_ndumpers; j ++) {
+        dumper = &aof_rw_dumpers[j];
+        if (lseek(dumper->fd,0,SEEK_SET) == -1) goto werr;
+        while ((nread = read(dumper->fd,buf,AOF_REWRITE_COPY_BYTES)) > 0) {
+            if (aofWriteAll(aof_rw_fd,buf,(size_t)nread) != VR_OK) goto werr;
+        }
+        if (nread == -1) goto werr;
+        for (k = 0; k < dumper->nchunks; k ++)
+            aof_rw_chunks[aof_rw_nchunks++] = dumper->chunks[k];
+    }
+    dfree(buf);
+    return VR_OK;
+
+werr:
+    log_warn("Error joining the dumps of the AOF rewrite: %s",
+        strerror(errno));
+    dfree(buf);
+    return VR_ERROR;
+}
+
+static void *aofRewriteDumperRun(void *data) {
+    aofRewriteDumper *dumper = data;
+    long long len;
+    int idx;
+
+    while ((idx = aof_atomic_incr(&aof_rw_next_db)-1) < server.dbnum) {
+        if (aofRewriteDumpDb(dumper,idx,&len) != VR_OK) {
+            log_warn("Error dumping db %d in %s: %s",
+                idx, dumper->tmpfile, strerror(errno));
+            dumper->status = VR_ERROR;
+            break;
+        }
+        dumper->chunks[dumper->nchunks++] = len;
+    }
+
+    if (aof_atomic_decr(&aof_rw_dumpers_left) == 0) {
+        aof_atomic_store(&aof_rw_dump_status,aofRewriteJoinDumps());
+        aof_atomic_store(&aof_rw_dumped,1);
+    }
+    return NULL;
+}
+
+/* Open the temp files of 'threads' dumpers. */
+static int aofRewriteCreateDumpers(int threads) {
+    aofRewriteDumper *dumper;
+    int j;
+
+    aof_rw_dumpers = dcalloc(threads,sizeof(aofRewriteDumper));
+    aof_rw_ndumpers = 0;
+    for (j = 0; j < threads; j ++) {
+        dumper = &aof_rw_dumpers[j];
+        dumper->tmpfile = sdscatprintf(sdsempty(),"%s.dump-%d",aof_rw_tmpfile,j);
+        dumper->fd = open(dumper->tmpfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+        if (dumper->fd == -1) {
+            log_warn("Can't open the temp file %s: %s",
+                dumper->tmpfile,strerror(errno));
+            sdsfree(dumper->tmpfile);
+            return VR_ERROR;
+        }
+        dumper->size = 0;
+        dumper->chunks = dalloc(sizeof(long long)*(size_t)server.dbnum);
+        dumper->nchunks = 0;
+        dumper->status = VR_OK;
+        vr_thread_init(&dumper->thread);
+        dumper->thread.fun_run = aofRewriteDumperRun;
+        dumper->thread.data = dumper;
+        aof_rw_ndumpers ++;
+    }
+    return VR_OK;
+}
+
+/* Remove the temp files of the dumpers, once they exited if 'started'. */
+static void aofRewriteReleaseDumpers(int started) {
+    aofRewriteDumper *dumper;
+    int j;
+
+    if (aof_rw_dumpers == NULL) return;
+
+    for (j = 0; j < aof_rw_ndumpers; j ++) {
+        dumper = &aof_rw_dumpers[j];
+        if (started) pthread_join(dumper->thread.thread_id,NULL);
+        close(dumper->fd);
+        unlink(dumper->tmpfile);
+        sdsfree(dumper->tmpfile);
+        dfree(dumper->chunks);
+    }
+    dfree(aof_rw_dumpers);
+    aof_rw_dumpers = NULL;
+    aof_rw_ndumpers = 0;
+}
+
+static int aofRewriteTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    if (!aof_atomic_load(&aof_rw_dumped)) return AOF_REWRITE_POLL_MS;
+
+    aofRewriteReleaseDumpers(1);
+    if (aof_atomic_load(&aof_rw_dump_status) == VR_OK) {
+        aofRewriteFinish();
+    } else {
+        log_warn("Error trying to rewrite the AOF");
+        aofRewriteAbort();
+    }
+    return AE_NOMORE;
+}
+
+/* Return 1 if an eventloop other than 'vel' is inside a call that
+ * numbered its writes and didn't queue its record yet. */
+static int aofCallsPending(vr_eventloop *vel) {
+    uint32_t idx;
+
+    if (!aof_atomic_load(&aof_writer_started)) return 0;
+
+    for (idx = 0; idx < aof_writer_nvels; idx ++) {
+        if (aof_writer_vels[idx] == vel) continue;
+        if (aof_atomic_load(&aof_writer_vels[idx]->aof_pending) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Start the scheduled rewrite from the backend eventloop. The base is the
+ * dataset as it is at this instant, when the backend holds all the dbs:
+ * the records numbered up to now are in the base, the others go in the
+ * diff, or for a snapshot are sent to the slaves from the backlog. */
+static void aofRewriteStart(vr_eventloop *vel, int purpose) {
+    redisDb *db;
+    sds dir;
+    int threads, j;
+
+    pthread_mutex_lock(&aof_rw_lock);
+    aof_rw_purpose = purpose;
+    aof_rw_repl_offset = -1;
+    pthread_mutex_unlock(&aof_rw_lock);
+
+    conf_server_get(CONFIG_SOPN_DIR,&dir);
+    if (purpose == AOF_RW_FOR_REPL) {
+        aof_rw_tmpfile = sdscatprintf(sdsempty(),"%s/temp-repl-%d-%llu.aof",
+            dir,(int)getpid(),aof_rw_id+1);
+    } else {
+        aof_rw_tmpfile = sdscatprintf(sdsempty(),"%s/temp-rewriteaof-bg-%d.aof",
+            dir,(int)getpid());
+    }
+    sdsfree(dir);
+    aof_rw_fd = open(aof_rw_tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (aof_rw_fd == -1) {
+        log_warn("Can't open the temp append only file %s: %s",
+            aof_rw_tmpfile,strerror(errno));
+        aofRewriteEnd(VR_ERROR);
+        return;
+    }
+
+    conf_server_get(CONFIG_SOPN_RDBTHREADS,&threads);
+    if (threads > server.dbnum) threads = server.dbnum;
+    if (threads < 1) threads = 1;
+    if (aofRewriteCreateDumpers(threads) != VR_OK) {
+        aofRewriteReleaseDumpers(0);
+        aofRewriteEnd(VR_ERROR);
+        return;
+    }
+
+    aof_rw_dbs = dalloc(sizeof(aofRewriteDb)*(size_t)server.dbnum);
+    for (j = 0; j < server.dbnum; j ++) {
+        db = darray_get(&server.dbs, (uint32_t)j);
+        aof_rw_dbs[j].state = AOF_RW_DB_WAIT;
+        aof_rw_dbs[j].cursor = 0;
+        aof_rw_dbs[j].paused = 0;
+        aof_rw_dbs[j].dumped = dictCreate(&aofRewriteDumpedDictType,NULL);
+        aof_rw_dbs[j].buf = catAppendOnlySelectCommand(sdsempty(),db->id);
+    }
+    aof_rw_next_db = 0;
+    aof_rw_dumpers_left = aof_rw_ndumpers;
+    aof_rw_dumped = 0;
+    aof_rw_dump_status = VR_ERROR;
+    if (purpose == AOF_RW_FOR_AOF) server.aof_rewrite_time_start = time(NULL);
+
+    /* A call numbered before the start point may still be inside, with
+     * its record not queued: it would end after the start point in the
+     * stream, and may be waiting for one of our dbs. Take the start point
+     * when no call is inside, and let them go on meanwhile. */
+    while (1) {
+        for (j = 0; j < server.dbnum; j ++) {
+            db = darray_get(&server.dbs, (uint32_t)j);
+            lockDbWrite(db);
+        }
+        if (!aofCallsPending(vel)) break;
+        for (j = server.dbnum-1; j >= 0; j --) {
+            db = darray_get(&server.dbs, (uint32_t)j);
+            unlockDb(db);
+        }
+        usleep(100);
+    }
+    pthread_mutex_lock(&aof_rw_lock);
+    aof_rw_diff_db = -1;
+    aof_rw_id ++;
+    aof_rw_seq = aof_atomic_load(&aof_seq);
+    aof_rw_state = AOF_RW_BASE;
+    pthread_mutex_unlock(&aof_rw_lock);
+    for (j = 0; j < server.dbnum; j ++) {
+        db = darray_get(&server.dbs, (uint32_t)j);
+        db->aof_rewrite = &aof_rw_dbs[j];
+        unlockDb(db);
+    }
+
+    if (aeCreateTimeEvent(vel->el,AOF_REWRITE_POLL_MS,aofRewriteTimeProc,
+            NULL,NULL) == AE_ERR) {
+        log_warn("Can't create the AOF rewrite time event");
+        aofRewriteReleaseDumpers(0);
+        aofRewriteAbort();
+        return;
     }
+    for (j = 0; j < aof_rw_ndumpers; j ++)
+        vr_thread_start(&aof_rw_dumpers[j].thread);
+
+    if (purpose == AOF_RW_FOR_REPL)
+        log_notice("Snapshot for the slaves started, %d threads",
+            aof_rw_ndumpers);
+    else
+        log_notice("Background append only file rewriting started, %d threads",
+            aof_rw_ndumpers);
+}
+
+/* Schedule a rewrite, the backend starts it at its next cron, after the
+ * running snapshot if any. Return VR_ERROR if a rewrite is already in
+ * progress. */
+int rewriteAppendOnlyFileBackground(void) {
+    int ret = VR_ERROR;
+
+    pthread_mutex_lock(&aof_rw_lock);
+    if (!(aof_rw_scheduled & AOF_RW_FOR_AOF) &&
+        (aof_rw_state == AOF_RW_NONE || aof_rw_purpose != AOF_RW_FOR_AOF)) {
+        aof_rw_scheduled |= AOF_RW_FOR_AOF;
+        ret = VR_OK;
+    }
+    pthread_mutex_unlock(&aof_rw_lock);
+    return ret;
+}
+
+/* Schedule a snapshot of the dataset for the slaves waiting a full
+ * resync. Nothing to do if one is already running, the slaves arriving
+ * now take it as well if its offset is still in the backlog. */
+int aofRewriteScheduleSnapshot(void) {
+    pthread_mutex_lock(&aof_rw_lock);
+    if (aof_rw_state == AOF_RW_NONE || aof_rw_purpose != AOF_RW_FOR_REPL)
+        aof_rw_scheduled |= AOF_RW_FOR_REPL;
+    pthread_mutex_unlock(&aof_rw_lock);
+    return VR_OK;
+}
+
+/* The state of the AOF rewrite, the snapshots are not reported. */
+int aofRewriteGetState(void) {
+    int state;
 
-    /* Append to the AOF buffer. This will be flushed on disk just before
-     * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
-        server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
+    pthread_mutex_lock(&aof_rw_lock);
+    if (aof_rw_state != AOF_RW_NONE && aof_rw_purpose == AOF_RW_FOR_AOF)
+        state = aof_rw_state;
+    else if (aof_rw_scheduled & AOF_RW_FOR_AOF)
+        state = AOF_RW_SCHEDULED;
+    else
+        state = AOF_RW_NONE;
+    pthread_mutex_unlock(&aof_rw_lock);
+    return state;
+}
 
-    /* If a background append only file rewriting is in progress we want to
-     * accumulate the differences between the child DB and the current one
-     * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+unsigned long aofRewriteBufferLength(void) {
+    unsigned long len;
 
-    sdsfree(buf);
+    pthread_mutex_lock(&aof_rw_lock);
+    len = server.aof_rewrite_buf_blocks ? aofRewriteBufferSize() : 0;
+    pthread_mutex_unlock(&aof_rw_lock);
+    return len;
 }
 
+/* Called by the backend cron. Start the scheduled rewrite, the snapshot
+ * first as slaves wait for it, or schedule one if the AOF grew over
+ * auto-aof-rewrite-percentage. */
+void aofRewriteCron(vr_eventloop *vel) {
+    long long minsize, base, growth;
+    int perc, purpose = 0;
+
+    if (server.aof_state == AOF_ON && aofRewriteGetState() == AOF_RW_NONE) {
+        conf_server_get(CONFIG_SOPN_AOFRWPERC,&perc);
+        conf_server_get(CONFIG_SOPN_AOFRWMINSIZE,&minsize);
+        if (perc && server.aof_current_size > minsize) {
+            base = server.aof_rewrite_base_size ?
+                server.aof_rewrite_base_size : 1;
+            growth = (server.aof_current_size*100/base) - 100;
+            if (growth >= perc) {
+                log_notice("Starting automatic rewriting of AOF on %lld%% growth",
+                    growth);
+                rewriteAppendOnlyFileBackground();
+            }
+        }
+    }
+
+    pthread_mutex_lock(&aof_rw_lock);
+    if (aof_rw_state == AOF_RW_NONE) {
+        if (aof_rw_scheduled & AOF_RW_FOR_REPL)
+            purpose = AOF_RW_FOR_REPL;
+        else if (aof_rw_scheduled & AOF_RW_FOR_AOF)
+            purpose = AOF_RW_FOR_AOF;
+        aof_rw_scheduled &= ~purpose;
+    }
+    pthread_mutex_unlock(&aof_rw_lock);
+
+    if (purpose) aofRewriteStart(vel,purpose);
+}
+
+void bgrewriteaofCommand(client *c) {
+    if (server.aof_state != AOF_ON) {
+        addReplyError(c,"Background append only file rewriting needs appendonly enabled");
+    } else if (rewriteAppendOnlyFileBackground() == VR_OK) {
+        addReplyStatus(c,"Background append only file rewriting started");
+    } else {
+        addReplyError(c,"Background append only file rewriting already in progress");
+    }
+}
@@ -8,6 +8,48 @@
 
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
+#define AOF_QUEUE_SIZE 4096     /* Max records waiting for the writer per worker */
+
+/* AOF rewrite states, see aofRewriteStart() */
+#define AOF_RW_NONE 0           /* No rewrite */
+#define AOF_RW_SCHEDULED 1      /* The backend starts it at the next cron */
+#define AOF_RW_BASE 2           /* Dumping the dataset in the temp file */
+#define AOF_RW_SWITCH 3         /* The writer completes it and renames the file */
+
+/* What a rewrite is for */
+#define AOF_RW_FOR_AOF 1        /* Compact the AOF */
+#define AOF_RW_FOR_REPL 2       /* Snapshot for the slaves in full resync */
+
+/* States of a db in a rewrite */
+#define AOF_RW_DB_WAIT 0        /* Not yet scanned */
+#define AOF_RW_DB_SCAN 1        /* The keys before 'cursor' are dumped */
+#define AOF_RW_DB_DONE 2        /* All the keys are dumped */
+
+#define AOF_REWRITE_ITEMS_PER_CMD 64
+
+/* The rewrite state of a db. The keys the workers write while the db is
+ * scanned are dumped just before the write and added to 'dumped', so the
+ * scan skips them. Changed just with the db write lock held, or by the
+ * dumper of the db with the read lock held. */
+typedef struct aofRewriteDb {
+    int state;
+    unsigned long cursor;       /* dictScan() cursor of the next bucket */
+    int paused;                 /* The db dict rehashing is paused */
+    dict *dumped;               /* Keys dumped out of the scan */
+    sds buf;                    /* Dump of the db not yet written */
+} aofRewriteDb;
+
+/* The commands propagated by one call() of a worker, in the AOF format.
+ * 'seq' is the last sequence number the worker took under a db write
+ * lock in that call, the writer thread appends the records of all the
+ * workers to the file ordered by it, see aofWriterMerge(). */
+typedef struct aofRecord {
+    unsigned long long seq;
+    int dbid;                   /* DB of the first command */
+    int lastdbid;               /* DB of the last command */
+    sds buf;
+} aofRecord;
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite buffer implementation.
  *
@@ -30,10 +72,27 @@ typedef struct aofrwblock {
 } aofrwblock;
 
 unsigned long aofRewriteBufferSize(void);
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask);
 sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, robj *seconds);
 sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv);
 void aofRewriteBufferAppend(unsigned char *s, unsigned long len);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 
+void aofWriteLocked(vr_eventloop *vel);
+void aofCallDone(vr_eventloop *vel);
+void aofBeforeSleep(vr_eventloop *vel);
+int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFileChunks(char *filename, long long *chunks, int nchunks, int threads);
+sds aofGetFilename(void);
+int aofStartStream(void);
+int aofInit(void);
+
+int rewriteAppendOnlyFileBackground(void);
+int aofRewriteScheduleSnapshot(void);
+int aofRewriteGetState(void);
+unsigned long aofRewriteBufferLength(void);
+void aofRewriteTouchKey(redisDb *db, robj *key);
+void aofRewriteFlushDb(redisDb *db);
+void aofRewriteCron(vr_eventloop *vel);
+void bgrewriteaofCommand(struct client *c);
+
 #endif
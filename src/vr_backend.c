@@ -5,6 +5,28 @@ static int num_backend_threads;
 
 struct darray backends;
 
+/* The values and the keyspaces to free out of the db locks, any backend
+ * frees them, see backends_lazyfree(). */
+typedef struct lazyfreeJob {
+    lazyfreeProc *proc;
+    void *ptr;
+    unsigned long objects;      /* Objects freed by the job, for INFO */
+} lazyfreeJob;
+
+static dmtqueue *lazyfree_queue = NULL;
+static unsigned long long lazyfree_pending = 0; /* Objects still to free */
+static unsigned int lazyfree_next = 0;          /* Backend woken next */
+
+#if defined(__ATOMIC_RELAXED)
+#define lazyfree_atomic_add(_ptr,_n) __atomic_add_fetch(_ptr,_n,__ATOMIC_RELAXED)
+#define lazyfree_atomic_sub(_ptr,_n) __atomic_sub_fetch(_ptr,_n,__ATOMIC_RELAXED)
+#define lazyfree_atomic_load(_ptr) __atomic_load_n(_ptr,__ATOMIC_RELAXED)
+#else
+#define lazyfree_atomic_add(_ptr,_n) __sync_add_and_fetch(_ptr,_n)
+#define lazyfree_atomic_sub(_ptr,_n) __sync_sub_and_fetch(_ptr,_n)
+#define lazyfree_atomic_load(_ptr) __sync_add_and_fetch(_ptr,0)
+#endif
+
 static void *backend_thread_run(void *args);
 
 int
@@ -18,15 +40,26 @@ vr_backend_init(vr_backend *backend)
     }
 
     backend->id = 0;
+    backend->notifier.rfd = -1;
+    backend->notifier.wfd = -1;
     backend->current_db = 0;
     backend->timelimit_exit = 0;
     backend->last_fast_cycle = 0;
     backend->resize_db = 0;
     backend->rehash_db = 0;
+    backend->prepare_db = 0;
 
     vr_eventloop_init(&backend->vel, 10);
+    /* The backends lock the dbs for jobs writing nothing to the AOF, they
+     * number just the keys they expire or evict. */
+    backend->vel.aof_number_locks = 0;
     backend->vel.thread.fun_run = backend_thread_run;
     backend->vel.thread.data = backend;
+
+    status = vr_notifier_init(&backend->notifier);
+    if (status != VR_OK) {
+        return VR_ERROR;
+    }
     
     return VR_OK;
 }
@@ -39,6 +72,8 @@ vr_backend_deinit(vr_backend *backend)
     }
 
     vr_eventloop_deinit(&backend->vel);
+
+    vr_notifier_deinit(&backend->notifier);
 }
 
 static int
@@ -55,6 +90,7 @@ backend_cron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     vel->unixtime = time(NULL);
     vel->mstime = vr_msec_now();
+    vel->lruclock = getLRUClock() & LRU_CLOCK_MAX;
 
     /* Record the max memory used since the server was started. */
     stat_used_memory = dalloc_used_memory();
@@ -65,6 +101,18 @@ backend_cron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     databasesCron(backend);
 
+    /* Take back the slab slots freed by the workers */
+    slabCron();
+
+    /* Keep the used memory under the low watermark */
+    backgroundEvictCycle(vel);
+
+    /* Start the AOF rewrite if scheduled or needed */
+    aofRewriteCron(vel);
+
+    /* Hand the DELs of the expired and evicted keys to the AOF writer */
+    aofBeforeSleep(vel);
+
     /* Update the config cache */
     run_with_period(1000, vel->cronloops) {
         conf_cache_update(&vel->cc);
@@ -74,6 +122,26 @@ backend_cron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     return 1000/vel->hz;
 }
 
+/* Free what the workers queued since the last wakeup. */
+static void
+backend_lazyfree_process(aeEventLoop *el, int fd, void *privdata, int mask) {
+    vr_backend *backend = privdata;
+    lazyfreeJob *job;
+
+    UNUSED(mask);
+
+    ASSERT(el == backend->vel.el);
+    ASSERT(fd == backend->notifier.rfd);
+
+    vr_notifier_consume(&backend->notifier);
+
+    while ((job = dmtqueue_pop(lazyfree_queue)) != NULL) {
+        job->proc(job->ptr);
+        lazyfree_atomic_sub(&lazyfree_pending,job->objects);
+        dfree(job);
+    }
+}
+
 static int
 setup_backend(vr_backend *backend)
 {
@@ -83,6 +151,12 @@ setup_backend(vr_backend *backend)
         serverPanic("Can't create the serverCron time event.");
         return VR_ERROR;
     }
+
+    if (aeCreateFileEvent(backend->vel.el, backend->notifier.rfd, AE_READABLE,
+        backend_lazyfree_process, backend) == AE_ERR) {
+        log_error("Unrecoverable error creating backend notifier file event.");
+        return VR_ERROR;
+    }
     
     return VR_OK;
 }
@@ -91,6 +165,10 @@ static void *
 backend_thread_run(void *args)
 {
     vr_worker *backend = args;
+
+    vr_eventloop_bind(&backend->vel);
+
+    slabPoolBind();
     
     /* vire worker run */
     aeMain(backend->vel.el);
@@ -107,9 +185,19 @@ backends_init(uint32_t backend_count)
 
     darray_init(&backends, backend_count, sizeof(vr_backend));
 
+    lazyfree_queue = dmtqueue_create();
+    if (lazyfree_queue == NULL ||
+        dmtqueue_init_with_lockqueue(lazyfree_queue, NULL) != 0) {
+        log_error("create lazy free queue failed: out of memory");
+        return VR_ENOMEM;
+    }
+
     for (idx = 0; idx < backend_count; idx ++) {
         backend = darray_push(&backends);
-        vr_backend_init(backend);
+        status = vr_backend_init(backend);
+        if (status != VR_OK) {
+            exit(1);
+        }
         backend->id = idx;
         status = setup_backend(backend);
         if (status != VR_OK) {
@@ -163,4 +251,52 @@ backends_deinit(void)
         backend = darray_pop(&backends);
 		vr_backend_deinit(backend);
     }
+
+    if (lazyfree_queue != NULL) {
+        dmtqueue_destroy(lazyfree_queue);
+        lazyfree_queue = NULL;
+    }
+}
+
+/* Let a backend free 'ptr' by 'proc' out of the db locks, 'objects' is
+ * how many objects are freed, for INFO. Return VR_OK if it was queued,
+ * otherwise the caller has to free it itself. */
+int
+backends_lazyfree(lazyfreeProc *proc, void *ptr, unsigned long objects)
+{
+    lazyfreeJob *job;
+    vr_backend *backend;
+    unsigned int next;
+
+    if (lazyfree_queue == NULL || num_backend_threads == 0) {
+        return VR_ERROR;
+    }
+
+    job = dalloc(sizeof(*job));
+    if (job == NULL) {
+        return VR_ENOMEM;
+    }
+    job->proc = proc;
+    job->ptr = ptr;
+    job->objects = objects;
+
+    lazyfree_atomic_add(&lazyfree_pending,objects);
+    if (dmtqueue_push(lazyfree_queue, job) < 0) {
+        lazyfree_atomic_sub(&lazyfree_pending,objects);
+        dfree(job);
+        return VR_ENOMEM;
+    }
+
+    next = lazyfree_atomic_add(&lazyfree_next,1);
+    backend = darray_get(&backends, next%(unsigned int)num_backend_threads);
+    vr_notifier_notify(&backend->notifier);
+
+    return VR_OK;
+}
+
+/* Objects queued by backends_lazyfree() still to free. */
+unsigned long long
+backends_lazyfree_pending(void)
+{
+    return lazyfree_atomic_load(&lazyfree_pending);
 }
@@ -5,6 +5,7 @@ typedef struct vr_backend {
 
     int id;
     vr_eventloop vel;
+    vr_notifier notifier;       /* Woken for the lazy free queue */
 
     /* Some global state in order to continue the work incrementally 
        * across calls for activeExpireCycle() to expire some keys. */
@@ -17,8 +18,12 @@ typedef struct vr_backend {
        * cron loop iteration for databasesCron() to resize and reshash db. */
     unsigned int resize_db;
     unsigned int rehash_db;
+    unsigned int prepare_db;
 }vr_backend;
 
+/* Frees something queued by backends_lazyfree(). */
+typedef void lazyfreeProc(void *ptr);
+
 extern struct darray backends;
 
 int backends_init(uint32_t backend_count);
@@ -26,4 +31,7 @@ int backends_run(void);
 int backends_wait(void);
 void backends_deinit(void);
 
+int backends_lazyfree(lazyfreeProc *proc, void *ptr, unsigned long objects);
+unsigned long long backends_lazyfree_pending(void);
+
 #endif
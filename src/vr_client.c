@@ -57,16 +57,28 @@ client *createClient(vr_eventloop *vel, struct conn *conn) {
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_size = 0;
+    c->argv_arena = NULL;
+    c->argv_arena_used = 0;
     c->cmd = c->lastcmd = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
+    c->write_calls = 0;
+    c->writes_saved = 0;
     c->flags = 0;
     c->ctime = c->lastinteraction = vel->unixtime;
     c->authenticated = 0;
     c->replstate = REPL_STATE_NONE;
     c->repl_put_online_on_ack = 0;
+    c->repldbfd = -1;
+    c->repldboff = 0;
+    c->repldbsize = 0;
+    c->replpreamble = NULL;
     c->reploff = 0;
+    c->read_reploff = 0;
+    c->repl_feed_off = 0;
+    c->repl_snapshot_id = 0;
     c->repl_ack_off = 0;
     c->repl_ack_time = 0;
     c->slave_listening_port = 0;
@@ -91,6 +103,9 @@ client *createClient(vr_eventloop *vel, struct conn *conn) {
     c->taridx = -1;
     c->steps = 0;
     c->cache = NULL;
+    c->forwarded = 0;
+    c->ops = 0;
+    c->close_on_return = 0;
     dlistSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     dlistSetMatchMethod(c->pubsub_patterns,listMatchObjects);
     if (conn->sd != -1) dlistAddNodeTail(vel->clients,c);
@@ -166,7 +181,7 @@ robj *dupLastObjectIfNeeded(dlist *reply) {
     ASSERT(dlistLength(reply) > 0);
     ln = dlistLast(reply);
     cur = dlistNodeValue(ln);
-    if (cur->constant) {
+    if (cur->constant || objectIsShared(cur)) {
         new = dupStringObject(cur);
         dlistNodeValue(ln) = new;
     }
@@ -536,6 +551,29 @@ void addReplyBulk(client *c, robj *obj) {
     addReply(c,shared.crlf);
 }
 
+/* Add a string value of the keyspace as bulk reply, with the db lock
+ * held. The big values are not copied in the output buffers: the reply
+ * list shares the object with the keyspace, so it is sent by writev()
+ * straight from the keyspace. The object is freed by the last of its
+ * owners, and a value written in place is copied first, see
+ * dbUnshareStringValue(). */
+void addReplyBulkShared(client *c, robj *obj) {
+    if (obj->encoding != OBJ_ENCODING_RAW || obj->constant ||
+        sdslen(obj->ptr) < PROTO_SHARED_REPLY_MIN_BYTES) {
+        addReplyBulk(c,obj);
+        return;
+    }
+
+    if (prepareClientToWrite(c) != VR_OK) return;
+    addReplyBulkLen(c,obj);
+    if (!(c->flags & CLIENT_CLOSE_AFTER_REPLY)) {
+        dlistAddNodeTail(c->reply,shareObject(obj));
+        c->reply_bytes += getStringObjectSdsUsedMemory(obj);
+        asyncCloseClientOnOutputBufferLimitReached(c);
+    }
+    addReply(c,shared.crlf);
+}
+
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
     addReplyLongLongWithPrefix(c,len,'$');
@@ -591,17 +629,36 @@ static void freeClientArgv(client *c) {
     for (j = 0; j < c->argc; j++)
         freeObject(c->argv[j]);
     c->argc = 0;
+    c->argv_arena_used = 0;
     c->cmd = NULL;
 }
 
-/* Close all the slaves connections. This is useful in chained replication
- * when we resync with our own master and want to force all our slaves to
- * resync with us as well. */
-void disconnectSlaves(void) {
-    while (dlistLength(repl.slaves)) {
-        dlistNode *ln = dlistFirst(repl.slaves);
-        freeClient((client*)ln->value);
-    }
+/* Make room in argv for the 'argc' arguments of the next command. The
+ * array is kept from a command to the next one, unless it is big. */
+static void clientArgvReserve(client *c, int argc) {
+    if (c->argv != NULL && argc <= c->argv_size &&
+        (c->argv_size <= PROTO_ARGV_KEEP_SLOTS ||
+         argc > PROTO_ARGV_KEEP_SLOTS)) return;
+
+    if (c->argv) dfree(c->argv);
+    c->argv = dalloc(sizeof(robj*)*(size_t)argc);
+    c->argv_size = argc;
+}
+
+/* Create an argument of the current command. The small ones are carved
+ * out of the client arena, that is reused by the next command: no
+ * allocation is made for them, and the commands already duplicate what
+ * they keep, like the values stored by SET. */
+static robj *createClientArgument(client *c, const char *ptr, size_t len) {
+    robj *o;
+    size_t used;
+
+    if (c->argv_arena == NULL) c->argv_arena = dalloc(PROTO_ARGV_ARENA_BYTES);
+    o = createArenaStringObject(c->argv_arena+c->argv_arena_used,
+        PROTO_ARGV_ARENA_BYTES-c->argv_arena_used,ptr,len,&used);
+    if (o == NULL) return createStringObject(ptr,len);
+    c->argv_arena_used += used;
+    return o;
 }
 
 /* Remove the specified client from eventloop lists where the client could
@@ -661,7 +718,7 @@ void linkClientToEventloop(client *c,vr_eventloop *vel) {
     }
 
     /* Handle the remain query buffer */
-    processInputBuffer(c);
+    if (processInputBuffer(c) == VR_EAGAIN) return;
     if (c->flags&CLIENT_JUMP) {
         dispatch_conn_exist(c,c->taridx);
     } else {
@@ -727,16 +784,9 @@ void freeClient(client *c) {
      *
      * Note that before doing this we make sure that the client is not in
      * some unexpected state, by checking its flags. */
-    if (repl.role == REPLICATION_ROLE_MASTER && c->flags & CLIENT_MASTER) {
+    if (c->flags & CLIENT_MASTER) {
         log_warn("connection with master lost.");
-        if (!(c->flags & (CLIENT_CLOSE_AFTER_REPLY|
-                          CLIENT_CLOSE_ASAP|
-                          CLIENT_BLOCKED|
-                          CLIENT_UNBLOCKED)))
-        {
-            replicationCacheMaster(c);
-            return;
-        }
+        replicationCacheMaster(c);
     }
 
     /* Log link disconnection with slave */
@@ -775,20 +825,13 @@ void freeClient(client *c) {
     /* Master/slave cleanup Case 1:
      * we lost the connection with a slave. */
     if (c->flags & CLIENT_SLAVE) {
-        if (c->replstate == SLAVE_STATE_SEND_BULK) {
-            if (c->repldbfd != -1) close(c->repldbfd);
-            if (c->replpreamble) sdsfree(c->replpreamble);
+        if (c->flags & CLIENT_MONITOR) {
+            ln = dlistSearchKey(server.monitors,c);
+            ASSERT(ln != NULL);
+            dlistDelNode(server.monitors,ln);
+        } else {
+            replicationRemoveSlave(c);
         }
-        dlist *l = (c->flags & CLIENT_MONITOR) ? server.monitors : repl.slaves;
-        ln = dlistSearchKey(l,c);
-        ASSERT(ln != NULL);
-        dlistDelNode(l,ln);
-        /* We need to remember the time when we started to have zero
-         * attached slaves, as after some time we'll free the replication
-         * backlog. */
-        if (c->flags & CLIENT_SLAVE && dlistLength(repl.slaves) == 0)
-            repl.repl_no_slaves_since = c->vel->unixtime;
-        refreshGoodSlavesCount();
     }
 
     /* Master/slave cleanup Case 2:
@@ -807,6 +850,7 @@ void freeClient(client *c) {
      * and finally release the client structure itself. */
     if (c->name) freeObject(c->name);
     if (c->argv) dfree(c->argv);
+    if (c->argv_arena) dfree(c->argv_arena);
     freeClientMultiState(c);
     sdsfree(c->peerid);
     dfree(c);
@@ -819,6 +863,8 @@ void freeClient(client *c) {
 void freeClientAsync(client *c) {
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
+    /* A forwarded client is queued by its own worker when it is back. */
+    if (c->forwarded) return;
     dlistAddNodeTail(c->vel->clients_to_close,c);
 }
 
@@ -833,52 +879,98 @@ void freeClientsInAsyncFreeQueue(vr_eventloop *vel) {
     }
 }
 
-/* Write data in output buffers to client. Return VR_OK if the client
- * is still valid after the call, VR_ERROR if it was freed. */
+/* Remove from the output buffers the 'nwritten' bytes just written,
+ * and the empty reply objects. */
+static void clientConsumeWritten(client *c, size_t nwritten) {
+    size_t objlen, n;
+    robj *o;
+
+    if (c->bufpos > 0) {
+        n = (size_t)c->bufpos-c->sentlen;
+        if (n > nwritten) n = nwritten;
+        c->sentlen += n;
+        nwritten -= n;
+        /* If the buffer was sent, set bufpos to zero to continue with
+         * the remainder of the reply. */
+        if ((int)c->sentlen != c->bufpos) return;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+
+    while (dlistLength(c->reply)) {
+        o = dlistNodeValue(dlistFirst(c->reply));
+        objlen = sdslen(o->ptr);
+        if (objlen > 0) {
+            if (nwritten == 0) break;
+            n = objlen-c->sentlen;
+            if (n > nwritten) n = nwritten;
+            c->sentlen += n;
+            nwritten -= n;
+            /* If we fully sent the object on head go to the next one */
+            if (c->sentlen != objlen) break;
+        }
+        c->reply_bytes -= getStringObjectSdsUsedMemory(o);
+        dlistDelNode(c->reply,dlistFirst(c->reply));
+        c->sentlen = 0;
+    }
+}
+
+/* Write data in output buffers to client. The static buffer and the
+ * reply objects are gathered in a single writev(), up to
+ * NET_MAX_WRITEV_IOVS buffers and NET_MAX_WRITES_PER_EVENT bytes.
+ * Return VR_OK if the client is still valid after the call, VR_ERROR if
+ * it was freed. */
 int writeToClient(int fd, client *c, int handler_installed) {
+    struct iovec iov[NET_MAX_WRITEV_IOVS];
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    size_t objmem;
+    size_t iovlen, objlen, offset;
+    int iovcnt;
+    dlistNode *ln;
+    dlistIter li;
     robj *o;
-    long long maxmemory;
+    long long maxmemory, saved = 0;
 
     maxmemory = c->vel->cc.maxmemory;
     while(clientHasPendingReplies(c)) {
+        iovcnt = 0;
+        iovlen = 0;
+        offset = c->sentlen;
         if (c->bufpos > 0) {
-            nwritten = vr_write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = dlistNodeValue(dlistFirst(c->reply));
+            iov[iovcnt].iov_base = c->buf+c->sentlen;
+            iov[iovcnt].iov_len = (size_t)c->bufpos-c->sentlen;
+            iovlen += iov[iovcnt++].iov_len;
+            offset = 0;
+        }
+        dlistRewind(c->reply,&li);
+        while (iovcnt < NET_MAX_WRITEV_IOVS &&
+               iovlen < NET_MAX_WRITES_PER_EVENT &&
+               (ln = dlistNext(&li)) != NULL) {
+            o = dlistNodeValue(ln);
             objlen = sdslen(o->ptr);
-            objmem = getStringObjectSdsUsedMemory(o);
-
-            if (objlen == 0) {
-                dlistDelNode(c->reply,dlistFirst(c->reply));
-                c->reply_bytes -= objmem;
-                continue;
+            if (objlen > 0) {
+                iov[iovcnt].iov_base = (char*)o->ptr+offset;
+                iov[iovcnt].iov_len = objlen-offset;
+                iovlen += iov[iovcnt++].iov_len;
             }
+            offset = 0;
+        }
 
-            nwritten = vr_write(fd, ((char*)o->ptr)+c->sentlen,objlen-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                dlistDelNode(c->reply,dlistFirst(c->reply));
-                c->sentlen = 0;
-                c->reply_bytes -= objmem;
-            }
+        /* Just empty reply objects. */
+        if (iovcnt == 0) {
+            clientConsumeWritten(c,0);
+            continue;
         }
+
+        nwritten = vr_writev(fd,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+        c->write_calls ++;
+        saved += iovcnt-1;
+        clientConsumeWritten(c,(size_t)nwritten);
+
+        /* The socket buffer is full, the next write would fail. */
+        if ((size_t)nwritten < iovlen) break;
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -888,9 +980,13 @@ int writeToClient(int fd, client *c, int handler_installed) {
          * However if we are over the maxmemory limit we ignore that and
          * just deliver as much data as it is possible to deliver. */
         if (totwritten > NET_MAX_WRITES_PER_EVENT &&
-            (maxmemory == 0 || dalloc_used_memory() < maxmemory)) 
+            (maxmemory == 0 || dalloc_used_memory_fast() < (size_t)maxmemory)) 
             break;
     }
+    if (saved > 0) {
+        c->writes_saved += saved;
+        update_stats_add(c->vel->stats, writes_saved, saved);
+    }
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
@@ -1024,10 +1120,7 @@ int processInlineBuffer(client *c) {
     sdsrange(c->querybuf,querylen+2,-1);
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) dfree(c->argv);
-        c->argv = dalloc(sizeof(robj*)*argc);
-    }
+    if (argc) clientArgvReserve(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1061,9 +1154,30 @@ int processMultibulkBuffer(client *c) {
     long long ll;
 
     if (c->multibulklen == 0) {
+        respArg args[RESP_MAX_FAST_ARGS];
+        size_t used;
+        int argc, j;
+
         /* The client should have been reset */
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
+        /* Fast path: a whole command with small arguments is tokenized
+         * in one pass and its argv is filled at once. The command that
+         * is not all in the buffer yet is parsed again from its start
+         * when more data arrives, the rest goes on below. */
+        ok = respParseMultibulk(c->querybuf,sdslen(c->querybuf),
+            PROTO_MBULK_BIG_ARG-1,args,RESP_MAX_FAST_ARGS,&argc,&used);
+        if (ok == RESP_PARSE_MORE) return VR_ERROR;
+        if (ok == RESP_PARSE_OK) {
+            clientArgvReserve(c,argc);
+            for (j = 0; j < argc; j ++)
+                c->argv[j] = createClientArgument(c,
+                    c->querybuf+args[j].offset,args[j].len);
+            c->argc = argc;
+            sdsrange(c->querybuf,(int)used,-1);
+            return VR_OK;
+        }
+
         /* Multi bulk length cannot be read without a \r\n */
         newline = strchr(c->querybuf,'\r');
         if (newline == NULL) {
@@ -1097,8 +1211,7 @@ int processMultibulkBuffer(client *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) dfree(c->argv);
-        c->argv = dalloc(sizeof(robj*)*c->multibulklen);
+        clientArgvReserve(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
@@ -1175,7 +1288,7 @@ int processMultibulkBuffer(client *c) {
                 pos = 0;
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+pos,c->bulklen);
+                    createClientArgument(c,c->querybuf+pos,(size_t)c->bulklen);
                 pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1193,8 +1306,15 @@ int processMultibulkBuffer(client *c) {
     return VR_ERROR;
 }
 
-void processInputBuffer(client *c) {
-    c->vel->current_client = c;
+/* Return VR_EAGAIN if the client was handed to another worker by the
+ * key affinity mode, the caller must not touch the client anymore. The
+ * pipelined commands on the same db lock it once, see dbLockBatchBegin(). */
+int processInputBuffer(client *c) {
+    vr_eventloop *vel = c->vel;
+    int ret;
+
+    vel->current_client = c;
+    dbLockBatchBegin();
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
         /* Return if clients are paused. */
@@ -1230,19 +1350,32 @@ void processInputBuffer(client *c) {
             resetClient(c);
         } else {
             /* Only reset the client when the command was executed. */
-            if (processCommand(c) == VR_OK)
+            ret = processCommand(c);
+            if (ret == VR_EAGAIN) {
+                dbLockBatchEnd();
+                vel->current_client = NULL;
+                return VR_EAGAIN;
+            }
+            if (ret == VR_OK)
                 resetClient(c);
             /* freeMemoryIfNeeded may flush slave output buffers. This may result
              * into a slave, that may be the active client, to be freed. */
             if (c->vel->current_client == NULL) break;
 
+            /* The master stream was applied up to the end of this
+             * command, see replicationSendAck(). */
+            if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI))
+                c->reploff = c->read_reploff - (long long)sdslen(c->querybuf);
+
             /* If this client need to jump to another worker,
              * break this while loop. When this client jumped finished, 
              * continue handle the remain query buffer. */
             if (c->flags&CLIENT_JUMP) break;
         }
     }
+    dbLockBatchEnd();
     c->vel->current_client = NULL;
+    return VR_OK;
 }
 
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1287,7 +1420,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = c->vel->unixtime;
-    if (c->flags & CLIENT_MASTER) c->reploff += nread;
+    if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
     update_stats_add(c->vel->stats, net_input_bytes, nread);
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
@@ -1299,7 +1432,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         freeClient(c);
         return;
     }
-    processInputBuffer(c);
+    if (processInputBuffer(c) == VR_EAGAIN) return;
 
     if (c->flags&CLIENT_JUMP) {
         dispatch_conn_exist(c,c->taridx);
@@ -1316,6 +1449,7 @@ void getClientsMaxBuffers(vr_eventloop *vel, unsigned long *longest_output_list,
     dlistRewind(vel->clients,&li);
     while ((ln = dlistNext(&li)) != NULL) {
         c = dlistNodeValue(ln);
+        if (c->forwarded) continue;
 
         if (dlistLength(c->reply) > lol) lol = dlistLength(c->reply);
         if (sdslen(c->querybuf) > bib) bib = sdslen(c->querybuf);
@@ -1392,7 +1526,7 @@ sds catClientInfoString(sds s, client *client) {
     *p = '\0';
     
     return sdscatfmt(s,
-        "oid=%i id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s",
+        "oid=%i id=%U addr=%s fd=%i name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U wcalls=%I wsaved=%I events=%s cmd=%s",
         client->curidx,
         (unsigned long long) client->id,
         getClientPeerId(client),
@@ -1410,6 +1544,8 @@ sds catClientInfoString(sds s, client *client) {
         (unsigned long long) client->bufpos,
         (unsigned long long) dlistLength(client->reply),
         (unsigned long long) getClientOutputBufferMemoryUsage(client),
+        client->write_calls,
+        client->writes_saved,
         events,
         client->lastcmd ? client->lastcmd->name : "NULL");
 }
@@ -1434,160 +1570,172 @@ struct clientkilldata {
     int type;
     uint64_t id;
     int skipme;
-    int killed;
-    int close_this_client;
+    int close_this_client;      /* Set just by the worker of the client */
 };
 
-void clientCommand(client *c) {
+/* CLIENT LIST part of a worker, see worker_fanout(). */
+static void *clientListFanoutProc(vr_worker *worker, client *c, void *privdata) {
+    UNUSED(c);
+    UNUSED(privdata);
+
+    return getAllClientsInfoString(&worker->vel);
+}
+
+static void clientListFanoutDone(client *c, void *privdata, void **results) {
+    uint32_t j;
+    sds str = sdsempty();
+
+    UNUSED(privdata);
+
+    for (j = 0; j < darray_n(&workers); j ++) {
+        if (results[j] == NULL) continue;
+        str = sdscatsds(str,results[j]);
+        sdsfree(results[j]);
+    }
+
+    addReplyBulkCBuffer(c,str,sdslen(str));
+    sdsfree(str);
+}
+
+/* CLIENT KILL part of a worker, return the number of killed clients. */
+static void *clientKillFanoutProc(vr_worker *worker, client *c, void *privdata) {
+    struct clientkilldata *ckd = privdata;
     dlistNode *ln;
     dlistIter li;
     client *client;
+    long killed = 0;
 
-    if (!strcasecmp(c->argv[1]->ptr,"list") && c->argc == 2) {
-        /* CLIENT LIST */
-        sds str = c->cache;
-        sds o = getAllClientsInfoString(c->vel);
-
-        str = sdscatsds(str?str:sdsempty(),o);
-
-        if (c->steps >= (darray_n(&workers) - 1)) {
-            addReplyBulkCBuffer(c,str,sdslen(str));
-            c->steps = 0;
-            c->taridx = -1;
-            sdsfree(str);
-            c->cache = NULL;
-            c->flags &= ~CLIENT_JUMP;
+    /* Iterate clients killing all the matching clients. */
+    dlistRewind(worker->vel.clients,&li);
+    while ((ln = dlistNext(&li)) != NULL) {
+        client = dlistNodeValue(ln);
+        if (ckd->addr && strcmp(getClientPeerId(client),ckd->addr) != 0) continue;
+        if (ckd->type != -1 && getClientType(client) != ckd->type) continue;
+        if (ckd->id != 0 && client->id != ckd->id) continue;
+        if (c == client && ckd->skipme) continue;
+
+        /* Kill it. */
+        if (c == client) {
+            ckd->close_this_client = 1;
+        } else if (client->forwarded) {
+            client->close_on_return = 1;
         } else {
-            if (!(c->flags&CLIENT_JUMP))
-                c->flags |= CLIENT_JUMP;
-            c->taridx = worker_get_next_idx(c->curidx);
-            c->cache = str;
+            freeClient(client);
         }
-        sdsfree(o);
+        killed++;
+    }
+
+    return (void*)killed;
+}
+
+static void clientKillFanoutDone(client *c, void *privdata, void **results) {
+    struct clientkilldata *ckd = privdata;
+    uint32_t j;
+    long killed = 0;
+
+    for (j = 0; j < darray_n(&workers); j ++) {
+        killed += (long)results[j];
+    }
+
+    /* Reply according to old/new format. */
+    if (c->argc == 3) {
+        if (killed == 0)
+            addReplyError(c,"No such client");
+        else
+            addReply(c,shared.ok);
+    } else {
+        addReplyLongLong(c,killed);
+    }
+
+    /* If this client has to be closed, flag it as CLOSE_AFTER_REPLY
+     * only after we queued the reply to its output buffers. */
+    if (ckd->close_this_client) c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+
+    if (ckd->addr) sdsfree(ckd->addr);
+    dfree(ckd);
+}
+
+void clientCommand(client *c) {
+    if (!strcasecmp(c->argv[1]->ptr,"list") && c->argc == 2) {
+        /* CLIENT LIST */
+        if (worker_fanout(c,clientListFanoutProc,clientListFanoutDone,NULL) != VR_OK)
+            addReplyError(c,"Out of memory");
         return;
     } else if (!strcasecmp(c->argv[1]->ptr,"kill")) {
         /* CLIENT KILL <ip:port>
          * CLIENT KILL <option> [value] ... <option> [value] */
         struct clientkilldata *ckd;
 
-        if (c->steps == 0) {
-            ckd = dalloc(sizeof(struct clientkilldata));
-            ckd->addr = NULL;
-            ckd->type = -1;
-            ckd->id = 0;
-            ckd->skipme = 1;
-            ckd->killed = 0;
-            ckd->close_this_client = 0;
-
-            if (c->argc == 3) {
-                /* Old style syntax: CLIENT KILL <addr> */
-                ckd->addr = sdsnew(c->argv[2]->ptr);
-                ckd->skipme = 0; /* With the old form, you can kill yourself. */
-            } else if (c->argc > 3) {
-                int i = 2; /* Next option index. */
-    
-                /* New style syntax: parse options. */
-                while(i < c->argc) {
-                    int moreargs = c->argc > i+1;
-    
-                    if (!strcasecmp(c->argv[i]->ptr,"id") && moreargs) {
-                        long long tmp;
-    
-                        if (getLongLongFromObjectOrReply(c,c->argv[i+1],&tmp,NULL)
-                            != VR_OK) {
-                            if (ckd->addr) sdsfree(ckd->addr);
-                            dfree(ckd);
-                            return;
-                        }
-                        ckd->id = tmp;
-                    } else if (!strcasecmp(c->argv[i]->ptr,"type") && moreargs) {
-                        ckd->type = getClientTypeByName(c->argv[i+1]->ptr);
-                        if (ckd->type == -1) {
-                            if (ckd->addr) sdsfree(ckd->addr);
-                            dfree(ckd);
-                            addReplyErrorFormat(c,"Unknown client type '%s'",
-                                (char*) c->argv[i+1]->ptr);
-                            return;
-                        }
-                    } else if (!strcasecmp(c->argv[i]->ptr,"addr") && moreargs) {
-                        ckd->addr = sdsnew(c->argv[i+1]->ptr);
-                    } else if (!strcasecmp(c->argv[i]->ptr,"skipme") && moreargs) {
-                        if (!strcasecmp(c->argv[i+1]->ptr,"yes")) {
-                            ckd->skipme = 1;
-                        } else if (!strcasecmp(c->argv[i+1]->ptr,"no")) {
-                            ckd->skipme = 0;
-                        } else {
-                            if (ckd->addr) sdsfree(ckd->addr);
-                            dfree(ckd);
-                            addReply(c,shared.syntaxerr);
-                            return;
-                        }
+        ckd = dalloc(sizeof(struct clientkilldata));
+        ckd->addr = NULL;
+        ckd->type = -1;
+        ckd->id = 0;
+        ckd->skipme = 1;
+        ckd->close_this_client = 0;
+
+        if (c->argc == 3) {
+            /* Old style syntax: CLIENT KILL <addr> */
+            ckd->addr = sdsnew(c->argv[2]->ptr);
+            ckd->skipme = 0; /* With the old form, you can kill yourself. */
+        } else if (c->argc > 3) {
+            int i = 2; /* Next option index. */
+
+            /* New style syntax: parse options. */
+            while(i < c->argc) {
+                int moreargs = c->argc > i+1;
+
+                if (!strcasecmp(c->argv[i]->ptr,"id") && moreargs) {
+                    long long tmp;
+
+                    if (getLongLongFromObjectOrReply(c,c->argv[i+1],&tmp,NULL)
+                        != VR_OK) {
+                        if (ckd->addr) sdsfree(ckd->addr);
+                        dfree(ckd);
+                        return;
+                    }
+                    ckd->id = (uint64_t)tmp;
+                } else if (!strcasecmp(c->argv[i]->ptr,"type") && moreargs) {
+                    ckd->type = getClientTypeByName(c->argv[i+1]->ptr);
+                    if (ckd->type == -1) {
+                        if (ckd->addr) sdsfree(ckd->addr);
+                        dfree(ckd);
+                        addReplyErrorFormat(c,"Unknown client type '%s'",
+                            (char*) c->argv[i+1]->ptr);
+                        return;
+                    }
+                } else if (!strcasecmp(c->argv[i]->ptr,"addr") && moreargs) {
+                    ckd->addr = sdsnew(c->argv[i+1]->ptr);
+                } else if (!strcasecmp(c->argv[i]->ptr,"skipme") && moreargs) {
+                    if (!strcasecmp(c->argv[i+1]->ptr,"yes")) {
+                        ckd->skipme = 1;
+                    } else if (!strcasecmp(c->argv[i+1]->ptr,"no")) {
+                        ckd->skipme = 0;
                     } else {
                         if (ckd->addr) sdsfree(ckd->addr);
                         dfree(ckd);
                         addReply(c,shared.syntaxerr);
                         return;
                     }
-                    i += 2;
+                } else {
+                    if (ckd->addr) sdsfree(ckd->addr);
+                    dfree(ckd);
+                    addReply(c,shared.syntaxerr);
+                    return;
                 }
-            } else {
-                if (ckd->addr) sdsfree(ckd->addr);
-                dfree(ckd);
-                addReply(c,shared.syntaxerr);
-                return;
+                i += 2;
             }
-
-            if (!(c->flags&CLIENT_JUMP))
-                c->flags |= CLIENT_JUMP;
-            c->taridx = worker_get_next_idx(c->curidx);
-            c->cache = ckd;
         } else {
-            ckd = c->cache;
-            c->taridx = worker_get_next_idx(c->curidx);
-        }
-
-        /* Iterate clients killing all the matching clients. */
-        dlistRewind(c->vel->clients,&li);
-        while ((ln = dlistNext(&li)) != NULL) {
-            client = dlistNodeValue(ln);
-            if (ckd->addr && strcmp(getClientPeerId(client),ckd->addr) != 0) continue;
-            if (ckd->type != -1 && getClientType(client) != ckd->type) continue;
-            if (ckd->id != 0 && client->id != ckd->id) continue;
-            if (c == client && ckd->skipme) continue;
-
-            /* Kill it. */
-            if (c == client) {
-                ckd->close_this_client = 1;
-            } else {
-                freeClient(client);
-            }
-            ckd->killed++;
+            if (ckd->addr) sdsfree(ckd->addr);
+            dfree(ckd);
+            addReply(c,shared.syntaxerr);
+            return;
         }
 
-        if (c->steps >= (darray_n(&workers) - 1)) {
-            /* Reply according to old/new format. */
-            if (c->argc == 3) {
-                if (ckd->killed == 0)
-                    addReplyError(c,"No such client");
-                else
-                    addReply(c,shared.ok);
-            } else {
-                addReplyLongLong(c,ckd->killed);
-            }
-            
-            c->steps = 0;
-            c->taridx = -1;
-            c->cache = NULL;
-            c->flags &= ~CLIENT_JUMP;
-            
-            /* If this client has to be closed, flag it as CLOSE_AFTER_REPLY
-             * only after we queued the reply to its output buffers. */
-            if (ckd->close_this_client) c->flags |= CLIENT_CLOSE_AFTER_REPLY;
-
+        if (worker_fanout(c,clientKillFanoutProc,clientKillFanoutDone,ckd) != VR_OK) {
             if (ckd->addr) sdsfree(ckd->addr);
             dfree(ckd);
+            addReplyError(c,"Out of memory");
         }
-
         return;
     } else if (!strcasecmp(c->argv[1]->ptr,"setname") && c->argc == 3) {
         int j, len = sdslen(c->argv[2]->ptr);
@@ -1673,7 +1821,7 @@ void rewriteClientCommandVector(client *c, int argc, ...) {
     dfree(c->argv);
     /* Replace argv and argc with our new versions. */
     c->argv = argv;
-    c->argc = argc;
+    c->argv_size = c->argc = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
     va_end(ap);
@@ -1684,7 +1832,7 @@ void replaceClientCommandVector(client *c, int argc, robj **argv) {
     freeClientArgv(c);
     dfree(c->argv);
     c->argv = argv;
-    c->argc = argc;
+    c->argv_size = c->argc = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
 }
@@ -1705,7 +1853,7 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
 
     if (i >= c->argc) {
         c->argv = drealloc(c->argv,sizeof(robj*)*(i+1));
-        c->argc = i+1;
+        c->argv_size = c->argc = i+1;
         c->argv[i] = NULL;
     }
     oldval = c->argv[i];
@@ -1836,35 +1984,6 @@ void asyncCloseClientOnOutputBufferLimitReached(client *c) {
     }
 }
 
-/* Helper function used by freeMemoryIfNeeded() in order to flush slaves
- * output buffers without returning control to the event loop.
- * This is also called by SHUTDOWN for a best-effort attempt to send
- * slaves the latest writes. */
-void flushSlavesOutputBuffers(void) {
-    dlistIter li;
-    dlistNode *ln;
-
-    dlistRewind(repl.slaves,&li);
-    while((ln = dlistNext(&li))) {
-        client *slave = dlistNodeValue(ln);
-        int events;
-
-        /* Note that the following will not flush output buffers of slaves
-         * in STATE_ONLINE but having put_online_on_ack set to true: in this
-         * case the writable event is never installed, since the purpose
-         * of put_online_on_ack is to postpone the moment it is installed.
-         * This is what we want since slaves in this state should not receive
-         * writes before the first ACK. */
-        events = aeGetFileEvents(repl.vel.el,slave->conn->sd);
-        if (events & AE_WRITABLE &&
-            slave->replstate == SLAVE_STATE_ONLINE &&
-            clientHasPendingReplies(slave))
-        {
-            writeToClient(slave->conn->sd,slave,0);
-        }
-    }
-}
-
 /* Pause clients up to the specified unixtime (in ms). While clients
  * are paused no command is processed from clients, so the data set can't
  * change during that time.
@@ -1911,6 +2030,8 @@ int clientsArePaused(vr_eventloop *vel) {
             /* Don't touch slaves and blocked clients. The latter pending
              * requests be processed when unblocked. */
             if (c->flags & (CLIENT_SLAVE|CLIENT_BLOCKED)) continue;
+            /* A forwarded client handles its input buffer when back. */
+            if (c->forwarded) continue;
             c->flags |= CLIENT_UNBLOCKED;
             dlistAddNodeTail(vel->unblocked_clients,c);
         }
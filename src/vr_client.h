@@ -2,12 +2,20 @@
 #define _VR_CLIENT_H_
 
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
+#ifdef IOV_MAX
+#define NET_MAX_WRITEV_IOVS IOV_MAX     /* Max buffers of a writev() */
+#else
+#define NET_MAX_WRITEV_IOVS 1024
+#endif
 
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_SHARED_REPLY_MIN_BYTES (1024*16) /* Values sent without a copy */
+#define PROTO_ARGV_ARENA_BYTES  (1024*4) /* Small arguments of a command */
+#define PROTO_ARGV_KEEP_SLOTS   1024  /* Max argv slots kept for the next command */
 
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a slave server */
@@ -80,6 +88,9 @@ typedef struct client {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    int argv_size;          /* Slots allocated in argv. */
+    char *argv_arena;       /* Small arguments of current command. */
+    size_t argv_arena_used; /* Bytes of argv_arena in use. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
@@ -88,6 +99,8 @@ typedef struct client {
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
+    long long write_calls;  /* writev() calls sending the replies. */
+    long long writes_saved; /* write() calls saved gathering the buffers. */
     time_t ctime;           /* Client creation time. */
     time_t lastinteraction; /* Time of the last interaction, used for timeout */
     time_t obuf_soft_limit_reached_time;
@@ -102,9 +115,9 @@ typedef struct client {
     long long reploff;      /* Replication offset if this is our master. */
     long long repl_ack_off; /* Replication ack offset, if this is a slave. */
     long long repl_ack_time;/* Replication ack time, if this is a slave. */
-    long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
-                                       copying this slave output buffer
-                                       should use. */
+    long long read_reploff; /* Replication offset read, if this is our master. */
+    long long repl_feed_off;/* Stream offset to send next, if this is a slave. */
+    unsigned long long repl_snapshot_id; /* Snapshot id the slave waits after. */
     char replrunid[CONFIG_RUN_ID_SIZE+1]; /* Master run id if is a master. */
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
     int slave_capa;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
@@ -121,6 +134,9 @@ typedef struct client {
     int taridx;             /* The target worker idx that this client will jump to */
     int steps;              /* The steps that this client jumps between workers. */
     void *cache;            /* Cache data for client to jump between workers. */
+    int forwarded;          /* The command is running in the worker owning the keys. */
+    int close_on_return;    /* Free this client when it is back from the owner worker. */
+    long long ops;          /* Commands since the last hot client check of its worker. */
 
     /* Response buffer */
     int bufpos;
@@ -142,9 +158,10 @@ void resetClient(client *c);
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void *addDeferredMultiBulkLength(client *c);
 void setDeferredMultiBulkLength(client *c, void *node, long length);
-void processInputBuffer(client *c);
+int processInputBuffer(client *c);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReplyBulk(client *c, robj *obj);
+void addReplyBulkShared(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
@@ -178,8 +195,6 @@ void asyncCloseClientOnOutputBufferLimitReached(client *c);
 int getClientType(client *c);
 int getClientTypeByName(char *name);
 char *getClientTypeName(int class);
-void flushSlavesOutputBuffers(void);
-void disconnectSlaves(void);
 int listenToPort(int port, int *fds, int *count);
 void pauseClients(vr_eventloop *vel, long long duration);
 int clientsArePaused(vr_eventloop *vel);
@@ -71,16 +71,25 @@ struct redisCommand redisCommandTable[] = {
     {"admin",adminCommand,2,"sltF",0,NULL,0,0,0,0,0},
     /* Server */
     {"info",infoCommand,-1,"lt",0,NULL,0,0,0,0,0},
-    {"flushdb",flushdbCommand,1,"w",0,NULL,0,0,0,0,0},
-    {"flushall",flushallCommand,1,"w",0,NULL,0,0,0,0,0},
+    {"flushdb",flushdbCommand,-1,"w",0,NULL,0,0,0,0,0},
+    {"flushall",flushallCommand,-1,"w",0,NULL,0,0,0,0,0},
     {"time",timeCommand,1,"RF",0,NULL,0,0,0,0,0},
     {"dbsize",dbsizeCommand,1,"rF",0,NULL,0,0,0,0,0},
     {"command",commandCommand,0,"lt",0,NULL,0,0,0,0,0},
     {"config",configCommand,-2,"lat",0,NULL,0,0,0,0,0},
     {"client",clientCommand,-2,"as",0,NULL,0,0,0,0,0},
     {"slowlog",slowlogCommand,-2,"a",0,NULL,0,0,0,0,0},
+    {"save",saveCommand,1,"as",0,NULL,0,0,0,0,0},
+    {"bgsave",bgsaveCommand,-1,"a",0,NULL,0,0,0,0,0},
+    {"bgrewriteaof",bgrewriteaofCommand,1,"a",0,NULL,0,0,0,0,0},
+    {"sync",syncCommand,1,"ars",0,NULL,0,0,0,0,0},
+    {"psync",syncCommand,3,"ars",0,NULL,0,0,0,0,0},
+    {"slaveof",slaveofCommand,3,"ast",0,NULL,0,0,0,0,0},
+    {"replconf",replconfCommand,-1,"aslt",0,NULL,0,0,0,0,0},
+    {"lastsave",lastsaveCommand,1,"RF",0,NULL,0,0,0,0,0},
     /* Key */
     {"del",delCommand,-2,"w",0,NULL,1,-1,1,0,0},
+    {"unlink",unlinkCommand,-2,"w",0,NULL,1,-1,1,0,0},
     {"exists",existsCommand,-2,"rF",0,NULL,1,-1,1,0,0},
     {"ttl",ttlCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"pttl",pttlCommand,2,"rF",0,NULL,1,1,1,0,0},
@@ -308,6 +317,7 @@ struct redisCommand *lookupCommandByCString(char *s) {
 void call(client *c, int flags) {
     long long dirty, start, duration;
     int client_old_flags = c->flags;
+    int fast_read;
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
      * not generated from reading an AOF. */
@@ -323,10 +333,16 @@ void call(client *c, int flags) {
     c->flags &= ~(CLIENT_FORCE_AOF|CLIENT_FORCE_REPL|CLIENT_PREVENT_PROP);
     redisOpArrayInit(&server.also_propagate);
 
+    /* Fast read only commands can use the optimistic db read path. */
+    fast_read = server.db_optimistic_read &&
+        (c->cmd->flags&(CMD_READONLY|CMD_FAST)) == (CMD_READONLY|CMD_FAST);
+
     /* Call the command. */
     dirty = c->vel->dirty;
     start = vr_usec_now();
+    if (fast_read) dbFastReadBegin();
     c->cmd->proc(c);
+    if (fast_read) dbFastReadEnd();
     duration = vr_usec_now()-start;
     dirty = c->vel->dirty-dirty;
     if (dirty < 0) dirty = 0;
@@ -388,7 +404,7 @@ void call(client *c, int flags) {
         /* Call propagate() only if at least one of AOF / replication
          * propagation is needed. */
         if (propagate_flags != PROPAGATE_NONE)
-            propagate(c->cmd,c->db->id,c->argv,c->argc,propagate_flags);
+            propagate(c->cmd,c->dictid,c->argv,c->argc,propagate_flags);
     }
 
     /* Restore the old replication flags, since call() can be executed
@@ -418,6 +434,7 @@ void call(client *c, int flags) {
         redisOpArrayFree(&server.also_propagate);
     }
     update_stats_add(c->vel->stats, numcommands, 1);
+    c->ops ++;
 }
 
 /* If this function gets called we already read a whole
@@ -430,6 +447,7 @@ void call(client *c, int flags) {
  * if VR_ERROR is returned the client was destroyed (i.e. after QUIT). */
 int processCommand(client *c) {
     long long maxmemory;
+    int locked;
 
     /* The QUIT command is handled separately. Normal command procs will
      * go through checking for replication and QUIT will cause trouble
@@ -592,10 +610,25 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+        /* Let the worker owning the keys run the command, it must not
+         * wait the lock kept by the batch of this worker. */
+        if (server.worker_key_affinity) {
+            dbLockBatchRelease();
+            if (worker_forward_command(c)) return VR_EAGAIN;
+        }
+
+        /* The record of a multi key write is numbered with all its dbs
+         * locked, see dbLockCommand(). */
+        locked = dbLockCommand(c);
         call(c,CMD_CALL_FULL);
+        if (locked) dbUnlockCommand();
         c->woff = repl.master_repl_offset;
         if (dlistLength(server.ready_keys))
             handleClientsBlockedOnLists();
+        aofCallDone(c->vel);
+
+        /* The command waits for all the workers, see worker_fanout(). */
+        if (c->forwarded) return VR_EAGAIN;
     }
 
     return VR_OK;
@@ -652,10 +685,9 @@ void redisOpArrayFree(redisOpArray *oa) {
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc,
                int flags)
 {
-    if (server.aof_state != AOF_OFF && flags & PROPAGATE_AOF)
+    /* The AOF and the slaves share the same stream, see aofWriterMerge(). */
+    if (flags & (PROPAGATE_AOF|PROPAGATE_REPL))
         feedAppendOnlyFile(cmd,dbid,argv,argc);
-    if (flags & PROPAGATE_REPL)
-        replicationFeedSlaves(repl.slaves,dbid,argv,argc);
 }
 
 /* Used inside commands to schedule the propagation of additional commands
@@ -757,6 +789,78 @@ static void addReplyCommand(client *c, struct redisCommand *cmd) {
 }
 
 /* COMMAND <subcommand> <args> */
+/* COMMAND STATS part of a worker, a copy of its command stats table. */
+static void *commandStatsFanoutProc(vr_worker *worker, client *c, void *privdata) {
+    uint32_t j;
+    struct darray *cstable = worker->vel.cstable;
+    struct darray *cstablecopy;
+    commandStats *cstats, *cstatscopy;
+
+    UNUSED(c);
+    UNUSED(privdata);
+
+    cstablecopy = commandStatsTableCreate();
+    if (cstablecopy == NULL) return NULL;
+
+    for (j = 0; j < darray_n(cstable); j ++) {
+        cstats = darray_get(cstable, j);
+        if (!cstats->calls) continue;
+
+        cstatscopy = darray_get(cstablecopy, j);
+        cstatscopy->microseconds = cstats->microseconds;
+        cstatscopy->calls = cstats->calls;
+    }
+
+    return cstablecopy;
+}
+
+static void commandStatsFanoutDone(client *c, void *privdata, void **results) {
+    uint32_t j, idx;
+    struct darray *cstableall = NULL, *cstable;
+    commandStats *cstats, *cstatsall;
+    sds command_stats_info;
+    void *replylen_node;
+    long replylen = 0;
+
+    UNUSED(privdata);
+
+    /* Sum the tables of all the workers in the first one. */
+    for (idx = 0; idx < darray_n(&workers); idx ++) {
+        cstable = results[idx];
+        if (cstable == NULL) continue;
+        if (cstableall == NULL) {
+            cstableall = cstable;
+            continue;
+        }
+
+        for (j = 0; j < darray_n(cstable); j ++) {
+            cstats = darray_get(cstable, j);
+            if (!cstats->calls) continue;
+            
+            cstatsall = darray_get(cstableall, j);
+            cstatsall->microseconds += cstats->microseconds;
+            cstatsall->calls += cstats->calls;
+        }
+        commandStatsTableDestroy(cstable);
+    }
+
+    replylen_node = addDeferredMultiBulkLength(c);
+    for (j = 0; cstableall != NULL && j < darray_n(cstableall); j ++) {
+        cstatsall = darray_get(cstableall, j);
+        if (!cstatsall->calls) continue;
+        
+        command_stats_info = sdscatprintf(sdsempty(),
+            "%s:calls=%lld,usec=%lld,usec_per_call=%.2f",
+            cstatsall->name, cstatsall->calls, cstatsall->microseconds,
+            (float)cstatsall->microseconds/(float)cstatsall->calls);
+        addReplyBulkSds(c,command_stats_info);
+        replylen ++;
+    }
+    setDeferredMultiBulkLength(c,replylen_node,replylen);
+
+    if (cstableall != NULL) commandStatsTableDestroy(cstableall);
+}
+
 void commandCommand(client *c) {
     if (c->argc == 1) {
         dictIterator *di;
@@ -795,58 +899,8 @@ void commandCommand(client *c) {
         for (j = 0; j < numkeys; j++) addReplyBulk(c,c->argv[keys[j]+2]);
         getKeysFreeResult(keys);
     } else if (!strcasecmp(c->argv[1]->ptr, "stats") && c->argc == 2) {
-        int j;
-        struct darray *cstableall;
-        struct array *cstable = c->vel->cstable;
-        commandStats *cstats, *cstatsall;
-
-        if (c->steps == 0) {
-            cstableall = commandStatsTableCreate();
-            if (!(c->flags&CLIENT_JUMP))
-                c->flags |= CLIENT_JUMP;
-            c->taridx = worker_get_next_idx(c->curidx);
-            c->cache = cstableall;
-        } else {
-            cstableall = c->cache;
-            c->taridx = worker_get_next_idx(c->curidx);
-        }
-
-        for (j = 0; j < darray_n(cstable); j ++) {
-            cstats = darray_get(cstable, j);
-            if (!cstats->calls) continue;
-            
-            cstatsall = darray_get(cstableall, j);
-            cstatsall->microseconds += cstats->microseconds;
-            cstatsall->calls += cstats->calls;
-        }
-        
-        if (c->steps >= (darray_n(&workers) - 1)) {
-            sds command_stats_info;
-            void *replylen_node;
-            long replylen = 0;
-            
-            c->steps = 0;
-            c->taridx = -1;
-            c->cache = NULL;
-            c->flags &= ~CLIENT_JUMP;
-            
-            replylen_node = addDeferredMultiBulkLength(c);
-            for (j = 0; j < darray_n(cstableall); j ++) {
-                cstatsall = darray_get(cstableall, j);
-                if (!cstatsall->calls) continue;
-                
-                command_stats_info = sdscatprintf(sdsempty(),
-                    "%s:calls=%lld,usec=%lld,usec_per_call=%.2f",
-                    cstatsall->name, cstatsall->calls, cstatsall->microseconds,
-                    (float)cstatsall->microseconds/cstatsall->calls);
-                addReplyBulkSds(c,command_stats_info);
-                replylen ++;
-            }
-
-            setDeferredMultiBulkLength(c,replylen_node,replylen);
-            
-            commandStatsTableDestroy(cstableall);
-        }
+        if (worker_fanout(c,commandStatsFanoutProc,commandStatsFanoutDone,NULL) != VR_OK)
+            addReplyError(c,"Out of memory");
     } else {
         addReplyError(c, "Unknown subcommand or wrong number of arguments.");
         return;
@@ -52,6 +52,20 @@ static char* evictpolicy_strings[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_policy, _name) (char*)(#_name),
+static char* dispatchpolicy_strings[] = {
+    DISPATCHPOLICY_CODEC( DEFINE_ACTION )
+    NULL
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_policy, _name) (char*)(#_name),
+static char* appendfsync_strings[] = {
+    APPENDFSYNC_CODEC( DEFINE_ACTION )
+    NULL
+};
+#undef DEFINE_ACTION
+
 static conf_option conf_server_options[] = {
     { (char *)CONFIG_SOPN_DATABASES,
       CONF_FIELD_TYPE_INT, 1,
@@ -61,6 +75,30 @@ static conf_option conf_server_options[] = {
       CONF_FIELD_TYPE_INT, 1,
       conf_set_int_non_zero, conf_get_int,
       offsetof(conf_server, internal_dbs_per_databases) },
+    { (char *)CONFIG_SOPN_DBOPTREAD,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, db_optimistic_read) },
+    { (char *)CONFIG_SOPN_KEYAFFINITY,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, worker_key_affinity) },
+    { (char *)CONFIG_SOPN_EXPIREINDEX,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, active_expire_index) },
+    { (char *)CONFIG_SOPN_KEYSPACEOPEN,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, keyspace_open_addressing) },
+    { (char *)CONFIG_SOPN_TABLEPREALLOC,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, keyspace_table_prealloc) },
+    { (char *)CONFIG_SOPN_LAZYSERVERDEL,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, lazyfree_lazy_server_del) },
     { (char *)CONFIG_SOPN_MAXMEMORY,
       CONF_FIELD_TYPE_LONGLONG, 0,
       conf_set_maxmemory, conf_get_longlong,
@@ -73,6 +111,18 @@ static conf_option conf_server_options[] = {
       CONF_FIELD_TYPE_INT, 0,
       conf_set_int_non_zero, conf_get_int,
       offsetof(conf_server, maxmemory_samples) },
+    { (char *)CONFIG_SOPN_LFULOGFACTOR,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_int, conf_get_int,
+      offsetof(conf_server, lfu_log_factor) },
+    { (char *)CONFIG_SOPN_LFUDECAYTIME,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_int, conf_get_int,
+      offsetof(conf_server, lfu_decay_time) },
+    { (char *)CONFIG_SOPN_LOWWATERMARK,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_int, conf_get_int,
+      offsetof(conf_server, maxmemory_low_watermark) },
     { (char *)CONFIG_SOPN_MTCLIMIT,
       CONF_FIELD_TYPE_LONGLONG, 0,
       conf_set_longlong, conf_get_longlong,
@@ -85,10 +135,70 @@ static conf_option conf_server_options[] = {
       CONF_FIELD_TYPE_INT, 1,
       conf_set_int, conf_get_int,
       offsetof(conf_server, port) },
+    { (char *)CONFIG_SOPN_REUSEPORT,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, worker_reuseport) },
+    { (char *)CONFIG_SOPN_DISPATCHP,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_dispatch_policy, conf_get_int,
+      offsetof(conf_server, worker_dispatch_policy) },
+    { (char *)CONFIG_SOPN_MIGRATEHOT,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, worker_migrate_hot_clients) },
     { (char *)CONFIG_SOPN_THREADS,
       CONF_FIELD_TYPE_INT, 1,
       conf_set_int, conf_get_int,
       offsetof(conf_server, threads) },
+    { (char *)CONFIG_SOPN_DIR,
+      CONF_FIELD_TYPE_SDS, 1,
+      conf_set_sds, conf_get_sds,
+      offsetof(conf_server, dir) },
+    { (char *)CONFIG_SOPN_DBFILENAME,
+      CONF_FIELD_TYPE_SDS, 0,
+      conf_set_dbfilename, conf_get_sds,
+      offsetof(conf_server, dbfilename) },
+    { (char *)CONFIG_SOPN_RDBCOMPRESSION,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, rdb_compression) },
+    { (char *)CONFIG_SOPN_RDBCHECKSUM,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, rdb_checksum) },
+    { (char *)CONFIG_SOPN_RDBTHREADS,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_int_non_zero, conf_get_int,
+      offsetof(conf_server, rdb_threads) },
+    { (char *)CONFIG_SOPN_APPENDONLY,
+      CONF_FIELD_TYPE_INT, 1,
+      conf_set_yesorno, conf_get_int,
+      offsetof(conf_server, appendonly) },
+    { (char *)CONFIG_SOPN_APPENDFILENAME,
+      CONF_FIELD_TYPE_SDS, 1,
+      conf_set_dbfilename, conf_get_sds,
+      offsetof(conf_server, appendfilename) },
+    { (char *)CONFIG_SOPN_APPENDFSYNC,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_appendfsync, conf_get_int,
+      offsetof(conf_server, appendfsync) },
+    { (char *)CONFIG_SOPN_AOFRWPERC,
+      CONF_FIELD_TYPE_INT, 0,
+      conf_set_int, conf_get_int,
+      offsetof(conf_server, auto_aof_rewrite_perc) },
+    { (char *)CONFIG_SOPN_AOFRWMINSIZE,
+      CONF_FIELD_TYPE_LONGLONG, 0,
+      conf_set_maxmemory, conf_get_longlong,
+      offsetof(conf_server, auto_aof_rewrite_min_size) },
+    { (char *)CONFIG_SOPN_SLAVEOF,
+      CONF_FIELD_TYPE_ARRAYSDS, 1,
+      conf_set_array_sds, conf_get_array_sds,
+      offsetof(conf_server, slaveof) },
+    { (char *)CONFIG_SOPN_REPLBACKLOGSIZE,
+      CONF_FIELD_TYPE_LONGLONG, 1,
+      conf_set_maxmemory, conf_get_longlong,
+      offsetof(conf_server, repl_backlog_size) },
     { (char *)CONFIG_SOPN_MAXCLIENTS,
       CONF_FIELD_TYPE_INT, 0,
       conf_set_int_non_zero, conf_get_int,
@@ -274,15 +384,82 @@ conf_set_maxmemory_policy(void *obj, conf_option *opt, void *data)
         return VR_ERROR;
     }
 
-    if (*gt == MAXMEMORY_VOLATILE_LRU || *gt == MAXMEMORY_ALLKEYS_LRU) {
-        CONF_UNLOCK();
-        log_error("ERROR: Conf maxmemory policy now is not support %s and %s", 
-            evictpolicy_strings[MAXMEMORY_VOLATILE_LRU], 
-            evictpolicy_strings[MAXMEMORY_ALLKEYS_LRU]);
+    conf->version ++;
+    CONF_UNLOCK();
+    return VR_OK;
+}
+
+int
+conf_set_dispatch_policy(void *obj, conf_option *opt, void *data)
+{
+    uint8_t *p;
+    conf_value *cv = data;
+    int *gt;
+    char **policy;
+
+    if(cv->type != CONF_VALUE_TYPE_STRING){
+        log_error("conf server in the conf file is not a string");
+        return VR_ERROR;
+    }
+
+    CONF_WLOCK();
+
+    p = obj;
+    gt = (int*)(p + opt->offset);
+
+    for (policy = dispatchpolicy_strings; *policy; policy ++) {
+        if (strcmp(cv->value, *policy) == 0) {
+            *gt = (int)(policy - dispatchpolicy_strings);
+            break;
+        }
+    }
+
+    CONF_UNLOCK();
+
+    if (*policy == NULL) {
+        log_error("ERROR: Conf worker dispatch policy '%s' is invalid", 
+            cv->value);
+        return VR_ERROR;
+    }
+
+    return VR_OK;
+}
+
+int
+conf_set_appendfsync(void *obj, conf_option *opt, void *data)
+{
+    uint8_t *p;
+    conf_value *cv = data;
+    int *gt;
+    char **policy;
+
+    if(cv->type != CONF_VALUE_TYPE_STRING){
+        log_error("conf server in the conf file is not a string");
         return VR_ERROR;
     }
 
+    CONF_WLOCK();
+
+    p = obj;
+    gt = (int*)(p + opt->offset);
+
+    for (policy = appendfsync_strings; *policy; policy ++) {
+        if (strcmp(cv->value, *policy) == 0) {
+            *gt = (int)(policy - appendfsync_strings);
+            break;
+        }
+    }
+
+    if (*policy != NULL) conf->version ++;
+
     CONF_UNLOCK();
+
+    if (*policy == NULL) {
+        log_error("ERROR: Conf appendfsync '%s' is invalid", 
+            cv->value);
+        return VR_ERROR;
+    }
+
     return VR_OK;
 }
 
@@ -366,12 +543,33 @@ conf_set_sds(void *obj, conf_option *opt, void *data)
     p = obj;
     gt = (sds*)(p + opt->offset);
 
+    if (*gt != NULL) sdsfree(*gt);
     *gt = sdsnewlen(cv->value, sdslen(cv->value));
     conf->version ++;
     CONF_UNLOCK();
     return VR_OK;
 }
 
+/* The RDB file name is relative to the dir option, 
+ * so it can not be a path. */
+int
+conf_set_dbfilename(void *obj, conf_option *opt, void *data)
+{
+    conf_value *cv = data;
+
+    if (cv->type != CONF_VALUE_TYPE_STRING) {
+        log_error("conf pool %s in the conf file is not a string", 
+            opt->name);
+        return VR_ERROR;
+    } else if (sdslen(cv->value) == 0 || strchr(cv->value,'/') != NULL) {
+        log_error("dbfilename '%s' is invalid, it can't be a path", 
+            cv->value);
+        return VR_ERROR;
+    }
+
+    return conf_set_sds(obj, opt, data);
+}
+
 int
 conf_set_password(void *obj, conf_option *opt, void *data)
 {
@@ -551,11 +749,13 @@ conf_set_array_sds(void *obj, conf_option *opt, void *data)
             opt->name);
         return VR_ERROR;
     } else if (cv->type == CONF_VALUE_TYPE_ARRAY) {
-        cv_sub = darray_get(cv->value, j);
-        if ((*cv_sub)->type != CONF_VALUE_TYPE_STRING) {
-            log_error("conf pool %s in the conf file is not a string array", 
-                opt->name);
-            return VR_ERROR;            
+        for (j = 0; j < darray_n(cv->value); j ++) {
+            cv_sub = darray_get(cv->value, j);
+            if ((*cv_sub)->type != CONF_VALUE_TYPE_STRING) {
+                log_error("conf pool %s in the conf file is not a string array", 
+                    opt->name);
+                return VR_ERROR;
+            }
         }
     }
 
@@ -764,17 +964,40 @@ static int conf_server_init(conf_server *cs)
 
     cs->databases = CONF_UNSET_NUM;
     cs->internal_dbs_per_databases = CONF_UNSET_NUM;
+    cs->db_optimistic_read = CONF_UNSET_NUM;
+    cs->worker_key_affinity = CONF_UNSET_NUM;
+    cs->active_expire_index = CONF_UNSET_NUM;
+    cs->keyspace_open_addressing = CONF_UNSET_NUM;
+    cs->keyspace_table_prealloc = CONF_UNSET_NUM;
+    cs->lazyfree_lazy_server_del = CONF_UNSET_NUM;
     cs->max_time_complexity_limit = CONF_UNSET_NUM;
     cs->maxmemory = CONF_UNSET_NUM;
     cs->maxmemory_policy = CONF_UNSET_NUM;
     cs->maxmemory_samples = CONF_UNSET_NUM;
+    cs->lfu_log_factor = CONF_UNSET_NUM;
+    cs->lfu_decay_time = CONF_UNSET_NUM;
+    cs->maxmemory_low_watermark = CONF_UNSET_NUM;
     cs->maxclients = CONF_UNSET_NUM;
     cs->threads = CONF_UNSET_NUM;
     darray_init(&cs->binds,1,sizeof(sds));
     cs->port = CONF_UNSET_NUM;
+    cs->worker_reuseport = CONF_UNSET_NUM;
+    cs->worker_dispatch_policy = CONF_UNSET_NUM;
+    cs->worker_migrate_hot_clients = CONF_UNSET_NUM;
     cs->requirepass = CONF_UNSET_PTR;
     cs->adminpass = CONF_UNSET_PTR;
     cs->dir = CONF_UNSET_PTR;
+    cs->dbfilename = CONF_UNSET_PTR;
+    cs->rdb_compression = CONF_UNSET_NUM;
+    cs->rdb_checksum = CONF_UNSET_NUM;
+    cs->rdb_threads = CONF_UNSET_NUM;
+    cs->appendonly = CONF_UNSET_NUM;
+    cs->appendfilename = CONF_UNSET_PTR;
+    cs->appendfsync = CONF_UNSET_NUM;
+    cs->auto_aof_rewrite_perc = CONF_UNSET_NUM;
+    cs->auto_aof_rewrite_min_size = CONF_UNSET_NUM;
+    darray_init(&cs->slaveof,2,sizeof(sds));
+    cs->repl_backlog_size = CONF_UNSET_NUM;
     darray_init(&cs->commands_need_adminpass,1,sizeof(sds));
 
     return VR_OK;
@@ -795,10 +1018,19 @@ static int conf_server_set_default(conf_server *cs)
 
     cs->databases = CONFIG_DEFAULT_LOGICAL_DBNUM;
     cs->internal_dbs_per_databases = CONFIG_DEFAULT_INTERNAL_DBNUM;
+    cs->db_optimistic_read = CONFIG_DEFAULT_DB_OPTIMISTIC_READ;
+    cs->worker_key_affinity = CONFIG_DEFAULT_WORKER_KEY_AFFINITY;
+    cs->active_expire_index = CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX;
+    cs->keyspace_open_addressing = CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING;
+    cs->keyspace_table_prealloc = CONFIG_DEFAULT_KEYSPACE_TABLE_PREALLOC;
+    cs->lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
     cs->max_time_complexity_limit = CONFIG_DEFAULT_MAX_TIME_COMPLEXITY_LIMIT;
     cs->maxmemory = CONFIG_DEFAULT_MAXMEMORY;
     cs->maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     cs->maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    cs->lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
+    cs->lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
+    cs->maxmemory_low_watermark = CONFIG_DEFAULT_LOW_WATERMARK;
     cs->maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
     cs->threads = CONFIG_DEFAULT_THREADS_NUM;
     cs->slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
@@ -814,12 +1046,37 @@ static int conf_server_set_default(conf_server *cs)
     *str = sdsnew(CONFIG_DEFAULT_HOST);
     
     cs->port = CONFIG_DEFAULT_SERVER_PORT;
+    cs->worker_reuseport = CONFIG_DEFAULT_WORKER_REUSEPORT;
+    cs->worker_dispatch_policy = CONFIG_DEFAULT_DISPATCH_POLICY;
+    cs->worker_migrate_hot_clients = CONFIG_DEFAULT_MIGRATE_HOT_CLIENTS;
 
     if (cs->dir != CONF_UNSET_PTR) {
         sdsfree(cs->dir);
     }
     cs->dir = sdsnew(CONFIG_DEFAULT_DATA_DIR);
 
+    if (cs->dbfilename != CONF_UNSET_PTR) {
+        sdsfree(cs->dbfilename);
+    }
+    cs->dbfilename = sdsnew(CONFIG_DEFAULT_RDB_FILENAME);
+    cs->rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
+    cs->rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
+    cs->rdb_threads = CONFIG_DEFAULT_RDB_THREADS;
+    cs->appendonly = CONFIG_DEFAULT_APPENDONLY;
+    if (cs->appendfilename != CONF_UNSET_PTR) {
+        sdsfree(cs->appendfilename);
+    }
+    cs->appendfilename = sdsnew(CONFIG_DEFAULT_AOF_FILENAME);
+    cs->appendfsync = CONFIG_DEFAULT_AOF_FSYNC;
+    cs->auto_aof_rewrite_perc = CONFIG_DEFAULT_AOF_REWRITE_PERC;
+    cs->auto_aof_rewrite_min_size = CONFIG_DEFAULT_AOF_REWRITE_MIN_SIZE;
+
+    while (darray_n(&cs->slaveof) > 0) {
+        str = darray_pop(&cs->slaveof);
+        sdsfree(*str);
+    }
+    cs->repl_backlog_size = CONFIG_DEFAULT_REPL_BACKLOG_SIZE;
+
     while (darray_n(&cs->commands_need_adminpass) > 0) {
         str = darray_pop(&cs->commands_need_adminpass);
         sdsfree(*str);
@@ -838,9 +1095,18 @@ static void conf_server_deinit(conf_server *cs)
 
     cs->databases = CONF_UNSET_NUM;
     cs->internal_dbs_per_databases = CONF_UNSET_NUM;
+    cs->db_optimistic_read = CONF_UNSET_NUM;
+    cs->worker_key_affinity = CONF_UNSET_NUM;
+    cs->active_expire_index = CONF_UNSET_NUM;
+    cs->keyspace_open_addressing = CONF_UNSET_NUM;
+    cs->keyspace_table_prealloc = CONF_UNSET_NUM;
+    cs->lazyfree_lazy_server_del = CONF_UNSET_NUM;
     cs->maxmemory = CONF_UNSET_NUM;
     cs->maxmemory_policy = CONF_UNSET_NUM;
     cs->maxmemory_samples = CONF_UNSET_NUM;
+    cs->lfu_log_factor = CONF_UNSET_NUM;
+    cs->lfu_decay_time = CONF_UNSET_NUM;
+    cs->maxmemory_low_watermark = CONF_UNSET_NUM;
     cs->max_time_complexity_limit = CONF_UNSET_NUM;
     cs->maxclients = CONF_UNSET_NUM;
     cs->threads = CONF_UNSET_NUM;
@@ -852,11 +1118,36 @@ static void conf_server_deinit(conf_server *cs)
     darray_deinit(&cs->binds);
 
     cs->port = CONF_UNSET_NUM;
+    cs->worker_reuseport = CONF_UNSET_NUM;
+    cs->worker_dispatch_policy = CONF_UNSET_NUM;
+    cs->worker_migrate_hot_clients = CONF_UNSET_NUM;
     
     if (cs->dir != CONF_UNSET_PTR) {
         sdsfree(cs->dir);
         cs->dir = CONF_UNSET_PTR;    
     }
+    if (cs->dbfilename != CONF_UNSET_PTR) {
+        sdsfree(cs->dbfilename);
+        cs->dbfilename = CONF_UNSET_PTR;    
+    }
+    cs->rdb_compression = CONF_UNSET_NUM;
+    cs->rdb_checksum = CONF_UNSET_NUM;
+    cs->rdb_threads = CONF_UNSET_NUM;
+    cs->appendonly = CONF_UNSET_NUM;
+    if (cs->appendfilename != CONF_UNSET_PTR) {
+        sdsfree(cs->appendfilename);
+        cs->appendfilename = CONF_UNSET_PTR;    
+    }
+    cs->appendfsync = CONF_UNSET_NUM;
+    cs->auto_aof_rewrite_perc = CONF_UNSET_NUM;
+    cs->auto_aof_rewrite_min_size = CONF_UNSET_NUM;
+
+    while (darray_n(&cs->slaveof) > 0) {
+        str = darray_pop(&cs->slaveof);
+        sdsfree(*str);
+    }
+    darray_deinit(&cs->slaveof);
+    cs->repl_backlog_size = CONF_UNSET_NUM;
 
     if (cs->requirepass != CONF_UNSET_PTR) {
         sdsfree(cs->requirepass);
@@ -964,10 +1255,34 @@ conf_server_dump(conf_server *cs, int log_level)
 
     log_debug(log_level, "  databases : %d", cs->databases);
     log_debug(log_level, "  internal_dbs_per_databases : %d", cs->internal_dbs_per_databases);
+    log_debug(log_level, "  db_optimistic_read : %d", cs->db_optimistic_read);
+    log_debug(log_level, "  worker_key_affinity : %d", cs->worker_key_affinity);
+    log_debug(log_level, "  active_expire_index : %d", cs->active_expire_index);
+    log_debug(log_level, "  keyspace_open_addressing : %d", cs->keyspace_open_addressing);
+    log_debug(log_level, "  keyspace_table_prealloc : %d", cs->keyspace_table_prealloc);
+    log_debug(log_level, "  lazyfree_lazy_server_del : %d", cs->lazyfree_lazy_server_del);
     log_debug(log_level, "  maxmemory : %lld", cs->maxmemory);
     log_debug(log_level, "  maxmemory_policy : %d", cs->maxmemory_policy);    
     log_debug(log_level, "  maxmemory_samples : %d", cs->maxmemory_samples);
+    log_debug(log_level, "  lfu_log_factor : %d", cs->lfu_log_factor);
+    log_debug(log_level, "  lfu_decay_time : %d", cs->lfu_decay_time);
+    log_debug(log_level, "  maxmemory_low_watermark : %d", cs->maxmemory_low_watermark);
     log_debug(log_level, "  max_time_complexity_limit : %lld", cs->max_time_complexity_limit);
+    log_debug(log_level, "  worker_reuseport : %d", cs->worker_reuseport);
+    log_debug(log_level, "  worker_dispatch_policy : %d", cs->worker_dispatch_policy);
+    log_debug(log_level, "  worker_migrate_hot_clients : %d", cs->worker_migrate_hot_clients);
+    log_debug(log_level, "  dir : %s", cs->dir);
+    log_debug(log_level, "  dbfilename : %s", cs->dbfilename);
+    log_debug(log_level, "  rdb_compression : %d", cs->rdb_compression);
+    log_debug(log_level, "  rdb_checksum : %d", cs->rdb_checksum);
+    log_debug(log_level, "  rdb_threads : %d", cs->rdb_threads);
+    log_debug(log_level, "  appendonly : %d", cs->appendonly);
+    log_debug(log_level, "  appendfilename : %s", cs->appendfilename);
+    log_debug(log_level, "  appendfsync : %d", cs->appendfsync);
+    log_debug(log_level, "  auto_aof_rewrite_perc : %d", cs->auto_aof_rewrite_perc);
+    log_debug(log_level, "  auto_aof_rewrite_min_size : %lld", cs->auto_aof_rewrite_min_size);
+    log_debug(log_level, "  slaveof : %u", darray_n(&cs->slaveof));
+    log_debug(log_level, "  repl_backlog_size : %lld", cs->repl_backlog_size);
 }
 
 static void
@@ -1405,6 +1720,18 @@ get_evictpolicy_strings(int evictpolicy_type)
     return evictpolicy_strings[evictpolicy_type];
 }
 
+const char *
+get_dispatchpolicy_strings(int dispatchpolicy_type)
+{
+    return dispatchpolicy_strings[dispatchpolicy_type];
+}
+
+const char *
+get_appendfsync_strings(int appendfsync_type)
+{
+    return appendfsync_strings[appendfsync_type];
+}
+
 /*-----------------------------------------------------------------------------
  * CONFIG SET implementation
  *----------------------------------------------------------------------------*/
@@ -1522,6 +1849,12 @@ static void addReplyConfOption(client *c,conf_option *cop)
         
         if (!strcmp(cop->name,CONFIG_SOPN_MAXMEMORYP)) {
             addReplyBulkCString(c,get_evictpolicy_strings(value));
+        } else if (!strcmp(cop->name,CONFIG_SOPN_DISPATCHP)) {
+            addReplyBulkCString(c,get_dispatchpolicy_strings(value));
+        } else if (!strcmp(cop->name,CONFIG_SOPN_APPENDFSYNC)) {
+            addReplyBulkCString(c,get_appendfsync_strings(value));
+        } else if (cop->set == conf_set_yesorno) {
+            addReplyBulkCString(c,value?"yes":"no");
         } else {
             addReplyBulkLongLong(c,value);
         }
@@ -1899,6 +2232,20 @@ static void rewriteConfigIntOption(struct rewriteConfigState *state, char *optio
     rewriteConfigRewriteLine(state,option,line,force);
 }
 
+/* Rewrite a yes/no option. */
+static void rewriteConfigYesNoOption(struct rewriteConfigState *state, char *option, int defvalue) {
+    int value;
+    int force;
+    sds line;
+
+    conf_server_get(option,&value);
+    line = sdscatprintf(sdsempty(),"%s %s",option,
+        value ? CONF_VALUE_YES : CONF_VALUE_NO);
+    force = value != defvalue;
+
+    rewriteConfigRewriteLine(state,option,line,force);
+}
+
 /* Rewrite a numerical (int range) option. */
 static void rewriteConfigSdsOption(struct rewriteConfigState *state, char *option, sds defvalue) {
     sds value;
@@ -2015,6 +2362,21 @@ static void rewriteConfigBindOption(struct rewriteConfigState *state) {
     rewriteConfigRewriteLine(state,option,line,force);
 }
 
+/* Rewrite the slaveof option, from the master set by SLAVEOF. */
+static void rewriteConfigSlaveofOption(struct rewriteConfigState *state) {
+    sds line, config;
+    char *option = CONFIG_SOPN_SLAVEOF;
+
+    config = replicationGetMasterConfig();
+    if (config == NULL) {
+        rewriteConfigMarkAsProcessed(state,option);
+        return;
+    }
+    line = sdscatprintf(sdsempty(),"%s %s",option,config);
+    sdsfree(config);
+    rewriteConfigRewriteLine(state,option,line,1);
+}
+
 /* Rewrite the save option. */
 void rewriteConfigCommandsNAPOption(struct rewriteConfigState *state) {
     struct darray values;
@@ -2052,6 +2414,7 @@ void rewriteConfigCommandsNAPOption(struct rewriteConfigState *state) {
 static int rewriteConfig(char *path) {
     struct rewriteConfigState *state;
     sds newcontent;
+    sds defdir, defdbfilename, defappendfilename;
     int retval;
     conf_option *cop;
 
@@ -2064,15 +2427,42 @@ static int rewriteConfig(char *path) {
 
     /* Step 2: rewrite every single option, replacing or appending it inside
      * the rewrite state. */
+    defdir = sdsnew(CONFIG_DEFAULT_DATA_DIR);
+    defdbfilename = sdsnew(CONFIG_DEFAULT_RDB_FILENAME);
+    defappendfilename = sdsnew(CONFIG_DEFAULT_AOF_FILENAME);
     rewriteConfigIntOption(state,CONFIG_SOPN_DATABASES,CONFIG_DEFAULT_LOGICAL_DBNUM);
     rewriteConfigIntOption(state,CONFIG_SOPN_IDPDATABASE,CONFIG_DEFAULT_INTERNAL_DBNUM);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_DBOPTREAD,CONFIG_DEFAULT_DB_OPTIMISTIC_READ);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_KEYAFFINITY,CONFIG_DEFAULT_WORKER_KEY_AFFINITY);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_EXPIREINDEX,CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_KEYSPACEOPEN,CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_TABLEPREALLOC,CONFIG_DEFAULT_KEYSPACE_TABLE_PREALLOC);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_LAZYSERVERDEL,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
     rewriteConfigBytesOption(state,CONFIG_SOPN_MAXMEMORY,CONFIG_DEFAULT_MAXMEMORY);
     rewriteConfigEnumOption(state,CONFIG_SOPN_MAXMEMORYP,get_evictpolicy_strings,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigIntOption(state,CONFIG_SOPN_MAXMEMORYS,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
+    rewriteConfigIntOption(state,CONFIG_SOPN_LFULOGFACTOR,CONFIG_DEFAULT_LFU_LOG_FACTOR);
+    rewriteConfigIntOption(state,CONFIG_SOPN_LFUDECAYTIME,CONFIG_DEFAULT_LFU_DECAY_TIME);
+    rewriteConfigIntOption(state,CONFIG_SOPN_LOWWATERMARK,CONFIG_DEFAULT_LOW_WATERMARK);
     rewriteConfigLongLongOption(state,CONFIG_SOPN_MTCLIMIT,CONFIG_DEFAULT_MAX_TIME_COMPLEXITY_LIMIT);
     rewriteConfigBindOption(state);
     rewriteConfigIntOption(state,CONFIG_SOPN_PORT,CONFIG_DEFAULT_SERVER_PORT);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_REUSEPORT,CONFIG_DEFAULT_WORKER_REUSEPORT);
+    rewriteConfigEnumOption(state,CONFIG_SOPN_DISPATCHP,get_dispatchpolicy_strings,CONFIG_DEFAULT_DISPATCH_POLICY);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_MIGRATEHOT,CONFIG_DEFAULT_MIGRATE_HOT_CLIENTS);
     rewriteConfigIntOption(state,CONFIG_SOPN_THREADS,CONFIG_DEFAULT_THREADS_NUM);
+    rewriteConfigSdsOption(state,CONFIG_SOPN_DIR,defdir);
+    rewriteConfigSdsOption(state,CONFIG_SOPN_DBFILENAME,defdbfilename);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_RDBCOMPRESSION,CONFIG_DEFAULT_RDB_COMPRESSION);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_RDBCHECKSUM,CONFIG_DEFAULT_RDB_CHECKSUM);
+    rewriteConfigIntOption(state,CONFIG_SOPN_RDBTHREADS,CONFIG_DEFAULT_RDB_THREADS);
+    rewriteConfigYesNoOption(state,CONFIG_SOPN_APPENDONLY,CONFIG_DEFAULT_APPENDONLY);
+    rewriteConfigSdsOption(state,CONFIG_SOPN_APPENDFILENAME,defappendfilename);
+    rewriteConfigEnumOption(state,CONFIG_SOPN_APPENDFSYNC,get_appendfsync_strings,CONFIG_DEFAULT_AOF_FSYNC);
+    rewriteConfigIntOption(state,CONFIG_SOPN_AOFRWPERC,CONFIG_DEFAULT_AOF_REWRITE_PERC);
+    rewriteConfigBytesOption(state,CONFIG_SOPN_AOFRWMINSIZE,CONFIG_DEFAULT_AOF_REWRITE_MIN_SIZE);
+    rewriteConfigSlaveofOption(state);
+    rewriteConfigBytesOption(state,CONFIG_SOPN_REPLBACKLOGSIZE,CONFIG_DEFAULT_REPL_BACKLOG_SIZE);
     rewriteConfigLongLongOption(state,CONFIG_SOPN_SLOWLOGLST,CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN);
     rewriteConfigIntOption(state,CONFIG_SOPN_SLOWLOGML,CONFIG_DEFAULT_SLOWLOG_MAX_LEN);
     rewriteConfigIntOption(state,CONFIG_SOPN_MAXCLIENTS,CONFIG_DEFAULT_MAX_CLIENTS);
@@ -2084,6 +2474,9 @@ static int rewriteConfig(char *path) {
      * that were used by a config option and are no longer used, like in case
      * of multiple "save" options or duplicated options. */
     rewriteConfigRemoveOrphaned(state);
+    sdsfree(defdir);
+    sdsfree(defdbfilename);
+    sdsfree(defappendfilename);
 
     /* Step 4: generate a new configuration file from the modified state
      * and write it into the original file. */
@@ -2151,8 +2544,12 @@ conf_cache_init(conf_cache *cc)
     conf_server_get(CONFIG_SOPN_REQUIREPASS,&cc->requirepass);
     conf_server_get(CONFIG_SOPN_ADMINPASS,&cc->adminpass);
     conf_server_get(CONFIG_SOPN_MAXMEMORY,&cc->maxmemory);
+    conf_server_get(CONFIG_SOPN_MAXMEMORYP,&cc->maxmemory_policy);
+    conf_server_get(CONFIG_SOPN_LFULOGFACTOR,&cc->lfu_log_factor);
+    conf_server_get(CONFIG_SOPN_LFUDECAYTIME,&cc->lfu_decay_time);
     conf_server_get(CONFIG_SOPN_MTCLIMIT,&cc->max_time_complexity_limit);
     conf_server_get(CONFIG_SOPN_SLOWLOGLST,&cc->slowlog_log_slower_than);
+    conf_server_get(CONFIG_SOPN_APPENDFSYNC,&cc->appendfsync);
 
     return VR_OK;
 }
@@ -2196,8 +2593,12 @@ conf_cache_update(conf_cache *cc)
     conf_server_get(CONFIG_SOPN_REQUIREPASS,&cc->requirepass);
     conf_server_get(CONFIG_SOPN_ADMINPASS,&cc->adminpass);
     conf_server_get(CONFIG_SOPN_MAXMEMORY,&cc->maxmemory);
+    conf_server_get(CONFIG_SOPN_MAXMEMORYP,&cc->maxmemory_policy);
+    conf_server_get(CONFIG_SOPN_LFULOGFACTOR,&cc->lfu_log_factor);
+    conf_server_get(CONFIG_SOPN_LFUDECAYTIME,&cc->lfu_decay_time);
     conf_server_get(CONFIG_SOPN_MTCLIMIT,&cc->max_time_complexity_limit);
     conf_server_get(CONFIG_SOPN_SLOWLOGLST,&cc->slowlog_log_slower_than);
+    conf_server_get(CONFIG_SOPN_APPENDFSYNC,&cc->appendfsync);
 
     cc->cache_version = cversion;
 
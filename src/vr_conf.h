@@ -7,26 +7,58 @@
 #define CONFIG_SOPN_MAXMEMORY    "maxmemory"
 #define CONFIG_SOPN_MAXMEMORYP   "maxmemory-policy"
 #define CONFIG_SOPN_MAXMEMORYS   "maxmemory-samples"
+#define CONFIG_SOPN_LFULOGFACTOR "lfu-log-factor"
+#define CONFIG_SOPN_LFUDECAYTIME "lfu-decay-time"
+#define CONFIG_SOPN_LOWWATERMARK "maxmemory-low-watermark"
 #define CONFIG_SOPN_MTCLIMIT     "max-time-complexity-limit"
 #define CONFIG_SOPN_BIND         "bind"
 #define CONFIG_SOPN_PORT         "port"
+#define CONFIG_SOPN_REUSEPORT    "worker-reuseport"
+#define CONFIG_SOPN_DISPATCHP    "worker-dispatch-policy"
+#define CONFIG_SOPN_MIGRATEHOT   "worker-migrate-hot-clients"
 #define CONFIG_SOPN_THREADS      "threads"
 #define CONFIG_SOPN_DIR          "dir"
+#define CONFIG_SOPN_DBFILENAME   "dbfilename"
+#define CONFIG_SOPN_RDBCOMPRESSION "rdbcompression"
+#define CONFIG_SOPN_RDBCHECKSUM  "rdbchecksum"
+#define CONFIG_SOPN_RDBTHREADS   "rdb-threads"
+#define CONFIG_SOPN_APPENDONLY   "appendonly"
+#define CONFIG_SOPN_APPENDFILENAME "appendfilename"
+#define CONFIG_SOPN_APPENDFSYNC  "appendfsync"
+#define CONFIG_SOPN_AOFRWPERC    "auto-aof-rewrite-percentage"
+#define CONFIG_SOPN_AOFRWMINSIZE "auto-aof-rewrite-min-size"
+#define CONFIG_SOPN_SLAVEOF      "slaveof"
+#define CONFIG_SOPN_REPLBACKLOGSIZE "repl-backlog-size"
 #define CONFIG_SOPN_MAXCLIENTS   "maxclients"
 #define CONFIG_SOPN_SLOWLOGLST   "slowlog-log-slower-than"
 #define CONFIG_SOPN_SLOWLOGML    "slowlog-max-len"
 #define CONFIG_SOPN_REQUIREPASS  "requirepass"
 #define CONFIG_SOPN_ADMINPASS    "adminpass"
 #define CONFIG_SOPN_COMMANDSNAP  "commands-need-adminpass"
+#define CONFIG_SOPN_DBOPTREAD    "db-optimistic-read"
+#define CONFIG_SOPN_KEYAFFINITY  "worker-key-affinity"
+#define CONFIG_SOPN_EXPIREINDEX  "active-expire-index"
+#define CONFIG_SOPN_KEYSPACEOPEN "keyspace-open-addressing"
+#define CONFIG_SOPN_TABLEPREALLOC "keyspace-table-prealloc"
+#define CONFIG_SOPN_LAZYSERVERDEL "lazyfree-lazy-server-del"
 
 #define CONFIG_RUN_ID_SIZE 40
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
 
 #define CONFIG_DEFAULT_LOGICAL_DBNUM    6
 #define CONFIG_DEFAULT_INTERNAL_DBNUM   6
+#define CONFIG_DEFAULT_DB_OPTIMISTIC_READ 0
+#define CONFIG_DEFAULT_WORKER_KEY_AFFINITY 0
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_INDEX 0
+#define CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING 0
+#define CONFIG_DEFAULT_KEYSPACE_TABLE_PREALLOC 0
+#define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
 
 #define CONFIG_DEFAULT_MAXMEMORY 0
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
+#define CONFIG_DEFAULT_LFU_DECAY_TIME 1
+#define CONFIG_DEFAULT_LOW_WATERMARK 0
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
 
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
@@ -36,8 +68,20 @@
 #define CONFIG_DEFAULT_HOST "0.0.0.0"
 
 #define CONFIG_DEFAULT_SERVER_PORT 55555
+#define CONFIG_DEFAULT_WORKER_REUSEPORT 0
+#define CONFIG_DEFAULT_DISPATCH_POLICY DISPATCH_ROUND_ROBIN
+#define CONFIG_DEFAULT_MIGRATE_HOT_CLIENTS 0
 
 #define CONFIG_DEFAULT_DATA_DIR "viredata"
+#define CONFIG_DEFAULT_RDB_FILENAME "dump.rdb"
+#define CONFIG_DEFAULT_RDB_COMPRESSION 1
+#define CONFIG_DEFAULT_RDB_CHECKSUM 1
+#define CONFIG_DEFAULT_RDB_THREADS 4
+#define CONFIG_DEFAULT_APPENDONLY 0
+#define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
+#define CONFIG_DEFAULT_AOF_FSYNC AOF_FSYNC_EVERYSEC
+#define CONFIG_DEFAULT_AOF_REWRITE_PERC 100
+#define CONFIG_DEFAULT_AOF_REWRITE_MIN_SIZE (64*1024*1024)
 
 #define CONFIG_DEFAULT_MAX_TIME_COMPLEXITY_LIMIT 0 /* Not limited */
 
@@ -79,6 +123,8 @@ typedef struct conf_option {
     ACTION( MAXMEMORY_ALLKEYS_LRU,      allkeys-lru)        \
     ACTION( MAXMEMORY_ALLKEYS_RANDOM,   allkeys-random)     \
     ACTION( MAXMEMORY_NO_EVICTION,      noeviction)         \
+    ACTION( MAXMEMORY_VOLATILE_LFU,     volatile-lfu)       \
+    ACTION( MAXMEMORY_ALLKEYS_LFU,      allkeys-lfu)        \
 
 #define DEFINE_ACTION(_policy, _name) _policy,
 typedef enum evictpolicy_type {
@@ -87,25 +133,80 @@ typedef enum evictpolicy_type {
 } evictpolicy_type_t;
 #undef DEFINE_ACTION
 
+#define MAXMEMORY_POLICY_LRU(_p)    \
+    ((_p) == MAXMEMORY_VOLATILE_LRU || (_p) == MAXMEMORY_ALLKEYS_LRU)
+#define MAXMEMORY_POLICY_LFU(_p)    \
+    ((_p) == MAXMEMORY_VOLATILE_LFU || (_p) == MAXMEMORY_ALLKEYS_LFU)
+#define MAXMEMORY_POLICY_ALLKEYS(_p)    \
+    ((_p) == MAXMEMORY_ALLKEYS_LRU || (_p) == MAXMEMORY_ALLKEYS_LFU || \
+     (_p) == MAXMEMORY_ALLKEYS_RANDOM)
+
+#define DISPATCHPOLICY_CODEC(ACTION)                        \
+    ACTION( DISPATCH_ROUND_ROBIN,       round-robin)        \
+    ACTION( DISPATCH_LEAST_LOADED,      least-loaded)       \
+
+#define DEFINE_ACTION(_policy, _name) _policy,
+typedef enum dispatchpolicy_type {
+    DISPATCHPOLICY_CODEC( DEFINE_ACTION )
+    DISPATCHPOLICY_SENTINEL
+} dispatchpolicy_type_t;
+#undef DEFINE_ACTION
+
+#define APPENDFSYNC_CODEC(ACTION)                           \
+    ACTION( AOF_FSYNC_NO,               no)                 \
+    ACTION( AOF_FSYNC_ALWAYS,           always)             \
+    ACTION( AOF_FSYNC_EVERYSEC,         everysec)           \
+
+#define DEFINE_ACTION(_policy, _name) _policy,
+typedef enum appendfsync_type {
+    APPENDFSYNC_CODEC( DEFINE_ACTION )
+    APPENDFSYNC_SENTINEL
+} appendfsync_type_t;
+#undef DEFINE_ACTION
+
 typedef struct conf_server {
     dict          *ctable;
 
     int           databases;
     int           internal_dbs_per_databases;
+    int           db_optimistic_read;   /* Fast read only commands skip the db rwlock */
+    int           worker_key_affinity;  /* Run commands in the worker owning the keys */
+    int           active_expire_index;  /* Expire the keys by an index of the times */
+    int           keyspace_open_addressing; /* Open addressing tables for the keys */
+    int           keyspace_table_prealloc; /* Backends make the next keyspace tables */
+    int           lazyfree_lazy_server_del; /* Backends free the big values deleted */
 
     /* Limits */
     long long     max_time_complexity_limit;
     long long     maxmemory;            /* Max number of memory bytes to use */
     int           maxmemory_policy;     /* Policy for key eviction */
     int           maxmemory_samples;    /* Pricision of random sampling */
+    int           lfu_log_factor;       /* LFU logarithmic counter factor */
+    int           lfu_decay_time;       /* LFU counter decay factor, in minutes */
+    int           maxmemory_low_watermark;  /* Percent of maxmemory the backends evict to */
     int           maxclients;           /* Max number of simultaneous clients */
 
     int           threads;
 
     struct darray  binds;                /* Type: sds */
     int           port;
+    int           worker_reuseport;     /* Every worker accepts on its own SO_REUSEPORT listener */
+    int           worker_dispatch_policy;   /* How the master picks the worker for a new client */
+    int           worker_migrate_hot_clients;   /* Move hot clients to cooler workers */
 
     sds           dir;
+    sds           dbfilename;           /* Name of the RDB file in dir */
+    int           rdb_compression;      /* Use compression in RDB? */
+    int           rdb_checksum;         /* Use RDB checksum? */
+    int           rdb_threads;          /* Threads saving and loading the RDB */
+    int           appendonly;           /* Log the writes in the AOF file? */
+    sds           appendfilename;       /* Name of the AOF file in dir */
+    int           appendfsync;          /* Kind of fsync() policy of the AOF */
+    int           auto_aof_rewrite_perc;    /* Rewrite AOF if % growth is > M and... */
+    long long     auto_aof_rewrite_min_size;    /* the AOF file is at least N bytes. */
+
+    struct darray  slaveof;              /* Type: sds, master host and port */
+    long long     repl_backlog_size;    /* Replication backlog size in bytes */
 
     long long     slowlog_log_slower_than;  /* SLOWLOG time limit (to get logged) */
     int           slowlog_max_len;      /* SLOWLOG max number of items logged */
@@ -145,8 +246,12 @@ typedef struct conf_cache {
     sds requirepass;
     sds adminpass;
     long long maxmemory;
+    int maxmemory_policy;
+    int lfu_log_factor;
+    int lfu_decay_time;
     long long max_time_complexity_limit;
     long long slowlog_log_slower_than;
+    int appendfsync;
 }conf_cache;
 
 extern vr_conf *conf;
@@ -165,7 +270,10 @@ int conf_server_set(const char *option_name, conf_value *value);
 
 int conf_set_maxmemory(void *obj, conf_option *opt, void *data);
 int conf_set_maxmemory_policy(void *obj, conf_option *opt, void *data);
+int conf_set_dispatch_policy(void *obj, conf_option *opt, void *data);
+int conf_set_appendfsync(void *obj, conf_option *opt, void *data);
 int conf_set_int_non_zero(void *obj, conf_option *opt, void *data);
+int conf_set_dbfilename(void *obj, conf_option *opt, void *data);
 
 int conf_get_sds(void *obj, conf_option *opt, void *data);
 int conf_get_int(void *obj, conf_option *opt, void *data);
@@ -188,6 +296,8 @@ int CONFF_LOCK(void);
 int CONFF_UNLOCK(void);
 
 const char *get_evictpolicy_strings(int evictpolicy_type);
+const char *get_dispatchpolicy_strings(int dispatchpolicy_type);
+const char *get_appendfsync_strings(int appendfsync_type);
 
 void configCommand(struct client *c);
 
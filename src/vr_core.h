@@ -73,6 +73,7 @@ struct vr_worker;
 #include <dmalloc.h>
 #include <darray.h>
 #include <dlist.h>
+#include <dmtqueue.h>
 
 #include <vr_util.h>
 #include <vr_signal.h>
@@ -88,6 +89,8 @@ struct vr_worker;
 #include <vr_lzfP.h>
 
 #include <vr_object.h>
+#include <vr_slab.h>
+#include <vr_timewheel.h>
 
 #include <vr_listen.h>
 #include <vr_connection.h>
@@ -97,8 +100,8 @@ struct vr_worker;
 
 #include <vr_thread.h>
 #include <vr_eventloop.h>
-#include <vr_master.h>
 #include <vr_worker.h>
+#include <vr_master.h>
 #include <vr_backend.h>
 
 #include <vr_db.h>
@@ -106,12 +109,14 @@ struct vr_worker;
 
 #include <vr_command.h>
 #include <vr_block.h>
+#include <vr_resp.h>
 #include <vr_client.h>
 #include <vr_server.h>
 
 #include <vr_notify.h>
 #include <vr_pubsub.h>
 
+#include <vr_rio.h>
 #include <vr_rdb.h>
 #include <vr_aof.h>
 #include <vr_replication.h>
@@ -1,28 +1,37 @@
 #include <signal.h>
 #include <ctype.h>
+#include <sched.h>
 
 #include <vr_core.h>
 
+#define DB_VOLATILE_KEYS_MIN 16 /* Smallest db->volatile_keys array */
+#define DB_PREPARE_TABLE_MIN_SIZE (64*1024) /* Slots, see prepareHashTablesForDb() */
+#define LAZYFREE_THRESHOLD 64 /* Elements of the values freed by the backends */
+
+static void dbKeyFree(sds key);
+static void dbVolatileRemove(redisDb *db, sds key);
+static int expireIfNeededAt(redisDb *db, robj *key, long long when);
+static void dbFreeValueAsync(robj *o);
+
+/* A key of db->dict is freed with its expire, privdata is the db, or NULL
+ * for a keyspace detached from its db by emptyDbAsync(). */
+static void dictDbKeyDestructor(void *privdata, void *key) {
+    redisDb *db = privdata;
+
+    if (db != NULL && dbKeyGetExpire(key) != -1) dbVolatileRemove(db,key);
+    dbKeyFree(key);
+}
+
 /* Db->dict, keys are sds strings, vals are Redis objects. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
+    dictDbKeyDestructor,        /* key destructor */
     dictObjectDestructor   /* val destructor */
 };
 
-/* Db->expires */
-dictType keyptrDictType = {
-    dictSdsHash,               /* hash function */
-    NULL,                      /* key dup */
-    NULL,                      /* val dup */
-    dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* key destructor */
-    NULL                       /* val destructor */
-};
-
 /* Keylist hash table type has unencoded redis objects as keys and
  * lists as values. It's used for blocking operations (BLPOP) and to
  * map swapped keys to a list of clients waiting for this keys to be loaded. */
@@ -54,8 +63,20 @@ static struct evictionPoolEntry *evictionPoolAlloc(void) {
 
 int redisDbInit(redisDb *db)
 {
-    db->dict = dictCreate(&dbDictType,NULL);
-    db->expires = dictCreate(&keyptrDictType,NULL);
+    if (server.keyspace_open_addressing)
+        db->dict = dictCreateOpen(&dbDictType,db);
+    else
+        db->dict = dictCreate(&dbDictType,db);
+    if (darray_init(&db->volatile_keys,DB_VOLATILE_KEYS_MIN,
+                    sizeof(void*)) != 0) {
+        return VR_ENOMEM;
+    }
+    if (server.active_expire_index)
+        db->expire_index = timeWheelCreate(vr_msec_now());
+    else
+        db->expire_index = NULL;
+    db->expire_lag = 0;
+    db->preparing_table = 0;
     db->blocking_keys = dictCreate(&keylistDictType,NULL);
     db->ready_keys = dictCreate(&setDictType,NULL);
     db->watched_keys = dictCreate(&keylistDictType,NULL);
@@ -64,6 +85,12 @@ int redisDbInit(redisDb *db)
 
     pthread_rwlock_init(&db->rwl, NULL);
 
+    db->seq = 0;
+    db->nreaders = 0;
+    db->readers = NULL;
+
+    db->aof_rewrite = NULL;
+
     return VR_OK;
 }
 
@@ -71,55 +98,440 @@ int
 redisDbDeinit(redisDb *db)
 {
     pthread_rwlock_destroy(&db->rwl);
+    if (db->readers != NULL) {
+        dfree(db->readers);
+        db->readers = NULL;
+        db->nreaders = 0;
+    }
     return VR_OK;
 }
 
+/* Enable the optimistic read mode for this db. The 'readers' is the
+ * number of threads that can run fast read only commands, every one
+ * of them gets a reader slot (see dbReaderSlotSet()). */
+int
+redisDbOptimisticReadInit(redisDb *db, int readers)
+{
+    int j;
+
+    if (readers <= 0) return VR_ERROR;
+
+    db->readers = dalloc(sizeof(dbReaderSlot)*(size_t)readers);
+    if (db->readers == NULL) return VR_ENOMEM;
+    for (j = 0; j < readers; j ++) {
+        db->readers[j].active = 0;
+    }
+    db->nreaders = readers;
+    db->seq = 0;
+
+    return VR_OK;
+}
+
+/*-----------------------------------------------------------------------------
+ * Db locks
+ *
+ * By default every db is guarded by a pthread rwlock. With the optimistic
+ * read mode (db-optimistic-read yes) the fast read only commands do not
+ * touch the rwlock at all: the reader publishes itself in its own reader
+ * slot and validates the db sequence number, retrying if a writer is
+ * inside. A writer takes the rwlock exclusively, makes the sequence odd
+ * and waits for the readers already inside to leave. The waits spin for a
+ * while and then yield the cpu, see dbSpinWait(). So the readers only
+ * write to their own cache line and never bounce the shared reader counter
+ * of the rwlock between the cpus. Slow read commands still use the rwlock
+ * in shared mode.
+ *
+ * The pipelined commands of a client are run in a lock batch, see
+ * dbLockBatchBegin(): unlockDb() keeps the db locked, and the next command
+ * locking the same db in a compatible mode just takes it over, so a run
+ * of commands on the same db locks it once. Locking another db releases
+ * the kept lock first, so a kept lock is never held while waiting for
+ * another one. A reader slot is neither kept nor taken over while a
+ * writer waits for it.
+ *
+ * A write command with more than one key, or flushing many dbs, holds the
+ * write locks of all its dbs for the whole command, see dbLockCommand().
+ * Its record in the append only file is numbered by its last write lock,
+ * so no other write of its keys may be done, and numbered lower, before
+ * it is done. The locks are taken in db order, as aofRewriteStart() does, and no
+ * other thread holds a db lock while waiting for another one, so they
+ * never deadlock.
+ *----------------------------------------------------------------------------*/
+
+#if defined(__ATOMIC_SEQ_CST)
+#define db_atomic_load(_ptr) __atomic_load_n(_ptr,__ATOMIC_SEQ_CST)
+#define db_atomic_store(_ptr,_val) __atomic_store_n(_ptr,_val,__ATOMIC_SEQ_CST)
+#else
+#define db_atomic_load(_ptr) (__sync_synchronize(),*(volatile typeof(*(_ptr))*)(_ptr))
+#define db_atomic_store(_ptr,_val) do {             \
+    *(volatile typeof(*(_ptr))*)(_ptr) = (_val);    \
+    __sync_synchronize();                           \
+} while(0)
+#endif
+
+#define db_atomic_cas(_ptr,_old,_new) __sync_bool_compare_and_swap(_ptr,_old,_new)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define db_cpu_relax() __asm__ __volatile__("pause")
+#else
+#define db_cpu_relax() __sync_synchronize()
+#endif
+
+#define DB_SPIN_MAX 1024    /* Pauses before yielding, see dbSpinWait() */
+
+/* Wait for another thread to leave, spinning first and then giving the
+ * cpu away, so a waiter does not burn its cpu against a preempted thread. */
+static inline void
+dbSpinWait(unsigned int *spins)
+{
+    if (*spins < DB_SPIN_MAX) {
+        (*spins) ++;
+        db_cpu_relax();
+    } else {
+        sched_yield();
+    }
+}
+
+static __thread int db_reader_slot = -1;  /* Reader slot of this thread */
+static __thread int db_fast_read = 0;     /* Running a fast read command? */
+static __thread redisDb *db_optimistic_locked = NULL;
+
+/* Lock batch of the thread, see dbLockBatchBegin(). The modes are
+ * ordered, a kept lock is taken over by the commands asking for a mode
+ * up to its own: an optimistic read only by the fast reads, a rwlock
+ * read by any read. */
+#define DB_LOCK_FAST_READ 1
+#define DB_LOCK_READ 2
+#define DB_LOCK_WRITE 3
+#define DB_LOCK_BATCH_MAX 32    /* Commands run under a kept lock */
+static __thread int db_batch = 0;               /* Batching unlocks? */
+static __thread redisDb *db_batch_kept = NULL;  /* Locked, not in use */
+static __thread int db_batch_kept_mode;
+static __thread redisDb *db_batch_last = NULL;  /* Last db locked */
+static __thread int db_batch_last_mode;
+static __thread int db_batch_reused;            /* Commands since locked */
+
+/* Write locks held for the command run by the thread, see dbLockCommand(). */
+static __thread redisDb **db_held = NULL;
+static __thread int db_nheld = 0;
+
+static void unlockDbNow(redisDb *db);
+
+/* Bind the calling thread to a reader slot, called by the worker
+ * threads at startup with their worker id. */
+void
+dbReaderSlotSet(int slot)
+{
+    db_reader_slot = slot;
+}
+
+/* Called around the fast read only commands, see call(). */
+void
+dbFastReadBegin(void)
+{
+    db_fast_read = 1;
+}
+
+void
+dbFastReadEnd(void)
+{
+    db_fast_read = 0;
+}
+
+/* A writer waits for the readers of the db to leave, so a kept reader
+ * slot must not be taken over. */
+static int
+dbLockBatchWriterWaiting(redisDb *db, int mode)
+{
+    return mode == DB_LOCK_FAST_READ && (db_atomic_load(&db->seq)&1);
+}
+
+/* Take over the kept lock if it is of 'db' and allows 'mode', otherwise
+ * release it. Return 1 if the db is locked. */
+static int
+dbLockBatchReuse(redisDb *db, int mode)
+{
+    redisDb *kept = db_batch_kept;
+
+    if (kept == NULL) return 0;
+    db_batch_kept = NULL;
+    if (kept == db && db_batch_kept_mode >= mode &&
+        !dbLockBatchWriterWaiting(kept,db_batch_kept_mode)) {
+        db_batch_last = db;
+        db_batch_last_mode = db_batch_kept_mode;
+        db_batch_reused ++;
+        return 1;
+    }
+    unlockDbNow(kept);
+    return 0;
+}
+
+static void
+dbLockBatchLocked(redisDb *db, int mode)
+{
+    if (!db_batch) return;
+    db_batch_last = db;
+    db_batch_last_mode = mode;
+    db_batch_reused = 0;
+}
+
+/* Start to batch the unlocks of the calling thread, the lock kept by
+ * the last command is released by dbLockBatchEnd(). */
+void
+dbLockBatchBegin(void)
+{
+    db_batch = 1;
+}
+
+/* Release the lock kept by the batch, if any. */
+void
+dbLockBatchRelease(void)
+{
+    redisDb *kept = db_batch_kept;
+
+    db_batch_last = NULL;
+    if (kept != NULL) {
+        db_batch_kept = NULL;
+        unlockDbNow(kept);
+    }
+}
+
+void
+dbLockBatchEnd(void)
+{
+    db_batch = 0;
+    dbLockBatchRelease();
+}
+
+/* Is the db held for the running command? */
+static int
+dbLockHeld(redisDb *db)
+{
+    int j;
+
+    for (j = 0; j < db_nheld; j ++) {
+        if (db_held[j] == db) return 1;
+    }
+    return 0;
+}
+
 int
 lockDbRead(redisDb *db)
 {
+    if (db_nheld > 0 && dbLockHeld(db)) return VR_OK;
+    if (dbLockBatchReuse(db,db_fast_read?DB_LOCK_FAST_READ:DB_LOCK_READ))
+        return VR_OK;
+
+    if (db->readers != NULL && db_fast_read &&
+        db_reader_slot >= 0 && db_reader_slot < db->nreaders) {
+        dbReaderSlot *slot = &db->readers[db_reader_slot];
+        unsigned int spins = 0;
+
+        while (1) {
+            db_atomic_store(&slot->active,1);
+            if ((db_atomic_load(&db->seq)&1) == 0) break;
+
+            /* A writer is inside, step back and retry when it leaves. */
+            db_atomic_store(&slot->active,0);
+            while (db_atomic_load(&db->seq)&1) dbSpinWait(&spins);
+        }
+        db_optimistic_locked = db;
+        dbLockBatchLocked(db,DB_LOCK_FAST_READ);
+        return VR_OK;
+    }
+
     pthread_rwlock_rdlock(&db->rwl);
+    dbLockBatchLocked(db,DB_LOCK_READ);
     return VR_OK;
 }
 
+static void
+lockDbWriteNow(redisDb *db)
+{
+    pthread_rwlock_wrlock(&db->rwl);
+    if (db->readers != NULL) {
+        unsigned int spins = 0;
+        int j;
+
+        db_atomic_store(&db->seq,db->seq+1);
+        for (j = 0; j < db->nreaders; j ++) {
+            while (db_atomic_load(&db->readers[j].active))
+                dbSpinWait(&spins);
+        }
+    }
+}
+
 int
 lockDbWrite(redisDb *db)
 {
-    pthread_rwlock_wrlock(&db->rwl);
+    if ((db_nheld == 0 || !dbLockHeld(db)) &&
+        !dbLockBatchReuse(db,DB_LOCK_WRITE)) {
+        lockDbWriteNow(db);
+        dbLockBatchLocked(db,DB_LOCK_WRITE);
+    }
+
+    /* Number the write for the append only file. */
+    if (current_vel != NULL && current_vel->aof_queue != NULL &&
+        current_vel->aof_number_locks)
+        aofWriteLocked(current_vel);
     return VR_OK;
 }
 
 int
 unlockDb(redisDb *db)
 {
-    pthread_rwlock_unlock(&db->rwl);
+    /* Released at the end of the command, see dbUnlockCommand(). */
+    if (db_nheld > 0 && dbLockHeld(db)) return VR_OK;
+
+    /* Keep the lock of the last db locked for the next command. */
+    if (db_batch && db_batch_kept == NULL && db_batch_last == db &&
+        db_batch_reused < DB_LOCK_BATCH_MAX &&
+        !dbLockBatchWriterWaiting(db,db_batch_last_mode)) {
+        db_batch_kept = db;
+        db_batch_kept_mode = db_batch_last_mode;
+        db_batch_last = NULL;
+        return VR_OK;
+    }
+    if (db_batch_last == db) db_batch_last = NULL;
+
+    unlockDbNow(db);
     return VR_OK;
 }
 
+static void
+unlockDbNow(redisDb *db)
+{
+    if (db_optimistic_locked == db) {
+        db_atomic_store(&db->readers[db_reader_slot].active,0);
+        db_optimistic_locked = NULL;
+        return;
+    }
+
+    /* The sequence is odd only while a writer holds the rwlock. */
+    if (db->readers != NULL && (db->seq&1))
+        db_atomic_store(&db->seq,db->seq+1);
+    pthread_rwlock_unlock(&db->rwl);
+}
+
+static int
+dbIndexCompare(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* Write lock all the dbs the command of the client is going to write,
+ * in db order, if it writes more than one key or flushes many dbs. The
+ * locks are held until dbUnlockCommand(), the command just takes them
+ * over. Return 1 if the dbs are locked. */
+int
+dbLockCommand(client *c)
+{
+    struct redisCommand *cmd = c->cmd;
+    int *keys = NULL, *dbidx, numkeys, ndbs = 0, j;
+
+    if (!(cmd->flags & CMD_WRITE)) return 0;
+
+    if (cmd->proc == flushallCommand) {
+        numkeys = server.dbnum;
+    } else if (cmd->proc == flushdbCommand) {
+        numkeys = server.dbinum;
+    } else {
+        keys = getKeysFromCommand(cmd,c->argv,c->argc,&numkeys);
+        if (numkeys < 2) {
+            getKeysFreeResult(keys);
+            return 0;
+        }
+    }
+
+    dbidx = dalloc(sizeof(int)*(size_t)numkeys);
+    for (j = 0; j < numkeys; j ++) {
+        if (cmd->proc == flushallCommand)
+            dbidx[j] = j;
+        else if (cmd->proc == flushdbCommand)
+            dbidx[j] = j+c->dictid*server.dbinum;
+        else
+            dbidx[j] = getInternalDbIdxByKey(c,c->argv[keys[j]]);
+    }
+    getKeysFreeResult(keys);
+    qsort(dbidx,(size_t)numkeys,sizeof(int),dbIndexCompare);
+
+    if (db_held == NULL)
+        db_held = dalloc(sizeof(redisDb*)*(size_t)server.dbnum);
+
+    /* Never wait for a lock while keeping another one. */
+    dbLockBatchRelease();
+    for (j = 0; j < numkeys; j ++) {
+        redisDb *db;
+
+        if (j > 0 && dbidx[j] == dbidx[j-1]) continue;
+        db = darray_get(&server.dbs, (uint32_t)dbidx[j]);
+        lockDbWriteNow(db);
+        db_held[ndbs++] = db;
+    }
+    db_nheld = ndbs;
+    dfree(dbidx);
+    return 1;
+}
+
+/* Release the locks taken by dbLockCommand(), once the command is done
+ * and its record numbered. */
+void
+dbUnlockCommand(void)
+{
+    int j, nheld = db_nheld;
+
+    db_nheld = 0;
+    for (j = nheld-1; j >= 0; j --)
+        unlockDbNow(db_held[j]);
+}
+
+static robj *lookupKeyEntry(dictEntry *de) {
+    robj *val = dictGetVal(de);
+
+    /* Update the access time for the ageing algorithm.
+     * Don't do it if we have a saving child, as this will trigger
+     * a copy on write madness. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+        objectUpdateLRU(val);
+    return val;
+}
+
 robj *lookupKey(redisDb *db, robj *key) {
     dictEntry *de = dictFind(db->dict,key->ptr);
     if (de) {
-        robj *val = dictGetVal(de);
-
-        /* Update the access time for the ageing algorithm.
-         * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
-            //val->lru = LRU_CLOCK();
-            val->lru = 0;
-        return val;
+        return lookupKeyEntry(de);
     } else {
         return NULL;
     }
 }
 
+/* The expire is in front of the key found, so checking it costs no
+ * other lookup. */
 robj *lookupKeyRead(redisDb *db, robj *key) {
-    if (checkIfExpired(db, key)) return NULL;
-    return lookupKey(db,key);
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    long long when;
+
+    if (de == NULL) return NULL;
+    when = dbKeyGetExpire(dictGetKey(de));
+    if (when > 0 && vr_msec_now() > when) return NULL;
+    return lookupKeyEntry(de);
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key, int *expired) {
-    if (expired) *expired = expireIfNeeded(db,key);
-    return lookupKey(db,key);
+    dictEntry *de;
+
+    aofRewriteTouchKey(db,key);
+    de = dictFind(db->dict,key->ptr);
+    if (de == NULL) {
+        if (expired) *expired = 0;
+        return NULL;
+    }
+    if (expired) {
+        *expired = expireIfNeededAt(db,key,dbKeyGetExpire(dictGetKey(de)));
+        /* The entry is gone if the key was deleted. */
+        if (*expired) return lookupKey(db,key);
+    }
+    return lookupKeyEntry(de);
 }
 
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply) {
@@ -140,8 +552,12 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply, int *expired) {
  * The program is aborted if the key already exists. 
  * Val object must be independent. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    sds copy;
+    int retval;
+
+    aofRewriteTouchKey(db,key);
+    copy = slabSdsDup(key->ptr);
+    retval = dictAdd(db->dict, copy, val);
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
  }
@@ -149,13 +565,22 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
+ * With lazyfree-lazy-server-del a big old value is freed by a backend.
  *
  * The program is aborted if the key was not already present. 
  * Val object must be independent. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
     dictEntry *de = dictFind(db->dict,key->ptr);
+    robj *old;
 
     serverAssertWithInfo(NULL,key,de != NULL);
+    aofRewriteTouchKey(db,key);
+    if (server.lazyfree_lazy_server_del) {
+        old = dictGetVal(de);
+        dictSetVal(db->dict,de,val);
+        dbFreeValueAsync(old);
+        return;
+    }
     dictReplace(db->dict, key->ptr, val);
 }
 
@@ -199,7 +624,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (dbKeyGetExpire(key) != -1) {
             if (checkIfExpired(db,keyobj)) {
                 unlockDb(db);
                 freeObject(keyobj);
@@ -212,10 +637,10 @@ robj *dbRandomKey(redisDb *db) {
 }
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
-int dbDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+int dbSyncDelete(redisDb *db, robj *key) {
+    aofRewriteTouchKey(db,key);
+
+    /* The expire goes with the key, see dictDbKeyDestructor(). */
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         return 1;
     } else {
@@ -223,9 +648,63 @@ int dbDelete(redisDb *db, robj *key) {
     }
 }
 
+/* How many allocations freeing the value takes, about. */
+static unsigned long dbFreeEffort(robj *o) {
+    if (o->type == OBJ_LIST && o->encoding == OBJ_ENCODING_QUICKLIST) {
+        quicklist *ql = o->ptr;
+        return ql->len;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
+        return dictSize((dict*)o->ptr);
+    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+        zset *zs = o->ptr;
+        return zs->zsl->length;
+    } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
+        return dictSize((dict*)o->ptr);
+    }
+    return 1;
+}
+
+/* Free a value taken out of the keyspace, a big one is queued for the
+ * backends, so the db lock is not held while it is freed. The values
+ * shared with the replies are just released by their last owner. */
+static void dbFreeValueAsync(robj *o) {
+    if (!o->constant && !o->arena && !objectIsShared(o) &&
+        dbFreeEffort(o) > LAZYFREE_THRESHOLD &&
+        backends_lazyfree(freeObjectVoid,o,1) == VR_OK) return;
+    freeObject(o);
+}
+
+/* Like dbSyncDelete(), but the value is just unlinked from the keyspace,
+ * and freed by a backend if it is a big one. */
+int dbAsyncDelete(redisDb *db, robj *key) {
+    dictEntry *de;
+    robj *val;
+
+    aofRewriteTouchKey(db,key);
+    de = dictFind(db->dict,key->ptr);
+    if (de == NULL) return 0;
+
+    /* The dict doesn't free a NULL value, see dictObjectDestructor(). */
+    val = dictGetVal(de);
+    dictSetVal(db->dict,de,NULL);
+    dictDelete(db->dict,key->ptr);
+    dbFreeValueAsync(val);
+    return 1;
+}
+
+/* Delete a key removed by a command itself, or expired, or evicted. The
+ * big values are freed by the backends with lazyfree-lazy-server-del. */
+int dbDelete(redisDb *db, robj *key) {
+    return server.lazyfree_lazy_server_del ? dbAsyncDelete(db,key) :
+                                             dbSyncDelete(db,key);
+}
+
+/* Return the string value 'o' of 'key' ready to be changed in place,
+ * replacing it with a copy if it is shared with the replies still
+ * sending it, see addReplyBulkShared(), or encoded. */
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {    
     ASSERT(o->type == OBJ_STRING);
-    if (o->constant || o->encoding != OBJ_ENCODING_RAW) {
+    if (o->constant || o->encoding != OBJ_ENCODING_RAW || objectIsShared(o)) {
         robj *decoded, *new;
         decoded = getDecodedObject(o);
         new = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
@@ -236,6 +715,70 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     return o;
 }
 
+/* The keyspace of a db emptied by emptyDbAsync(), freed by a backend. */
+typedef struct dbKeyspace {
+    dict *dict;
+    darray volatile_keys;
+    timeWheel *expire_index;
+} dbKeyspace;
+
+static void dbKeyspaceFree(void *ptr) {
+    dbKeyspace *ks = ptr;
+
+    dictRelease(ks->dict);
+    if (ks->expire_index != NULL) timeWheelRelease(ks->expire_index);
+    darray_deinit(&ks->volatile_keys);
+    dfree(ks);
+}
+
+/* Empty the db in constant time, taking its keys and expires out for a
+ * backend to free them. Return 1 if done, 0 if the db is small enough to
+ * be emptied in place or out of memory. The db write lock is held. */
+static int emptyDbAsync(redisDb *db) {
+    unsigned long removed = dictSize(db->dict);
+    dbKeyspace *ks;
+    darray volatile_keys;
+    timeWheel *expire_index = NULL;
+
+    if (removed <= LAZYFREE_THRESHOLD) return 0;
+
+    ks = dalloc(sizeof(*ks));
+    if (ks == NULL) return 0;
+    if (darray_init(&volatile_keys,DB_VOLATILE_KEYS_MIN,sizeof(void*)) != 0)
+        goto enomem;
+    if (db->expire_index != NULL &&
+        (expire_index = timeWheelCreate(vr_msec_now())) == NULL)
+        goto enomem;
+    ks->dict = dictDetach(db->dict);
+    if (ks->dict == NULL) goto enomem;
+
+    /* The keys of the detached dict have no db to remove the expires from,
+     * see dictDbKeyDestructor(), the expires are freed all together. */
+    ks->dict->privdata = NULL;
+    ks->volatile_keys = db->volatile_keys;
+    ks->expire_index = db->expire_index;
+    db->volatile_keys = volatile_keys;
+    db->expire_index = expire_index;
+
+    if (backends_lazyfree(dbKeyspaceFree,ks,removed) != VR_OK)
+        dbKeyspaceFree(ks);
+    return 1;
+
+enomem:
+    if (expire_index != NULL) timeWheelRelease(expire_index);
+    if (volatile_keys.elem != NULL) darray_deinit(&volatile_keys);
+    dfree(ks);
+    return 0;
+}
+
+/* Empty a db for FLUSHDB or FLUSHALL, with the db write lock held. */
+static void flushDb(redisDb *db, int async) {
+    aofRewriteFlushDb(db);
+    if (async && emptyDbAsync(db)) return;
+    dictEmpty(db->dict,NULL);
+    dbResizeExpires(db);
+}
+
 long long emptyDb(void(callback)(void*)) {
     int j;
     long long removed = 0;
@@ -245,7 +788,7 @@ long long emptyDb(void(callback)(void*)) {
         db = darray_get(&server.dbs, (uint32_t)j);
         removed += dictSize(db->dict);
         dictEmpty(db->dict,callback);
-        dictEmpty(db->expires,callback);
+        dbResizeExpires(db);
     }
     
     return removed;
@@ -282,38 +825,54 @@ void signalFlushedDb(int dbid) {
  * Type agnostic commands operating on the key space
  *----------------------------------------------------------------------------*/
 
+/* Return 1 for the ASYNC option of FLUSHDB and FLUSHALL, 0 without it,
+ * or -1 after replying with an error. */
+static int getFlushAsyncOrReply(client *c) {
+    if (c->argc == 1) return 0;
+    if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"async")) return 1;
+    addReply(c,shared.syntaxerr);
+    return -1;
+}
+
+/* FLUSHDB [ASYNC] */
 void flushdbCommand(client *c) {
-    int idx;
+    int idx, async;
+
+    if ((async = getFlushAsyncOrReply(c)) == -1) return;
 
     for (idx = 0; idx < server.dbinum; idx ++) {
         fetchInternalDbById(c, idx);
         lockDbWrite(c->db);
         c->vel->dirty += dictSize(c->db->dict);
         signalFlushedDb(c->db->id);
-        dictEmpty(c->db->dict,NULL);
-        dictEmpty(c->db->expires,NULL);
+        flushDb(c->db,async);
         unlockDb(c->db);
     }
 
     addReply(c,shared.ok);
 }
 
+/* FLUSHALL [ASYNC] */
 void flushallCommand(client *c) {
-    int idx;
+    int idx, async;
     redisDb *db;
 
+    if ((async = getFlushAsyncOrReply(c)) == -1) return;
+
     for (idx = 0; idx < server.dbnum; idx ++) {
         db = darray_get(&server.dbs, (uint32_t)idx);
         lockDbWrite(db);
-        dictEmpty(db->dict,NULL);
-        dictEmpty(db->expires,NULL);
+        flushDb(db,async);
         unlockDb(db);
     }
+    c->vel->dirty++;
 
     addReply(c,shared.ok);
 }
 
-void delCommand(client *c) {
+/* DEL frees the values in place, UNLINK lets the backends free the big
+ * ones. */
+static void delGenericCommand(client *c, int lazy) {
     int deleted = 0, j;
     int expired = 0;
 
@@ -321,7 +880,8 @@ void delCommand(client *c) {
         fetchInternalDbByKey(c, c->argv[j]);
         lockDbWrite(c->db);
         expired += expireIfNeeded(c->db,c->argv[j]);
-        if (dbDelete(c->db,c->argv[j])) {
+        if (lazy ? dbAsyncDelete(c->db,c->argv[j]) :
+                   dbSyncDelete(c->db,c->argv[j])) {
             signalModifiedKey(c->db,c->argv[j]);
             notifyKeyspaceEvent(NOTIFY_GENERIC,
                 "del",c->argv[j],c->db->id);
@@ -337,6 +897,14 @@ void delCommand(client *c) {
     }
 }
 
+void delCommand(client *c) {
+    delGenericCommand(c,0);
+}
+
+void unlinkCommand(client *c) {
+    delGenericCommand(c,1);
+}
+
 /* EXISTS key1 key2 ... key_N.
  * Return value is the number of keys existing. */
 void existsCommand(client *c) {
@@ -447,6 +1015,8 @@ void keysCommand(client *c) {
         }
         dictReleaseIterator(di);
         unlockDb(c->db);
+        /* The DELs of the expired keys are numbered with this db. */
+        aofCallDone(c->vel);
     }
     setDeferredMultiBulkLength(c,replylen,numkeys);
 }
@@ -938,23 +1508,167 @@ void moveCommand(client *c) {
 
 /*-----------------------------------------------------------------------------
  * Expires API
+ *
+ * The expire of a key is kept in a dbKeyExpire in front of the key itself,
+ * so the lookup of a key finds its expire too. The first expire set on a
+ * key moves it to a copy with the field, see dbKeyDupWithExpire().
+ *
+ * Just to find the keys to expire and to evict, db->volatile_keys has the
+ * keys with an expire set, every one knowing its position, so a key is
+ * added and removed in O(1) and a random one is sampled in O(1). With the
+ * expire index the array has the timers of the keys instead.
  *----------------------------------------------------------------------------*/
 
+static size_t dbKeyExpireAllocSize(size_t len) {
+    return sizeof(dbKeyExpire)+(len < 256 ? sizeof(struct sdshdr8) :
+        sizeof(struct sdshdr32))+len+1;
+}
+
+/* Copy a key of the keyspace in a key with the expire field. */
+static sds dbKeyDupWithExpire(sds key) {
+    size_t len = sdslen(key), size = dbKeyExpireAllocSize(len);
+    dbKeyExpire *ke;
+    sds s;
+
+    ke = size <= SLAB_MAX_SIZE ? slabAlloc(size) : dalloc(size);
+    if (ke == NULL) return NULL;
+    ke->when = -1;
+    ke->idx = 0;
+    if (len < 256) {
+        struct sdshdr8 *sh = (struct sdshdr8*)(ke+1);
+
+        sh->len = sh->alloc = (uint8_t)len;
+        sh->flags = SDS_TYPE_8|DB_KEY_EXPIRE;
+        s = sh->buf;
+    } else {
+        struct sdshdr32 *sh = (struct sdshdr32*)(ke+1);
+
+        sh->len = sh->alloc = (uint32_t)len;
+        sh->flags = SDS_TYPE_32|DB_KEY_EXPIRE;
+        s = sh->buf;
+    }
+    memcpy(s,key,len);
+    s[len] = '\0';
+    return s;
+}
+
+static void dbKeyFree(sds key) {
+    if (key[-1]&DB_KEY_EXPIRE) {
+        void *ptr = dbKeyExpireOf(key);
+
+        if (dbKeyExpireAllocSize(sdslen(key)) <= SLAB_MAX_SIZE)
+            slabFree(ptr);
+        else
+            dfree(ptr);
+        return;
+    }
+    slabSdsFree(key);
+}
+
+/* The key of an element of db->volatile_keys. */
+static sds dbVolatileKeyOf(redisDb *db, void *elem) {
+    return db->expire_index ? ((timeWheelNode*)elem)->data : elem;
+}
+
+static void dbVolatileSet(redisDb *db, sds key, long long when) {
+    dbKeyExpire *ke = dbKeyExpireOf(key);
+    void **elem;
+
+    if (ke->when != -1) {
+        if (db->expire_index) {
+            elem = darray_get(&db->volatile_keys,ke->idx);
+            timeWheelUpdate(db->expire_index,*elem,when);
+        }
+        ke->when = when;
+        return;
+    }
+
+    ke->idx = darray_n(&db->volatile_keys);
+    elem = darray_push(&db->volatile_keys);
+    *elem = db->expire_index ?
+        (void*)timeWheelAdd(db->expire_index,when,key) : key;
+    ke->when = when;
+}
+
+/* Take the last key of the array in the place of the removed one. */
+static void dbVolatileRemove(redisDb *db, sds key) {
+    dbKeyExpire *ke = dbKeyExpireOf(key);
+    void **elem, **last;
+
+    elem = darray_get(&db->volatile_keys,ke->idx);
+    if (db->expire_index) timeWheelDelete(db->expire_index,*elem);
+    last = darray_pop(&db->volatile_keys);
+    if (elem != last) {
+        *elem = *last;
+        dbKeyExpireOf(dbVolatileKeyOf(db,*elem))->idx = ke->idx;
+    }
+    ke->when = -1;
+}
+
+/* Give back the memory of db->volatile_keys if it is mostly unused, after
+ * a flush or when many expires are gone. */
+void dbResizeExpires(redisDb *db) {
+    darray *a = &db->volatile_keys;
+    unsigned long long nalloc;
+    void *elem;
+
+    if (a->nalloc <= DB_VOLATILE_KEYS_MIN || a->nelem >= a->nalloc/4) return;
+
+    nalloc = a->nelem*2;
+    if (nalloc < DB_VOLATILE_KEYS_MIN) nalloc = DB_VOLATILE_KEYS_MIN;
+    elem = drealloc(a->elem,(size_t)nalloc*a->size);
+    if (elem == NULL) return;
+    a->elem = elem;
+    a->nalloc = nalloc;
+}
+
+/* A random key with an expire set, or NULL if there are none. */
+sds dbRandomVolatileKey(redisDb *db) {
+    unsigned long long n = darray_n(&db->volatile_keys);
+
+    if (n == 0) return NULL;
+    return dbVolatileKeyOf(db,
+        *(void**)darray_get(&db->volatile_keys,(unsigned long long)random()%n));
+}
+
 int removeExpire(redisDb *db, robj *key) {
+    dictEntry *de;
+    sds k;
+
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    de = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    aofRewriteTouchKey(db,key);
+    k = dictGetKey(de);
+    if (dbKeyGetExpire(k) == -1) return 0;
+    dbVolatileRemove(db,k);
+    return 1;
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *kde;
+    sds k, copy;
 
-    /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictReplaceRaw(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    aofRewriteTouchKey(db,key);
+    k = dictGetKey(kde);
+    if (when == -1) {
+        if (dbKeyGetExpire(k) != -1) dbVolatileRemove(db,k);
+        return;
+    }
+
+    /* Move the key to a copy with room for the expire. No expire was set
+     * on it, so nothing else points to it. */
+    if (!(k[-1]&DB_KEY_EXPIRE)) {
+        copy = dbKeyDupWithExpire(k);
+        serverAssertWithInfo(NULL,key,copy != NULL);
+        dictSetKey(db->dict,kde,copy);
+        dbKeyFree(k);
+        k = copy;
+    }
+    dbVolatileSet(db,k,when);
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
@@ -963,13 +1677,10 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (dbExpiresSize(db) == 0 ||
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    return dbKeyGetExpire(dictGetKey(de));
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -983,17 +1694,12 @@ long long getExpire(redisDb *db, robj *key) {
 void propagateExpire(redisDb *db, robj *key) {
     robj *argv[2];
 
+    /* The command is copied in the record, and the shared objects are
+     * used by all the threads, so the refcounts are not touched. */
     argv[0] = shared.del;
     argv[1] = key;
-    incrRefCount(argv[0]);
-    incrRefCount(argv[1]);
-
-    if (server.aof_state != AOF_OFF)
-        feedAppendOnlyFile(server.delCommand,db->id,argv,2);
-    replicationFeedSlaves(repl.slaves,db->id,argv,2);
 
-    decrRefCount(argv[0]);
-    decrRefCount(argv[1]);
+    feedAppendOnlyFile(server.delCommand,db->id,argv,2);
 }
 
 /* Check if the key exists in the db and had expired */
@@ -1009,7 +1715,11 @@ int checkIfExpired(redisDb *db, robj *key) {
 }
 
 int expireIfNeeded(redisDb *db, robj *key) {
-    long long when = getExpire(db,key);
+    return expireIfNeededAt(db,key,getExpire(db,key));
+}
+
+/* Like expireIfNeeded() for a key whose expire time was already found. */
+static int expireIfNeededAt(redisDb *db, robj *key, long long when) {
     long long now;
 
     if (when < 0) return 0; /* No expire for this key */
@@ -1037,7 +1747,7 @@ int expireIfNeeded(redisDb *db, robj *key) {
     if (now <= when) return 0;
 
     /* Delete the key */
-    //propagateExpire(db,key);
+    propagateExpire(db,key);
     notifyKeyspaceEvent(NOTIFY_EXPIRED,
         "expired",key,db->id);
     return dbDelete(db,key);
@@ -1358,8 +2068,14 @@ int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkey
     return keys;
 }
 
+/* Return the idx of the internal db in server.dbs the key belongs to. */
+int getInternalDbIdxByKey(client *c, robj *key) {
+    return (int)((hash_crc16(key->ptr,stringObjectLen(key))&0x3FFF)%(uint32_t)server.dbinum)+
+        c->dictid*server.dbinum;
+}
+
 int fetchInternalDbByKey(client *c, robj *key) {
-    c->db = darray_get(&server.dbs, (hash_crc16(key->ptr,stringObjectLen(key))&0x3FFF)%server.dbinum+c->dictid*server.dbinum);
+    c->db = darray_get(&server.dbs, (uint32_t)getInternalDbIdxByKey(c,key));
     return VR_OK;
 }
 
@@ -1375,10 +2091,14 @@ void tryResizeHashTablesForDb(int dbid) {
 
     db = darray_get(&server.dbs, dbid);
     lockDbWrite(db);
+    /* An AOF rewrite is scanning the keys, see aofRewriteStep(). */
+    if (db->dict->iterators > 0) {
+        unlockDb(db);
+        return;
+    }
     if (htNeedsResize(db->dict))
         dictResize(db->dict);
-    if (htNeedsResize(db->expires))
-        dictResize(db->expires);
+    dbResizeExpires(db);
     unlockDb(db);
 }
 
@@ -1396,22 +2116,97 @@ int incrementallyRehashForDb(int dbid) {
     lockDbWrite(db);
     
     /* Keys dictionary */
-    if (dictIsRehashing(db->dict)) {
+    if (dictIsRehashing(db->dict) && db->dict->iterators == 0) {
         dictRehashMilliseconds(db->dict,1);
         unlockDb(db);
         return 1; /* already used our millisecond for this loop... */
     }
-    /* Expires */
-    if (dictIsRehashing(db->expires)) {
-        dictRehashMilliseconds(db->expires,1);
-        unlockDb(db);
-        return 1; /* already used our millisecond for this loop... */
-    }
-
     unlockDb(db);
     return 0;
 }
 
+/* Make the next table of the keyspace of a db about to grow, see
+ * dictGrowthSize(). The table is allocated and its memory touched out of
+ * the db lock, so the worker adding the key that makes the keyspace grow
+ * just takes it. Only done for the big tables, as the smaller ones are
+ * quick to make anyway. */
+void prepareHashTablesForDb(int dbid) {
+    redisDb *db;
+    unsigned long size;
+    void *table;
+    int retval;
+
+    /* Just look under the read lock, most of the times there is nothing
+     * to do and the writers and the optimistic readers are not stopped. */
+    db = darray_get(&server.dbs, (uint32_t)dbid);
+    lockDbRead(db);
+    size = dictGrowthSize(db->dict);
+    unlockDb(db);
+    if (size < DB_PREPARE_TABLE_MIN_SIZE) return;
+
+    /* One backend at a time makes the table of a db. */
+    if (!db_atomic_cas(&db->preparing_table,0,1)) return;
+    table = dictCreateTable(db->dict,size);
+
+    lockDbWrite(db);
+    retval = table != NULL ? dictSetSpareTable(db->dict,table,size) : DICT_ERR;
+    unlockDb(db);
+    db_atomic_store(&db->preparing_table,0);
+    if (retval != DICT_OK && table != NULL) dictReleaseTable(table);
+}
+
+static void activeExpireIndexProc(void *privdata, timeWheelNode *node) {
+    redisDb *db = privdata;
+    sds key = node->data;
+    robj *keyobj = createStringObject(key,sdslen(key));
+
+    /* Deleting the key deletes its timer too. */
+    propagateExpire(db,keyobj);
+    dbDelete(db,keyobj);
+    freeObject(keyobj);
+}
+
+/* Expire the keys due in the expire index of every db, no more than
+ * ACTIVE_EXPIRE_CYCLE_INDEX_BATCH of them for every time the db is
+ * locked, until 'timelimit' microseconds from 'start' are gone. Only the
+ * keys due are looked at, so a db with nothing to expire costs just the
+ * lock, and the next cycle goes on from the db where this one stopped. */
+static void activeExpireCycleIndex(vr_backend *backend, long long start,
+                                   long long timelimit) {
+    long long expired_total = 0;
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = darray_get(&server.dbs,
+            backend->current_db%(unsigned int)server.dbnum);
+        unsigned long expired;
+        long long lag;
+
+        /* Move on only when the db is done, if the time is over in the
+         * middle the next cycle starts again from it. */
+        do {
+            lockDbWrite(db);
+            expired = timeWheelExpire(db->expire_index,vr_msec_now(),
+                ACTIVE_EXPIRE_CYCLE_INDEX_BATCH,activeExpireIndexProc,db,&lag);
+            db->expire_lag = lag;
+            unlockDb(db);
+            aofCallDone(&backend->vel);
+            expired_total += (long long)expired;
+
+            if (vr_usec_now()-start > timelimit) {
+                backend->timelimit_exit = 1;
+                goto done;
+            }
+        } while (expired == ACTIVE_EXPIRE_CYCLE_INDEX_BATCH);
+        backend->current_db++;
+    }
+
+done:
+    if (expired_total > 0) {
+        update_stats_add(backend->vel.stats, expiredkeys, expired_total);
+    }
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
@@ -1424,6 +2219,9 @@ int incrementallyRehashForDb(int dbid) {
  * true, so there is more work to do, and we do it more incrementally from
  * the beforeSleep() function of the event loop.
  *
+ * With the expire index (active-expire-index yes) the keys due are taken
+ * from the index instead, see activeExpireCycleIndex().
+ *
  * Expire cycle type:
  *
  * If type is ACTIVE_EXPIRE_CYCLE_FAST the function will try to run a
@@ -1470,6 +2268,11 @@ void activeExpireCycle(vr_backend *backend, int type) {
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         timelimit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION; /* in microseconds. */
 
+    if (server.active_expire_index) {
+        activeExpireCycleIndex(backend,start,timelimit);
+        return;
+    }
+
     for (j = 0; j < dbs_per_call; j++) {
         int expired;
         redisDb *db = darray_get(&server.dbs, backend->current_db%server.dbnum);
@@ -1483,23 +2286,16 @@ void activeExpireCycle(vr_backend *backend, int type) {
         /* Continue to expire if at the end of the cycle more than 25%
          * of the keys were expired. */
         do {
-            unsigned long num, slots;
+            unsigned long num;
             long long now, ttl_sum;
             int ttl_samples;
             /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
+            if ((num = dbExpiresSize(db)) == 0) {
                 db->avg_ttl = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
             now = vr_msec_now();
 
-            /* When there are less than 1% filled slots getting random
-             * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
             /* The main collection cycle. Sample random keys among keys
              * with an expire set, checking for expired ones. */
             expired = 0;
@@ -1510,12 +2306,12 @@ void activeExpireCycle(vr_backend *backend, int type) {
                 num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
 
             while (num--) {
-                dictEntry *de;
+                sds key;
                 long long ttl;
 
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                ttl = dictGetSignedIntegerVal(de)-now;
-                if (activeExpireCycleTryExpire(db,de,now)) expired++;
+                if ((key = dbRandomVolatileKey(db)) == NULL) break;
+                ttl = dbKeyGetExpire(key)-now;
+                if (activeExpireCycleTryExpire(db,key,now)) expired++;
                 if (ttl > 0) {
                     /* We want the average TTL of keys yet not expired. */
                     ttl_sum += ttl;
@@ -1548,6 +2344,7 @@ void activeExpireCycle(vr_backend *backend, int type) {
             }
             if (backend->timelimit_exit) {
                 unlockDb(db);
+                aofCallDone(&backend->vel);
 
                 if (expired_total > 0) {
                     update_stats_add(backend->vel.stats, expiredkeys, expired_total);
@@ -1558,6 +2355,7 @@ void activeExpireCycle(vr_backend *backend, int type) {
              * found expired in the current DB. */
         } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
         unlockDb(db);
+        aofCallDone(&backend->vel);
     }
 
     if (expired_total > 0) {
@@ -1565,11 +2363,11 @@ void activeExpireCycle(vr_backend *backend, int type) {
     }
 }
 
-int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+int activeExpireCycleTryExpire(redisDb *db, sds key, long long now) {
+    long long t = dbKeyGetExpire(key);
     if (now > t) {
-        sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
+        propagateExpire(db,keyobj);
         dbDelete(db,keyobj);
         freeObject(keyobj);
         return 1;
@@ -1615,6 +2413,15 @@ void databasesCron(vr_backend *backend) {
                 }
             }
         }
+
+        /* Make the next tables of the keyspaces about to grow */
+        if (server.keyspace_table_prealloc) {
+            for (j = 0; j < dbs_per_call; j++) {
+                prepareHashTablesForDb((int)(backend->prepare_db%
+                    (unsigned int)server.dbnum));
+                backend->prepare_db++;
+            }
+        }
     }
 }
 
@@ -14,12 +14,36 @@ struct evictionPoolEntry {
     sds key;                    /* Key name. */
 };
 
+/* Reader slot used by the optimistic read mode. Every worker thread owns
+ * one slot per db, padded to a cache line so readers running on different
+ * workers never write to the same line. */
+#define DB_READER_SLOT_SIZE 64
+typedef struct dbReaderSlot {
+    int active;                 /* Non zero while the owner is reading */
+    char pad[DB_READER_SLOT_SIZE-sizeof(int)];
+} dbReaderSlot;
+
+/* A key of the keyspace with an expire set carries it in front of its sds
+ * header, flagged by DB_KEY_EXPIRE in the sds flags, so the expire is read
+ * from the memory the lookup already touched to compare the key. Once
+ * there the field stays with the key, 'when' is -1 while the key has no
+ * expire. The 'idx' is the position of the key in db->volatile_keys. */
+typedef struct dbKeyExpire {
+    long long when;             /* Unix time in milliseconds, or -1 */
+    unsigned long long idx;     /* Position in db->volatile_keys */
+} dbKeyExpire;
+
+#define DB_KEY_EXPIRE (1<<SDS_TYPE_BITS)    /* Flag in the sds flags */
+
 /* Vire database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
-    dict *expires;              /* Timeout of keys with a timeout set */
+    darray volatile_keys;       /* Keys with a timeout set, or their timers */
+    timeWheel *expire_index;    /* Keys with a timeout by time, or NULL */
+    long long expire_lag;       /* How late the last expired keys were, ms */
+    int preparing_table;        /* A backend makes the next keyspace table */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP) */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
@@ -28,18 +52,51 @@ typedef struct redisDb {
     long long avg_ttl;          /* Average TTL, just for stats */
 
     pthread_rwlock_t rwl;       /* read write lock */
+
+    /* Optimistic read mode, see lockDbRead(). */
+    unsigned long long seq;     /* Odd while a writer is inside */
+    int nreaders;               /* Number of reader slots */
+    dbReaderSlot *readers;      /* Reader slots, NULL if mode is disabled */
+
+    struct aofRewriteDb *aof_rewrite;   /* AOF rewrite state, NULL if none */
 } redisDb;
 
+/* The keys with a timeout set of the db. */
+#define dbExpiresSize(_db) ((unsigned long)darray_n(&(_db)->volatile_keys))
+
+/* The keys with the expire field are made with the sds header of 8 or 32
+ * bits, see dbKeyDupWithExpire(). */
+static inline dbKeyExpire *dbKeyExpireOf(sds key) {
+    size_t hdrlen = (key[-1]&SDS_TYPE_MASK) == SDS_TYPE_8 ?
+        sizeof(struct sdshdr8) : sizeof(struct sdshdr32);
+
+    return (dbKeyExpire*)(key-hdrlen-sizeof(dbKeyExpire));
+}
+
+/* The expire time of a key of the keyspace, or -1 if it has none. */
+static inline long long dbKeyGetExpire(sds key) {
+    return (key[-1]&DB_KEY_EXPIRE) ? dbKeyExpireOf(key)->when : -1;
+}
+
 extern dictType dbDictType;
-extern dictType keyptrDictType;
 extern dictType keylistDictType;
 
 int redisDbInit(redisDb *db);
 int redisDbDeinit(redisDb *db);
+int redisDbOptimisticReadInit(redisDb *db, int readers);
+
+void dbReaderSlotSet(int slot);
+void dbFastReadBegin(void);
+void dbFastReadEnd(void);
 
 int lockDbRead(redisDb *db);
 int lockDbWrite(redisDb *db);
 int unlockDb(redisDb *db);
+void dbLockBatchBegin(void);
+void dbLockBatchEnd(void);
+void dbLockBatchRelease(void);
+int dbLockCommand(struct client *c);
+void dbUnlockCommand(void);
 
 robj *lookupKey(redisDb *db, robj *key);
 robj *lookupKeyRead(redisDb *db, robj *key);
@@ -52,14 +109,19 @@ void setKey(redisDb *db, robj *key, robj *val, int *expired);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
+int dbSyncDelete(redisDb *db, robj *key);
+int dbAsyncDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 long long emptyDb(void(callback)(void*));
+void dbResizeExpires(redisDb *db);
+sds dbRandomVolatileKey(redisDb *db);
 int selectDb(struct client *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
 void flushdbCommand(struct client *c);
 void flushallCommand(struct client *c);
 void delCommand(struct client *c);
+void unlinkCommand(struct client *c);
 void existsCommand(struct client *c);
 void selectCommand(struct client *c);
 void randomkeyCommand(struct client *c);
@@ -99,13 +161,15 @@ int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
+int getInternalDbIdxByKey(struct client *c, robj *key);
 int fetchInternalDbByKey(struct client *c, robj *key);
 int fetchInternalDbById(struct client *c, int idx);
 
 void tryResizeHashTablesForDb(int dbid);
 int incrementallyRehashForDb(int dbid);
+void prepareHashTablesForDb(int dbid);
 void activeExpireCycle(vr_backend *backend, int type);
-int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now);
+int activeExpireCycleTryExpire(redisDb *db, sds key, long long now);
 void databasesCron(vr_backend *backend);
 
 #endif
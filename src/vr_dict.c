@@ -5,6 +5,10 @@
 #include <limits.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <vr_core.h>
 
@@ -25,6 +29,9 @@ static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static int _dictKeyIndex(dict *ht, const void *key);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static void _dictReset(dictht *ht);
+static void _dictRehashStep(dict *d);
+long long dictFingerprint(dict *d);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -113,6 +120,445 @@ unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return hash;
 }
 
+/* ------------------------- open addressing tables ------------------------- */
+
+/* A dict created by dictCreateOpen() keeps the entries in the slots of its
+ * tables instead of chaining them, swiss table style. The slots are in
+ * groups of DICT_GROUP_SLOTS with a control byte per slot, and a key is
+ * looked for from its home group, the one indexed by the low bits of its
+ * hash, on to the next groups. A group is 256 bytes, 15 slots and 16
+ * control bytes with one unused, so the tables are a power of two in size
+ * and are not rounded up by the allocator. The control byte of a full slot
+ * holds 7 high bits of the hash of its key, so all the slots of a group are
+ * matched at once (with SSE2 where available) and the key is compared just
+ * with the slots of the same bits. The probing stops at the first group with an
+ * empty slot, so a slot deleted in a group that was full is marked deleted
+ * rather than empty.
+ *
+ * This saves the dictEntry allocation and a pointer chase for every key.
+ * The dictEntry pointers handed out point to the slots: they are valid
+ * until the next add, delete or rehashing step, that may move them. */
+
+typedef struct dictSlot {
+    void *key;
+    union {
+        void *val;
+        uint64_t u64;
+        int64_t s64;
+        double d;
+    } v;                        /* Same layout as in dictEntry */
+} dictSlot;
+
+#define DICT_GROUP_SLOTS    15
+
+typedef struct dictGroup {
+    uint8_t ctrl[16];
+    dictSlot slots[DICT_GROUP_SLOTS];
+} dictGroup;
+
+#define DICT_CTRL_EMPTY     0x80
+#define DICT_CTRL_DELETED   0xfe
+#define DICT_GROUP_MASK     ((1U<<DICT_GROUP_SLOTS)-1)
+
+#define dictGroups(ht) ((dictGroup*)(ht)->table)
+#define dictOpenSlot(ht,pos) \
+    (&dictGroups(ht)[(pos)/DICT_GROUP_SLOTS].slots[(pos)%DICT_GROUP_SLOTS])
+#define dictOpenCtrl(ht,pos) \
+    (dictGroups(ht)[(pos)/DICT_GROUP_SLOTS].ctrl[(pos)%DICT_GROUP_SLOTS])
+#define dictCtrlIsFull(c) (((c)&DICT_CTRL_EMPTY) == 0)
+#define dictHashCtrl(h) ((uint8_t)(((h)>>25)&0x7f))
+
+/* At most 7/8 of the slots are full or deleted */
+#define dictOpenMaxLoad(size) ((size)-(size)/8)
+
+/* The table taking the adds */
+#define dictAddTable(d) (dictIsRehashing(d) ? &(d)->ht[1] : &(d)->ht[0])
+
+/* The bucket count of a table, the cursors of dictScan() index buckets */
+#define dictBuckets(d,ht) ((d)->open ? (ht)->sizemask+1 : (ht)->size)
+
+#if defined(__SSE2__)
+/* Bitmask of the slots of the group with the control byte 'c' */
+static inline unsigned int dictGroupMatch(const dictGroup *g, uint8_t c) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)g->ctrl);
+
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl,_mm_set1_epi8((char)c))) & DICT_GROUP_MASK;
+}
+
+/* Bitmask of the slots of the group that are empty or deleted */
+static inline unsigned int dictGroupMatchFree(const dictGroup *g) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)g->ctrl);
+
+    return (unsigned int)_mm_movemask_epi8(ctrl) & DICT_GROUP_MASK;
+}
+#else
+static inline unsigned int dictGroupMatch(const dictGroup *g, uint8_t c) {
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < DICT_GROUP_SLOTS; j++)
+        if (g->ctrl[j] == c) mask |= 1U<<j;
+    return mask;
+}
+
+static inline unsigned int dictGroupMatchFree(const dictGroup *g) {
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < DICT_GROUP_SLOTS; j++)
+        if (!dictCtrlIsFull(g->ctrl[j])) mask |= 1U<<j;
+    return mask;
+}
+#endif
+
+#define dictGroupMatchFull(g) (~dictGroupMatchFree(g)&DICT_GROUP_MASK)
+#define dictGroupHasEmpty(g) (dictGroupMatch(g,DICT_CTRL_EMPTY) != 0)
+
+/* The slots of a table for 'size' elements, a power of two of groups */
+static unsigned long _dictOpenNextPower(unsigned long size)
+{
+    unsigned long i = DICT_GROUP_SLOTS;
+
+    if (size >= LONG_MAX/32) return (LONG_MAX/32+1)/16*DICT_GROUP_SLOTS;
+    size += size/7;
+    while (i < size) i *= 2;
+    return i;
+}
+
+static void _dictOpenAlloc(dictht *ht, unsigned long size)
+{
+    dictGroup *groups;
+    unsigned long idx, count = size/DICT_GROUP_SLOTS;
+
+    groups = dalloc(count*sizeof(dictGroup));
+    for (idx = 0; idx < count; idx++)
+        memset(groups[idx].ctrl,DICT_CTRL_EMPTY,sizeof(groups[idx].ctrl));
+    ht->table = (dictEntry**)groups;
+    ht->size = size;
+    ht->sizemask = count-1;
+    ht->used = 0;
+}
+
+/* Return the position of 'key' in the table, or -1 if it is not there. */
+static long _dictOpenFind(dict *d, dictht *ht, const void *key, unsigned int h)
+{
+    unsigned long idx, probes;
+    uint8_t c = dictHashCtrl(h);
+
+    if (ht->used == 0) return -1;
+    idx = h & ht->sizemask;
+    for (probes = 0; probes <= ht->sizemask; probes++) {
+        dictGroup *g = &dictGroups(ht)[idx];
+        unsigned int match = dictGroupMatch(g,c);
+
+        while (match) {
+            int j = __builtin_ctz(match);
+
+            if (key == g->slots[j].key ||
+                dictCompareKeys(d, key, g->slots[j].key))
+                return (long)(idx*DICT_GROUP_SLOTS+(unsigned int)j);
+            match &= match-1;
+        }
+        if (dictGroupHasEmpty(g)) break;
+        idx = (idx+1) & ht->sizemask;
+    }
+    return -1;
+}
+
+/* Take the first free slot from the home group of the hash 'h' on, for
+ * a key not in the table. There is one, as the table is never full. */
+static dictSlot *_dictOpenInsert(dict *d, dictht *ht, unsigned int h)
+{
+    unsigned long idx = h & ht->sizemask;
+
+    while (1) {
+        dictGroup *g = &dictGroups(ht)[idx];
+        unsigned int avail = dictGroupMatchFree(g);
+
+        if (avail) {
+            int j = __builtin_ctz(avail);
+
+            if (g->ctrl[j] == DICT_CTRL_DELETED) d->deleted--;
+            g->ctrl[j] = dictHashCtrl(h);
+            ht->used++;
+            return &g->slots[j];
+        }
+        idx = (idx+1) & ht->sizemask;
+    }
+}
+
+/* Free the slot at 'pos'. A probing may have gone past its group only if
+ * the group has no empty slot, then the slot is just marked deleted. */
+static void _dictOpenRemove(dict *d, dictht *ht, long pos)
+{
+    dictGroup *g = &dictGroups(ht)[pos/DICT_GROUP_SLOTS];
+
+    if (dictGroupHasEmpty(g)) {
+        g->ctrl[pos%DICT_GROUP_SLOTS] = DICT_CTRL_EMPTY;
+    } else {
+        g->ctrl[pos%DICT_GROUP_SLOTS] = DICT_CTRL_DELETED;
+        if (ht == dictAddTable(d)) d->deleted++;
+    }
+    ht->used--;
+}
+
+/* dictRehash() moving a group of slots at every step. */
+static int _dictOpenRehash(dict *d, int n)
+{
+    int empty_visits = n*10; /* Max number of empty groups to visit. */
+    dictht *t0 = &d->ht[0], *t1 = &d->ht[1];
+
+    while(n-- && t0->used != 0) {
+        dictGroup *g;
+        unsigned int full;
+
+        ASSERT(t0->sizemask >= (unsigned long)d->rehashidx);
+        while ((full = dictGroupMatchFull(
+                &dictGroups(t0)[d->rehashidx])) == 0) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        g = &dictGroups(t0)[d->rehashidx];
+        while (full) {
+            int j = __builtin_ctz(full);
+            dictSlot *slot;
+
+            slot = _dictOpenInsert(d,t1,dictHashKey(d,g->slots[j].key));
+            *slot = g->slots[j];
+            _dictOpenRemove(d,t0,d->rehashidx*DICT_GROUP_SLOTS+j);
+            full &= full-1;
+        }
+        d->rehashidx++;
+    }
+
+    if (t0->used == 0) {
+        dfree(t0->table);
+        d->ht[0] = d->ht[1];
+        _dictReset(&d->ht[1]);
+        d->rehashidx = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* The adds go to ht[1] while rehashing, and it has to take the keys left
+ * in ht[0] too. If it gets too small move it to a table twice as big,
+ * ht[0] is left as it is: the rehashing may be paused, and a dictScan()
+ * emits the same keys from the bigger table. */
+static void _dictOpenGrow(dict *d)
+{
+    dictht n, *t1 = &d->ht[1];
+    unsigned long idx;
+
+    _dictOpenAlloc(&n,t1->size*2);
+    d->deleted = 0;
+    for (idx = 0; idx <= t1->sizemask; idx++) {
+        dictGroup *g = &dictGroups(t1)[idx];
+        unsigned int full = dictGroupMatchFull(g);
+
+        while (full) {
+            int j = __builtin_ctz(full);
+            dictSlot *slot;
+
+            slot = _dictOpenInsert(d,&n,dictHashKey(d,g->slots[j].key));
+            *slot = g->slots[j];
+            full &= full-1;
+        }
+    }
+    dfree(t1->table);
+    *t1 = n;
+}
+
+/* Unlike the chained tables the open addressing ones can't go past their
+ * load, so they are expanded even if dictDisableResize() was called. */
+static int _dictOpenExpandIfNeeded(dict *d)
+{
+    dictht *ht;
+
+    if (dictIsRehashing(d)) {
+        if (dictSize(d)+d->deleted >= dictOpenMaxLoad(d->ht[1].size))
+            _dictOpenGrow(d);
+        return DICT_OK;
+    }
+
+    if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+    ht = &d->ht[0];
+    if (ht->used+d->deleted < dictOpenMaxLoad(ht->size)) return DICT_OK;
+
+    /* Double the table, unless the slots are mostly deleted ones, then
+     * they are rehashed away in a table of the same size or smaller. */
+    return dictExpand(d, (ht->used+1)*2 < ht->size ? (ht->used+1)*2 : ht->size);
+}
+
+static dictEntry *_dictOpenAddRaw(dict *d, void *key)
+{
+    unsigned int h = dictHashKey(d, key);
+    dictSlot *slot;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (_dictOpenFind(d,&d->ht[0],key,h) != -1) return NULL;
+    if (dictIsRehashing(d) && _dictOpenFind(d,&d->ht[1],key,h) != -1)
+        return NULL;
+
+    if (_dictOpenExpandIfNeeded(d) == DICT_ERR) return NULL;
+    slot = _dictOpenInsert(d,dictAddTable(d),h);
+    dictSetKey(d, slot, key);
+    return (dictEntry*)slot;
+}
+
+static int _dictOpenDelete(dict *d, const void *key, int nofree)
+{
+    unsigned int h;
+    int table;
+    long pos;
+
+    if (d->ht[0].size == 0) return DICT_ERR;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+
+        if ((pos = _dictOpenFind(d,ht,key,h)) != -1) {
+            dictSlot *slot = dictOpenSlot(ht,pos);
+
+            if (!nofree) {
+                dictFreeKey(d, slot);
+                dictFreeVal(d, slot);
+            }
+            _dictOpenRemove(d,ht,pos);
+            return DICT_OK;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return DICT_ERR; /* not found */
+}
+
+static dictEntry *_dictOpenFindEntry(dict *d, const void *key)
+{
+    unsigned int h = dictHashKey(d, key);
+    int table;
+    long pos;
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+
+        if ((pos = _dictOpenFind(d,ht,key,h)) != -1)
+            return (dictEntry*)dictOpenSlot(ht,pos);
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+static void _dictOpenClear(dict *d, dictht *ht, void(callback)(void *))
+{
+    unsigned long idx;
+
+    for (idx = 0; idx <= ht->sizemask && ht->used > 0; idx++) {
+        dictGroup *g = &dictGroups(ht)[idx];
+        unsigned int full = dictGroupMatchFull(g);
+
+        if (callback && (idx & 4095) == 0) callback(d->privdata);
+
+        while (full) {
+            dictSlot *slot = &g->slots[__builtin_ctz(full)];
+
+            dictFreeKey(d, slot);
+            dictFreeVal(d, slot);
+            ht->used--;
+            full &= full-1;
+        }
+    }
+}
+
+/* dictNext() walking the slots */
+static dictEntry *_dictOpenNext(dictIterator *iter)
+{
+    while (1) {
+        dictht *ht = &iter->d->ht[iter->table];
+
+        if (iter->index == -1 && iter->table == 0) {
+            if (iter->safe)
+                iter->d->iterators++;
+            else
+                iter->fingerprint = dictFingerprint(iter->d);
+        }
+        iter->index++;
+        if (iter->index >= (long) ht->size) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = 0;
+                ht = &iter->d->ht[1];
+            } else {
+                break;
+            }
+        }
+        if (dictCtrlIsFull(dictOpenCtrl(ht,iter->index))) {
+            iter->entry = (dictEntry*)dictOpenSlot(ht,iter->index);
+            return iter->entry;
+        }
+    }
+    iter->entry = NULL;
+    return NULL;
+}
+
+static dictEntry *_dictOpenGetRandomKey(dict *d)
+{
+    dictht *ht;
+    unsigned long h, skip;
+
+    if (dictIsRehashing(d)) {
+        /* No slots are full in ht[0] before rehashidx */
+        skip = (unsigned long)d->rehashidx*DICT_GROUP_SLOTS;
+        do {
+            h = skip + ((unsigned long)random() %
+                        (d->ht[0].size + d->ht[1].size - skip));
+            ht = &d->ht[0];
+            if (h >= d->ht[0].size) {
+                ht = &d->ht[1];
+                h -= d->ht[0].size;
+            }
+        } while(!dictCtrlIsFull(dictOpenCtrl(ht,h)));
+    } else {
+        ht = &d->ht[0];
+        do {
+            h = (unsigned long)random() % ht->size;
+        } while(!dictCtrlIsFull(dictOpenCtrl(ht,h)));
+    }
+    return (dictEntry*)dictOpenSlot(ht,h);
+}
+
+/* dictScan() emitting the bucket 'idx' of an open addressing table, that
+ * is the entries whose home group is 'idx'. They are in the groups from
+ * 'idx' up to the first one with an empty slot. */
+static void _dictOpenScanBucket(dict *d, dictht *t, unsigned long idx,
+                                dictScanFunction *fn, void *privdata)
+{
+    unsigned long gidx = idx;
+    dictGroup *g;
+    int all;
+
+    /* The entries of a group are all at home, unless the probing of some
+     * other keys went past the group before it. */
+    all = dictGroupHasEmpty(&dictGroups(t)[(idx-1) & t->sizemask]);
+    do {
+        unsigned int full;
+
+        g = &dictGroups(t)[gidx];
+        full = dictGroupMatchFull(g);
+        while (full) {
+            dictSlot *slot = &g->slots[__builtin_ctz(full)];
+
+            if (all || (dictHashKey(d,slot->key) & t->sizemask) == idx)
+                fn(privdata, (dictEntry*)slot);
+            full &= full-1;
+        }
+        all = 0;
+        gidx = (gidx+1) & t->sizemask;
+    } while (!dictGroupHasEmpty(g) && gidx != idx);
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -125,6 +571,12 @@ static void _dictReset(dictht *ht)
     ht->used = 0;
 }
 
+static void _dictReleaseSpare(dict *d)
+{
+    if (d->spare.table != NULL) dictReleaseTable(d->spare.table);
+    _dictReset(&d->spare);
+}
+
 /* Create a new hash table */
 dict *dictCreate(dictType *type,
         void *privDataPtr)
@@ -135,6 +587,16 @@ dict *dictCreate(dictType *type,
     return d;
 }
 
+/* Create a new hash table with open addressing tables */
+dict *dictCreateOpen(dictType *type,
+        void *privDataPtr)
+{
+    dict *d = dictCreate(type,privDataPtr);
+
+    d->open = 1;
+    return d;
+}
+
 /* Initialize the hash table */
 int _dictInit(dict *d, dictType *type,
         void *privDataPtr)
@@ -145,6 +607,9 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->open = 0;
+    d->deleted = 0;
+    _dictReset(&d->spare);
     return DICT_OK;
 }
 
@@ -165,21 +630,35 @@ int dictResize(dict *d)
 int dictExpand(dict *d, unsigned long size)
 {
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize = d->open ? _dictOpenNextPower(size) :
+                                       _dictNextPower(size);
 
     /* the size is invalid if it is smaller than the number of
      * elements already inside the hash table */
     if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    /* Rehashing to the same table size is not useful. */
-    if (realsize == d->ht[0].size) return DICT_ERR;
+    /* Rehashing to the same table size is not useful, but to drop the
+     * deleted slots of an open addressing table. */
+    if (realsize == d->ht[0].size && (!d->open || d->deleted == 0))
+        return DICT_ERR;
 
-    /* Allocate the new hash table and initialize all pointers to NULL */
-    n.size = realsize;
-    n.sizemask = realsize-1;
-    n.table = dcalloc(realsize, sizeof(dictEntry*));
-    n.used = 0;
+    /* Take the table made ahead for this growth if there is one, else
+     * allocate the new hash table and initialize all pointers to NULL */
+    if (d->spare.table != NULL && d->spare.size == realsize) {
+        n = d->spare;
+        _dictReset(&d->spare);
+    } else if (d->open) {
+        _dictOpenAlloc(&n, realsize);
+    } else {
+        n.size = realsize;
+        n.sizemask = realsize-1;
+        n.table = dcalloc(realsize, sizeof(dictEntry*));
+        n.used = 0;
+    }
+    /* A table made for another size is not the next growth anymore */
+    _dictReleaseSpare(d);
+    d->deleted = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -206,6 +685,7 @@ int dictExpand(dict *d, unsigned long size)
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
+    if (d->open) return _dictOpenRehash(d,n);
 
     while(n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
@@ -248,7 +728,7 @@ int dictRehash(dict *d, int n) {
     return 1;
 }
 
-long long timeInMilliseconds(void) {
+static long long timeInMilliseconds(void) {
     struct timeval tv;
 
     gettimeofday(&tv,NULL);
@@ -310,6 +790,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
     dictEntry *entry;
     dictht *ht;
 
+    if (d->open) return _dictOpenAddRaw(d,key);
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
@@ -322,7 +803,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = dalloc(sizeof(*entry));
+    entry = slabAlloc(sizeof(*entry));
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
@@ -351,7 +832,7 @@ int dictReplace(dict *d, void *key, void *val)
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    auxentry = *entry;
+    auxentry.v = entry->v; /* Slots have no 'next' */
     dictSetVal(d, entry, val);
     dictFreeVal(d, &auxentry);
     return 0;
@@ -376,6 +857,7 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
     dictEntry *he, *prevHe;
     int table;
 
+    if (d->open) return _dictOpenDelete(d,key,nofree);
     if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
@@ -395,7 +877,7 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
                 }
-                dfree(he);
+                slabFree(he);
                 d->ht[table].used--;
                 return DICT_OK;
             }
@@ -416,23 +898,27 @@ int dictDeleteNoFree(dict *ht, const void *key) {
 }
 
 /* Destroy an entire dictionary */
-int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
+static int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
 
     /* Free all the elements */
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
-        dictEntry *he, *nextHe;
-
-        if (callback && (i & 65535) == 0) callback(d->privdata);
-
-        if ((he = ht->table[i]) == NULL) continue;
-        while(he) {
-            nextHe = he->next;
-            dictFreeKey(d, he);
-            dictFreeVal(d, he);
-            dfree(he);
-            ht->used--;
-            he = nextHe;
+    if (d->open) {
+        _dictOpenClear(d,ht,callback);
+    } else {
+        for (i = 0; i < ht->size && ht->used > 0; i++) {
+            dictEntry *he, *nextHe;
+
+            if (callback && (i & 65535) == 0) callback(d->privdata);
+
+            if ((he = ht->table[i]) == NULL) continue;
+            while(he) {
+                nextHe = he->next;
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                slabFree(he);
+                ht->used--;
+                he = nextHe;
+            }
         }
     }
     /* Free the table and the allocated cache structure */
@@ -447,6 +933,7 @@ void dictRelease(dict *d)
 {
     _dictClear(d,&d->ht[0],NULL);
     _dictClear(d,&d->ht[1],NULL);
+    _dictReleaseSpare(d);
     dfree(d);
 }
 
@@ -457,6 +944,7 @@ dictEntry *dictFind(dict *d, const void *key)
 
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     //if (dictIsRehashing(d)) _dictRehashStep(d);  /* we removed this line to avoild rehash the table when read this table, because  we used read-write lock */
+    if (d->open) return _dictOpenFindEntry(d,key);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
@@ -538,6 +1026,7 @@ dictIterator *dictGetSafeIterator(dict *d) {
 
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (iter->d->open) return _dictOpenNext(iter);
     while (1) {
         if (iter->entry == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
@@ -579,6 +1068,7 @@ void dictReleaseIterator(dictIterator *iter)
         } else {
             long long hv = dictFingerprint(iter->d);
             ASSERT(iter->fingerprint == hv);
+            UNUSED(hv);
         }
     }
     dfree(iter);
@@ -594,6 +1084,7 @@ dictEntry *dictGetRandomKey(dict *d)
 
     if (dictSize(d) == 0) return NULL;
     if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (d->open) return _dictOpenGetRandomKey(d);
     if (dictIsRehashing(d)) {
         do {
             /* We are sure there are no elements in indexes from 0
@@ -684,10 +1175,33 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                  * table, there will be no elements in both tables up to
                  * the current rehashing index, so we jump if possible.
                  * (this happens when going from big to small table). */
-                if (i >= d->ht[1].size) i = d->rehashidx;
+                if (i >= dictBuckets(d,&d->ht[1])) i = (unsigned long)d->rehashidx;
+                continue;
+            }
+            /* Out of range for this table. */
+            if (i >= dictBuckets(d,&d->ht[j])) continue;
+            if (d->open) {
+                dictGroup *g = &dictGroups(&d->ht[j])[i];
+                unsigned int full = dictGroupMatchFull(g);
+
+                if (full == 0) {
+                    emptylen++;
+                    if (emptylen >= 5 && emptylen > count) {
+                        i = (unsigned long)random() & maxsizemask;
+                        emptylen = 0;
+                    }
+                    continue;
+                }
+                emptylen = 0;
+                while (full) {
+                    *des = (dictEntry*)&g->slots[__builtin_ctz(full)];
+                    des++;
+                    full &= full-1;
+                    stored++;
+                    if (stored == count) return (unsigned int)stored;
+                }
                 continue;
             }
-            if (i >= d->ht[j].size) continue; /* Out of range for this table. */
             dictEntry *he = d->ht[j].table[i];
 
             /* Count contiguous empty buckets, and jump to other
@@ -728,6 +1242,24 @@ static unsigned long rev(unsigned long v) {
     return v;
 }
 
+/* Emit the entries of the bucket 'idx' of the table */
+static void _dictScanBucket(dict *d, dictht *t, unsigned long idx,
+                            dictScanFunction *fn, void *privdata)
+{
+    const dictEntry *de;
+
+    if (d->open) {
+        _dictOpenScanBucket(d, t, idx, fn, privdata);
+        return;
+    }
+
+    de = t->table[idx];
+    while (de) {
+        fn(privdata, de);
+        de = de->next;
+    }
+}
+
 /* dictScan() is used to iterate over the elements of a dictionary.
  *
  * Iterating works the following way:
@@ -818,7 +1350,6 @@ unsigned long dictScan(dict *d,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
@@ -828,11 +1359,7 @@ unsigned long dictScan(dict *d,
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            fn(privdata, de);
-            de = de->next;
-        }
+        _dictScanBucket(d, t0, v & m0, fn, privdata);
 
     } else {
         t0 = &d->ht[0];
@@ -848,21 +1375,13 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            fn(privdata, de);
-            de = de->next;
-        }
+        _dictScanBucket(d, t0, v & m0, fn, privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            de = t1->table[v & m1];
-            while (de) {
-                fn(privdata, de);
-                de = de->next;
-            }
+            _dictScanBucket(d, t1, v & m1, fn, privdata);
 
             /* Increment bits not covered by the smaller mask */
             v = (((v | m0) + 1) & ~m0) | (v & m0);
@@ -883,6 +1402,116 @@ unsigned long dictScan(dict *d,
     return v;
 }
 
+/* Return 1 if a dictScan() now at cursor 'v' already emitted the bucket of
+ * 'key', 0 if it will emit it later. Valid as long as the dict was not
+ * rehashed nor resized since the scan started, that is if the caller
+ * keeps the rehashing paused while scanning. */
+int dictScanPassed(dict *d, unsigned long v, const void *key)
+{
+    unsigned long m0, h;
+
+    if (d->ht[0].size == 0) return 0;
+
+    m0 = d->ht[0].sizemask;
+    if (dictIsRehashing(d) && d->ht[1].size < d->ht[0].size)
+        m0 = d->ht[1].sizemask;
+
+    /* The cursor visits the buckets of the smaller table in the order
+     * of their reversed index. */
+    h = dictHashKey(d, key) & m0;
+    return rev(h) < rev(v & m0);
+}
+
+/* The next table of a dict can be made ahead, out of the lock of the dict,
+ * so the dictExpand() growing the dict takes it instead of allocating and
+ * zeroing a table twice as big while the dict is locked:
+ *
+ *   size = dictGrowthSize(d);                  with the dict locked
+ *   table = dictCreateTable(d,size);           unlocked
+ *   if (dictSetSpareTable(d,table,size) != DICT_OK)  locked again
+ *       dictReleaseTable(table);
+ */
+
+#define DICT_HUGE_PAGE_SIZE (2*1024*1024)
+
+/* The slots of the table the dict grows to next, if it is 3/4 of the way to
+ * the growth and that table is not made already, otherwise 0. */
+unsigned long dictGrowthSize(dict *d)
+{
+    dictht *ht = &d->ht[0];
+    unsigned long size, max;
+
+    if (dictIsRehashing(d) || ht->size == 0) return 0;
+    if (d->open) {
+        max = dictOpenMaxLoad(ht->size);
+        if (ht->used < max-max/4) return 0;
+        size = _dictOpenNextPower(ht->size);
+    } else {
+        if (ht->used < ht->size-ht->size/4) return 0;
+        size = _dictNextPower(ht->size*2);
+    }
+    return d->spare.size == size ? 0 : size;
+}
+
+/* Allocate a table of 'size' slots for the dict and initialize it, touching
+ * all of its memory so the page faults are taken here. The big ones are
+ * advised to use transparent huge pages. Just the mode of the dict is read,
+ * so the dict doesn't need to be locked. */
+void *dictCreateTable(dict *d, unsigned long size)
+{
+    size_t bytes;
+    void *table;
+
+    if (d->open)
+        bytes = size/DICT_GROUP_SLOTS*sizeof(dictGroup);
+    else
+        bytes = size*sizeof(dictEntry*);
+    table = dalloc(bytes);
+    if (table == NULL) return NULL;
+
+#if defined(MADV_HUGEPAGE)
+    if (bytes >= DICT_HUGE_PAGE_SIZE) {
+        uintptr_t start, end;
+
+        start = ((uintptr_t)table+DICT_HUGE_PAGE_SIZE-1)&
+            ~(uintptr_t)(DICT_HUGE_PAGE_SIZE-1);
+        end = ((uintptr_t)table+bytes)&~(uintptr_t)(DICT_HUGE_PAGE_SIZE-1);
+        if (end > start) madvise((void*)start,end-start,MADV_HUGEPAGE);
+    }
+#endif
+
+    if (d->open) {
+        dictGroup *groups = table;
+        unsigned long idx;
+
+        for (idx = 0; idx < size/DICT_GROUP_SLOTS; idx++)
+            memset(groups[idx].ctrl,DICT_CTRL_EMPTY,sizeof(groups[idx].ctrl));
+    } else {
+        memset(table,0,bytes);
+    }
+    return table;
+}
+
+/* Keep a table made by dictCreateTable() for the next growth of the dict.
+ * Return DICT_ERR if 'size' is not the size of the next growth anymore,
+ * the caller has to release the table then. */
+int dictSetSpareTable(dict *d, void *table, unsigned long size)
+{
+    if (dictGrowthSize(d) != size) return DICT_ERR;
+
+    _dictReleaseSpare(d);
+    d->spare.table = table;
+    d->spare.size = size;
+    d->spare.sizemask = d->open ? size/DICT_GROUP_SLOTS-1 : size-1;
+    d->spare.used = 0;
+    return DICT_OK;
+}
+
+void dictReleaseTable(void *table)
+{
+    dfree(table);
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -953,8 +1582,29 @@ static int _dictKeyIndex(dict *d, const void *key)
 void dictEmpty(dict *d, void(callback)(void*)) {
     _dictClear(d,&d->ht[0],callback);
     _dictClear(d,&d->ht[1],callback);
+    _dictReleaseSpare(d);
     d->rehashidx = -1;
     d->iterators = 0;
+    d->deleted = 0;
+}
+
+/* Move all the entries of the dict to a new dict, returned, leaving the
+ * dict empty as dictEmpty() does, but in constant time. The new dict is
+ * released later with dictRelease(), even by another thread. Return NULL
+ * if out of memory. */
+dict *dictDetach(dict *d) {
+    dict *n = dalloc(sizeof(*n));
+
+    if (n == NULL) return NULL;
+    *n = *d;
+    n->iterators = 0;
+    _dictReset(&d->ht[0]);
+    _dictReset(&d->ht[1]);
+    _dictReset(&d->spare);
+    d->rehashidx = -1;
+    d->iterators = 0;
+    d->deleted = 0;
+    return n;
 }
 
 void dictEnableResize(void) {
@@ -968,7 +1618,7 @@ void dictDisableResize(void) {
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
-size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
+static size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
     unsigned long totchainlen = 0;
     unsigned long clvector[DICT_STATS_VECTLEN];
@@ -1029,16 +1679,80 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     return strlen(buf);
 }
 
+/* The stats of an open addressing table, the probe length of an entry is
+ * how many groups it is past its home group. */
+static size_t _dictOpenGetStatsHt(char *buf, size_t bufsize, dict *d,
+                                  dictht *ht, int tableid) {
+    unsigned long idx, probelen, maxprobelen = 0, totprobelen = 0;
+    unsigned long deleted = 0, fullgroups = 0;
+    unsigned long plvector[DICT_STATS_VECTLEN];
+    size_t l = 0;
+
+    if (ht->used == 0) {
+        return (size_t)snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    /* Compute stats. */
+    for (idx = 0; idx < DICT_STATS_VECTLEN; idx++) plvector[idx] = 0;
+    for (idx = 0; idx <= ht->sizemask; idx++) {
+        dictGroup *g = &dictGroups(ht)[idx];
+        unsigned int full = dictGroupMatchFull(g);
+
+        deleted += (unsigned long)__builtin_popcount(dictGroupMatch(g,DICT_CTRL_DELETED));
+        if (!dictGroupHasEmpty(g)) fullgroups++;
+        while (full) {
+            dictSlot *slot = &g->slots[__builtin_ctz(full)];
+
+            probelen = (idx-dictHashKey(d,slot->key)) & ht->sizemask;
+            plvector[(probelen < DICT_STATS_VECTLEN) ?
+                     probelen : (DICT_STATS_VECTLEN-1)]++;
+            if (probelen > maxprobelen) maxprobelen = probelen;
+            totprobelen += probelen;
+            full &= full-1;
+        }
+    }
+
+    /* Generate human readable stats. */
+    l += (size_t)snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s):\n"
+        " table size: %ld\n"
+        " number of elements: %ld\n"
+        " deleted slots: %ld\n"
+        " groups without empty slots: %ld\n"
+        " max probe length: %ld\n"
+        " avg probe length: %.02f\n"
+        " Probe length distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, deleted, fullgroups, maxprobelen,
+        (float)totprobelen/(float)ht->used);
+
+    for (idx = 0; idx < DICT_STATS_VECTLEN-1; idx++) {
+        if (plvector[idx] == 0) continue;
+        if (l >= bufsize) break;
+        l += (size_t)snprintf(buf+l,bufsize-l,
+            "   %ld: %ld (%.02f%%)\n",
+            idx, plvector[idx], ((float)plvector[idx]/(float)ht->used)*100);
+    }
+
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
 void dictGetStats(char *buf, size_t bufsize, dict *d) {
     size_t l;
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    l = d->open ? _dictOpenGetStatsHt(buf,bufsize,d,&d->ht[0],0) :
+                  _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        if (d->open)
+            _dictOpenGetStatsHt(buf,bufsize,d,&d->ht[1],1);
+        else
+            _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -30,7 +30,9 @@ typedef struct dictType {
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
- * implement incremental rehashing, for the old to the new table. */
+ * implement incremental rehashing, for the old to the new table.
+ * In an open addressing table 'table' points to the groups of slots,
+ * 'size' counts the slots and 'sizemask' masks the group index. */
 typedef struct dictht {
     dictEntry **table;
     unsigned long size;
@@ -44,6 +46,9 @@ typedef struct dict {
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int iterators; /* number of iterators currently running */
+    int open; /* open addressing tables, see dictCreateOpen() */
+    unsigned long deleted; /* deleted slots of the table taking the adds */
+    dictht spare; /* the table of the next growth, see dictSetSpareTable() */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -110,9 +115,12 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictPauseRehashing(d) ((d)->iterators++)
+#define dictResumeRehashing(d) ((d)->iterators--)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
+dict *dictCreateOpen(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key);
@@ -131,9 +139,11 @@ void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
 unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
+unsigned int dictIntHashFunction(unsigned int key);
 unsigned int dictGenHashFunction(const void *key, int len);
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
+dict *dictDetach(dict *d);
 void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
@@ -141,6 +151,11 @@ int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(unsigned int initval);
 unsigned int dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
+int dictScanPassed(dict *d, unsigned long v, const void *key);
+unsigned long dictGrowthSize(dict *d);
+void *dictCreateTable(dict *d, unsigned long size);
+int dictSetSpareTable(dict *d, void *table, unsigned long size);
+void dictReleaseTable(void *table);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
@@ -1,5 +1,8 @@
 #include <vr_core.h>
 
+/* The eventloop run by this thread, NULL for the threads without one. */
+__thread vr_eventloop *current_vel = NULL;
+
 int
 vr_eventloop_init(vr_eventloop *vel, int filelimit)
 {    
@@ -31,10 +34,19 @@ vr_eventloop_init(vr_eventloop *vel, int filelimit)
     vel->bpop_blocked_clients = 0;
     vel->unblocked_clients = NULL;
     vel->clients_waiting_acks = NULL;
+    vel->slaves = NULL;
     vel->pubsub_channels = NULL;
     vel->pubsub_patterns = NULL;
     vel->notify_keyspace_events = 0;
     vel->cstable = NULL;
+    vel->aof_queue = NULL;
+    vel->aof_record = NULL;
+    vel->aof_pending = 0;
+    vel->aof_seq = 0;
+    vel->aof_fed_seq = 0;
+    vel->aof_synced_seq = 0;
+    vel->aof_wake = 0;
+    vel->aof_number_locks = 1;
 
     vel->el = aeCreateEventLoop(filelimit);
     if (vel->el == NULL) {
@@ -77,6 +89,12 @@ vr_eventloop_init(vr_eventloop *vel, int filelimit)
         return VR_ENOMEM;
     }
 
+    vel->slaves = dlistCreate();
+    if (vel->slaves == NULL) {
+        log_error("create list failed: out of memory");
+        return VR_ENOMEM;
+    }
+
     vel->stats = dalloc(sizeof(vr_stats));
     if (vel->stats == NULL) {
         log_error("out of memory");
@@ -136,6 +154,11 @@ vr_eventloop_deinit(vr_eventloop *vel)
         vel->unblocked_clients = NULL;
     }
 
+    if (vel->slaves != NULL) {
+        dlistRelease(vel->slaves);
+        vel->slaves = NULL;
+    }
+
     if (vel->cb != NULL) {
         conn_deinit(vel->cb);
         dfree(vel->cb);
@@ -156,3 +179,10 @@ vr_eventloop_deinit(vr_eventloop *vel)
     conf_cache_deinit(&vel->cc);
 }
 
+/* Bind the eventloop to the calling thread, so the code running without
+ * a client at hand, like lookupKey(), finds the cached clocks and config. */
+void
+vr_eventloop_bind(vr_eventloop *vel)
+{
+    current_vel = vel;
+}
@@ -36,6 +36,7 @@ typedef struct vr_eventloop {
 
     /* Synchronous replication. */
     dlist *clients_waiting_acks;     /* Clients waiting in WAIT command. */
+    dlist *slaves;                   /* Slaves served by this eventloop */
 
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
@@ -45,10 +46,23 @@ typedef struct vr_eventloop {
 
     conf_cache cc; /* Cache the hot config option to improve vire speed. */
 
+    /* Append only file, see feedAppendOnlyFile(). */
+    dmtqueue *aof_queue;        /* Records for the writer, NULL if AOF is off */
+    struct aofRecord *aof_record;   /* Record of the current call */
+    unsigned long long aof_pending; /* Lowest seq of our record, 0 if none */
+    unsigned long long aof_seq;     /* Last seq taken */
+    unsigned long long aof_fed_seq; /* Seq of the last record queued */
+    unsigned long long aof_synced_seq; /* Seq of the last record written */
+    int aof_wake;               /* Records queued since the writer was woken */
+    int aof_number_locks;       /* Number the writes in lockDbWrite(), or when fed */
+
     struct darray *cstable; /* type: commandStats */
 }vr_eventloop;
 
+extern __thread vr_eventloop *current_vel;
+
 int vr_eventloop_init(vr_eventloop *vel, int filelimit);
 void vr_eventloop_deinit(vr_eventloop *vel);
+void vr_eventloop_bind(vr_eventloop *vel);
 
 #endif
@@ -24,6 +24,7 @@ vr_listen_create(sds listen_str)
     vlisten->port = 0;
     memset(&vlisten->info, 0, sizeof(vlisten->info));
     vlisten->sd = -1;
+    vlisten->reuseport = 0;
     
     if (listen_str == '/') {
         uint8_t *q, *start, *perm;
@@ -129,6 +130,10 @@ vr_listen_reuse(vr_listen *p)
     case AF_INET:
     case AF_INET6:
         status = vr_set_reuseaddr(p->sd);
+        if (status < 0 || !p->reuseport) {
+            break;
+        }
+        status = vr_set_reuseport(p->sd);
         break;
 
     case AF_UNIX:
@@ -7,6 +7,7 @@ typedef struct vr_listen {
     mode_t perm;            /* socket permissions */
     struct sockinfo info;   /* listen socket info */
     int sd;                 /* socket descriptor */
+    int reuseport;          /* share the address with other listeners? */
 }vr_listen;
 
 vr_listen *vr_listen_create(sds linten_str);
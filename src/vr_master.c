@@ -12,11 +12,13 @@ master_init(vr_conf *conf)
     uint32_t j;
     sds *host, listen_str;
     vr_listen **vlisten;
-    int threads_num;
+    int threads_num, maxclients, reuseport;
     int filelimit;
 
-    master.cbsul = NULL;
-    pthread_mutex_init(&master.cbsullock, NULL);
+    master.notifier.rfd = -1;
+    master.notifier.wfd = -1;
+    master.cbsul.ring = NULL;
+    master.cbsul.overflow = NULL;
 
     conf_server_get(CONFIG_SOPN_THREADS,&threads_num);
     filelimit = threads_num*2+CONFIG_MIN_RESERVED_FDS;
@@ -25,7 +27,9 @@ master_init(vr_conf *conf)
 
     darray_init(&master.listens,darray_n(&cserver->binds),sizeof(vr_listen*));
 
-    for (j = 0; j < darray_n(&cserver->binds); j ++) {
+    /* With worker-reuseport the workers listen and accept by themselves. */
+    conf_server_get(CONFIG_SOPN_REUSEPORT,&reuseport);
+    for (j = 0; !reuseport && j < darray_n(&cserver->binds); j ++) {
         host = darray_get(&cserver->binds,j);
         listen_str = sdsdup(*host);
         listen_str = sdscatfmt(listen_str, ":%i", cserver->port);
@@ -49,10 +53,16 @@ master_init(vr_conf *conf)
         }
     }
 
-    master.cbsul = dlistCreate();
-    if (master.cbsul == NULL) {
-        log_error("Create list failed: out of memory");
-        return VR_ENOMEM;
+    status = vr_notifier_init(&master.notifier);
+    if (status != VR_OK) {
+        return VR_ERROR;
+    }
+
+    /* Every client may jump between the workers at the same time. */
+    conf_server_get(CONFIG_SOPN_MAXCLIENTS,&maxclients);
+    status = csuq_init(&master.cbsul, maxclients);
+    if (status != VR_OK) {
+        return status;
     }
 
     setup_master();
@@ -67,6 +77,9 @@ master_deinit(void)
     
     vr_eventloop_deinit(&master.vel);
 
+    vr_notifier_deinit(&master.notifier);
+    csuq_deinit(&master.cbsul);
+
     while (darray_n(&master.listens) > 0) {
         vlisten = darray_pop(&master.listens);
         vr_listen_destroy(*vlisten);
@@ -86,31 +99,9 @@ client_accept(aeEventLoop *el, int fd, void *privdata, int mask) {
 }
 
 static void
-cbsul_push(struct connswapunit *su)
-{
-    pthread_mutex_lock(&master.cbsullock);
-    dlistPush(master.cbsul, su);
-    pthread_mutex_unlock(&master.cbsullock);
-}
-
-static struct connswapunit *
-cbsul_pop(void)
-{
-    struct connswapunit *su = NULL;
-
-    pthread_mutex_lock(&master.cbsullock);
-    su = dlistPop(master.cbsul);
-    pthread_mutex_unlock(&master.cbsullock);
-    
-    return su;
-}
-
-void
-dispatch_conn_exist(client *c, int tid)
+dispatch_conn_swap(client *c, int tid, int type)
 {
     struct connswapunit *su = csui_new();
-    char buf[1];
-    vr_worker *worker;
 
     if (su == NULL) {
         freeClient(c);
@@ -119,64 +110,44 @@ dispatch_conn_exist(client *c, int tid)
         return ;
     }
 
+    su->type = type;
     su->num = tid;
     su->data = c;
     
     unlinkClientFromEventloop(c);
 
-    cbsul_push(su);
+    /* Back to master */
+    csuq_push(&master.cbsul, su);
+    vr_notifier_notify(&master.notifier);
+}
 
-    worker = darray_get(&workers, (uint32_t)c->curidx);
+void
+dispatch_conn_exist(client *c, int tid)
+{
+    dispatch_conn_swap(c, tid, CONNSWAP_JUMP);
+}
 
-    /* Back to master */
-    buf[0] = 'b';
-    if (vr_write(worker->socketpairs[1], buf, 1) != 1) {
-        log_error("Notice the worker failed.");
-    }
+/* Move an idle client to the worker 'tid' for good. */
+void
+dispatch_conn_migrate(client *c, int tid)
+{
+    dispatch_conn_swap(c, tid, CONNSWAP_MIGRATE);
 }
 
 static void
 thread_event_process(aeEventLoop *el, int fd, void *privdata, int mask) {
-
-    rstatus_t status;
-    vr_worker *worker = privdata;
-    char buf[1];
-    int idx;
-    client *c;
     struct connswapunit *su;
+    vr_worker *worker;
 
     ASSERT(el == master.vel.el);
-    ASSERT(fd == worker->socketpairs[0]);
+    ASSERT(fd == master.notifier.rfd);
 
-    if (vr_read(fd, buf, 1) != 1) {
-        log_warn("Can't read for worker(id:%d) socketpairs[1](%d)", 
-            worker->vel.thread.id, fd);
-        buf[0] = 'b';
-    }
-    
-    switch (buf[0]) {
-    case 'b':
-        su = cbsul_pop();
-        if (su == NULL) {
-            log_warn("Pop from connection back swap list is null");
-            return;
-        }
-        
-        idx = su->num;
-        su->num = worker->id;
-        worker = darray_get(&workers, (uint32_t)idx);
-        csul_push(worker, su);
+    vr_notifier_consume(&master.notifier);
 
-        /* Jump to the target worker. */
-        buf[0] = 'j';
-        if (vr_write(worker->socketpairs[0], buf, 1) != 1) {
-            log_error("Notice the worker failed.");
-        }
-        break;
-    default:
-        log_error("read error char '%c' for worker(id:%d) socketpairs[0](%d)", 
-            buf[0], worker->vel.thread.id, worker->socketpairs[1]);
-        break;
+    while ((su = csuq_pop(&master.cbsul)) != NULL) {
+        /* Jump or migrate to the target worker. */
+        worker = darray_get(&workers, (uint32_t)su->num);
+        csul_push(worker, su);
     }
 }
 
@@ -186,16 +157,12 @@ setup_master(void)
     rstatus_t status;
     uint32_t j;
     vr_listen **vlisten;
-    vr_worker *worker;
 
-    for (j = 0; j < darray_n(&workers); j ++) {
-        worker = darray_get(&workers, j);
-        status = aeCreateFileEvent(master.vel.el, worker->socketpairs[0], 
-            AE_READABLE, thread_event_process, worker);
-        if (status == AE_ERR) {
-            log_error("Unrecoverable error creating master ipfd file event.");
-            return VR_ERROR;
-        }
+    status = aeCreateFileEvent(master.vel.el, master.notifier.rfd, 
+        AE_READABLE, thread_event_process, NULL);
+    if (status == AE_ERR) {
+        log_error("Unrecoverable error creating master ipfd file event.");
+        return VR_ERROR;
     }
 
     for (j = 0; j < darray_n(&master.listens); j ++) {
@@ -7,8 +7,8 @@ typedef struct vr_master {
     
     struct darray listens;   /* type: vr_listen */
 
-    dlist *cbsul;    /* Connect back swap unit list */
-    pthread_mutex_t cbsullock;   /* swap unit list locker */
+    vr_notifier notifier;   /* Wakes up the master for the queue below */
+    connswapqueue cbsul;    /* Connect back swap unit queue */
 }vr_master;
 
 extern vr_master master;
@@ -17,6 +17,7 @@ int master_init(vr_conf *conf);
 void master_deinit(void);
 
 void dispatch_conn_exist(struct client *c, int tid);
+void dispatch_conn_migrate(struct client *c, int tid);
 
 int master_run(void);
 
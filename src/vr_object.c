@@ -8,13 +8,14 @@
 #endif
 
 robj *createObject(int type, void *ptr) {
-    robj *o = dalloc(sizeof(*o));
+    robj *o = slabAlloc(sizeof(*o));
     o->type = type;
     o->encoding = OBJ_ENCODING_RAW;
     o->ptr = ptr;
     o->constant = 0;
+    o->arena = 0;
     o->refcount = -1;
-    o->lru = 0;
+    o->lru = objectInitialLRU();
     return o;
 }
 
@@ -27,16 +28,16 @@ robj *createRawStringObject(const char *ptr, size_t len) {
 /* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
-robj *createEmbeddedStringObject(const char *ptr, size_t len) {
-    robj *o = dalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+static robj *initEmbeddedStringObject(robj *o, const char *ptr, size_t len) {
     struct sdshdr8 *sh = (void*)(o+1);
 
     o->type = OBJ_STRING;
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->constant = 0;
+    o->arena = 0;
     o->refcount = -1;
-    o->lru = 0;
+    o->lru = objectInitialLRU();
 
     sh->len = len;
     sh->alloc = len;
@@ -50,6 +51,11 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     return o;
 }
 
+robj *createEmbeddedStringObject(const char *ptr, size_t len) {
+    return initEmbeddedStringObject(
+        slabAlloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1),ptr,len);
+}
+
 /* Create a string object with EMBSTR encoding if it is smaller than
  * REIDS_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
  * used.
@@ -64,6 +70,26 @@ robj *createStringObject(const char *ptr, size_t len) {
         return createRawStringObject(ptr,len);
 }
 
+/* Create the same object as createStringObject() for a small string, but
+ * in the 'size' bytes at 'buf', setting 'used' to the bytes it takes.
+ * Return NULL if the string is too long for the EMBSTR encoding or if it
+ * doesn't fit. The object belongs to the buffer: freeObject() leaves it
+ * alone and it's gone when the buffer is reused, what has to outlive
+ * that is duplicated, as the values stored in the keyspace already are. */
+robj *createArenaStringObject(void *buf, size_t size, const char *ptr,
+                              size_t len, size_t *used) {
+    size_t need = sizeof(robj)+sizeof(struct sdshdr8)+len+1;
+    robj *o;
+
+    need = (need+sizeof(void*)-1)&~(sizeof(void*)-1);
+    if (len > OBJ_ENCODING_EMBSTR_SIZE_LIMIT || need > size) return NULL;
+
+    o = initEmbeddedStringObject(buf,ptr,len);
+    o->arena = 1;
+    *used = need;
+    return o;
+}
+
 robj *createStringObjectFromLongLong(long long value) {
     robj *o;
     if (value >= 0 && value < OBJ_SHARED_INTEGERS) {
@@ -288,7 +314,7 @@ void decrRefCount(robj *o) {
         case OBJ_HASH: freeHashObject(o); break;
         default: serverPanic("Unknown object type"); break;
         }
-        dfree(o);
+        slabFree(o);
     } else {
         o->refcount--;
     }
@@ -301,8 +327,60 @@ void decrRefCountVoid(void *o) {
     decrRefCount(o);
 }
 
+/* References to the objects sent by the replies, see shareObject().
+ * The refcount field is otherwise unused, an object with a refcount up to
+ * one has just one owner. */
+#if defined(__ATOMIC_RELAXED)
+#define obj_atomic_load(_ptr) __atomic_load_n(_ptr,__ATOMIC_ACQUIRE)
+#else
+#define obj_atomic_load(_ptr) __sync_add_and_fetch(_ptr,0)
+#endif
+
+/* Set *ptr to 'new' if it is *old, else load it in *old. */
+static int objectRefcountCas(int *ptr, int *old, int new) {
+#if defined(__ATOMIC_RELAXED)
+    return __atomic_compare_exchange_n(ptr,old,new,0,
+        __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE);
+#else
+    int prev = __sync_val_compare_and_swap(ptr,*old,new);
+
+    if (prev == *old) return 1;
+    *old = prev;
+    return 0;
+#endif
+}
+
+/* Add an owner to the object, that is freed by the last freeObject() of
+ * its owners. Used for the values of the keyspace sent by the replies,
+ * it must be called with the db lock held, so the keyspace owns the
+ * object for sure. The owners must not change the object. */
+robj *shareObject(robj *o) {
+    int old = obj_atomic_load(&o->refcount), new;
+
+    do {
+        new = old > 1 ? old+1 : 2;
+    } while (!objectRefcountCas(&o->refcount,&old,new));
+    return o;
+}
+
+/* Return true if other owners share the object, see shareObject(). */
+int objectIsShared(robj *o) {
+    return obj_atomic_load(&o->refcount) > 1;
+}
+
+/* Drop an owner of the object, return 1 if it was the last one. */
+static int objectRelease(robj *o) {
+    int old = obj_atomic_load(&o->refcount);
+
+    while (old > 1) {
+        if (objectRefcountCas(&o->refcount,&old,old-1)) return 0;
+    }
+    return 1;
+}
+
 void freeObject(robj *o) {
-    if (o->constant) return;
+    if (o->constant || o->arena) return;
+    if (!objectRelease(o)) return;
     
     switch(o->type) {
     case OBJ_STRING: freeStringObject(o); break;
@@ -312,7 +390,7 @@ void freeObject(robj *o) {
     case OBJ_HASH: freeHashObject(o); break;
     default: serverPanic("Unknown object type"); break;
     }
-    dfree(o);
+    slabFree(o);
 }
 
 void freeObjectVoid(void *o) {
@@ -382,11 +460,10 @@ robj *tryObjectEncoding(robj *o) {
         /* This object is encodable as a long. Try to use a shared object.
          * Note that we avoid using shared integers when maxmemory is used
          * because every object needs to have a private LRU field for the LRU
-         * algorithm to work well. 
-         * Now we do not support LRU, so just comment it. */
-        if (/*(server.maxmemory == 0 ||
-             (server.maxmemory_policy != MAXMEMORY_VOLATILE_LRU &&
-              server.maxmemory_policy != MAXMEMORY_ALLKEYS_LRU)) && */
+         * and LFU algorithms to work well. */
+        if ((current_vel == NULL || current_vel->cc.maxmemory == 0 ||
+             (!MAXMEMORY_POLICY_LRU(current_vel->cc.maxmemory_policy) &&
+              !MAXMEMORY_POLICY_LFU(current_vel->cc.maxmemory_policy))) &&
             value >= 0 &&
             value < OBJ_SHARED_INTEGERS)
         {
@@ -680,21 +757,132 @@ char *strEncoding(int encoding) {
  * requested, using an approximated LRU algorithm. */
 unsigned long long estimateObjectIdleTime(robj *o) {
     unsigned long long lruclock = LRU_CLOCK();
-    if (lruclock >= o->lru) {
-        return (lruclock - o->lru) * LRU_CLOCK_RESOLUTION;
+    unsigned int lru;
+
+    atomic_get(o->lru,&lru);
+    if (lruclock >= lru) {
+        return (lruclock - lru) * LRU_CLOCK_RESOLUTION;
     } else {
-        return (lruclock + (LRU_CLOCK_MAX - o->lru)) *
+        return (lruclock + (LRU_CLOCK_MAX - lru)) *
                     LRU_CLOCK_RESOLUTION;
     }
 }
 
+/* The maxmemory policy as seen by this thread, the eventloops cache it. */
+int objectMaxmemoryPolicy(void) {
+    int policy;
+
+    if (current_vel != NULL) return current_vel->cc.maxmemory_policy;
+    conf_server_get(CONFIG_SOPN_MAXMEMORYP,&policy);
+    return policy;
+}
+
+/* ----------------------------- LFU ----------------------------------
+ * With the LFU policies the 24 bits of robj->lru are split in two:
+ *
+ *          16 bits      8 bits
+ *     +----------------+--------+
+ *     + Last decr time | LOG_C  |
+ *     +----------------+--------+
+ *
+ * LOG_C is a logarithmic counter of the accesses, it is incremented with
+ * a probability getting lower as it grows (see lfu-log-factor), and it is
+ * decremented once for every lfu-decay-time minutes since the last decrement
+ * time, so the keys that were popular a long time ago lose their score. */
+
+/* Return the current time in minutes, just taking the least significant
+ * 16 bits. The returned time is suitable to be stored as LDT (last decrement
+ * time) for the LFU implementation. */
+unsigned long LFUGetTimeInMinutes(void) {
+    time_t now = current_vel != NULL ? current_vel->unixtime : time(NULL);
+    return (now/60) & 65535;
+}
+
+/* Given an object last decrement time, compute the minimum number of minutes
+ * that elapsed since the last decrement. Handle overflow (ldt greater than
+ * the current 16 bits minutes time) considering the time as wrapping
+ * exactly once. */
+unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+    if (now >= ldt) return now-ldt;
+    return 65535-ldt+now;
+}
+
+/* Logarithmically increment a counter. The greater is the current counter 
+ * value the less likely is that it gets really implemented. Saturate it 
+ * at 255. */
+uint8_t LFULogIncr(uint8_t counter, int lfu_log_factor) {
+    static __thread unsigned int seed = 0;
+    double r, baseval, p;
+
+    if (counter == 255) return 255;
+    if (seed == 0) seed = (unsigned int)(vr_usec_now()^(long long)pthread_self());
+    r = (double)rand_r(&seed)/RAND_MAX;
+    baseval = counter - LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    p = 1.0/(baseval*lfu_log_factor+1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* If the object decrement time is reached, decrement the LFU counter by
+ * one for every lfu_decay_time minutes elapsed, and return the counter. 
+ * The object is not updated, the caller stores the new value if needed. */
+unsigned long LFUDecrAndReturn(robj *o, int lfu_decay_time) {
+    unsigned int lru;
+    unsigned long ldt, counter, num_periods;
+
+    atomic_get(o->lru,&lru);
+    ldt = lru >> 8;
+    counter = lru & 255;
+    num_periods = lfu_decay_time ? 
+        LFUTimeElapsed(ldt) / (unsigned long)lfu_decay_time : 0;
+    if (num_periods)
+        counter = (num_periods > counter) ? 0 : counter - num_periods;
+    return counter;
+}
+
+/* The initial robj->lru of a new object, according to the policy. */
+unsigned int objectInitialLRU(void) {
+    if (MAXMEMORY_POLICY_LFU(objectMaxmemoryPolicy()))
+        return (unsigned int)((LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL);
+    return LRU_CLOCK();
+}
+
+/* Update the access time or the access counter of an object used by
+ * the eviction, called by lookupKey(). The readers of a db update it
+ * concurrently, so it is stored with a relaxed atomic: concurrent accesses
+ * just keep one of the values, as an approximated LRU/LFU allows. */
+void objectUpdateLRU(robj *o) {
+    int policy, lfu_log_factor, lfu_decay_time;
+    unsigned long counter;
+
+    if (current_vel != NULL) {
+        policy = current_vel->cc.maxmemory_policy;
+        lfu_log_factor = current_vel->cc.lfu_log_factor;
+        lfu_decay_time = current_vel->cc.lfu_decay_time;
+    } else {
+        conf_server_get(CONFIG_SOPN_MAXMEMORYP,&policy);
+        conf_server_get(CONFIG_SOPN_LFULOGFACTOR,&lfu_log_factor);
+        conf_server_get(CONFIG_SOPN_LFUDECAYTIME,&lfu_decay_time);
+    }
+
+    if (MAXMEMORY_POLICY_LFU(policy)) {
+        counter = LFUDecrAndReturn(o,lfu_decay_time);
+        counter = LFULogIncr((uint8_t)counter,lfu_log_factor);
+        atomic_set(o->lru,(unsigned int)((LFUGetTimeInMinutes()<<8) | counter));
+    } else {
+        atomic_set(o->lru,LRU_CLOCK());
+    }
+}
+
 /* Return the amount of memory used by the sds string at object->ptr
  * for a string object. */
 size_t getStringObjectSdsUsedMemory(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     switch(o->encoding) {
     case OBJ_ENCODING_RAW: return sdsZmallocSize(o->ptr);
-    case OBJ_ENCODING_EMBSTR: return dmalloc_size(o)-sizeof(robj);
+    case OBJ_ENCODING_EMBSTR: return slabSize(o)-sizeof(robj);
     default: return 0; /* Just integer encoding for now. */
     }
 }
@@ -740,7 +928,23 @@ void objectCommand(client *c) {
         }
         addReplyLongLong(c,estimateObjectIdleTime(o)/1000);
         unlockDb(c->db);
+    } else if (!strcasecmp(c->argv[1]->ptr,"freq") && c->argc == 3) {
+        int lfu_decay_time = c->vel->cc.lfu_decay_time;
+
+        if (!MAXMEMORY_POLICY_LFU(c->vel->cc.maxmemory_policy)) {
+            addReplyError(c,"An LFU maxmemory policy is not selected, access frequency not tracked.");
+            return;
+        }
+        fetchInternalDbByKey(c,c->argv[2]);
+        lockDbRead(c->db);
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
+                == NULL) {
+            unlockDb(c->db);
+            return;
+        }
+        addReplyLongLong(c,(long long)LFUDecrAndReturn(o,lfu_decay_time));
+        unlockDb(c->db);
     } else {
-        addReplyError(c,"Syntax error. Try OBJECT (encoding|idletime)");
+        addReplyError(c,"Syntax error. Try OBJECT (encoding|idletime|freq)");
     }
 }
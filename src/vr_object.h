@@ -34,11 +34,18 @@
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
 #define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
+#define LFU_INIT_VAL 5 /* LFU counter of a new object, so it is not evicted at once */
 typedef struct vr_object {
     unsigned type:4;
     unsigned encoding:4;
-    unsigned lru:LRU_BITS; /* lru time (relative to server.lruclock) */
     unsigned constant:1;
+    unsigned arena:1;       /* In a buffer, see createArenaStringObject() */
+    unsigned lru;           /* LRU time (relative to the eventloop lruclock) or
+                             * LFU data (least significant 8 bits frequency
+                             * and most significant 16 bits decrease time),
+                             * LRU_BITS wide. Not a bitfield, as lookupKey()
+                             * updates it under the db read lock with relaxed
+                             * atomics, see objectUpdateLRU(). */
     int refcount;
     void *ptr;
 } robj;
@@ -48,6 +55,8 @@ void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
 robj *resetRefCount(robj *obj);
 void freeObject(robj *o);
+robj *shareObject(robj *o);
+int objectIsShared(robj *o);
 void freeObjectVoid(void *o);
 void freeStringObject(robj *o);
 void freeListObject(robj *o);
@@ -56,6 +65,7 @@ void freeZsetObject(robj *o);
 void freeHashObject(robj *o);
 robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
+robj *createArenaStringObject(void *buf, size_t size, const char *ptr, size_t len, size_t *used);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
 robj *dupStringObject(robj *o);
@@ -85,6 +95,13 @@ int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
+int objectMaxmemoryPolicy(void);
+unsigned long LFUGetTimeInMinutes(void);
+unsigned long LFUTimeElapsed(unsigned long ldt);
+uint8_t LFULogIncr(uint8_t counter, int lfu_log_factor);
+unsigned long LFUDecrAndReturn(robj *o, int lfu_decay_time);
+unsigned int objectInitialLRU(void);
+void objectUpdateLRU(robj *o);
 
 size_t getStringObjectSdsUsedMemory(robj *o);
 
@@ -1,7 +1,1171 @@
+#include <math.h>
+#include <sys/stat.h>
+
 #include <vr_core.h>
 
-/* Save the DB on disk. Return C_ERR on error, C_OK on success. */
+#define RDB_LOAD_NONE   0
+#define RDB_LOAD_ENC    (1<<0)
+#define RDB_LOAD_PLAIN  (1<<1)
+
+#define RDB_COPY_BUFFER_SIZE (1024*1024)
+#define RDB_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
+
+/* Just one save runs at a time, the SAVE and BGSAVE commands return an
+ * error while it is in progress. */
+static pthread_mutex_t rdb_save_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rdb_save_in_progress = 0;
+static int rdb_save_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
+static long long rdb_dirty_at_lastsave = 0;
+
+/* The loader threads bind this eventloop, so the object code reads the
+ * config from its cache as in the workers. */
+static vr_eventloop rdb_load_vel;
+
+static int rdbWriteRaw(rio *rdb, void *p, size_t len) {
+    if (rdb && rioWrite(rdb,p,len) == 0)
+        return -1;
+    return (int)len;
+}
+
+int rdbSaveType(rio *rdb, unsigned char type) {
+    return rdbWriteRaw(rdb,&type,1);
+}
+
+/* Load a "type" in RDB format, that is a one byte unsigned integer.
+ * This function is not only used to load object types, but also special
+ * "types" like the end-of-file type, the EXPIRE type, and so forth. */
+int rdbLoadType(rio *rdb) {
+    unsigned char type;
+    if (rioRead(rdb,&type,1) == 0) return -1;
+    return type;
+}
+
+int rdbSaveTime(rio *rdb, time_t t) {
+    int32_t t32 = (int32_t) t;
+    return rdbWriteRaw(rdb,&t32,4);
+}
+
+time_t rdbLoadTime(rio *rdb) {
+    int32_t t32;
+    if (rioRead(rdb,&t32,4) == 0) return -1;
+    return (time_t)t32;
+}
+
+int rdbSaveMillisecondTime(rio *rdb, long long t) {
+    int64_t t64 = (int64_t) t;
+    memrev64ifbe(&t64);
+    return rdbWriteRaw(rdb,&t64,8);
+}
+
+long long rdbLoadMillisecondTime(rio *rdb) {
+    int64_t t64;
+    if (rioRead(rdb,&t64,8) == 0) return -1;
+    memrev64ifbe(&t64);
+    return (long long)t64;
+}
+
+/* Saves an encoded length. The first two bits in the first byte are used to
+ * hold the encoding type. See the RDB_* definitions for more information
+ * on the types of encoding. */
+int rdbSaveLen(rio *rdb, uint32_t len) {
+    unsigned char buf[2];
+    size_t nwritten;
+
+    if (len < (1<<6)) {
+        /* Save a 6 bit len */
+        buf[0] = (len&0xFF)|(RDB_6BITLEN<<6);
+        if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
+        nwritten = 1;
+    } else if (len < (1<<14)) {
+        /* Save a 14 bit len */
+        buf[0] = ((len>>8)&0xFF)|(RDB_14BITLEN<<6);
+        buf[1] = len&0xFF;
+        if (rdbWriteRaw(rdb,buf,2) == -1) return -1;
+        nwritten = 2;
+    } else {
+        /* Save a 32 bit len */
+        buf[0] = (RDB_32BITLEN<<6);
+        if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
+        len = htonl(len);
+        if (rdbWriteRaw(rdb,&len,4) == -1) return -1;
+        nwritten = 1+4;
+    }
+    return (int)nwritten;
+}
+
+/* Load an encoded length. The "isencoded" argument is set to 1 if the length
+ * is not actually a length but an "encoding type". See the RDB_ENC_*
+ * definitions in vr_rdb.h for more information. */
+uint32_t rdbLoadLen(rio *rdb, int *isencoded) {
+    unsigned char buf[2];
+    uint32_t len;
+    int type;
+
+    if (isencoded) *isencoded = 0;
+    if (rioRead(rdb,buf,1) == 0) return RDB_LENERR;
+    type = (buf[0]&0xC0)>>6;
+    if (type == RDB_ENCVAL) {
+        /* Read a 6 bit encoding type. */
+        if (isencoded) *isencoded = 1;
+        return buf[0]&0x3F;
+    } else if (type == RDB_6BITLEN) {
+        /* Read a 6 bit len. */
+        return buf[0]&0x3F;
+    } else if (type == RDB_14BITLEN) {
+        /* Read a 14 bit len. */
+        if (rioRead(rdb,buf+1,1) == 0) return RDB_LENERR;
+        return ((buf[0]&0x3F)<<8)|buf[1];
+    } else {
+        /* Read a 32 bit len. */
+        if (rioRead(rdb,&len,4) == 0) return RDB_LENERR;
+        return ntohl(len);
+    }
+}
+
+/* Encodes the "value" argument as integer when it fits in the supported ranges
+ * for encoded types. If the function successfully encodes the integer, the
+ * representation is stored in the buffer pointer to by "enc" and the string
+ * length is returned. Otherwise 0 is returned. */
+static int rdbEncodeInteger(long long value, unsigned char *enc) {
+    if (value >= -(1<<7) && value <= (1<<7)-1) {
+        enc[0] = (RDB_ENCVAL<<6)|RDB_ENC_INT8;
+        enc[1] = (unsigned char)(value&0xFF);
+        return 2;
+    } else if (value >= -(1<<15) && value <= (1<<15)-1) {
+        enc[0] = (RDB_ENCVAL<<6)|RDB_ENC_INT16;
+        enc[1] = (unsigned char)(value&0xFF);
+        enc[2] = (unsigned char)((value>>8)&0xFF);
+        return 3;
+    } else if (value >= -((long long)1<<31) && value <= ((long long)1<<31)-1) {
+        enc[0] = (RDB_ENCVAL<<6)|RDB_ENC_INT32;
+        enc[1] = (unsigned char)(value&0xFF);
+        enc[2] = (unsigned char)((value>>8)&0xFF);
+        enc[3] = (unsigned char)((value>>16)&0xFF);
+        enc[4] = (unsigned char)((value>>24)&0xFF);
+        return 5;
+    } else {
+        return 0;
+    }
+}
+
+/* Loads an integer-encoded object with the specified encoding type "enctype".
+ * The returned value changes according to the flags, see
+ * rdbGenericLoadStringObject() for more info. */
+static void *rdbLoadIntegerObject(rio *rdb, int enctype, int flags) {
+    int plain = flags & RDB_LOAD_PLAIN;
+    int encode = flags & RDB_LOAD_ENC;
+    unsigned char enc[4];
+    long long val;
+
+    if (enctype == RDB_ENC_INT8) {
+        if (rioRead(rdb,enc,1) == 0) return NULL;
+        val = (signed char)enc[0];
+    } else if (enctype == RDB_ENC_INT16) {
+        uint16_t v;
+        if (rioRead(rdb,enc,2) == 0) return NULL;
+        v = enc[0]|(enc[1]<<8);
+        val = (int16_t)v;
+    } else if (enctype == RDB_ENC_INT32) {
+        uint32_t v;
+        if (rioRead(rdb,enc,4) == 0) return NULL;
+        v = enc[0]|(enc[1]<<8)|(enc[2]<<16)|((uint32_t)enc[3]<<24);
+        val = (int32_t)v;
+    } else {
+        val = 0; /* anti-warning */
+        log_error("Unknown RDB integer encoding type %d", enctype);
+        return NULL;
+    }
+    if (plain) {
+        char buf[LONG_STR_SIZE], *p;
+        int len = ll2string(buf,sizeof(buf),val);
+        p = dalloc((size_t)len);
+        memcpy(p,buf,(size_t)len);
+        return p;
+    } else if (encode) {
+        return createStringObjectFromLongLong(val);
+    } else {
+        return createObject(OBJ_STRING,sdsfromlonglong(val));
+    }
+}
+
+/* String objects in the form "2391" "-100" without any space and with a
+ * range of values that can fit in an 8, 16 or 32 bit signed value can be
+ * encoded as integers to save space */
+static int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
+    long long value;
+    char *endptr, buf[32];
+
+    /* Check if it's possible to encode this value as a number */
+    value = strtoll(s, &endptr, 10);
+    if (endptr[0] != '\0') return 0;
+    ll2string(buf,32,value);
+
+    /* If the number converted back into a string is not identical
+     * then it's not possible to encode the string as integer */
+    if (strlen(buf) != len || memcmp(buf,s,len)) return 0;
+
+    return rdbEncodeInteger(value,enc);
+}
+
+static ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                              size_t original_len) {
+    unsigned char byte;
+    ssize_t n, nwritten = 0;
+
+    /* Data compressed! Let's save it on disk */
+    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,(uint32_t)compress_len)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbSaveLen(rdb,(uint32_t)original_len)) == -1) goto writeerr;
+    nwritten += n;
+
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) goto writeerr;
+    nwritten += n;
+
+    return nwritten;
+
+writeerr:
+    return -1;
+}
+
+static ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+    size_t comprlen, outlen;
+    void *out;
+    ssize_t nwritten;
+
+    /* We require at least four bytes compression for this to be worth it */
+    if (len <= 4) return 0;
+    outlen = len-4;
+    if ((out = dalloc(outlen+1)) == NULL) return 0;
+    comprlen = lzf_compress(s, (unsigned int)len, out, (unsigned int)outlen);
+    if (comprlen == 0) {
+        dfree(out);
+        return 0;
+    }
+    nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    dfree(out);
+    return nwritten;
+}
+
+/* Load an LZF compressed string in RDB format. The returned value
+ * changes according to 'flags'. For more info check the
+ * rdbGenericLoadStringObject() function. */
+static void *rdbLoadLzfStringObject(rio *rdb, int flags) {
+    int plain = flags & RDB_LOAD_PLAIN;
+    unsigned int len, clen;
+    unsigned char *c = NULL;
+    sds val = NULL;
+
+    if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+    if ((c = dalloc(clen)) == NULL) goto err;
+
+    /* Allocate our target according to the uncompressed size. */
+    if (plain) {
+        val = dalloc(len);
+    } else {
+        if ((val = sdsnewlen(NULL,len)) == NULL) goto err;
+    }
+
+    /* Load the compressed representation and uncompress it to target. */
+    if (rioRead(rdb,c,clen) == 0) goto err;
+    if (lzf_decompress(c,clen,val,len) == 0) goto err;
+    dfree(c);
+    if (plain)
+        return val;
+    else
+        return createObject(OBJ_STRING,val);
+err:
+    if (c != NULL) dfree(c);
+    if (val != NULL) {
+        if (plain)
+            dfree(val);
+        else
+            sdsfree(val);
+    }
+    return NULL;
+}
+
+/* Save a string object as [len][data] on disk. If the object is a string
+ * representation of an integer value we try to save it in a special form */
+ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
+    int enclen;
+    ssize_t n, nwritten = 0;
+
+    /* Try integer encoding */
+    if (len <= 11) {
+        unsigned char buf[5];
+        if ((enclen = rdbTryIntegerEncoding((char*)s,len,buf)) > 0) {
+            if (rdbWriteRaw(rdb,buf,(size_t)enclen) == -1) return -1;
+            return enclen;
+        }
+    }
+
+    /* Try LZF compression - under 20 bytes it's unable to compress even
+     * aaaaaaaaaaaaaaaaaa so skip it */
+    if (rdb_save_compression && len > 20) {
+        n = rdbSaveLzfStringObject(rdb,s,len);
+        if (n == -1) return -1;
+        if (n > 0) return n;
+        /* Return value of 0 means data can't be compressed, save the old way */
+    }
+
+    /* Store verbatim */
+    if ((n = rdbSaveLen(rdb,(uint32_t)len)) == -1) return -1;
+    nwritten += n;
+    if (len > 0) {
+        if (rdbWriteRaw(rdb,s,len) == -1) return -1;
+        nwritten += (ssize_t)len;
+    }
+    return nwritten;
+}
+
+/* Save a long long value as either an encoded string or a string. */
+static ssize_t rdbSaveLongLongAsStringObject(rio *rdb, long long value) {
+    unsigned char buf[32];
+    ssize_t n, nwritten = 0;
+    int enclen = rdbEncodeInteger(value,buf);
+    if (enclen > 0) {
+        return rdbWriteRaw(rdb,buf,(size_t)enclen);
+    } else {
+        /* Encode as string */
+        enclen = ll2string((char*)buf,32,value);
+        ASSERT(enclen < 32);
+        if ((n = rdbSaveLen(rdb,(uint32_t)enclen)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbWriteRaw(rdb,buf,(size_t)enclen)) == -1) return -1;
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+/* Like rdbSaveStringObjectRaw() but handle encoded objects */
+int rdbSaveStringObject(rio *rdb, robj *obj) {
+    /* Avoid to decode the object, then encode it again, if the
+     * object is already integer encoded. */
+    if (obj->encoding == OBJ_ENCODING_INT) {
+        return (int)rdbSaveLongLongAsStringObject(rdb,(long)obj->ptr);
+    } else {
+        serverAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
+        return (int)rdbSaveRawString(rdb,obj->ptr,sdslen(obj->ptr));
+    }
+}
+
+/* Load a string object from an RDB file according to flags:
+ *
+ * RDB_LOAD_NONE (no flags): load an RDB object, unencoded.
+ * RDB_LOAD_ENC: If the returned type is a Vire object, try to
+ *               encode it in a special way to be more memory
+ *               efficient. When this flag is passed the function
+ *               no longer guarantees that obj->ptr is an SDS string.
+ * RDB_LOAD_PLAIN: Return a plain string allocated with dalloc()
+ *                 instead of a Vire object. */
+static void *rdbGenericLoadStringObject(rio *rdb, int flags) {
+    int encode = flags & RDB_LOAD_ENC;
+    int plain = flags & RDB_LOAD_PLAIN;
+    int isencoded;
+    uint32_t len;
+
+    len = rdbLoadLen(rdb,&isencoded);
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8:
+        case RDB_ENC_INT16:
+        case RDB_ENC_INT32:
+            return rdbLoadIntegerObject(rdb,(int)len,flags);
+        case RDB_ENC_LZF:
+            return rdbLoadLzfStringObject(rdb,flags);
+        default:
+            log_error("Unknown RDB string encoding type %d",len);
+            return NULL;
+        }
+    }
+
+    if (len == RDB_LENERR) return NULL;
+    if (plain) {
+        void *buf = dalloc(len ? len : 1);
+        if (len && rioRead(rdb,buf,len) == 0) {
+            dfree(buf);
+            return NULL;
+        }
+        return buf;
+    } else {
+        robj *o = encode ? createStringObject(NULL,len) :
+                           createRawStringObject(NULL,len);
+        if (len && rioRead(rdb,o->ptr,len) == 0) {
+            freeObject(o);
+            return NULL;
+        }
+        return o;
+    }
+}
+
+robj *rdbLoadStringObject(rio *rdb) {
+    return rdbGenericLoadStringObject(rdb,RDB_LOAD_NONE);
+}
+
+static robj *rdbLoadEncodedStringObject(rio *rdb) {
+    return rdbGenericLoadStringObject(rdb,RDB_LOAD_ENC);
+}
+
+/* Save a double value. Doubles are saved as strings prefixed by an unsigned
+ * 8 bit integer specifying the length of the representation.
+ * This 8 bit integer has special values in order to specify the following
+ * conditions:
+ * 253: not a number
+ * 254: + inf
+ * 255: - inf
+ */
+static int rdbSaveDoubleValue(rio *rdb, double val) {
+    unsigned char buf[128];
+    int len;
+
+    if (isnan(val)) {
+        buf[0] = 253;
+        len = 1;
+    } else if (!isfinite(val)) {
+        len = 1;
+        buf[0] = (val < 0) ? 255 : 254;
+    } else {
+#if (DBL_MANT_DIG >= 52) && (LLONG_MAX == 0x7fffffffffffffffLL)
+        /* Check if the float is in a safe range to be casted into a
+         * long long. We are assuming that long long is 64 bit here.
+         * Also we are assuming that there are no implementations around where
+         * double has precision < 52 bit.
+         *
+         * Under this assumptions we test if a double is inside an interval
+         * where casting to long long is safe. Then using two castings we
+         * make sure the decimal part is zero. If all this is true we use
+         * integer printing function that is much faster. */
+        double min = -4503599627370495; /* (2^52)-1 */
+        double max = 4503599627370496; /* -(2^52) */
+        if (val > min && val < max && val == ((double)((long long)val)))
+            ll2string((char*)buf+1,sizeof(buf)-1,(long long)val);
+        else
+#endif
+            snprintf((char*)buf+1,sizeof(buf)-1,"%.17g",val);
+        buf[0] = (unsigned char)strlen((char*)buf+1);
+        len = buf[0]+1;
+    }
+    return rdbWriteRaw(rdb,buf,(size_t)len);
+}
+
+/* For information about double serialization check rdbSaveDoubleValue() */
+static int rdbLoadDoubleValue(rio *rdb, double *val) {
+    char buf[256];
+    unsigned char len;
+
+    if (rioRead(rdb,&len,1) == 0) return -1;
+    switch(len) {
+    case 255: *val = -INFINITY; return 0;
+    case 254: *val = INFINITY; return 0;
+    case 253: *val = NAN; return 0;
+    default:
+        if (rioRead(rdb,buf,len) == 0) return -1;
+        buf[len] = '\0';
+        sscanf(buf, "%lg", val);
+        return 0;
+    }
+}
+
+/* Save the object type of object "o". */
+int rdbSaveObjectType(rio *rdb, robj *o) {
+    switch (o->type) {
+    case OBJ_STRING:
+        return rdbSaveType(rdb,RDB_TYPE_STRING);
+    case OBJ_LIST:
+        if (o->encoding == OBJ_ENCODING_QUICKLIST)
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+        else
+            serverPanic("Unknown list encoding");
+    case OBJ_SET:
+        if (o->encoding == OBJ_ENCODING_INTSET)
+            return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_HT)
+            return rdbSaveType(rdb,RDB_TYPE_SET);
+        else
+            serverPanic("Unknown set encoding");
+    case OBJ_ZSET:
+        if (o->encoding == OBJ_ENCODING_ZIPLIST)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET);
+        else
+            serverPanic("Unknown sorted set encoding");
+    case OBJ_HASH:
+        if (o->encoding == OBJ_ENCODING_ZIPLIST)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        else if (o->encoding == OBJ_ENCODING_HT)
+            return rdbSaveType(rdb,RDB_TYPE_HASH);
+        else
+            serverPanic("Unknown hash encoding");
+    default:
+        serverPanic("Unknown object type");
+    }
+    return -1; /* avoid warning */
+}
+
+/* Use rdbLoadType() to load a TYPE in RDB format, but returns -1 if the
+ * type is not specifically a valid Object Type. */
+int rdbLoadObjectType(rio *rdb) {
+    int type;
+    if ((type = rdbLoadType(rdb)) == -1) return -1;
+    if (!rdbIsObjectType(type)) return -1;
+    return type;
+}
+
+/* Save a Vire object. Returns -1 on error, number of bytes written on success.
+ * The caller holds the db lock, so the object is read without changing it,
+ * the non safe dict iterators just check nobody touched the dicts. */
+ssize_t rdbSaveObject(rio *rdb, robj *o) {
+    ssize_t n = 0, nwritten = 0;
+
+    if (o->type == OBJ_STRING) {
+        /* Save a string value */
+        if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
+        nwritten += n;
+    } else if (o->type == OBJ_LIST) {
+        /* Save a list value */
+        if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+            quicklist *ql = o->ptr;
+            quicklistNode *node = ql->head;
+
+            if ((n = rdbSaveLen(rdb,ql->len)) == -1) return -1;
+            nwritten += n;
+
+            while (node) {
+                if (quicklistNodeIsCompressed(node)) {
+                    void *data;
+                    size_t compress_len = quicklistGetLzf(node, &data);
+                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
+                    nwritten += n;
+                } else {
+                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                    nwritten += n;
+                }
+                node = node->next;
+            }
+        } else {
+            serverPanic("Unknown list encoding");
+        }
+    } else if (o->type == OBJ_SET) {
+        /* Save a set value */
+        if (o->encoding == OBJ_ENCODING_HT) {
+            dict *set = o->ptr;
+            dictIterator *di = dictGetIterator(set);
+            dictEntry *de;
+
+            if ((n = rdbSaveLen(rdb,(uint32_t)dictSize(set))) == -1) {
+                dictReleaseIterator(di);
+                return -1;
+            }
+            nwritten += n;
+
+            while((de = dictNext(di)) != NULL) {
+                robj *eleobj = dictGetKey(de);
+                if ((n = rdbSaveStringObject(rdb,eleobj)) == -1) {
+                    dictReleaseIterator(di);
+                    return -1;
+                }
+                nwritten += n;
+            }
+            dictReleaseIterator(di);
+        } else if (o->encoding == OBJ_ENCODING_INTSET) {
+            size_t l = intsetBlobLen((intset*)o->ptr);
+
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else {
+            serverPanic("Unknown set encoding");
+        }
+    } else if (o->type == OBJ_ZSET) {
+        /* Save a sorted set value */
+        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+            zset *zs = o->ptr;
+            dictIterator *di = dictGetIterator(zs->dict);
+            dictEntry *de;
+
+            if ((n = rdbSaveLen(rdb,(uint32_t)dictSize(zs->dict))) == -1) {
+                dictReleaseIterator(di);
+                return -1;
+            }
+            nwritten += n;
+
+            while((de = dictNext(di)) != NULL) {
+                robj *eleobj = dictGetKey(de);
+                double *score = dictGetVal(de);
+
+                if ((n = rdbSaveStringObject(rdb,eleobj)) == -1) {
+                    dictReleaseIterator(di);
+                    return -1;
+                }
+                nwritten += n;
+                if ((n = rdbSaveDoubleValue(rdb,*score)) == -1) {
+                    dictReleaseIterator(di);
+                    return -1;
+                }
+                nwritten += n;
+            }
+            dictReleaseIterator(di);
+        } else {
+            serverPanic("Unknown sorted set encoding");
+        }
+    } else if (o->type == OBJ_HASH) {
+        /* Save a hash value */
+        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_HT) {
+            dictIterator *di = dictGetIterator(o->ptr);
+            dictEntry *de;
+
+            if ((n = rdbSaveLen(rdb,(uint32_t)dictSize((dict*)o->ptr))) == -1) {
+                dictReleaseIterator(di);
+                return -1;
+            }
+            nwritten += n;
+
+            while((de = dictNext(di)) != NULL) {
+                robj *key = dictGetKey(de);
+                robj *val = dictGetVal(de);
+
+                if ((n = rdbSaveStringObject(rdb,key)) == -1) {
+                    dictReleaseIterator(di);
+                    return -1;
+                }
+                nwritten += n;
+                if ((n = rdbSaveStringObject(rdb,val)) == -1) {
+                    dictReleaseIterator(di);
+                    return -1;
+                }
+                nwritten += n;
+            }
+            dictReleaseIterator(di);
+        } else {
+            serverPanic("Unknown hash encoding");
+        }
+    } else {
+        serverPanic("Unknown object type");
+    }
+    return nwritten;
+}
+
+/* Save a key-value pair, with expire time, type, key, value.
+ * On error -1 is returned.
+ * On success if the key was actually saved 1 is returned, otherwise 0
+ * is returned (the key was already expired). */
+int rdbSaveKeyValuePair(rio *rdb, sds key, robj *val,
+                        long long expiretime, long long now)
+{
+    /* Save the expire time */
+    if (expiretime != -1) {
+        /* If this key is already expired skip it */
+        if (expiretime < now) return 0;
+        if (rdbSaveType(rdb,RDB_OPCODE_EXPIRETIME_MS) == -1) return -1;
+        if (rdbSaveMillisecondTime(rdb,expiretime) == -1) return -1;
+    }
+
+    /* Save type, key, value */
+    if (rdbSaveObjectType(rdb,val) == -1) return -1;
+    if (rdbSaveRawString(rdb,(unsigned char*)key,sdslen(key)) == -1) return -1;
+    if (rdbSaveObject(rdb,val) == -1) return -1;
+    return 1;
+}
+
+/* Save an AUX field. */
+static int rdbSaveAuxField(rio *rdb, void *key, size_t keylen, void *val, size_t vallen) {
+    if (rdbSaveType(rdb,RDB_OPCODE_AUX) == -1) return -1;
+    if (rdbSaveRawString(rdb,key,keylen) == -1) return -1;
+    if (rdbSaveRawString(rdb,val,vallen) == -1) return -1;
+    return 1;
+}
+
+/* Wrapper for rdbSaveAuxField() used when key/val length can be obtained
+ * with strlen(). */
+static int rdbSaveAuxFieldStrStr(rio *rdb, char *key, char *val) {
+    return rdbSaveAuxField(rdb,key,strlen(key),val,strlen(val));
+}
+
+/* Wrapper for strlen(key) + integer type (up to long long range). */
+static int rdbSaveAuxFieldStrInt(rio *rdb, char *key, long long val) {
+    char buf[LONG_STR_SIZE];
+    int vlen = ll2string(buf,sizeof(buf),val);
+    return rdbSaveAuxField(rdb,key,strlen(key),buf,(size_t)vlen);
+}
+
+/* Save a few default AUX fields with information about the RDB generated. */
+static int rdbSaveInfoAuxFields(rio *rdb) {
+    int redis_bits = (sizeof(void*) == 8) ? 64 : 32;
+
+    /* Add a few fields about the state when the RDB was created. */
+    if (rdbSaveAuxFieldStrStr(rdb,"redis-ver",VR_VERSION_STRING) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"redis-bits",redis_bits) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"ctime",time(NULL)) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"used-mem",(long long)dalloc_used_memory()) == -1) return -1;
+    return 1;
+}
+
+/* Dump the internal db 'idx' to 'rdb', starting with the SELECTDB of the
+ * logical db it belongs to. The db read lock is held for the whole dump,
+ * so every internal db is a consistent snapshot, the writers of this
+ * internal db wait meanwhile. An empty db writes nothing.
+ * Return VR_OK on success and VR_ERROR on write error. */
+int rdbSaveInternalDb(rio *rdb, int idx, long long now) {
+    redisDb *db = darray_get(&server.dbs, (uint32_t)idx);
+    dictIterator *di = NULL;
+    dictEntry *de;
+    uint32_t db_size, expires_size;
+
+    lockDbRead(db);
+    if (dictSize(db->dict) == 0) {
+        unlockDb(db);
+        return VR_OK;
+    }
+
+    /* Write the SELECT DB opcode */
+    if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
+    if (rdbSaveLen(rdb,(uint32_t)(idx/server.dbinum)) == -1) goto werr;
+
+    /* Write the RESIZE DB opcode, the loaders expand every internal
+     * db just once for all the keys. */
+    db_size = (dictSize(db->dict) <= UINT32_MAX) ?
+                            (uint32_t)dictSize(db->dict) :
+                            UINT32_MAX;
+    expires_size = (dbExpiresSize(db) <= UINT32_MAX) ?
+                            (uint32_t)dbExpiresSize(db) :
+                            UINT32_MAX;
+    if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
+    if (rdbSaveLen(rdb,db_size) == -1) goto werr;
+    if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
+
+    /* Iterate this DB writing every entry */
+    di = dictGetIterator(db->dict);
+    while((de = dictNext(di)) != NULL) {
+        sds keystr = dictGetKey(de);
+        robj *o = dictGetVal(de);
+        long long expire = dbKeyGetExpire(keystr);
+
+        if (rdbSaveKeyValuePair(rdb,keystr,o,expire,now) == -1) goto werr;
+    }
+    dictReleaseIterator(di);
+    unlockDb(db);
+    return VR_OK;
+
+werr:
+    if (di) dictReleaseIterator(di);
+    unlockDb(db);
+    return VR_ERROR;
+}
+
+/* ----------------------------------------------------------------------------
+ * Parallel save.
+ *
+ * There is no fork() in a multithreaded server, so the internal dbs are
+ * dumped in parallel by rdb-threads saver threads. Every saver takes the
+ * next internal db not yet dumped and appends it to its own temp file,
+ * computing the checksum of every internal db dump, a segment. Then the
+ * segments are copied after the RDB header in one file, and the index of
+ * the segments is written in the RDB_AUX_SEGMENTS field of the header.
+ * The checksum of the whole file is combined from the segments checksums.
+ * ------------------------------------------------------------------------- */
+
+typedef struct rdbSegment {
+    int idx;                /* Internal db index */
+    off_t offset;           /* Offset in the saver temp file, or after the
+                             * RDB_AUX_SEGMENTS field in the RDB file */
+    off_t len;              /* Length of the dump */
+    uint64_t cksum;         /* crc64 of the dump, 0 if checksum is off */
+} rdbSegment;
+
+typedef struct rdbSaver {
+    vr_thread thread;
+    struct rdbSaveJob *job;
+    char tmpfile[256];
+    FILE *fp;
+    rdbSegment *segments;   /* Segments in the temp file order */
+    int nsegments;
+    off_t size;             /* Temp file size */
+    int status;             /* VR_OK or VR_ERROR */
+} rdbSaver;
+
+typedef struct rdbSaveJob {
+    int nsavers;
+    rdbSaver *savers;
+    int next_db;            /* Next internal db to dump */
+    int checksum;           /* Compute the checksums? */
+    long long now;          /* Time the keys are expired against */
+} rdbSaveJob;
+
+static void *rdbSaverRun(void *data) {
+    rdbSaver *saver = data;
+    rdbSaveJob *job = saver->job;
+    rio rdb;
+    int idx;
+
+    rioInitWithFile(&rdb,saver->fp);
+    rioSetAutoSync(&rdb,RDB_AUTOSYNC_BYTES);
+    while ((idx = atomic_add(job->next_db,1)-1) < server.dbnum) {
+        rdbSegment *seg = &saver->segments[saver->nsegments];
+
+        seg->idx = idx;
+        seg->offset = (off_t)rdb.processed_bytes;
+        rdb.cksum = 0;
+        rdb.update_cksum = job->checksum ? rioGenericUpdateChecksum : NULL;
+        if (rdbSaveInternalDb(&rdb,idx,job->now) != VR_OK) {
+            log_error("Write error dumping db %d on %s: %s",
+                idx, saver->tmpfile, strerror(errno));
+            saver->status = VR_ERROR;
+            return NULL;
+        }
+        seg->len = (off_t)rdb.processed_bytes-seg->offset;
+        seg->cksum = rdb.cksum;
+        if (seg->len > 0) saver->nsegments ++;
+    }
+
+    if (fflush(saver->fp) == EOF) {
+        log_error("Write error dumping on %s: %s",
+            saver->tmpfile, strerror(errno));
+        saver->status = VR_ERROR;
+        return NULL;
+    }
+    saver->size = (off_t)rdb.processed_bytes;
+    saver->status = VR_OK;
+    return NULL;
+}
+
+/* Copy the whole temp file of a saver at the current position of 'fp'. */
+static int rdbCopySaverFile(rdbSaver *saver, FILE *fp, char *buf) {
+    size_t n;
+
+    rewind(saver->fp);
+    while ((n = fread(buf,1,RDB_COPY_BUFFER_SIZE,saver->fp)) > 0) {
+        if (fwrite(buf,n,1,fp) != 1) return VR_ERROR;
+    }
+    return ferror(saver->fp) ? VR_ERROR : VR_OK;
+}
+
+/* Make sure the dir option exists, as it is not created at startup. */
+static int rdbCreateDir(sds dir) {
+    if (mkdir(dir,0755) == -1 && errno != EEXIST) {
+        log_error("Failed creating the directory %s: %s", dir, strerror(errno));
+        return VR_ERROR;
+    }
+    return VR_OK;
+}
+
+/* Return the RDB file path, dir/dbfilename. The caller frees it. */
+sds rdbGetFilename(void) {
+    sds dir, dbfilename, filename;
+
+    conf_server_get(CONFIG_SOPN_DIR,&dir);
+    conf_server_get(CONFIG_SOPN_DBFILENAME,&dbfilename);
+    filename = sdscatfmt(sdsempty(),"%S/%S",dir,dbfilename);
+    sdsfree(dir);
+    sdsfree(dbfilename);
+    return filename;
+}
+
+/* Sum of the changes made by all the workers since the server started. */
+static long long rdbDirtyCount(void) {
+    long long dirty = server.dirty;
+    uint32_t idx;
+
+    for (idx = 0; idx < darray_n(&workers); idx ++) {
+        vr_worker *worker = darray_get(&workers, idx);
+        dirty += worker->vel.dirty;
+    }
+    return dirty;
+}
+
+long long rdbChangesSinceLastSave(void) {
+    return rdbDirtyCount()-rdb_dirty_at_lastsave;
+}
+
+int rdbSaveInProgress(void) {
+    int in_progress;
+
+    pthread_mutex_lock(&rdb_save_lock);
+    in_progress = rdb_save_in_progress;
+    pthread_mutex_unlock(&rdb_save_lock);
+    return in_progress;
+}
+
+static int rdbSaveBegin(void) {
+    pthread_mutex_lock(&rdb_save_lock);
+    if (rdb_save_in_progress) {
+        pthread_mutex_unlock(&rdb_save_lock);
+        return VR_ERROR;
+    }
+    rdb_save_in_progress = 1;
+    server.rdb_save_time_start = time(NULL);
+    server.lastbgsave_try = server.rdb_save_time_start;
+    pthread_mutex_unlock(&rdb_save_lock);
+    return VR_OK;
+}
+
+static void rdbSaveEnd(int status, long long dirty) {
+    pthread_mutex_lock(&rdb_save_lock);
+    if (status == VR_OK) {
+        rdb_dirty_at_lastsave = dirty;
+        server.lastsave = time(NULL);
+    }
+    server.lastbgsave_status = status;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    rdb_save_in_progress = 0;
+    pthread_mutex_unlock(&rdb_save_lock);
+}
+
+/* Dump the dataset to 'filename' with the saver threads, the caller
+ * waits them. Returns VR_ERROR on error, VR_OK on success. */
+static int rdbSaveParallel(char *filename) {
+    rdbSaveJob job;
+    rdbSaver *saver;
+    char tmpfile[256], magic[10];
+    char *buf = NULL;
+    FILE *fp = NULL;
+    rio rdb;
+    sds index = sdsempty();
+    off_t offset = 0;
+    uint64_t cksum;
+    int threads, j, k;
+
+    conf_server_get(CONFIG_SOPN_RDBTHREADS,&threads);
+    conf_server_get(CONFIG_SOPN_RDBCOMPRESSION,&rdb_save_compression);
+    conf_server_get(CONFIG_SOPN_RDBCHECKSUM,&job.checksum);
+    if (threads > server.dbnum) threads = server.dbnum;
+    if (threads < 1) threads = 1;
+
+    job.nsavers = threads;
+    job.savers = dcalloc(threads,sizeof(rdbSaver));
+    job.next_db = 0;
+    job.now = vr_msec_now();
+
+    /* Start the savers */
+    for (j = 0; j < job.nsavers; j ++) {
+        saver = &job.savers[j];
+        saver->job = &job;
+        saver->segments = dcalloc(server.dbnum,sizeof(rdbSegment));
+        saver->status = VR_ERROR;
+        snprintf(saver->tmpfile,sizeof(saver->tmpfile),"%s.temp-%d-%d",
+            filename,(int)getpid(),j);
+        saver->fp = fopen(saver->tmpfile,"w+");
+        if (saver->fp == NULL) {
+            log_error("Failed opening %s for saving: %s",
+                saver->tmpfile, strerror(errno));
+            job.nsavers = j;
+            goto werr;
+        }
+        vr_thread_init(&saver->thread);
+        saver->thread.fun_run = rdbSaverRun;
+        saver->thread.data = saver;
+        vr_thread_start(&saver->thread);
+    }
+    for (j = 0; j < job.nsavers; j ++) {
+        pthread_join(job.savers[j].thread.thread_id, NULL);
+    }
+    for (j = 0; j < job.nsavers; j ++) {
+        if (job.savers[j].status != VR_OK) goto werr;
+    }
+
+    /* Build the segments index, with the offsets the segments will have
+     * after the RDB_AUX_SEGMENTS field. */
+    for (j = 0; j < job.nsavers; j ++) {
+        saver = &job.savers[j];
+        for (k = 0; k < saver->nsegments; k ++) {
+            rdbSegment *seg = &saver->segments[k];
+            index = sdscatprintf(index,"%s%d:%lld:%lld:%016llx",
+                sdslen(index) ? "," : "", seg->idx,
+                (long long)(offset+seg->offset), (long long)seg->len,
+                (unsigned long long)seg->cksum);
+        }
+        offset += saver->size;
+    }
+
+    /* Write the RDB file, the header, the savers temp files, the EOF
+     * opcode and the checksum. */
+    snprintf(tmpfile,sizeof(tmpfile),"%s.temp-%d",filename,(int)getpid());
+    fp = fopen(tmpfile,"w");
+    if (!fp) {
+        log_error("Failed opening %s for saving: %s",
+            tmpfile, strerror(errno));
+        goto werr;
+    }
+
+    rioInitWithFile(&rdb,fp);
+    if (job.checksum) rdb.update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rdbWriteRaw(&rdb,magic,9) == -1) goto werr;
+    if (rdbSaveInfoAuxFields(&rdb) == -1) goto werr;
+    if (rdbSaveAuxField(&rdb,RDB_AUX_SEGMENTS,strlen(RDB_AUX_SEGMENTS),
+        index,sdslen(index)) == -1) goto werr;
+
+    buf = dalloc(RDB_COPY_BUFFER_SIZE);
+    cksum = rdb.cksum;
+    for (j = 0; j < job.nsavers; j ++) {
+        saver = &job.savers[j];
+        if (rdbCopySaverFile(saver,fp,buf) != VR_OK) {
+            log_error("Write error copying %s to %s: %s",
+                saver->tmpfile, tmpfile, strerror(errno));
+            goto werr;
+        }
+        for (k = 0; k < saver->nsegments && job.checksum; k ++) {
+            rdbSegment *seg = &saver->segments[k];
+            cksum = crc64_combine(cksum,seg->cksum,(uint64_t)seg->len);
+        }
+    }
+    rdb.cksum = cksum;
+
+    /* EOF opcode */
+    if (rdbSaveType(&rdb,RDB_OPCODE_EOF) == -1) goto werr;
+
+    /* CRC64 checksum. It will be zero if checksum computation is disabled, the
+     * loading code skips the check in this case. */
+    cksum = rdb.cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(&rdb,&cksum,8) == 0) goto werr;
+
+    /* Make sure data will not remain on the OS's output buffers */
+    if (fflush(fp) == EOF) goto werr;
+    if (fsync(fileno(fp)) == -1) goto werr;
+    if (fclose(fp) == EOF) {
+        fp = NULL;
+        goto werr;
+    }
+    fp = NULL;
+
+    /* Use RENAME to make sure the DB file is changed atomically only
+     * if the generate DB file is ok. */
+    if (rename(tmpfile,filename) == -1) {
+        log_error("Error moving temp DB file %s on the final "
+            "destination %s: %s", tmpfile, filename, strerror(errno));
+        unlink(tmpfile);
+        goto err;
+    }
+
+    for (j = 0; j < job.nsavers; j ++) {
+        fclose(job.savers[j].fp);
+        unlink(job.savers[j].tmpfile);
+        dfree(job.savers[j].segments);
+    }
+    dfree(job.savers);
+    dfree(buf);
+    sdsfree(index);
+    return VR_OK;
+
+werr:
+    log_error("Write error saving DB on disk: %s", strerror(errno));
+    if (fp) {
+        fclose(fp);
+        unlink(tmpfile);
+    }
+err:
+    for (j = 0; j < job.nsavers; j ++) {
+        if (job.savers[j].fp) {
+            fclose(job.savers[j].fp);
+            unlink(job.savers[j].tmpfile);
+        }
+    }
+    for (j = 0; j < threads; j ++) {
+        if (job.savers[j].segments) dfree(job.savers[j].segments);
+    }
+    dfree(job.savers);
+    if (buf) dfree(buf);
+    sdsfree(index);
+    return VR_ERROR;
+}
+
+/* Save the DB on disk, the caller waits the end of the save.
+ * Return VR_ERROR on error, VR_OK on success. */
 int rdbSave(char *filename) {
+    long long start, dirty;
+    sds dir;
+    int ret;
+
+    if (rdbSaveBegin() != VR_OK) return VR_ERROR;
+
+    conf_server_get(CONFIG_SOPN_DIR,&dir);
+    ret = rdbCreateDir(dir);
+    sdsfree(dir);
+    if (ret != VR_OK) {
+        rdbSaveEnd(VR_ERROR,0);
+        return VR_ERROR;
+    }
+
+    start = vr_usec_now();
+    dirty = rdbDirtyCount();
+    ret = rdbSaveParallel(filename);
+    rdbSaveEnd(ret,dirty);
+    if (ret == VR_OK) {
+        log_notice("DB saved on disk in %.3f seconds",
+            (float)(vr_usec_now()-start)/1000000);
+    }
+    return ret;
+}
+
+static void *rdbBackgroundSaveRun(void *data) {
+    sds filename = data;
+    long long start, dirty;
+    int ret;
+
+    start = vr_usec_now();
+    dirty = rdbDirtyCount();
+    ret = rdbSaveParallel(filename);
+    rdbSaveEnd(ret,dirty);
+    if (ret == VR_OK) {
+        log_notice("Background saving terminated with success in %.3f seconds",
+            (float)(vr_usec_now()-start)/1000000);
+    } else {
+        log_warn("Background saving error");
+    }
+
+    sdsfree(filename);
+    return NULL;
+}
+
+/* Save the DB on disk in a detached thread, that waits the saver
+ * threads. Return VR_ERROR if a save is already in progress. */
+int rdbSaveBackground(char *filename) {
+    pthread_attr_t attr;
+    pthread_t thread_id;
+    sds dir, name;
+    int ret;
+
+    if (rdbSaveBegin() != VR_OK) return VR_ERROR;
+
+    conf_server_get(CONFIG_SOPN_DIR,&dir);
+    ret = rdbCreateDir(dir);
+    sdsfree(dir);
+    if (ret != VR_OK) {
+        rdbSaveEnd(VR_ERROR,0);
+        return VR_ERROR;
+    }
+
+    name = sdsnew(filename);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread_id,&attr,rdbBackgroundSaveRun,name);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        log_error("Can't create the background saving thread: %s",
+            strerror(ret));
+        sdsfree(name);
+        rdbSaveEnd(VR_ERROR,0);
+        return VR_ERROR;
+    }
+
+    log_notice("Background saving started");
     return VR_OK;
 }
 
@@ -11,3 +1175,676 @@ void rdbRemoveTempFile(pid_t childpid) {
     snprintf(tmpfile,sizeof(tmpfile),"temp-%d.rdb", (int) childpid);
     unlink(tmpfile);
 }
+
+/* Load a Vire object of the specified type from the specified file.
+ * On success a newly allocated object is returned, otherwise NULL. */
+robj *rdbLoadObject(int rdbtype, rio *rdb) {
+    robj *o = NULL, *ele, *dec;
+    size_t len;
+    unsigned int i;
+
+    if (rdbtype == RDB_TYPE_STRING) {
+        /* Read string value */
+        if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+        o = tryObjectEncoding(o);
+    } else if (rdbtype == RDB_TYPE_LIST) {
+        /* Read list value */
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+
+        o = createQuicklistObject();
+        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
+                            server.list_compress_depth);
+
+        /* Load every single element of the list */
+        while(len--) {
+            if ((dec = rdbLoadStringObject(rdb)) == NULL) return NULL;
+            quicklistPushTail(o->ptr, dec->ptr, sdslen(dec->ptr));
+            freeObject(dec);
+        }
+    } else if (rdbtype == RDB_TYPE_SET) {
+        /* Read list/set value */
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+
+        /* Use a regular set when there are too many entries. */
+        if (len > server.set_max_intset_entries) {
+            o = createSetObject();
+            /* It's faster to expand the dict to the right size asap in order
+             * to avoid rehashing */
+            if (len > DICT_HT_INITIAL_SIZE)
+                dictExpand(o->ptr,len);
+        } else {
+            o = createIntsetObject();
+        }
+
+        /* Load every single element of the list/set */
+        for (i = 0; i < len; i++) {
+            long long llval;
+            if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+            ele = tryObjectEncoding(ele);
+
+            if (o->encoding == OBJ_ENCODING_INTSET) {
+                /* Fetch integer value from element */
+                if (isObjectRepresentableAsLongLong(ele,&llval) == VR_OK) {
+                    o->ptr = intsetAdd(o->ptr,llval,NULL);
+                } else {
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    dictExpand(o->ptr,len);
+                }
+            }
+
+            /* This will also be called when the set was just converted
+             * to a regular hash table encoded set */
+            if (o->encoding == OBJ_ENCODING_HT) {
+                dictAdd((dict*)o->ptr,ele,NULL);
+            } else {
+                freeObject(ele);
+            }
+        }
+    } else if (rdbtype == RDB_TYPE_ZSET) {
+        /* Read list/set value */
+        size_t zsetlen;
+        size_t maxelelen = 0;
+        zset *zs;
+
+        if ((zsetlen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        o = createZsetObject();
+        zs = o->ptr;
+
+        /* Load every single element of the list/set */
+        while(zsetlen--) {
+            double score;
+            zskiplistNode *znode;
+
+            if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+            ele = tryObjectEncoding(ele);
+            if (rdbLoadDoubleValue(rdb,&score) == -1) return NULL;
+
+            /* Don't care about integer-encoded strings. */
+            if (sdsEncodedObject(ele) && sdslen(ele->ptr) > maxelelen)
+                maxelelen = sdslen(ele->ptr);
+
+            znode = zslInsert(zs->zsl,score,ele);
+            dictAdd(zs->dict,ele,&znode->score);
+        }
+
+        /* Convert *after* loading, since sorted sets are not stored ordered. */
+        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
+            maxelelen <= server.zset_max_ziplist_value)
+                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+    } else if (rdbtype == RDB_TYPE_HASH) {
+        size_t hashlen;
+        robj *field, *value;
+
+        hashlen = rdbLoadLen(rdb,NULL);
+        if (hashlen == RDB_LENERR) return NULL;
+
+        o = createHashObject();
+
+        /* Too many entries? Use a hash table. */
+        if (hashlen > server.hash_max_ziplist_entries)
+            hashTypeConvert(o, OBJ_ENCODING_HT);
+
+        /* Load every field and value into the ziplist */
+        while (o->encoding == OBJ_ENCODING_ZIPLIST && hashlen > 0) {
+            hashlen--;
+            /* Load raw strings */
+            if ((field = rdbLoadStringObject(rdb)) == NULL) return NULL;
+            if ((value = rdbLoadStringObject(rdb)) == NULL) return NULL;
+
+            /* Add pair to ziplist */
+            o->ptr = ziplistPush(o->ptr, field->ptr, (unsigned int)sdslen(field->ptr), ZIPLIST_TAIL);
+            o->ptr = ziplistPush(o->ptr, value->ptr, (unsigned int)sdslen(value->ptr), ZIPLIST_TAIL);
+            /* Convert to hash table if size threshold is exceeded */
+            if (sdslen(field->ptr) > server.hash_max_ziplist_value ||
+                sdslen(value->ptr) > server.hash_max_ziplist_value)
+            {
+                freeObject(field);
+                freeObject(value);
+                hashTypeConvert(o, OBJ_ENCODING_HT);
+                break;
+            }
+            freeObject(field);
+            freeObject(value);
+        }
+
+        /* Load remaining fields and values into the hash table */
+        while (o->encoding == OBJ_ENCODING_HT && hashlen > 0) {
+            hashlen--;
+            /* Load encoded strings */
+            if ((field = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+            if ((value = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+
+            field = tryObjectEncoding(field);
+            value = tryObjectEncoding(value);
+
+            /* Add pair to hash table */
+            dictAdd((dict*)o->ptr, field, value);
+        }
+
+        /* All pairs should be read by now */
+        ASSERT(hashlen == 0);
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        o = createQuicklistObject();
+        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
+                            server.list_compress_depth);
+
+        while (len--) {
+            unsigned char *zl = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN);
+            if (zl == NULL) return NULL;
+            quicklistAppendZiplist(o->ptr, zl);
+        }
+    } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
+               rdbtype == RDB_TYPE_LIST_ZIPLIST ||
+               rdbtype == RDB_TYPE_SET_INTSET   ||
+               rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
+               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+    {
+        unsigned char *encoded = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN);
+        if (encoded == NULL) return NULL;
+        o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
+
+        /* Fix the object encoding, and make sure to convert the encoded
+         * data type into the base type if accordingly to the current
+         * configuration there are too many elements in the encoded data
+         * type. Note that we only check the length and not max element
+         * size as this is an O(N) scan. Eventually everything will get
+         * converted. */
+        switch(rdbtype) {
+            case RDB_TYPE_HASH_ZIPMAP:
+                /* Convert to ziplist encoded hash. This must be deprecated
+                 * when loading dumps created by Redis 2.4 gets deprecated. */
+                {
+                    unsigned char *zl = ziplistNew();
+                    unsigned char *zi = zipmapRewind(o->ptr);
+                    unsigned char *fstr, *vstr;
+                    unsigned int flen, vlen;
+                    unsigned int maxlen = 0;
+
+                    while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
+                        if (flen > maxlen) maxlen = flen;
+                        if (vlen > maxlen) maxlen = vlen;
+                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
+                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                    }
+
+                    dfree(o->ptr);
+                    o->ptr = zl;
+                    o->type = OBJ_HASH;
+                    o->encoding = OBJ_ENCODING_ZIPLIST;
+
+                    if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
+                        maxlen > server.hash_max_ziplist_value)
+                    {
+                        hashTypeConvert(o, OBJ_ENCODING_HT);
+                    }
+                }
+                break;
+            case RDB_TYPE_LIST_ZIPLIST:
+                o->type = OBJ_LIST;
+                o->encoding = OBJ_ENCODING_ZIPLIST;
+                listTypeConvert(o,OBJ_ENCODING_QUICKLIST);
+                break;
+            case RDB_TYPE_SET_INTSET:
+                o->type = OBJ_SET;
+                o->encoding = OBJ_ENCODING_INTSET;
+                if (intsetLen(o->ptr) > server.set_max_intset_entries)
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                break;
+            case RDB_TYPE_ZSET_ZIPLIST:
+                o->type = OBJ_ZSET;
+                o->encoding = OBJ_ENCODING_ZIPLIST;
+                if (zsetLength(o) > server.zset_max_ziplist_entries)
+                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                break;
+            case RDB_TYPE_HASH_ZIPLIST:
+                o->type = OBJ_HASH;
+                o->encoding = OBJ_ENCODING_ZIPLIST;
+                if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+                    hashTypeConvert(o, OBJ_ENCODING_HT);
+                break;
+            default:
+                serverPanic("Unknown RDB encoding type");
+                break;
+        }
+    } else {
+        serverPanic("Unknown RDB object type");
+    }
+    return o;
+}
+
+/* ----------------------------------------------------------------------------
+ * Parallel load.
+ *
+ * A file with the RDB_AUX_SEGMENTS field is loaded by rdb-threads loader
+ * threads, every one loads the next segment not yet loaded, reading it
+ * from its own file descriptor and checking its checksum. The main thread
+ * skips the segments and reads the rest of the file. Other RDB files are
+ * loaded by the main thread alone.
+ * ------------------------------------------------------------------------- */
+
+typedef struct rdbLoadJob {
+    char *filename;
+    off_t base;             /* Offset of the first segment */
+    rdbSegment *segments;
+    int nsegments;
+    int next_segment;       /* Next segment to load */
+    long long now;          /* Time the keys are expired against */
+    long long keys;         /* Keys loaded by the loaders */
+} rdbLoadJob;
+
+typedef struct rdbLoader {
+    vr_thread thread;
+    rdbLoadJob *job;
+    int status;             /* VR_OK or VR_ERROR */
+} rdbLoader;
+
+/* Add the key to the internal db it hashes to in the logical db 'dbid',
+ * the keys already expired are skipped. The key object is freed. */
+static int rdbLoadAddKey(int dbid, robj *key, robj *val, long long expiretime,
+                         long long now) {
+    redisDb *db;
+    uint32_t idx;
+
+    if (expiretime != -1 && expiretime < now) {
+        freeObject(key);
+        freeObject(val);
+        return 0;
+    }
+
+    idx = (hash_crc16(key->ptr,sdslen(key->ptr))&0x3FFF)%(uint32_t)server.dbinum+
+        (uint32_t)(dbid*server.dbinum);
+    db = darray_get(&server.dbs, idx);
+    lockDbWrite(db);
+    if (dictFind(db->dict,key->ptr) != NULL) {
+        unlockDb(db);
+        log_warn("Duplicate key '%s' in the RDB file skipped", (char*)key->ptr);
+        freeObject(key);
+        freeObject(val);
+        return 0;
+    }
+    dbAdd(db,key,val);
+    if (expiretime != -1) setExpire(db,key,expiretime);
+    unlockDb(db);
+    freeObject(key);
+    return 1;
+}
+
+/* Load the records of 'rdb' into the dbs, until the EOF opcode or until
+ * 'limit' bytes were read if not zero. The AUX fields are passed to
+ * 'auxproc' if not NULL. 'dbid' is the current logical db, it is updated
+ * by the SELECTDB opcodes. Returns VR_OK on success, VR_ERROR if the
+ * file is truncated or corrupted. */
+typedef int rdbAuxProc(rio *rdb, robj *auxkey, robj *auxval, void *privdata);
+
+static int rdbLoadRecords(rio *rdb, size_t limit, int *dbid, long long now,
+                          long long *keys, rdbAuxProc *auxproc, void *privdata) {
+    long long expiretime;
+    robj *key, *val;
+    int type;
+
+    while (limit == 0 || rdb->processed_bytes < limit) {
+        expiretime = -1;
+
+        /* Read type. */
+        if ((type = rdbLoadType(rdb)) == -1) return VR_ERROR;
+
+        /* Handle special types. */
+        if (type == RDB_OPCODE_EXPIRETIME) {
+            /* EXPIRETIME: load an expire associated with the next key
+             * to load. Note that after loading an expire we need to
+             * load the actual type, and continue. */
+            if ((expiretime = rdbLoadTime(rdb)) == -1) return VR_ERROR;
+            /* We read the time so we need to read the object type again. */
+            if ((type = rdbLoadType(rdb)) == -1) return VR_ERROR;
+            /* the EXPIRETIME opcode specifies time in seconds, so convert
+             * into milliseconds. */
+            expiretime *= 1000;
+        } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
+            /* EXPIRETIME_MS: milliseconds precision expire times introduced
+             * with RDB v3. Like EXPIRETIME but no with more precision. */
+            if ((expiretime = rdbLoadMillisecondTime(rdb)) == -1) return VR_ERROR;
+            /* We read the time so we need to read the object type again. */
+            if ((type = rdbLoadType(rdb)) == -1) return VR_ERROR;
+        } else if (type == RDB_OPCODE_EOF) {
+            /* EOF: End of file, exit the main loop. */
+            return VR_OK;
+        } else if (type == RDB_OPCODE_SELECTDB) {
+            /* SELECTDB: Select the specified database. */
+            uint32_t id;
+
+            if ((id = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return VR_ERROR;
+            if (id >= (unsigned)server.dblnum) {
+                log_error("FATAL: Data file was created with a server "
+                    "configured to handle more than %d databases. Exiting",
+                    server.dblnum);
+                return VR_ERROR;
+            }
+            *dbid = (int)id;
+            continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_RESIZEDB) {
+            /* RESIZEDB: Hint about the size of the keys in the currently
+             * selected data base, in order to avoid useless rehashing.
+             * The keys are spread over the internal dbs of the logical db. */
+            uint32_t db_size, expires_size;
+            int j;
+
+            if ((db_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
+                return VR_ERROR;
+            if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
+                return VR_ERROR;
+            for (j = 0; j < server.dbinum; j ++) {
+                redisDb *db = darray_get(&server.dbs,
+                    (uint32_t)(*dbid*server.dbinum+j));
+                lockDbWrite(db);
+                if (dictSize(db->dict) == 0)
+                    dictExpand(db->dict,db_size/(uint32_t)server.dbinum+1);
+                unlockDb(db);
+            }
+            continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_AUX) {
+            /* AUX: generic string-string fields. Use to add state to RDB
+             * which is backward compatible. Implementations of RDB loading
+             * are requierd to skip AUX fields they don't understand.
+             *
+             * An AUX field is composed of two strings: key and value. */
+            robj *auxkey, *auxval;
+            int ret = VR_OK;
+
+            if ((auxkey = rdbLoadStringObject(rdb)) == NULL) return VR_ERROR;
+            if ((auxval = rdbLoadStringObject(rdb)) == NULL) return VR_ERROR;
+
+            if (((char*)auxkey->ptr)[0] == '%') {
+                /* All the fields with a name staring with '%' are considered
+                 * information fields and are logged at startup with a log
+                 * level of NOTICE. */
+                log_notice("RDB '%s': %s", (char*)auxkey->ptr,
+                    (char*)auxval->ptr);
+            } else if (auxproc != NULL) {
+                ret = auxproc(rdb,auxkey,auxval,privdata);
+            } else {
+                /* We ignore fields we don't understand, as by AUX field
+                 * contract. */
+                log_debug(LOG_DEBUG, "Unrecognized RDB AUX field: '%s'",
+                    (char*)auxkey->ptr);
+            }
+
+            freeObject(auxkey);
+            freeObject(auxval);
+            if (ret != VR_OK) return VR_ERROR;
+            continue; /* Read type again. */
+        }
+
+        /* Read key */
+        if (!rdbIsObjectType(type)) {
+            log_error("Unknown RDB type %d", type);
+            return VR_ERROR;
+        }
+        if ((key = rdbLoadStringObject(rdb)) == NULL) return VR_ERROR;
+        /* Read value */
+        if ((val = rdbLoadObject(type,rdb)) == NULL) {
+            freeObject(key);
+            return VR_ERROR;
+        }
+
+        *keys += rdbLoadAddKey(*dbid,key,val,expiretime,now);
+    }
+
+    return limit == 0 ? VR_ERROR : VR_OK;
+}
+
+static void *rdbLoaderRun(void *data) {
+    rdbLoader *loader = data;
+    rdbLoadJob *job = loader->job;
+    long long keys = 0;
+    FILE *fp;
+    rio rdb;
+    int j;
+
+    vr_eventloop_bind(&rdb_load_vel);
+
+    fp = fopen(job->filename,"r");
+    if (fp == NULL) {
+        log_error("Failed opening the RDB file %s: %s",
+            job->filename, strerror(errno));
+        loader->status = VR_ERROR;
+        return NULL;
+    }
+
+    loader->status = VR_OK;
+    while ((j = atomic_add(job->next_segment,1)-1) < job->nsegments) {
+        rdbSegment *seg = &job->segments[j];
+        int dbid = 0;
+
+        if (fseeko(fp,job->base+seg->offset,SEEK_SET) == -1) {
+            loader->status = VR_ERROR;
+            break;
+        }
+        rioInitWithFile(&rdb,fp);
+        if (seg->cksum) rdb.update_cksum = rioGenericUpdateChecksum;
+        if (rdbLoadRecords(&rdb,(size_t)seg->len,&dbid,job->now,&keys,
+                NULL,NULL) != VR_OK ||
+            rdb.processed_bytes != (size_t)seg->len) {
+            log_error("Short read or corrupted segment of db %d "
+                "loading the RDB file", seg->idx);
+            loader->status = VR_ERROR;
+            break;
+        }
+        if (seg->cksum && rdb.cksum != seg->cksum) {
+            log_error("Wrong RDB checksum of the segment of db %d", seg->idx);
+            loader->status = VR_ERROR;
+            break;
+        }
+    }
+    fclose(fp);
+    atomic_add(job->keys,keys);
+
+    return NULL;
+}
+
+/* Parse the RDB_AUX_SEGMENTS field. */
+static int rdbParseSegments(rdbLoadJob *job, sds value) {
+    sds *entries;
+    int count, j;
+
+    entries = sdssplitlen(value,(int)sdslen(value),",",1,&count);
+    if (entries == NULL) return VR_ERROR;
+    job->segments = dcalloc(count ? count : 1,sizeof(rdbSegment));
+    job->nsegments = 0;
+    for (j = 0; j < count; j ++) {
+        rdbSegment *seg = &job->segments[job->nsegments];
+        long long offset, len;
+        unsigned long long cksum;
+        int idx;
+
+        if (sdslen(entries[j]) == 0) continue;
+        if (sscanf(entries[j],"%d:%lld:%lld:%llx",
+                &idx,&offset,&len,&cksum) != 4) {
+            sdsfreesplitres(entries,count);
+            return VR_ERROR;
+        }
+        seg->idx = idx;
+        seg->offset = (off_t)offset;
+        seg->len = (off_t)len;
+        seg->cksum = (uint64_t)cksum;
+        job->nsegments ++;
+    }
+    sdsfreesplitres(entries,count);
+    return VR_OK;
+}
+
+/* Start the loaders of the segments, and move the main stream after the
+ * segments, with the checksum it would have after reading them. */
+static int rdbLoadSegmentsAux(rio *rdb, robj *auxkey, robj *auxval, void *privdata) {
+    rdbLoadJob *job = privdata;
+    rdbLoader *loaders;
+    uint64_t cksum = rdb->cksum;
+    off_t end = 0;
+    int threads, j;
+
+    if (strcasecmp(auxkey->ptr,RDB_AUX_SEGMENTS)) return VR_OK;
+    if (job->segments != NULL || rdbParseSegments(job,auxval->ptr) != VR_OK) {
+        log_error("Wrong %s field in the RDB file", RDB_AUX_SEGMENTS);
+        return VR_ERROR;
+    }
+
+    job->base = rioTell(rdb);
+    for (j = 0; j < job->nsegments; j ++) {
+        rdbSegment *seg = &job->segments[j];
+        if (seg->offset+seg->len > end) end = seg->offset+seg->len;
+        if (rdb->update_cksum)
+            cksum = crc64_combine(cksum,seg->cksum,(uint64_t)seg->len);
+    }
+
+    conf_server_get(CONFIG_SOPN_RDBTHREADS,&threads);
+    if (threads > job->nsegments) threads = job->nsegments;
+    loaders = dcalloc(threads ? threads : 1,sizeof(rdbLoader));
+    for (j = 0; j < threads; j ++) {
+        loaders[j].job = job;
+        loaders[j].status = VR_ERROR;
+        vr_thread_init(&loaders[j].thread);
+        loaders[j].thread.fun_run = rdbLoaderRun;
+        loaders[j].thread.data = &loaders[j];
+        vr_thread_start(&loaders[j].thread);
+    }
+
+    /* The main thread waits the loaders here, as it can not add the keys
+     * after the segments before the segments keys. */
+    for (j = 0; j < threads; j ++) {
+        pthread_join(loaders[j].thread.thread_id, NULL);
+    }
+    for (j = 0; j < threads; j ++) {
+        if (loaders[j].status != VR_OK) {
+            dfree(loaders);
+            return VR_ERROR;
+        }
+    }
+    dfree(loaders);
+
+    if (fseeko(rdb->io.file.fp,job->base+end,SEEK_SET) == -1) return VR_ERROR;
+    rdb->processed_bytes += (size_t)end;
+    rdb->cksum = cksum;
+    return VR_OK;
+}
+
+/* Load the RDB file 'filename' into the dbs, called at startup before the
+ * threads run. Returns VR_OK on success, VR_ERROR if the file is missing,
+ * truncated or corrupted, errno is ENOENT if the file is missing. */
+int rdbLoad(char *filename) {
+    rdbLoadJob job;
+    uint64_t cksum, expected;
+    long long keys = 0;
+    char buf[1024];
+    int rdbver, dbid = 0;
+    FILE *fp;
+    rio rdb;
+    int checksum, ret;
+
+    fp = fopen(filename,"r");
+    if (fp == NULL) return VR_ERROR;
+
+    memset(&job,0,sizeof(job));
+    job.filename = filename;
+    job.now = vr_msec_now();
+
+    memset(&rdb_load_vel,0,sizeof(rdb_load_vel));
+    rdb_load_vel.hz = server.hz;
+    rdb_load_vel.lruclock = getLRUClock() & LRU_CLOCK_MAX;
+    conf_cache_init(&rdb_load_vel.cc);
+    conf_cache_update(&rdb_load_vel.cc);
+    vr_eventloop_bind(&rdb_load_vel);
+
+    conf_server_get(CONFIG_SOPN_RDBCHECKSUM,&checksum);
+    rioInitWithFile(&rdb,fp);
+    rdb.update_cksum = rioGenericUpdateChecksum;
+    server.loading = 1;
+    server.loading_start_time = time(NULL);
+
+    if (rioRead(&rdb,buf,9) == 0) goto eoferr;
+    buf[9] = '\0';
+    if (memcmp(buf,"REDIS",5) != 0) {
+        log_error("Wrong signature trying to load DB from file");
+        errno = EINVAL;
+        goto err;
+    }
+    rdbver = atoi(buf+5);
+    if (rdbver < 1 || rdbver > RDB_VERSION) {
+        log_error("Can't handle RDB format version %d",rdbver);
+        errno = EINVAL;
+        goto err;
+    }
+
+    if (rdbLoadRecords(&rdb,0,&dbid,job.now,&keys,
+            rdbLoadSegmentsAux,&job) != VR_OK) goto eoferr;
+
+    /* Verify the checksum if RDB version is >= 5 */
+    if (rdbver >= 5 && checksum) {
+        cksum = rdb.cksum;
+        if (rioRead(&rdb,&expected,8) == 0) goto eoferr;
+        memrev64ifbe(&expected);
+        if (expected == 0) {
+            log_warn("RDB file was saved with checksum disabled: no check performed.");
+        } else if (cksum != expected) {
+            log_error("Wrong RDB checksum. Aborting now.");
+            goto err;
+        }
+    }
+
+    keys += job.keys;
+    log_notice("Loaded %lld keys from %s, %d segments in parallel",
+        keys, filename, job.nsegments);
+    ret = VR_OK;
+    goto done;
+
+eoferr: /* unexpected end of file is handled here with a fatal exit */
+    log_error("Short read or OOM loading DB. Unrecoverable error, aborting now.");
+err:
+    if (errno == 0 || errno == ENOENT) errno = EINVAL;
+    ret = VR_ERROR;
+done:
+    fclose(fp);
+    if (job.segments) dfree(job.segments);
+    server.loading = 0;
+    vr_eventloop_bind(NULL);
+    conf_cache_deinit(&rdb_load_vel.cc);
+    rdb_dirty_at_lastsave = rdbDirtyCount();
+    if (ret == VR_OK) server.lastsave = time(NULL);
+    return ret;
+}
+
+void saveCommand(client *c) {
+    sds filename;
+
+    if (rdbSaveInProgress()) {
+        addReplyError(c,"Background save already in progress");
+        return;
+    }
+    filename = rdbGetFilename();
+    if (rdbSave(filename) == VR_OK) {
+        addReply(c,shared.ok);
+    } else {
+        addReply(c,shared.err);
+    }
+    sdsfree(filename);
+}
+
+void bgsaveCommand(client *c) {
+    sds filename;
+
+    if (c->argc > 1) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    if (rdbSaveInProgress()) {
+        addReplyError(c,"Background save already in progress");
+        return;
+    }
+    filename = rdbGetFilename();
+    if (rdbSaveBackground(filename) == VR_OK) {
+        addReplyStatus(c,"Background saving started");
+    } else {
+        addReply(c,shared.err);
+    }
+    sdsfree(filename);
+}
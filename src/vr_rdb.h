@@ -1,6 +1,11 @@
 #ifndef _VR_RDB_H_
 #define _VR_RDB_H_
 
+/* The current RDB version. When the format changes in a way that is no longer
+ * backward compatible this number gets incremented. Vire writes the format
+ * of redis-3.2. */
+#define RDB_VERSION 7
+
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
  * the first byte to interpreter the length:
@@ -28,12 +33,72 @@
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
 
+/* Dup object types to RDB object types. Only reason is readability (are we
+ * dealing with RDB types or with in-memory object types?). */
+#define RDB_TYPE_STRING 0
+#define RDB_TYPE_LIST   1
+#define RDB_TYPE_SET    2
+#define RDB_TYPE_ZSET   3
+#define RDB_TYPE_HASH   4
+/* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
+
+/* Object types for encoded objects. */
+#define RDB_TYPE_HASH_ZIPMAP    9
+#define RDB_TYPE_LIST_ZIPLIST  10
+#define RDB_TYPE_SET_INTSET    11
+#define RDB_TYPE_ZSET_ZIPLIST  12
+#define RDB_TYPE_HASH_ZIPLIST  13
+#define RDB_TYPE_LIST_QUICKLIST 14
+/* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
+
+/* Test if a type is an object type. */
+#define rdbIsObjectType(t) ((t >= 0 && t <= 4) || (t >= 9 && t <= 14))
+
+/* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
+#define RDB_OPCODE_AUX        250
+#define RDB_OPCODE_RESIZEDB   251
+#define RDB_OPCODE_EXPIRETIME_MS 252
+#define RDB_OPCODE_EXPIRETIME 253
+#define RDB_OPCODE_SELECTDB   254
+#define RDB_OPCODE_EOF        255
+
+/* Vire dumps every internal db in parallel and writes the position of every
+ * dump in this AUX field, so the loader can read them in parallel too. Other
+ * loaders just skip the field, the file is a plain RDB file. */
+#define RDB_AUX_SEGMENTS "vire-segments"
+
 struct saveparam {
     time_t seconds;
     int changes;
 };
 
+int rdbSaveType(rio *rdb, unsigned char type);
+int rdbLoadType(rio *rdb);
+int rdbSaveTime(rio *rdb, time_t t);
+time_t rdbLoadTime(rio *rdb);
+int rdbSaveLen(rio *rdb, uint32_t len);
+uint32_t rdbLoadLen(rio *rdb, int *isencoded);
+int rdbSaveMillisecondTime(rio *rdb, long long t);
+long long rdbLoadMillisecondTime(rio *rdb);
+ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len);
+int rdbSaveStringObject(rio *rdb, robj *obj);
+robj *rdbLoadStringObject(rio *rdb);
+int rdbSaveObjectType(rio *rdb, robj *o);
+int rdbLoadObjectType(rio *rdb);
+ssize_t rdbSaveObject(rio *rdb, robj *o);
+robj *rdbLoadObject(int rdbtype, rio *rdb);
+int rdbSaveKeyValuePair(rio *rdb, sds key, robj *val, long long expiretime, long long now);
+int rdbSaveInternalDb(rio *rdb, int idx, long long now);
+
 int rdbSave(char *filename);
+int rdbSaveBackground(char *filename);
+int rdbLoad(char *filename);
+sds rdbGetFilename(void);
+int rdbSaveInProgress(void);
+long long rdbChangesSinceLastSave(void);
 void rdbRemoveTempFile(pid_t childpid);
 
+void saveCommand(struct client *c);
+void bgsaveCommand(struct client *c);
+
 #endif
@@ -1,31 +1,106 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <vr_core.h>
 
+/* ----------------------------------------------------------------------------
+ * Replication
+ *
+ * The slaves receive the stream of commands the AOF is made of, merged by
+ * the AOF writer thread in the order the workers wrote the dbs, see
+ * aofWriterMerge(). The writer is the only one adding to the backlog, a
+ * ring buffer of the last repl-backlog-size bytes of the stream, so the
+ * workers never take a lock to propagate a command.
+ *
+ * Every slave is served by the worker its connection belongs to, that
+ * copies the stream from the backlog to the slave output buffer a bit at a
+ * time, as the slave reads. The backlog is read with no lock: before
+ * overwriting a part of the ring the writer reserves the stream offsets it
+ * is going to add in repl_backlog_reserved, and it publishes the new
+ * master_repl_offset after the copy, so a worker checks after copying a
+ * range that the writer did not reserve it meanwhile. A slave so behind
+ * that its range was overwritten is closed, and comes back with a full
+ * resynchronization.
+ *
+ * The full resynchronization sends a snapshot taken by the AOF rewrite
+ * engine without fork(), see aofRewriteStart(), that the writer marks with
+ * the stream offset it starts from. The slave loads it and goes on with
+ * the stream from that offset. A snapshot is also good for the slaves
+ * arriving later, as long as its offset is in the backlog.
+ *
+ * The slave side runs in the replication thread: it connects to the
+ * master with blocking calls, loads the snapshot, and then runs the stream
+ * as the commands of a client of its eventloop, the AOF of the slave
+ * gets them as the writes of a worker.
+ * ------------------------------------------------------------------------- */
+
+#if defined(__ATOMIC_SEQ_CST)
+#define repl_atomic_load(_ptr) __atomic_load_n(_ptr,__ATOMIC_ACQUIRE)
+#define repl_atomic_store(_ptr,_val) __atomic_store_n(_ptr,_val,__ATOMIC_RELEASE)
+#define repl_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define repl_atomic_load(_ptr) (__sync_synchronize(),*(volatile typeof(*(_ptr))*)(_ptr))
+#define repl_atomic_store(_ptr,_val) do {           \
+    __sync_synchronize();                           \
+    *(volatile typeof(*(_ptr))*)(_ptr) = (_val);    \
+} while(0)
+#define repl_fence() __sync_synchronize()
+#endif
+
 struct vr_replication repl;
 
+static void *replicationThreadRun(void *args);
+
 int vr_replication_init(void)
 {
     vr_eventloop_init(&repl.vel,1000);
+    repl.vel.cstable = commandStatsTableCreate();
+    repl.vel.thread.fun_run = replicationThreadRun;
+    repl.vel.thread.data = NULL;
 
+    pthread_mutex_init(&repl.lock,NULL);
     repl.role = REPLICATION_ROLE_MASTER;
     repl.master = NULL;
-    repl.cached_master = NULL;
     repl.slaves = NULL;
+    repl.slaveseldb = -1;
+    repl.master_repl_offset = 0;
+    repl.repl_ping_slave_period = 0;
     repl.repl_no_slaves_since = 0;
     repl.repl_min_slaves_to_write = 0;
     repl.repl_min_slaves_max_lag = 0;
     repl.repl_good_slaves_count = 0;
-    repl.repl_state = REPL_STATE_NONE;
-    repl.repl_down_since = 0;
 
     /* Replication partial resync backlog */
     repl.repl_backlog = NULL;
     repl.repl_backlog_size = CONFIG_DEFAULT_REPL_BACKLOG_SIZE;
-    repl.repl_backlog_histlen = 0;
-    repl.repl_backlog_idx = 0;
-    repl.repl_backlog_off = 0;
-    repl.repl_backlog_time_limit = CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT;
+    repl.repl_backlog_reserved = 0;
+    repl.repl_backlog_min_offset = 0;
     repl.repl_no_slaves_since = time(NULL);
 
+    repl.snapshot_id = 0;
+    repl.snapshot_file = NULL;
+    repl.snapshot_offset = -1;
+    repl.snapshot_chunks = NULL;
+    repl.stat_sync_full = 0;
+    repl.stat_sync_partial_ok = 0;
+    repl.stat_sync_partial_err = 0;
+
+    repl.masterauth = NULL;
+    repl.masterhost = NULL;
+    repl.masterport = 0;
+    repl.master_changed = 0;
+    repl.repl_timeout = CONFIG_DEFAULT_REPL_TIMEOUT;
+    repl.repl_syncio_timeout = CONFIG_REPL_SYNCIO_TIMEOUT;
+    repl.repl_state = REPL_STATE_NONE;
+    repl.repl_transfer_lastio = 0;
+    repl.repl_serve_stale_data = 1;
+    repl.repl_slave_ro = 1;
+    repl.repl_down_since = 0;
+    repl.repl_master_runid[0] = '\0';
+    repl.repl_master_initial_offset = -1;
+    repl.repl_master_initial_dbid = -1;
+    repl.slave_repl_offset = -1;
+
     repl.slaves = dlistCreate();
 
     return VR_OK;
@@ -33,31 +108,40 @@ int vr_replication_init(void)
 
 void vr_replication_deinit(void)
 {
-    vr_eventloop_deinit(&repl.vel);
-
+    /* The clients are released with the eventloops they belong to. */
     if (repl.master != NULL) {
         freeClient(repl.master);
         repl.master = NULL;
     }
 
-    if (repl.cached_master != NULL) {
-        freeClient(repl.cached_master);
-        repl.cached_master = NULL;
-    }
+    vr_eventloop_deinit(&repl.vel);
 
     if (repl.repl_backlog != NULL) {
         dfree(repl.repl_backlog);
         repl.repl_backlog = NULL;
     }
 
+    if (repl.snapshot_file != NULL) {
+        unlink(repl.snapshot_file);
+        sdsfree(repl.snapshot_file);
+        repl.snapshot_file = NULL;
+    }
+    if (repl.snapshot_chunks != NULL) {
+        sdsfree(repl.snapshot_chunks);
+        repl.snapshot_chunks = NULL;
+    }
+
+    if (repl.masterhost != NULL) {
+        sdsfree(repl.masterhost);
+        repl.masterhost = NULL;
+    }
+
     if (repl.slaves != NULL) {
-        client *slave;
-        while (slave = dlistPop(repl.slaves)) {
-            freeClient(slave);
-        }
         dlistRelease(repl.slaves);
         repl.slaves = NULL;
     }
+
+    pthread_mutex_destroy(&repl.lock);
 }
 
 /* This is called by unblockClient() to perform the blocking op type
@@ -83,86 +167,441 @@ void refreshGoodSlavesCount(void) {
     if (!repl.repl_min_slaves_to_write ||
         !repl.repl_min_slaves_max_lag) return;
 
+    pthread_mutex_lock(&repl.lock);
     dlistRewind(repl.slaves,&li);
     while((ln = dlistNext(&li))) {
         client *slave = ln->value;
-        time_t lag = repl.vel.unixtime - slave->repl_ack_time;
+        time_t lag = time(NULL) - slave->repl_ack_time;
 
         if (slave->replstate == SLAVE_STATE_ONLINE &&
             lag <= repl.repl_min_slaves_max_lag) good++;
     }
     repl.repl_good_slaves_count = good;
+    pthread_mutex_unlock(&repl.lock);
 }
 
-/* This function is called when the slave lose the connection with the
- * master into an unexpected way. */
-void replicationHandleMasterDisconnection(void) {
-    repl.master = NULL;
-    repl.repl_state = REPL_STATE_CONNECT;
-    repl.repl_down_since = repl.vel.unixtime;
-    /* We lost connection with our master, don't disconnect slaves yet,
-     * maybe we'll be able to PSYNC with our master later. We'll disconnect
-     * the slaves only if we'll have to do a full resync with our master. */
+/* --------------------------- REPLICATION BACKLOG -------------------------- */
+
+/* Create the backlog the first time a slave connects. The writer starts to
+ * fill it at its next merge, from the current offset. */
+static int replicationCreateBacklog(void) {
+    long long size;
+
+    pthread_mutex_lock(&repl.lock);
+    if (repl.repl_backlog == NULL) {
+        conf_server_get(CONFIG_SOPN_REPLBACKLOGSIZE,&size);
+        if (size < CONFIG_REPL_BACKLOG_MIN_SIZE)
+            size = CONFIG_REPL_BACKLOG_MIN_SIZE;
+        repl.repl_backlog_size = size;
+        repl.repl_backlog_reserved = repl.master_repl_offset;
+        repl.repl_backlog_min_offset = repl.master_repl_offset;
+        repl_atomic_store(&repl.repl_backlog,dalloc((size_t)size));
+    }
+    pthread_mutex_unlock(&repl.lock);
+
+    return VR_OK;
 }
 
+int replicationBacklogEnabled(void) {
+    return repl_atomic_load(&repl.repl_backlog) != NULL;
+}
 
-/* ---------------------- MASTER CACHING FOR PSYNC -------------------------- */
+/* Called just by the writer thread: add the stream bytes to the ring.
+ * The bytes about to be overwritten are reserved first, the new offset
+ * is published after the copy. */
+void replicationBacklogAppend(const char *buf, size_t len) {
+    long long start = repl.master_repl_offset, end = start+(long long)len;
+    long long size = repl.repl_backlog_size, idx, thislen;
 
-/* In order to implement partial synchronization we need to be able to cache
- * our master's client structure after a transient disconnection.
- * It is cached into server.cached_master and flushed away using the following
- * functions. */
+    repl_atomic_store(&repl.repl_backlog_reserved,end);
+    repl_fence();
 
-/* This function is called by freeClient() in order to cache the master
- * client structure instead of destryoing it. freeClient() will return
- * ASAP after this function returns, so every action needed to avoid problems
- * with a client that is really "suspended" has to be done by this function.
- *
- * The other functions that will deal with the cached master are:
- *
- * replicationDiscardCachedMaster() that will make sure to kill the client
- * as for some reason we don't want to use it in the future.
- *
- * replicationResurrectCachedMaster() that is used after a successful PSYNC
- * handshake in order to reactivate the cached master.
- */
-void replicationCacheMaster(client *c) {
-    ASSERT(repl.master != NULL && repl.cached_master == NULL);
-    log_debug(LOG_NOTICE,"Caching the disconnected master state.");
+    /* Just the last 'size' bytes survive. */
+    if ((long long)len > size) {
+        buf += (long long)len-size;
+        start = end-size;
+    }
+    while (start < end) {
+        idx = start%size;
+        thislen = size-idx;
+        if (thislen > end-start) thislen = end-start;
+        memcpy(repl.repl_backlog+idx,buf,(size_t)thislen);
+        buf += thislen;
+        start += thislen;
+    }
 
-    /* Unlink the client from the server structures. */
-    unlinkClient(c);
+    repl_atomic_store(&repl.master_repl_offset,end);
+}
 
-    /* Save the master. Server.master will be set to null later by
-     * replicationHandleMasterDisconnection(). */
-    repl.cached_master = repl.master;
+/* Return 1 if the stream from 'offset' on is still in the backlog. */
+static int replicationBacklogHas(long long offset) {
+    long long end, reserved;
 
-    /* Invalidate the Peer ID cache. */
-    if (c->peerid) {
-        sdsfree(c->peerid);
-        c->peerid = NULL;
+    if (!replicationBacklogEnabled()) return 0;
+    end = repl_atomic_load(&repl.master_repl_offset);
+    reserved = repl_atomic_load(&repl.repl_backlog_reserved);
+    return offset >= repl.repl_backlog_min_offset && offset <= end &&
+        reserved-offset <= repl.repl_backlog_size;
+}
+
+/* Copy 'len' stream bytes from 'offset' on, that the caller knows are
+ * below master_repl_offset. Return VR_ERROR if the writer overwrote
+ * them, before or during the copy. */
+static int replicationBacklogRead(long long offset, char *buf, long long len) {
+    long long size = repl.repl_backlog_size, idx, thislen, pos = offset;
+
+    while (pos < offset+len) {
+        idx = pos%size;
+        thislen = size-idx;
+        if (thislen > offset+len-pos) thislen = offset+len-pos;
+        memcpy(buf,repl.repl_backlog+idx,(size_t)thislen);
+        buf += thislen;
+        pos += thislen;
     }
 
-    /* Caching the master happens instead of the actual freeClient() call,
-     * so make sure to adjust the replication state. This function will
-     * also set server.master to NULL. */
-    replicationHandleMasterDisconnection();
+    repl_fence();
+    if (repl_atomic_load(&repl.repl_backlog_reserved)-offset > size)
+        return VR_ERROR;
+    return VR_OK;
+}
+
+/* Called by the writer after adding to the backlog: wake up the workers
+ * serving slaves. The list length is read with no lock, a worker missing
+ * the wake up feeds its slaves in its cron anyway. */
+void replicationWakeSlaves(void) {
+    uint32_t idx;
+    vr_worker *worker;
+
+    for (idx = 0; idx < darray_n(&workers); idx ++) {
+        worker = darray_get(&workers, idx);
+        if (dlistLength(worker->vel.slaves) > 0)
+            vr_notifier_notify(&worker->notifier);
+    }
 }
 
+/* ------------------------------ MASTER SIDE ------------------------------- */
+
 /* Return the pointer to a string representing the slave ip:listening_port
  * pair. Mostly useful for logging, since we want to log a slave using its
  * IP address and it's listening port which is more clear for the user, for
  * example: "Closing connection with slave 10.1.2.3:6380". */
 char *replicationGetSlaveName(client *c) {
-    static char buf[VR_INET_PEER_ID_LEN];
-    char ip[VR_INET_ADDRSTRLEN];
-
-    ip[0] = '\0';
-    buf[0] = '\0';
-    
+    static __thread char buf[VR_INET_PEER_ID_LEN];
+    char *peerid = getClientPeerId(c), *p;
+    int iplen;
+
+    p = strrchr(peerid,':');
+    iplen = p ? (int)(p-peerid) : (int)strlen(peerid);
+    if (c->slave_listening_port)
+        snprintf(buf,sizeof(buf),"%.*s:%d",iplen,peerid,c->slave_listening_port);
+    else
+        snprintf(buf,sizeof(buf),"%s",peerid);
     return buf;
 }
 
+/* Drop the slave from the replication lists, called by freeClient(). */
+void replicationRemoveSlave(client *c) {
+    dlistNode *ln;
+
+    pthread_mutex_lock(&repl.lock);
+    ln = dlistSearchKey(repl.slaves,c);
+    ASSERT(ln != NULL);
+    dlistDelNode(repl.slaves,ln);
+    /* We need to remember the time when we started to have zero
+     * attached slaves. */
+    if (dlistLength(repl.slaves) == 0)
+        repl.repl_no_slaves_since = c->vel->unixtime;
+    pthread_mutex_unlock(&repl.lock);
+
+    ln = dlistSearchKey(c->vel->slaves,c);
+    ASSERT(ln != NULL);
+    dlistDelNode(c->vel->slaves,ln);
+
+    if (c->repldbfd != -1) {
+        close(c->repldbfd);
+        c->repldbfd = -1;
+    }
+    if (c->replpreamble) {
+        sdsfree(c->replpreamble);
+        c->replpreamble = NULL;
+    }
+    refreshGoodSlavesCount();
+}
+
+/* Queue the stream for an online slave, from the backlog, up to
+ * REPL_SLAVE_FEED_LIMIT bytes pending in its output buffer. Return
+ * VR_ERROR if the slave was freed. */
+static int replicationFeedSlave(client *slave) {
+    char buf[PROTO_IOBUF_LEN];
+    long long end, len, pending;
+
+    pending = (long long)slave->reply_bytes+slave->bufpos;
+    while (pending < REPL_SLAVE_FEED_LIMIT) {
+        end = repl_atomic_load(&repl.master_repl_offset);
+        if (slave->repl_feed_off >= end) break;
+
+        len = end-slave->repl_feed_off;
+        if (len > (long long)sizeof(buf)) len = sizeof(buf);
+        if (replicationBacklogRead(slave->repl_feed_off,buf,len) != VR_OK) {
+            log_warn("Slave %s fell behind the replication backlog, "
+                "closing the connection", replicationGetSlaveName(slave));
+            freeClient(slave);
+            return VR_ERROR;
+        }
+        addReplyString(slave,buf,(size_t)len);
+        slave->repl_feed_off += len;
+        pending += len;
+    }
+    return VR_OK;
+}
+
+/* This function puts a slave in the online state, just after it received
+ * the snapshot, and starts to send it the stream from the offset of the
+ * snapshot. */
+void putSlaveOnline(client *slave) {
+    slave->replstate = SLAVE_STATE_ONLINE;
+    slave->repl_put_online_on_ack = 0;
+    slave->repl_ack_time = slave->vel->unixtime; /* Prevent false timeout. */
+    refreshGoodSlavesCount();
+    log_notice("Synchronization with slave %s succeeded",
+        replicationGetSlaveName(slave));
+    replicationFeedSlave(slave);
+}
+
+/* Write event handler sending the snapshot to the slave, after the
+ * +FULLRESYNC line, the chunk table and the bulk length. */
+static void sendSnapshotToSlave(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *slave = privdata;
+    char buf[PROTO_IOBUF_LEN];
+    ssize_t nwritten, buflen;
+
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (slave->replpreamble) {
+        nwritten = write(fd,slave->replpreamble,sdslen(slave->replpreamble));
+        if (nwritten == -1) {
+            if (errno == EAGAIN) return;
+            log_warn("Write error sending the snapshot preamble to slave: %s",
+                strerror(errno));
+            freeClient(slave);
+            return;
+        }
+        update_stats_add(slave->vel->stats, net_output_bytes, nwritten);
+        sdsrange(slave->replpreamble,(int)nwritten,-1);
+        if (sdslen(slave->replpreamble) != 0) return;
+        sdsfree(slave->replpreamble);
+        slave->replpreamble = NULL;
+    }
+
+    if (slave->repldboff < slave->repldbsize) {
+        if (lseek(slave->repldbfd,slave->repldboff,SEEK_SET) == -1 ||
+            (buflen = read(slave->repldbfd,buf,PROTO_IOBUF_LEN)) <= 0) {
+            log_warn("Read error sending the snapshot to slave: %s",
+                strerror(errno));
+            freeClient(slave);
+            return;
+        }
+        if ((nwritten = write(fd,buf,(size_t)buflen)) == -1) {
+            if (errno != EAGAIN) {
+                log_warn("Write error sending the snapshot to slave: %s",
+                    strerror(errno));
+                freeClient(slave);
+            }
+            return;
+        }
+        slave->repldboff += nwritten;
+        update_stats_add(slave->vel->stats, net_output_bytes, nwritten);
+    }
+
+    if (slave->repldboff == slave->repldbsize) {
+        close(slave->repldbfd);
+        slave->repldbfd = -1;
+        aeDeleteFileEvent(slave->vel->el,slave->conn->sd,AE_WRITABLE);
+        putSlaveOnline(slave);
+    }
+}
+
+/* Start to send the last snapshot to the slave. Called with the
+ * replication lock held. */
+static int replicationSendSnapshot(client *slave) {
+    struct stat sb;
+    int fd;
+
+    fd = open(repl.snapshot_file,O_RDONLY);
+    if (fd == -1 || fstat(fd,&sb) == -1) {
+        log_warn("Can't open the snapshot %s for the slaves: %s",
+            repl.snapshot_file,strerror(errno));
+        if (fd != -1) close(fd);
+        return VR_ERROR;
+    }
+
+    slave->repldbfd = fd;
+    slave->repldboff = 0;
+    slave->repldbsize = sb.st_size;
+    slave->replpreamble = sdsempty();
+    if (!(slave->flags & CLIENT_PRE_PSYNC)) {
+        slave->replpreamble = sdscatprintf(slave->replpreamble,
+            "+FULLRESYNC %s %lld\r\n",server.runid,repl.snapshot_offset);
+    }
+    if (slave->slave_capa & SLAVE_CAPA_CHUNKS && repl.snapshot_chunks != NULL)
+        slave->replpreamble = sdscatsds(slave->replpreamble,repl.snapshot_chunks);
+    slave->replpreamble = sdscatprintf(slave->replpreamble,"$%lld\r\n",
+        (long long)sb.st_size);
+    slave->repl_feed_off = repl.snapshot_offset;
+    slave->replstate = SLAVE_STATE_SEND_BULK;
+
+    if (aeCreateFileEvent(slave->vel->el,slave->conn->sd,AE_WRITABLE,
+        sendSnapshotToSlave,slave) == AE_ERR) {
+        return VR_ERROR;
+    }
+    log_notice("Sending the snapshot at offset %lld to slave %s",
+        repl.snapshot_offset,replicationGetSlaveName(slave));
+    return VR_OK;
+}
+
+/* A slave needs a full resynchronization: send it the last snapshot if
+ * the stream after it is still in the backlog, otherwise wait the next
+ * one. Called with the replication lock held. */
+static int replicationWaitSnapshot(client *slave) {
+    slave->repl_snapshot_id = repl.snapshot_id;
+    if (repl.snapshot_file != NULL &&
+        replicationBacklogHas(repl.snapshot_offset)) {
+        return replicationSendSnapshot(slave);
+    }
+
+    slave->replstate = SLAVE_STATE_WAIT_BGSAVE_END;
+    return aofRewriteScheduleSnapshot();
+}
+
+/* Called by the writer, or by the backend if the snapshot failed with a
+ * NULL filename: publish the snapshot for the waiting slaves. The file is
+ * made of the 'nchunks' dumps of the internal dbs of the lengths in
+ * 'chunks', the slaves able to load them in parallel get the table as
+ * "*<nchunks>\r\n" followed by ":<length>\r\n" for every chunk. The
+ * table is freed here. */
+void replicationSnapshotDone(sds filename, long long offset, long long *chunks, int nchunks) {
+    sds table = NULL;
+    int j;
+
+    if (filename != NULL && chunks != NULL) {
+        table = sdscatprintf(sdsempty(),"*%d\r\n",nchunks);
+        for (j = 0; j < nchunks; j ++)
+            table = sdscatprintf(table,":%lld\r\n",chunks[j]);
+    }
+    if (chunks != NULL) dfree(chunks);
+
+    pthread_mutex_lock(&repl.lock);
+    /* The slaves still reading the old file keep it open. */
+    if (repl.snapshot_file != NULL) {
+        unlink(repl.snapshot_file);
+        sdsfree(repl.snapshot_file);
+    }
+    repl.snapshot_file = filename;
+    repl.snapshot_offset = offset;
+    if (repl.snapshot_chunks != NULL) sdsfree(repl.snapshot_chunks);
+    repl.snapshot_chunks = table;
+    repl.snapshot_id ++;
+    pthread_mutex_unlock(&repl.lock);
+
+    replicationWakeSlaves();
+}
+
+/* Accept the PSYNC of the slave if the stream it asks for is in the
+ * backlog. Called with the replication lock held. */
+static int replicationTryPartialResync(client *c) {
+    long long psync_offset;
+    char *runid = c->argv[1]->ptr;
+
+    if (strcasecmp(runid,server.runid)) {
+        /* Run id "?" is used by slaves that want to force a full resync. */
+        if (runid[0] != '?') {
+            log_notice("Partial resynchronization not accepted: "
+                "Runid mismatch (Client asked for runid '%s', my runid is '%s')",
+                runid,server.runid);
+        } else {
+            log_notice("Full resync requested by slave %s",
+                replicationGetSlaveName(c));
+        }
+        return VR_ERROR;
+    }
+
+    if (getLongLongFromObject(c->argv[2],&psync_offset) != VR_OK ||
+        !replicationBacklogHas(psync_offset-1)) {
+        log_notice("Unable to partial resync with slave %s for lack of backlog "
+            "(Slave request was: %lld).",replicationGetSlaveName(c),psync_offset);
+        return VR_ERROR;
+    }
+
+    c->replstate = SLAVE_STATE_ONLINE;
+    c->repl_ack_time = c->vel->unixtime;
+    c->repl_feed_off = psync_offset-1;
+    addReplyString(c,"+CONTINUE\r\n",11);
+    log_notice("Partial resynchronization request from %s accepted. Sending "
+        "%lld bytes of backlog starting from offset %lld.",
+        replicationGetSlaveName(c),
+        repl_atomic_load(&repl.master_repl_offset)-c->repl_feed_off,
+        psync_offset);
+    return VR_OK;
+}
+
+/* SYNC and PSYNC command implementation. */
+void syncCommand(client *c) {
+    int ret;
+
+    /* ignore SYNC if already slave or in monitor mode */
+    if (c->flags & CLIENT_SLAVE) return;
+
+    if (repl.masterhost != NULL) {
+        addReplyError(c,"Can't SYNC with a slave, chained replication is not supported");
+        return;
+    }
+
+    /* SYNC can't be issued when the server has pending data to send to
+     * the client about already issued commands. We need a fresh reply
+     * buffer registering the differences between the BGSAVE and the current
+     * dataset, so that we can copy to other slaves if needed. */
+    if (clientHasPendingReplies(c) || c->flags & CLIENT_MULTI) {
+        addReplyError(c,"SYNC and PSYNC are invalid with pending output");
+        return;
+    }
+
+    log_notice("Slave %s asks for synchronization",replicationGetSlaveName(c));
+
+    replicationCreateBacklog();
+    if (aofStartStream() != VR_OK) {
+        addReplyError(c,"Unable to start the replication stream");
+        return;
+    }
+
+    c->flags |= CLIENT_SLAVE;
+    c->repl_ack_time = c->vel->unixtime;
+    dlistAddNodeTail(c->vel->slaves,c);
+
+    pthread_mutex_lock(&repl.lock);
+    dlistAddNodeTail(repl.slaves,c);
+    if (!strcasecmp(c->argv[0]->ptr,"psync")) {
+        if (replicationTryPartialResync(c) == VR_OK) {
+            repl.stat_sync_partial_ok ++;
+            pthread_mutex_unlock(&repl.lock);
+            refreshGoodSlavesCount();
+            replicationFeedSlave(c);
+            return;
+        }
+        repl.stat_sync_partial_err ++;
+    } else {
+        /* If a slave uses SYNC, we are dealing with an old implementation
+         * of the replication protocol (like redis-cli --slave). Flag the
+         * client so that we don't expect to receive REPLCONF ACK feedbacks. */
+        c->flags |= CLIENT_PRE_PSYNC;
+    }
+    repl.stat_sync_full ++;
+    ret = replicationWaitSnapshot(c);
+    pthread_mutex_unlock(&repl.lock);
+
+    if (ret != VR_OK) freeClientAsync(c);
+}
+
 /* REPLCONF <option> <value> <option> <value> ...
  * This command is used by a slave in order to configure the replication
  * process before starting it with the SYNC command.
@@ -198,6 +637,8 @@ void replconfCommand(client *c) {
             /* Ignore capabilities not understood by this master. */
             if (!strcasecmp(c->argv[j+1]->ptr,"eof"))
                 c->slave_capa |= SLAVE_CAPA_EOF;
+            else if (!strcasecmp(c->argv[j+1]->ptr,"chunks"))
+                c->slave_capa |= SLAVE_CAPA_CHUNKS;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -210,17 +651,12 @@ void replconfCommand(client *c) {
             if (offset > c->repl_ack_off)
                 c->repl_ack_off = offset;
             c->repl_ack_time = c->vel->unixtime;
-            /* If this was a diskless replication, we need to really put
-             * the slave online when the first ACK is received (which
-             * confirms slave is online and ready to get more data). */
-            if (c->repl_put_online_on_ack && c->replstate == SLAVE_STATE_ONLINE)
-                putSlaveOnline(c);
             /* Note: this command does not reply anything! */
             return;
         } else if (!strcasecmp(c->argv[j]->ptr,"getack")) {
             /* REPLCONF GETACK is used in order to request an ACK ASAP
              * to the slave. */
-            if (repl.masterhost && repl.master) replicationSendAck();
+            if (c->flags & CLIENT_MASTER) replicationSendAck();
             /* Note: this command does not reply anything! */
         } else {
             addReplyErrorFormat(c,"Unrecognized REPLCONF option: %s",
@@ -231,31 +667,148 @@ void replconfCommand(client *c) {
     addReply(c,shared.ok);
 }
 
-/* This function puts a slave in the online state, and should be called just
- * after a slave received the RDB file for the initial synchronization, and
- * we are finally ready to send the incremental stream of commands.
- *
- * It does a few things:
- *
- * 1) Put the slave in ONLINE state (useless when the function is called
- *    because state is already ONLINE but repl_put_online_on_ack is true).
- * 2) Make sure the writable event is re-installed, since calling the SYNC
- *    command disables it, so that we can accumulate output buffer without
- *    sending it to the slave.
- * 3) Update the count of good slaves. */
-void putSlaveOnline(client *slave) {
-    slave->replstate = SLAVE_STATE_ONLINE;
-    slave->repl_put_online_on_ack = 0;
-    slave->repl_ack_time = slave->vel->unixtime; /* Prevent false timeout. */
-    if (aeCreateFileEvent(slave->vel->el, slave->conn->sd, AE_WRITABLE,
-        sendReplyToClient, slave) == AE_ERR) {
-        log_warn("unable to register writable event for slave bulk transfer: %s", strerror(errno));
-        freeClient(slave);
+/* Called by the workers before sleeping: start to send the snapshot to the
+ * slaves waiting it, and queue the stream for the online ones. */
+void replicationBeforeSleep(vr_eventloop *vel) {
+    dlistIter li;
+    dlistNode *ln;
+    client *slave;
+    int ret;
+
+    if (dlistLength(vel->slaves) == 0) return;
+
+    dlistRewind(vel->slaves,&li);
+    while ((ln = dlistNext(&li))) {
+        slave = dlistNodeValue(ln);
+        if (slave->flags & CLIENT_CLOSE_ASAP) continue;
+
+        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_END) {
+            pthread_mutex_lock(&repl.lock);
+            ret = VR_OK;
+            if (repl.snapshot_id != slave->repl_snapshot_id) {
+                if (repl.snapshot_file == NULL) {
+                    log_warn("Snapshot for the slaves failed, closing %s",
+                        replicationGetSlaveName(slave));
+                    ret = VR_ERROR;
+                } else {
+                    ret = replicationWaitSnapshot(slave);
+                }
+            }
+            pthread_mutex_unlock(&repl.lock);
+            if (ret != VR_OK) freeClient(slave);
+        } else if (slave->replstate == SLAVE_STATE_ONLINE) {
+            replicationFeedSlave(slave);
+        }
+    }
+}
+
+/* Called by the worker cron. */
+void replicationWorkerCron(vr_eventloop *vel) {
+    dlistIter li;
+    dlistNode *ln;
+    client *slave;
+
+    if (dlistLength(vel->slaves) == 0) return;
+
+    /* We turned into a slave, no chained replication. */
+    if (repl.masterhost != NULL) {
+        while (dlistLength(vel->slaves) > 0) {
+            slave = dlistNodeValue(dlistFirst(vel->slaves));
+            freeClient(slave);
+        }
         return;
     }
-    refreshGoodSlavesCount();
-    log_debug(LOG_NOTICE,"Synchronization with slave %s succeeded",
-        replicationGetSlaveName(slave));
+
+    run_with_period(REPL_KEEPALIVE_PERIOD*1000, vel->cronloops) {
+        dlistRewind(vel->slaves,&li);
+        while ((ln = dlistNext(&li))) {
+            slave = dlistNodeValue(ln);
+
+            /* Newlines keep alive the link with the slaves waiting the
+             * snapshot, they are ignored before the +FULLRESYNC reply. */
+            if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_END) {
+                if (write(slave->conn->sd,"\n",1) == -1) {
+                    /* Don't worry, it's just a ping. */
+                }
+            } else if (slave->replstate == SLAVE_STATE_ONLINE &&
+                !(slave->flags & CLIENT_PRE_PSYNC) &&
+                vel->unixtime-slave->repl_ack_time > repl.repl_timeout) {
+                log_warn("Disconnecting timedout slave: %s",
+                    replicationGetSlaveName(slave));
+                freeClient(slave);
+            }
+        }
+    }
+
+    /* Catch up if a wake up from the writer was missed. */
+    replicationBeforeSleep(vel);
+}
+
+/* ------------------------------ SLAVE SIDE -------------------------------- */
+
+/* Set the master to replicate, or no master with a NULL host. The
+ * replication thread drops the current link and connects to the new
+ * master in its cron. */
+static void replicationSetMaster(char *host, int port) {
+    sds oldhost;
+
+    pthread_mutex_lock(&repl.lock);
+    oldhost = repl.masterhost;
+    repl.masterhost = host ? sdsnew(host) : NULL;
+    repl.masterport = port;
+    repl.master_changed = 1;
+    repl.role = host ? REPLICATION_ROLE_SLAVE : REPLICATION_ROLE_MASTER;
+    if (oldhost != NULL) sdsfree(oldhost);
+    pthread_mutex_unlock(&repl.lock);
+}
+
+/* Return "host port" of the master, for CONFIG REWRITE, or NULL. */
+sds replicationGetMasterConfig(void) {
+    sds config = NULL;
+
+    pthread_mutex_lock(&repl.lock);
+    if (repl.masterhost != NULL)
+        config = sdscatprintf(sdsempty(),"%s %d",repl.masterhost,repl.masterport);
+    pthread_mutex_unlock(&repl.lock);
+    return config;
+}
+
+void slaveofCommand(client *c) {
+    long port;
+    int same;
+
+    if (!strcasecmp(c->argv[1]->ptr,"no") &&
+        !strcasecmp(c->argv[2]->ptr,"one")) {
+        if (repl.masterhost) {
+            replicationSetMaster(NULL,0);
+            log_notice("MASTER MODE enabled (user request from '%s')",
+                getClientPeerId(c));
+        }
+    } else {
+        if ((getLongFromObjectOrReply(c, c->argv[2], &port, NULL) != VR_OK))
+            return;
+        if (port <= 0 || port > 65535) {
+            addReplyError(c,"Invalid master port");
+            return;
+        }
+
+        /* Check if we are already attached to the specified slave */
+        pthread_mutex_lock(&repl.lock);
+        same = repl.masterhost && !strcasecmp(repl.masterhost,c->argv[1]->ptr)
+            && repl.masterport == port;
+        pthread_mutex_unlock(&repl.lock);
+        if (same) {
+            log_notice("SLAVE OF would result into synchronization with the "
+                "master we are already connected with. No operation performed.");
+            addReplySds(c,sdsnew("+OK Already connected to specified master\r\n"));
+            return;
+        }
+
+        replicationSetMaster(c->argv[1]->ptr,(int)port);
+        log_notice("SLAVE OF %s:%d enabled (user request from '%s')",
+            (char*)c->argv[1]->ptr,(int)port,getClientPeerId(c));
+    }
+    addReply(c,shared.ok);
 }
 
 /* Send a REPLCONF ACK command to the master to inform it about the current
@@ -274,6 +827,458 @@ void replicationSendAck(void) {
     }
 }
 
+/* Called by freeClient() for our master: remember where the stream
+ * stopped, to ask the master for the rest with PSYNC. */
+void replicationCacheMaster(client *c) {
+    pthread_mutex_lock(&repl.lock);
+    memcpy(repl.repl_master_runid,c->replrunid,sizeof(c->replrunid));
+    repl.repl_master_initial_offset = c->reploff;
+    repl.repl_master_initial_dbid = c->dictid;
+    pthread_mutex_unlock(&repl.lock);
+}
+
+/* This function is called when the slave lose the connection with the
+ * master into an unexpected way. */
+void replicationHandleMasterDisconnection(void) {
+    repl.master = NULL;
+    repl.repl_state = REPL_STATE_CONNECT;
+    repl.repl_down_since = repl.vel.unixtime;
+}
+
+/* Write the whole command to the master, with the blocking socket. */
+static int replicationSyncWrite(int sd, int argc, char **argv) {
+    sds cmd = sdscatprintf(sdsempty(),"*%d\r\n",argc);
+    ssize_t nwritten;
+    size_t sent = 0;
+    int j;
+
+    for (j = 0; j < argc; j ++) {
+        cmd = sdscatprintf(cmd,"$%lu\r\n",(unsigned long)strlen(argv[j]));
+        cmd = sdscat(cmd,argv[j]);
+        cmd = sdscatlen(cmd,"\r\n",2);
+    }
+    while (sent < sdslen(cmd)) {
+        nwritten = write(sd,cmd+sent,sdslen(cmd)-sent);
+        if (nwritten <= 0) {
+            sdsfree(cmd);
+            return VR_ERROR;
+        }
+        sent += (size_t)nwritten;
+    }
+    sdsfree(cmd);
+    return VR_OK;
+}
+
+/* Read a line from the master, without the trailing CRLF. The empty lines
+ * the master sends to keep the link alive are skipped. */
+static int replicationSyncReadLine(int sd, char *buf, size_t size) {
+    size_t len = 0;
+    char ch;
+
+    while (1) {
+        if (read(sd,&ch,1) <= 0) return VR_ERROR;
+        if (ch == '\n') {
+            if (len > 0 && buf[len-1] == '\r') len --;
+            if (len == 0) continue;
+            buf[len] = '\0';
+            return VR_OK;
+        }
+        if (len < size-1) buf[len++] = ch;
+    }
+}
+
+/* Empty the dataset before loading the snapshot of the master. */
+static void replicationFlushData(void) {
+    redisDb *db;
+    int j;
+
+    for (j = 0; j < server.dbnum; j ++) {
+        db = darray_get(&server.dbs, (uint32_t)j);
+        lockDbWrite(db);
+        aofRewriteFlushDb(db);
+        dictEmpty(db->dict,NULL);
+        dbResizeExpires(db);
+        unlockDb(db);
+    }
+}
+
+/* Read the chunk table the master sends before the snapshot, if any, see
+ * replicationSnapshotDone(). The line after it is left in 'buf'. */
+static int replicationReadChunks(int sd, char *buf, size_t buflen,
+                                 long long **chunks, int *nchunks) {
+    long long n;
+    int j;
+
+    *chunks = NULL;
+    *nchunks = 0;
+    if (replicationSyncReadLine(sd,buf,buflen) != VR_OK) return VR_ERROR;
+    if (buf[0] != '*') return VR_OK;
+
+    n = strtoll(buf+1,NULL,10);
+    if (n < 0 || n > INT_MAX) {
+        log_warn("Bad chunk count from MASTER: '%s'",buf);
+        return VR_ERROR;
+    }
+    *chunks = dalloc(sizeof(long long)*(size_t)(n ? n : 1));
+    for (j = 0; j < n; j ++) {
+        if (replicationSyncReadLine(sd,buf,buflen) != VR_OK) goto err;
+        if (buf[0] != ':') {
+            log_warn("Bad chunk length from MASTER: '%s'",buf);
+            goto err;
+        }
+        (*chunks)[j] = strtoll(buf+1,NULL,10);
+    }
+    *nchunks = (int)n;
+    return replicationSyncReadLine(sd,buf,buflen);
+
+err:
+    dfree(*chunks);
+    *chunks = NULL;
+    return VR_ERROR;
+}
+
+/* Receive the snapshot after +FULLRESYNC and load it, in parallel if the
+ * master sent the chunks it is made of. */
+static int replicationLoadSnapshot(int sd) {
+    char buf[PROTO_IOBUF_LEN];
+    long long size, left, sum, *chunks;
+    ssize_t nread;
+    sds dir, tmpfile;
+    int fd, ret, nchunks, threads, j;
+
+    if (replicationReadChunks(sd,buf,sizeof(buf),&chunks,&nchunks) != VR_OK) {
+        log_warn("I/O error reading bulk count from MASTER: %s",strerror(errno));
+        return VR_ERROR;
+    }
+    if (buf[0] != '$') {
+        log_warn("Bad protocol from MASTER, the first byte is not '$' "
+            "(we received '%s')",buf);
+        if (chunks != NULL) dfree(chunks);
+        return VR_ERROR;
+    }
+    size = strtoll(buf+1,NULL,10);
+    if (chunks != NULL) {
+        for (sum = 0, j = 0; j < nchunks; j ++) sum += chunks[j];
+        if (sum != size) {
+            /* Still a valid AOF, just not splittable. */
+            log_warn("The snapshot chunks from MASTER are %lld bytes, "
+                "not %lld, loading it serially",sum,size);
+            dfree(chunks);
+            chunks = NULL;
+        }
+    }
+    log_notice("MASTER <-> SLAVE sync: receiving %lld bytes from master "
+        "in %d chunks",size,chunks != NULL ? nchunks : 1);
+
+    conf_server_get(CONFIG_SOPN_DIR,&dir);
+    tmpfile = sdscatprintf(sdsempty(),"%s/temp-repl-recv-%d.aof",
+        dir,(int)getpid());
+    sdsfree(dir);
+    fd = open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) {
+        log_warn("Opening the temp file needed for MASTER <-> SLAVE "
+            "synchronization: %s",strerror(errno));
+        sdsfree(tmpfile);
+        if (chunks != NULL) dfree(chunks);
+        return VR_ERROR;
+    }
+
+    left = size;
+    while (left > 0) {
+        nread = read(sd,buf,left < (long long)sizeof(buf) ? (size_t)left : sizeof(buf));
+        if (nread <= 0) {
+            log_warn("I/O error trying to sync with MASTER: %s",
+                nread == 0 ? "connection lost" : strerror(errno));
+            goto werr;
+        }
+        if (write(fd,buf,(size_t)nread) != nread) {
+            log_warn("Write error writing to the DB received from MASTER: %s",
+                strerror(errno));
+            goto werr;
+        }
+        left -= nread;
+    }
+    close(fd);
+
+    log_notice("MASTER <-> SLAVE sync: Flushing old data");
+    replicationFlushData();
+    log_notice("MASTER <-> SLAVE sync: Loading DB in memory");
+    if (chunks != NULL) {
+        conf_server_get(CONFIG_SOPN_RDBTHREADS,&threads);
+        ret = loadAppendOnlyFileChunks(tmpfile,chunks,nchunks,threads);
+        dfree(chunks);
+    } else {
+        ret = loadAppendOnlyFile(tmpfile);
+    }
+    vr_eventloop_bind(&repl.vel);
+    unlink(tmpfile);
+    sdsfree(tmpfile);
+    if (ret != VR_OK) {
+        log_warn("Failed trying to load the MASTER synchronization DB from disk");
+        return VR_ERROR;
+    }
+
+    /* Our backlog does not lead to this dataset. */
+    pthread_mutex_lock(&repl.lock);
+    repl.repl_backlog_min_offset = repl_atomic_load(&repl.master_repl_offset);
+    pthread_mutex_unlock(&repl.lock);
+
+    /* The AOF has the old dataset. */
+    if (server.aof_state == AOF_ON) rewriteAppendOnlyFileBackground();
+    return VR_OK;
+
+werr:
+    close(fd);
+    unlink(tmpfile);
+    sdsfree(tmpfile);
+    if (chunks != NULL) dfree(chunks);
+    return VR_ERROR;
+}
+
+/* Run the stream of the master as the commands of a client of the
+ * replication eventloop. */
+static int replicationCreateMasterClient(int sd, char *runid, long long reploff, int dbid) {
+    struct conn *conn;
+    client *c;
+
+    conn = conn_get(repl.vel.cb);
+    if (conn == NULL) return VR_ERROR;
+    conn->sd = sd;
+    update_curr_clients_add(1);
+    vr_set_nonblocking(sd);
+
+    c = createClient(&repl.vel,conn);
+    if (c == NULL) {
+        conn_put(conn);
+        return VR_ERROR;
+    }
+    c->flags |= CLIENT_MASTER;
+    c->authenticated = 2;
+    c->reploff = c->read_reploff = reploff;
+    selectDb(c,dbid >= 0 ? dbid : 0);
+    memcpy(c->replrunid,runid,sizeof(c->replrunid));
+
+    repl.master = c;
+    repl.repl_state = REPL_STATE_CONNECTED;
+    repl.repl_transfer_lastio = repl.vel.unixtime;
+    return VR_OK;
+}
+
+/* Connect to the master and synchronize, with blocking calls timing out
+ * after repl_syncio_timeout seconds. The master sends newlines while it
+ * prepares the snapshot. */
+static void replicationConnectMaster(sds host, int port) {
+    struct sockinfo si;
+    struct timeval tv;
+    char buf[256], portstr[32], offstr[32], runid[CONFIG_RUN_ID_SIZE+1];
+    char *argv[5];
+    long long offset;
+    int sd, dbid;
+
+    repl.repl_state = REPL_STATE_CONNECTING;
+    if (vr_resolve(host,port,&si) != 0) goto error;
+    sd = socket(si.family,SOCK_STREAM,0);
+    if (sd == -1) goto error;
+    tv.tv_sec = repl.repl_syncio_timeout;
+    tv.tv_usec = 0;
+    setsockopt(sd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(sd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    if (connect(sd,(struct sockaddr*)&si.addr,si.addrlen) == -1) {
+        log_warn("Unable to connect to MASTER %s:%d: %s",host,port,strerror(errno));
+        close(sd);
+        goto error;
+    }
+    log_notice("MASTER <-> SLAVE sync started");
+
+    /* Check with a PING that the master is able to reply. */
+    repl.repl_state = REPL_STATE_RECEIVE_PONG;
+    argv[0] = "PING";
+    if (replicationSyncWrite(sd,1,argv) != VR_OK ||
+        replicationSyncReadLine(sd,buf,sizeof(buf)) != VR_OK) {
+        log_warn("I/O error in the handshake with MASTER: %s",strerror(errno));
+        goto cerr;
+    }
+    if (buf[0] != '+') {
+        log_warn("Error reply to PING from master: '%s'",buf);
+        goto cerr;
+    }
+
+    /* Set the slave port, so that Master's INFO command can list the
+     * slave listening port correctly, and tell that we load the snapshot
+     * chunks in parallel. Errors are not fatal. */
+    repl.repl_state = REPL_STATE_SEND_PORT;
+    snprintf(portstr,sizeof(portstr),"%d",server.port);
+    argv[0] = "REPLCONF";
+    argv[1] = "listening-port";
+    argv[2] = portstr;
+    argv[3] = "capa";
+    argv[4] = "chunks";
+    if (replicationSyncWrite(sd,5,argv) != VR_OK ||
+        replicationSyncReadLine(sd,buf,sizeof(buf)) != VR_OK) {
+        log_warn("I/O error in the handshake with MASTER: %s",strerror(errno));
+        goto cerr;
+    }
+
+    /* Ask for the stream after what we processed of the last master,
+     * or for a full resync. */
+    repl.repl_state = REPL_STATE_RECEIVE_PSYNC;
+    pthread_mutex_lock(&repl.lock);
+    memcpy(runid,repl.repl_master_runid,sizeof(runid));
+    offset = repl.repl_master_initial_offset;
+    dbid = repl.repl_master_initial_dbid;
+    pthread_mutex_unlock(&repl.lock);
+    argv[0] = "PSYNC";
+    if (runid[0] != '\0' && offset != -1) {
+        argv[1] = runid;
+        snprintf(offstr,sizeof(offstr),"%lld",offset+1);
+        argv[2] = offstr;
+        log_notice("Trying a partial resynchronization (request %s:%s).",
+            runid,offstr);
+    } else {
+        argv[1] = "?";
+        argv[2] = "-1";
+        log_notice("Partial resynchronization not possible (no cached master)");
+    }
+    if (replicationSyncWrite(sd,3,argv) != VR_OK ||
+        replicationSyncReadLine(sd,buf,sizeof(buf)) != VR_OK) {
+        log_warn("I/O error in the handshake with MASTER: %s",strerror(errno));
+        goto cerr;
+    }
+
+    if (!strncmp(buf,"+CONTINUE",9)) {
+        log_notice("Successful partial resynchronization with master.");
+    } else if (!strncmp(buf,"+FULLRESYNC ",12) &&
+        strlen(buf) > 13+CONFIG_RUN_ID_SIZE) {
+        memcpy(runid,buf+12,CONFIG_RUN_ID_SIZE);
+        runid[CONFIG_RUN_ID_SIZE] = '\0';
+        offset = strtoll(buf+13+CONFIG_RUN_ID_SIZE,NULL,10);
+        log_notice("Full resync from master: %s:%lld",runid,offset);
+        repl.repl_state = REPL_STATE_TRANSFER;
+        if (replicationLoadSnapshot(sd) != VR_OK) goto cerr;
+        dbid = -1;
+        log_notice("MASTER <-> SLAVE sync: Finished with success");
+    } else {
+        log_warn("Unexpected reply to PSYNC from master: %s",buf);
+        goto cerr;
+    }
+
+    pthread_mutex_lock(&repl.lock);
+    memcpy(repl.repl_master_runid,runid,sizeof(runid));
+    repl.repl_master_initial_offset = offset;
+    repl.repl_master_initial_dbid = dbid;
+    pthread_mutex_unlock(&repl.lock);
+
+    if (replicationCreateMasterClient(sd,runid,offset,dbid) != VR_OK) goto cerr;
+    return;
+
+cerr:
+    close(sd);
+error:
+    repl.repl_state = REPL_STATE_CONNECT;
+}
+
+/* Replication cron function, called 1 time per second by the replication
+ * thread. */
+static void replicationCron(void) {
+    sds host = NULL;
+    int port, changed;
+
+    pthread_mutex_lock(&repl.lock);
+    changed = repl.master_changed;
+    repl.master_changed = 0;
+    if (repl.masterhost != NULL) host = sdsnew(repl.masterhost);
+    port = repl.masterport;
+    pthread_mutex_unlock(&repl.lock);
+
+    if (changed) {
+        if (repl.master != NULL) freeClient(repl.master);
+        repl.repl_state = host ? REPL_STATE_CONNECT : REPL_STATE_NONE;
+        pthread_mutex_lock(&repl.lock);
+        repl.repl_master_runid[0] = '\0';
+        repl.repl_master_initial_offset = -1;
+        repl.repl_master_initial_dbid = -1;
+        pthread_mutex_unlock(&repl.lock);
+    }
+
+    if (host != NULL && repl.repl_state == REPL_STATE_CONNECT)
+        replicationConnectMaster(host,port);
+    if (host != NULL) sdsfree(host);
+
+    if (repl.master != NULL) {
+        replicationSendAck();
+        repl.slave_repl_offset = repl.master->reploff;
+        repl.repl_transfer_lastio = repl.master->lastinteraction;
+    }
+}
+
+static int replicationCronProc(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    vr_eventloop *vel = &repl.vel;
+
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    vel->unixtime = time(NULL);
+    vel->mstime = vr_msec_now();
+    vel->lruclock = getLRUClock() & LRU_CLOCK_MAX;
+
+    run_with_period(1000, vel->cronloops) {
+        conf_cache_update(&vel->cc);
+        replicationCron();
+    }
+
+    freeClientsInAsyncFreeQueue(vel);
+
+    vel->cronloops ++;
+    return 1000/vel->hz;
+}
+
+static void replicationBeforeSleepProc(struct aeEventLoop *eventLoop, void *private_data) {
+    UNUSED(eventLoop);
+    UNUSED(private_data);
+
+    aofBeforeSleep(&repl.vel);
+    handleClientsWithPendingWrites(&repl.vel);
+}
+
+static void *replicationThreadRun(void *args) {
+    UNUSED(args);
+
+    vr_eventloop_bind(&repl.vel);
+    aeMain(repl.vel.el);
+    return NULL;
+}
+
+/* Start the replication thread, replicating the master in the slaveof
+ * option if any. */
+int replication_run(void) {
+    struct darray values;
+    sds *value;
+
+    darray_init(&values,2,sizeof(sds));
+    conf_server_get(CONFIG_SOPN_SLAVEOF,&values);
+    if (darray_n(&values) == 2) {
+        value = darray_get(&values,0);
+        replicationSetMaster(*value,atoi(*(sds*)darray_get(&values,1)));
+    } else if (darray_n(&values) != 0) {
+        log_warn("The slaveof option needs the master host and port");
+    }
+    while (darray_n(&values) > 0) {
+        value = darray_pop(&values);
+        sdsfree(*value);
+    }
+    darray_deinit(&values);
+
+    conf_cache_update(&repl.vel.cc);
+    aeSetBeforeSleepProc(repl.vel.el,replicationBeforeSleepProc,NULL);
+    if (aeCreateTimeEvent(repl.vel.el,1,replicationCronProc,NULL,NULL) == AE_ERR) {
+        log_error("Can't create the replication time event");
+        return VR_ERROR;
+    }
+
+    return vr_thread_start(&repl.vel.thread);
+}
+
 void replicationFeedMonitors(client *c, dlist *monitors, int dictid, robj **argv, int argc) {
     dlistNode *ln;
     dlistIter li;
@@ -313,144 +1318,95 @@ void replicationFeedMonitors(client *c, dlist *monitors, int dictid, robj **argv
     decrRefCount(cmdobj);
 }
 
-/* Add data to the replication backlog.
- * This function also increments the global replication offset stored at
- * server.master_repl_offset, because there is no case where we want to feed
- * the backlog without incrementing the buffer. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
-
-    repl.master_repl_offset += len;
-
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = repl.repl_backlog_size - repl.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(repl.repl_backlog+repl.repl_backlog_idx,p,thislen);
-        repl.repl_backlog_idx += thislen;
-        if (repl.repl_backlog_idx == repl.repl_backlog_size)
-            repl.repl_backlog_idx = 0;
-        len -= thislen;
-        p += thislen;
-        repl.repl_backlog_histlen += thislen;
-    }
-    if (repl.repl_backlog_histlen > repl.repl_backlog_size)
-        repl.repl_backlog_histlen = repl.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    repl.repl_backlog_off = repl.master_repl_offset -
-                              repl.repl_backlog_histlen + 1;
-}
-
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
- * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
-    char llstr[LONG_STR_SIZE];
-    void *p;
-    size_t len;
-
-    if (o->encoding == OBJ_ENCODING_INT) {
-        len = ll2string(llstr,sizeof(llstr),(long)o->ptr);
-        p = llstr;
-    } else {
-        len = sdslen(o->ptr);
-        p = o->ptr;
+static char *replicationSlaveStateName(int replstate) {
+    switch (replstate) {
+    case SLAVE_STATE_WAIT_BGSAVE_START:
+    case SLAVE_STATE_WAIT_BGSAVE_END:
+        return "wait_bgsave";
+    case SLAVE_STATE_SEND_BULK:
+        return "send_bulk";
+    case SLAVE_STATE_ONLINE:
+        return "online";
+    default:
+        return "";
     }
-    feedReplicationBacklog(p,len);
 }
 
-void replicationFeedSlaves(dlist *slaves, int dictid, robj **argv, int argc) {
-    dlistNode *ln;
+/* The Replication section of INFO. */
+sds replicationGetInfo(sds info) {
     dlistIter li;
-    int j, len;
-    char llstr[LONG_STR_SIZE];
-
-    /* If there aren't slaves, and there is no backlog buffer to populate,
-     * we can return ASAP. */
-    if (repl.repl_backlog == NULL && dlistLength(slaves) == 0) return;
-
-    /* We can't have slaves attached and no backlog. */
-    ASSERT(!(dlistLength(slaves) != 0 && repl.repl_backlog == NULL));
-
-    /* Send SELECT command to every slave if needed. */
-    if (repl.slaveseldb != dictid) {
-        robj *selectcmd;
-
-        /* For a few DBs we have pre-computed SELECT command. */
-        if (dictid >= 0 && dictid < PROTO_SHARED_SELECT_CMDS) {
-            selectcmd = shared.select[dictid];
-        } else {
-            int dictid_len;
-
-            dictid_len = ll2string(llstr,sizeof(llstr),dictid);
-            selectcmd = createObject(OBJ_STRING,
-                sdscatprintf(sdsempty(),
-                "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
-                dictid_len, llstr));
-        }
-
-        /* Add the SELECT command into the backlog. */
-        if (repl.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        dlistRewind(slaves,&li);
-        while((ln = dlistNext(&li))) {
-            client *slave = ln->value;
-            if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-            addReply(slave,selectcmd);
-        }
-
-        if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
-            decrRefCount(selectcmd);
-    }
-    repl.slaveseldb = dictid;
-
-    /* Write the command to the replication backlog if any. */
-    if (repl.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
-
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
-        aux[len+1] = '\r';
-        aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
-
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
-
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
+    dlistNode *ln;
+    client *slave;
+    long long end, start = 0;
+    char *peerid, *p;
+    int slaveid = 0;
+
+    pthread_mutex_lock(&repl.lock);
+    info = sdscatprintf(info,
+        "# Replication\r\n"
+        "role:%s\r\n",
+        repl.masterhost == NULL ? "master" : "slave");
+    if (repl.masterhost) {
+        info = sdscatprintf(info,
+            "master_host:%s\r\n"
+            "master_port:%d\r\n"
+            "master_link_status:%s\r\n"
+            "master_last_io_seconds_ago:%d\r\n"
+            "master_sync_in_progress:%d\r\n"
+            "slave_repl_offset:%lld\r\n",
+            repl.masterhost,
+            repl.masterport,
+            (repl.repl_state == REPL_STATE_CONNECTED) ? "up" : "down",
+            (repl.repl_state == REPL_STATE_CONNECTED) ?
+                (int)(time(NULL)-repl.repl_transfer_lastio) : -1,
+            repl.repl_state == REPL_STATE_TRANSFER,
+            repl.slave_repl_offset);
+        if (repl.repl_state != REPL_STATE_CONNECTED) {
+            info = sdscatprintf(info,
+                "master_link_down_since_seconds:%jd\r\n",
+                repl.repl_down_since ?
+                (intmax_t)(time(NULL)-repl.repl_down_since) : -1);
         }
+        info = sdscatprintf(info,
+            "slave_read_only:%d\r\n", repl.repl_slave_ro);
     }
 
-    /* Write the command to every slave. */
+    info = sdscatprintf(info,
+        "connected_slaves:%lu\r\n",
+        dlistLength(repl.slaves));
     dlistRewind(repl.slaves,&li);
-    while((ln = dlistNext(&li))) {
-        client *slave = ln->value;
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
-
-        /* Add the multi bulk length. */
-        addReplyMultiBulkLen(slave,argc);
+    while ((ln = dlistNext(&li))) {
+        slave = dlistNodeValue(ln);
+        /* Set by replicationGetSlaveName() in SYNC. */
+        peerid = slave->peerid ? slave->peerid : "?";
+        p = strrchr(peerid,':');
+        info = sdscatprintf(info,
+            "slave%d:ip=%.*s,port=%d,state=%s,offset=%lld,lag=%ld\r\n",
+            slaveid,p ? (int)(p-peerid) : (int)strlen(peerid),peerid,
+            slave->slave_listening_port,
+            replicationSlaveStateName(slave->replstate),
+            slave->repl_ack_off,
+            (long)(time(NULL)-slave->repl_ack_time));
+        slaveid ++;
+    }
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+    end = repl_atomic_load(&repl.master_repl_offset);
+    if (repl.repl_backlog != NULL) {
+        start = repl_atomic_load(&repl.repl_backlog_reserved)-repl.repl_backlog_size;
+        if (start < repl.repl_backlog_min_offset) start = repl.repl_backlog_min_offset;
     }
+    info = sdscatprintf(info,
+        "master_repl_offset:%lld\r\n"
+        "repl_backlog_active:%d\r\n"
+        "repl_backlog_size:%lld\r\n"
+        "repl_backlog_first_byte_offset:%lld\r\n"
+        "repl_backlog_histlen:%lld\r\n",
+        end,
+        repl.repl_backlog != NULL,
+        repl.repl_backlog_size,
+        repl.repl_backlog ? start+1 : 0,
+        repl.repl_backlog ? end-start : 0);
+    pthread_mutex_unlock(&repl.lock);
+
+    return info;
 }
-
@@ -32,10 +32,14 @@
 /* Slave capabilities. */
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)   /* Can parse the RDB EOF streaming format. */
+#define SLAVE_CAPA_CHUNKS (1<<1)    /* Loads the snapshot chunks in parallel */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
 
+/* Slaves not acknowledging the stream for N seconds are closed */
+#define CONFIG_DEFAULT_REPL_TIMEOUT 60
+
 #define REPLICATION_ROLE_MASTER 0
 #define REPLICATION_ROLE_SLAVE  1
 
@@ -43,73 +47,89 @@
 #define CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT (60*60)  /* 1 hour */
 #define CONFIG_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
 
+/* Keepalive newlines sent to the slaves waiting the snapshot, and ACKs
+ * sent by the slaves, every N seconds. */
+#define REPL_KEEPALIVE_PERIOD 1
+
+/* The stream bytes queued in the output buffer of a slave at a time, the
+ * rest is copied from the backlog as the slave reads. */
+#define REPL_SLAVE_FEED_LIMIT (1024*64)
+
 struct vr_replication {
-    vr_eventloop vel;
+    vr_eventloop vel;       /* Runs the link with our master */
 
     int role;               /* Master/slave? */
+    pthread_mutex_t lock;   /* Protects the fields shared by the threads */
 
     /* Replication (master) */
-    dlist *slaves;           /* List of slaves */
+    dlist *slaves;           /* List of slaves, see replicationAddSlave() */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
-    long long master_repl_offset;   /* Global replication offset */
+    long long master_repl_offset;   /* Stream bytes in the backlog so far */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
     char *repl_backlog;             /* Replication backlog for partial syncs */
     long long repl_backlog_size;    /* Backlog circular buffer size */
-    long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset */
-    long long repl_backlog_off;     /* Replication offset of first byte in the
-                                       backlog buffer. */
-    time_t repl_backlog_time_limit; /* Time without slaves after the backlog
-                                       gets released. */
+    long long repl_backlog_reserved;/* Stream bytes the writer is adding */
+    long long repl_backlog_min_offset;  /* Lowest offset a slave can start from */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
                                        Only valid if server.slaves len is 0. */
     int repl_min_slaves_to_write;   /* Min number of slaves to write. */
     int repl_min_slaves_max_lag;    /* Max lag of <count> slaves to write. */
     int repl_good_slaves_count;     /* Number of slaves with lag <= max_lag. */
-    int repl_diskless_sync;         /* Send RDB to slaves sockets directly. */
-    int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+
+    /* Last snapshot for the full resynchronizations, see
+     * replicationSnapshotDone(). */
+    unsigned long long snapshot_id; /* Incremented by every snapshot */
+    sds snapshot_file;              /* Base file, NULL if the last failed */
+    long long snapshot_offset;      /* Stream offset of the snapshot */
+    sds snapshot_chunks;            /* Chunk table sent before the file */
+    long long stat_sync_full;       /* Full resynchronizations served */
+    long long stat_sync_partial_ok; /* Accepted PSYNC requests */
+    long long stat_sync_partial_err;/* Unaccepted PSYNC requests */
 
     /* Replication (slave) */
     char *masterauth;               /* AUTH with this password with master */
     char *masterhost;               /* Hostname of master */
     int masterport;                 /* Port of master */
+    int master_changed;             /* SLAVEOF changed the master */
     int repl_timeout;               /* Timeout after N seconds of master idle */
     client *master;     /* Client that is master for this slave */
-    client *cached_master; /* Cached master to be reused for PSYNC. */
     int repl_syncio_timeout; /* Timeout for synchronous I/O calls */
     int repl_state;          /* Replication status if the instance is a slave */
-    off_t repl_transfer_size; /* Size of RDB to read from master during sync. */
-    off_t repl_transfer_read; /* Amount of RDB read from master during sync. */
-    off_t repl_transfer_last_fsync_off; /* Offset when we fsync-ed last time. */
-    int repl_transfer_s;     /* Slave -> Master SYNC socket */
-    int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
-    char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
     time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
     int repl_serve_stale_data; /* Serve stale data when link is down? */
     int repl_slave_ro;          /* Slave is read only? */
     time_t repl_down_since; /* Unix time at which link with master went down */
-    int repl_disable_tcp_nodelay;   /* Disable TCP_NODELAY after SYNC? */
-    int slave_priority;             /* Reported in INFO and used by Sentinel. */
     char repl_master_runid[CONFIG_RUN_ID_SIZE+1];  /* Master run id for PSYNC. */
     long long repl_master_initial_offset;         /* Master PSYNC offset. */
+    long long slave_repl_offset;    /* Stream of the master processed, for INFO */
+    int repl_master_initial_dbid;   /* DB selected at that offset */
 };
 
 extern struct vr_replication repl;
 
 int vr_replication_init(void);
 void vr_replication_deinit(void);
+int replication_run(void);
 
 void unblockClientWaitingReplicas(client *c);
 void refreshGoodSlavesCount(void);
 void replicationHandleMasterDisconnection(void);
 void replicationCacheMaster(client *c);
 char *replicationGetSlaveName(client *c);
+void replicationRemoveSlave(client *c);
 void replconfCommand(client *c);
+void syncCommand(client *c);
+void slaveofCommand(client *c);
 void putSlaveOnline(client *slave);
 void replicationSendAck(void);
 void replicationFeedMonitors(client *c, dlist *monitors, int dictid, robj **argv, int argc);
-void replicationFeedSlaves(dlist *slaves, int dictid, robj **argv, int argc);
-void feedReplicationBacklogWithObject(robj *o);
-void feedReplicationBacklog(void *ptr, size_t len);
+int replicationBacklogEnabled(void);
+void replicationBacklogAppend(const char *buf, size_t len);
+void replicationWakeSlaves(void);
+void replicationSnapshotDone(sds filename, long long offset, long long *chunks, int nchunks);
+void replicationBeforeSleep(vr_eventloop *vel);
+void replicationWorkerCron(vr_eventloop *vel);
+sds replicationGetInfo(sds info);
+sds replicationGetMasterConfig(void);
 
 #endif
@@ -0,0 +1,84 @@
+#include <vr_resp.h>
+
+/* ----------------------------------------------------------------------------
+ * RESP tokenizer
+ *
+ * The multibulk requests are made of a "*<count>" line and of a
+ * "$<len>" line before every argument. The tokenizer walks the command
+ * once: the digits of a length are converted while looking for its CR,
+ * and the argument is skipped by that length, so no byte of the payloads
+ * is looked at and no line is scanned twice.
+ *
+ * It is for the common case, a whole command with a few small arguments,
+ * parsed again from its start if it is not complete yet. The rest,
+ * including the malformed requests, is left to the incremental parser,
+ * see processMultibulkBuffer(), so the errors are the same.
+ * ------------------------------------------------------------------------- */
+
+#define RESP_MAX_LEN_DIGITS 18  /* A length of up to 18 digits can't overflow */
+
+/* Parse the line at 'p' made of 'prefix' and of a non negative length,
+ * setting 'next' after its CRLF. Like string2ll() the length has no
+ * leading zeros. */
+static inline int respParseLength(const char *p, const char *end, char prefix,
+                                  long long *ll, const char **next) {
+    const char *digits, *limit;
+    long long v = 0;
+    unsigned int digit;
+
+    if (p == end) return RESP_PARSE_MORE;
+    if (*p != prefix) return RESP_PARSE_SLOW;
+
+    digits = ++p;
+    limit = end-p > RESP_MAX_LEN_DIGITS ? p+RESP_MAX_LEN_DIGITS : end;
+    while (p < limit) {
+        digit = (unsigned int)(unsigned char)*p-'0';
+        if (digit > 9) break;
+        v = v*10+digit;
+        p ++;
+    }
+
+    /* The CR, and the LF that must be in the buffer too. */
+    if (end-p < 2) {
+        if (p == limit && limit == end) return RESP_PARSE_MORE;
+        if (p+1 == end && *p == '\r') return RESP_PARSE_MORE;
+    }
+    if (p == end || *p != '\r') return RESP_PARSE_SLOW;
+    if (p == digits || (*digits == '0' && p > digits+1))
+        return RESP_PARSE_SLOW;
+
+    *ll = v;
+    *next = p+2;
+    return RESP_PARSE_OK;
+}
+
+/* Parse the multibulk command at the start of 'buf' in a single pass.
+ * On RESP_PARSE_OK 'args' has the 'argc' arguments and the command is
+ * 'used' bytes long. The commands with more than 'maxargs' arguments,
+ * arguments longer than 'maxarglen', or a count not above zero return
+ * RESP_PARSE_SLOW, as the malformed ones. */
+int respParseMultibulk(const char *buf, size_t len, size_t maxarglen,
+                       respArg *args, int maxargs, int *argc, size_t *used) {
+    const char *p = buf, *end = buf+len;
+    long long count, ll;
+    int j, ret;
+
+    ret = respParseLength(p,end,'*',&count,&p);
+    if (ret != RESP_PARSE_OK) return ret;
+    if (count <= 0 || count > maxargs) return RESP_PARSE_SLOW;
+
+    for (j = 0; j < count; j ++) {
+        ret = respParseLength(p,end,'$',&ll,&p);
+        if (ret != RESP_PARSE_OK) return ret;
+        if ((unsigned long long)ll > maxarglen) return RESP_PARSE_SLOW;
+        /* The argument and its CRLF. */
+        if (end-p < ll+2) return RESP_PARSE_MORE;
+        args[j].offset = (size_t)(p-buf);
+        args[j].len = (size_t)ll;
+        p += ll+2;
+    }
+
+    *argc = (int)count;
+    *used = (size_t)(p-buf);
+    return RESP_PARSE_OK;
+}
@@ -0,0 +1,22 @@
+#ifndef _VR_RESP_H_
+#define _VR_RESP_H_
+
+#include <stddef.h>
+
+/* Results of respParseMultibulk(). */
+#define RESP_PARSE_OK 0         /* A whole command was parsed */
+#define RESP_PARSE_MORE 1       /* The command is not all in the buffer */
+#define RESP_PARSE_SLOW 2       /* Left to the incremental parser */
+
+#define RESP_MAX_FAST_ARGS 64   /* Max arguments parsed in one pass */
+
+/* An argument of the command, at 'offset' in the parsed buffer. */
+typedef struct respArg {
+    size_t offset;
+    size_t len;
+} respArg;
+
+int respParseMultibulk(const char *buf, size_t len, size_t maxarglen,
+    respArg *args, int maxargs, int *argc, size_t *used);
+
+#endif
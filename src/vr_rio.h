@@ -0,0 +1,98 @@
+#ifndef _VR_RIO_H_
+#define _VR_RIO_H_
+
+/* rio is a simple stream oriented I/O abstraction that provides an interface
+ * to write code that can consume/produce data using different concrete input
+ * and output devices. The RDB code uses it to dump and load the same format
+ * from files and memory buffers. */
+struct _rio {
+    /* Backend functions.
+     * Since this functions do not tolerate short writes or reads the return
+     * value is simplified to: zero on error, non zero on complete success. */
+    size_t (*read)(struct _rio *, void *buf, size_t len);
+    size_t (*write)(struct _rio *, const void *buf, size_t len);
+    off_t (*tell)(struct _rio *);
+    int (*flush)(struct _rio *);
+    /* The update_cksum method if not NULL is used to compute the checksum of
+     * all the data that was read or written so far. The method should be
+     * designed so that can be called with the current checksum, and the buf
+     * and len fields pointing to the new block of data to add to the checksum
+     * computation. */
+    void (*update_cksum)(struct _rio *, const void *buf, size_t len);
+
+    /* The current checksum */
+    uint64_t cksum;
+
+    /* number of bytes read or written */
+    size_t processed_bytes;
+
+    /* maximum single read or write chunk size */
+    size_t max_processing_chunk;
+
+    /* Backend-specific vars. */
+    union {
+        /* In-memory buffer target. */
+        struct {
+            sds ptr;
+            off_t pos;
+        } buffer;
+        /* Stdio file pointer target. */
+        struct {
+            FILE *fp;
+            off_t buffered; /* Bytes written since last fsync. */
+            off_t autosync; /* fsync after 'autosync' bytes written. */
+        } file;
+    } io;
+};
+
+typedef struct _rio rio;
+
+/* The following functions are our interface with the stream. They'll call the
+ * actual implementation of read / write / tell, and will update the checksum
+ * if needed. */
+static inline size_t rioWrite(rio *r, const void *buf, size_t len) {
+    while (len) {
+        size_t bytes_to_write = (r->max_processing_chunk && r->max_processing_chunk < len) ? r->max_processing_chunk : len;
+        if (r->update_cksum) r->update_cksum(r,buf,bytes_to_write);
+        if (r->write(r,buf,bytes_to_write) == 0)
+            return 0;
+        buf = (char*)buf + bytes_to_write;
+        len -= bytes_to_write;
+        r->processed_bytes += bytes_to_write;
+    }
+    return 1;
+}
+
+static inline size_t rioRead(rio *r, void *buf, size_t len) {
+    while (len) {
+        size_t bytes_to_read = (r->max_processing_chunk && r->max_processing_chunk < len) ? r->max_processing_chunk : len;
+        if (r->read(r,buf,bytes_to_read) == 0)
+            return 0;
+        if (r->update_cksum) r->update_cksum(r,buf,bytes_to_read);
+        buf = (char*)buf + bytes_to_read;
+        len -= bytes_to_read;
+        r->processed_bytes += bytes_to_read;
+    }
+    return 1;
+}
+
+static inline off_t rioTell(rio *r) {
+    return r->tell(r);
+}
+
+static inline int rioFlush(rio *r) {
+    return r->flush(r);
+}
+
+void rioInitWithFile(rio *r, FILE *fp);
+void rioInitWithBuffer(rio *r, sds s);
+
+void rioGenericUpdateChecksum(rio *r, const void *buf, size_t len);
+void rioSetAutoSync(rio *r, off_t bytes);
+
+size_t rioWriteBulkCount(rio *r, char prefix, long count);
+size_t rioWriteBulkString(rio *r, const char *buf, size_t len);
+size_t rioWriteBulkLongLong(rio *r, long long l);
+size_t rioWriteBulkDouble(rio *r, double d);
+
+#endif
@@ -300,6 +300,46 @@ static void createSharedObjects(void) {
     }
 }
 
+/* Load the RDB file at startup, before the threads run. A missing file
+ * just means an empty dataset. */
+int
+loadDataFromDisk(void)
+{
+    long long start = vr_usec_now();
+    int appendonly;
+    sds filename;
+
+    conf_server_get(CONFIG_SOPN_APPENDONLY,&appendonly);
+    if (appendonly) {
+        filename = aofGetFilename();
+        if (loadAppendOnlyFile(filename) == VR_OK) {
+            log_notice("DB loaded from append only file: %.3f seconds",
+                (float)(vr_usec_now()-start)/1000000);
+        } else if (errno != ENOENT) {
+            log_error("Fatal error loading the AOF %s: %s. Exiting.",
+                filename, strerror(errno));
+            sdsfree(filename);
+            return VR_ERROR;
+        }
+        sdsfree(filename);
+        return VR_OK;
+    }
+
+    filename = rdbGetFilename();
+    if (rdbLoad(filename) == VR_OK) {
+        log_notice("DB loaded from disk: %.3f seconds",
+            (float)(vr_usec_now()-start)/1000000);
+    } else if (errno != ENOENT) {
+        log_error("Fatal error loading the DB %s: %s. Exiting.",
+            filename, strerror(errno));
+        sdsfree(filename);
+        return VR_ERROR;
+    }
+
+    sdsfree(filename);
+    return VR_OK;
+}
+
 int
 init_server(struct instance *nci)
 {
@@ -335,6 +375,12 @@ init_server(struct instance *nci)
     server.dblnum = cserver->databases;
     server.dbinum = cserver->internal_dbs_per_databases;
     server.dbnum = server.dblnum*server.dbinum;
+    server.db_optimistic_read = cserver->db_optimistic_read;
+    server.worker_key_affinity = cserver->worker_key_affinity;
+    server.active_expire_index = cserver->active_expire_index;
+    server.keyspace_open_addressing = cserver->keyspace_open_addressing;
+    server.keyspace_table_prealloc = cserver->keyspace_table_prealloc;
+    server.lazyfree_lazy_server_del = cserver->lazyfree_lazy_server_del;
     darray_init(&server.dbs, server.dbnum, sizeof(redisDb));
     server.pidfile = nci->pid_filename;
     server.executable = NULL;
@@ -345,6 +391,13 @@ init_server(struct instance *nci)
     for (i = 0; i < server.dbnum; i ++) {
         db = darray_push(&server.dbs);
         redisDbInit(db);
+        db->id = (int)(i/(uint32_t)server.dbinum);
+        /* Every worker thread owns a reader slot in every db. */
+        if (server.db_optimistic_read &&
+            redisDbOptimisticReadInit(db, nci->thread_num) != VR_OK) {
+            log_error("Init optimistic read for db %d failed", i);
+            return VR_ERROR;
+        }
     }
 
     server.clients = dlistCreate();
@@ -356,6 +409,19 @@ init_server(struct instance *nci)
     server.lua_timedout = 0;
 
     server.aof_state = AOF_OFF;
+    server.aof_fd = -1;
+    server.aof_buf = NULL;
+    server.aof_filename = NULL;
+    server.aof_selected_db = -1;
+    server.aof_current_size = 0;
+    server.aof_last_fsync = 0;
+    server.aof_last_write_status = VR_OK;
+    server.aof_last_write_errno = 0;
+    server.aof_rewrite_base_size = 0;
+    server.aof_rewrite_buf_blocks = NULL;
+    server.aof_rewrite_time_last = -1;
+    server.aof_rewrite_time_start = -1;
+    server.aof_lastbgrewrite_status = VR_OK;
 
     server.stop_writes_on_bgsave_err = 0;
 
@@ -365,6 +431,11 @@ init_server(struct instance *nci)
 
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
+    server.lastsave = time(NULL);
+    server.lastbgsave_try = 0;
+    server.lastbgsave_status = VR_OK;
+    server.rdb_save_time_last = -1;
+    server.rdb_save_time_start = -1;
 
     server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
@@ -421,13 +492,17 @@ unsigned int getLRUClock(void) {
  * expire a key. Keys with idle time smaller than one of the current
  * keys are added. Keys are always added if there are free entries.
  *
+ * With the LFU policies the idle time is the inverted frequency, so the
+ * keys accessed less often look the most idle.
+ *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
 #define EVICTION_SAMPLES_ARRAY_SIZE 16
-void evictionPoolPopulate(dict *sampledict, dict *keydict, 
-    struct evictionPoolEntry *pool, int maxmemory_samples) {
+static void evictionPoolPopulate(redisDb *db, int volatile_only,
+    struct evictionPoolEntry *pool, int maxmemory_samples, 
+    int maxmemory_policy, int lfu_decay_time) {
     int j, k, count;
     dictEntry *_samples[EVICTION_SAMPLES_ARRAY_SIZE];
     dictEntry **samples;
@@ -440,7 +515,19 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict,
         samples = dalloc(sizeof(samples[0])*maxmemory_samples);
     }
 
-    count = dictGetSomeKeys(sampledict,samples,maxmemory_samples);
+    /* The keys with an expire are sampled from db->volatile_keys, and
+     * looked up to obtain the value object. */
+    if (volatile_only) {
+        for (count = 0; count < maxmemory_samples; count++) {
+            sds key = dbRandomVolatileKey(db);
+
+            if (key == NULL) break;
+            samples[count] = dictFind(db->dict,key);
+        }
+    } else {
+        count = (int)dictGetSomeKeys(db->dict,samples,
+            (unsigned int)maxmemory_samples);
+    }
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -449,12 +536,12 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict,
 
         de = samples[j];
         key = dictGetKey(de);
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (sampledict != keydict) de = dictFind(keydict, key);
         o = dictGetVal(de);
-        idle = estimateObjectIdleTime(o);
+        if (MAXMEMORY_POLICY_LFU(maxmemory_policy)) {
+            idle = 255-LFUDecrAndReturn(o,lfu_decay_time);
+        } else {
+            idle = estimateObjectIdleTime(o);
+        }
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
@@ -492,23 +579,25 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict,
     if (samples != _samples) dfree(samples);
 }
 
-int freeMemoryIfNeeded(vr_eventloop *vel) {
-    size_t mem_used, mem_tofree, mem_freed;
-    mstime_t latency, eviction_latency;
+/* Evict keys according to the maxmemory policy until the used memory
+ * is not greater than 'target' bytes. With a positive 'timelimit' (in
+ * microseconds) give up when it is reached, so the caller can go on
+ * with the job later.
+ *
+ * Return VR_OK if the target was reached, VR_EAGAIN if the time limit
+ * was reached first, and VR_ERROR if there was nothing to evict. */
+int evictKeysUntil(vr_eventloop *vel, size_t target, long long timelimit) {
     int keys_freed = 0;
-    long long maxmemory;
-    int maxmemory_policy, maxmemory_samples;
-    int ret;
-
-    maxmemory = vel->cc.maxmemory;
-    if (dalloc_used_memory() <= maxmemory)
-        return VR_OK;
+    long long start;
+    int maxmemory_policy, maxmemory_samples, lfu_decay_time;
 
     conf_server_get(CONFIG_SOPN_MAXMEMORYP, &maxmemory_policy);
     if (maxmemory_policy == MAXMEMORY_NO_EVICTION)
         return VR_ERROR; /* We need to free memory, but policy forbids. */
 
     conf_server_get(CONFIG_SOPN_MAXMEMORYS, &maxmemory_samples);
+    conf_server_get(CONFIG_SOPN_LFUDECAYTIME, &lfu_decay_time);
+    start = vr_usec_now();
     while (1) {
         int j, k;
 
@@ -517,41 +606,39 @@ int freeMemoryIfNeeded(vr_eventloop *vel) {
             sds bestkey = NULL;
             dictEntry *de;
             redisDb *db = darray_get(&server.dbs, j);
-            dict *dict;
+            int volatile_only;
 
             lockDbWrite(db);
-            if (maxmemory_policy == MAXMEMORY_ALLKEYS_LRU ||
-                maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM)
-            {
-                dict = db->dict;
-            } else {
-                dict = db->expires;
-            }
-            if (dictSize(dict) == 0) {
+            volatile_only = !MAXMEMORY_POLICY_ALLKEYS(maxmemory_policy);
+            if ((volatile_only ? dbExpiresSize(db) : dictSize(db->dict)) == 0) {
                 unlockDb(db);
                 continue;
             }
 
             /* volatile-random and allkeys-random policy */
-            if (maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
-                maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM)
-            {
-                de = dictGetRandomKey(dict);
+            if (maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
+                de = dictGetRandomKey(db->dict);
                 bestkey = dictGetKey(de);
+            } else if (maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM) {
+                bestkey = dbRandomVolatileKey(db);
             }
 
-            /* volatile-lru and allkeys-lru policy */
-            else if (maxmemory_policy == MAXMEMORY_ALLKEYS_LRU ||
-                maxmemory_policy == MAXMEMORY_VOLATILE_LRU)
+            /* volatile-lru, allkeys-lru, volatile-lfu and allkeys-lfu policy */
+            else if (MAXMEMORY_POLICY_LRU(maxmemory_policy) ||
+                MAXMEMORY_POLICY_LFU(maxmemory_policy))
             {
                 struct evictionPoolEntry *pool = db->eviction_pool;
 
                 while(bestkey == NULL) {
-                    evictionPoolPopulate(dict, db->dict, db->eviction_pool, maxmemory_samples);
+                    evictionPoolPopulate(db, volatile_only, db->eviction_pool, 
+                        maxmemory_samples, maxmemory_policy, lfu_decay_time);
                     /* Go backward from best to worst element to evict. */
                     for (k = MAXMEMORY_EVICTION_POOL_SIZE-1; k >= 0; k--) {
                         if (pool[k].key == NULL) continue;
-                        de = dictFind(dict,pool[k].key);
+                        de = dictFind(db->dict,pool[k].key);
+                        /* A volatile key may have been made persistent. */
+                        if (de && volatile_only &&
+                            dbKeyGetExpire(dictGetKey(de)) == -1) de = NULL;
 
                         /* Remove the entry from the pool. */
                         sdsfree(pool[k].key);
@@ -582,9 +669,8 @@ int freeMemoryIfNeeded(vr_eventloop *vel) {
                     sds thiskey;
                     long thisval;
 
-                    de = dictGetRandomKey(dict);
-                    thiskey = dictGetKey(de);
-                    thisval = (long) dictGetVal(de);
+                    thiskey = dbRandomVolatileKey(db);
+                    thisval = (long) dbKeyGetExpire(thiskey);
 
                     /* Expire sooner (minor expire unix timestamp) is better
                      * candidate for deletion */
@@ -598,15 +684,17 @@ int freeMemoryIfNeeded(vr_eventloop *vel) {
             /* Finally remove the selected key. */
             if (bestkey) {
                 robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
+                propagateExpire(db,keyobj);
                 dbDelete(db,keyobj);
                 freeObject(keyobj);
                 keys_freed++;
             }
             
             unlockDb(db);
+            /* Queue the DEL before locking the next db. */
+            aofCallDone(vel);
 
-            conf_server_get(CONFIG_SOPN_MAXMEMORY, &maxmemory);
-            if (dalloc_used_memory() <= maxmemory) {
+            if (dalloc_used_memory() <= target) {
                 goto stop;
             }
         }
@@ -617,6 +705,10 @@ int freeMemoryIfNeeded(vr_eventloop *vel) {
 
         update_stats_add(vel->stats, evictedkeys, keys_freed);
         keys_freed = 0;
+
+        if (timelimit > 0 && vr_usec_now()-start > timelimit) {
+            return VR_EAGAIN;
+        }
     }
 
 stop:
@@ -624,6 +716,44 @@ stop:
     return VR_OK;
 }
 
+/* Called by the workers before every command when maxmemory is set, 
+ * evict keys inline if the used memory is over maxmemory. The backend
+ * threads try to keep it under the low watermark, so this should just
+ * happen on write bursts faster than backgroundEvictCycle(). */
+int freeMemoryIfNeeded(vr_eventloop *vel) {
+    long long maxmemory;
+
+    maxmemory = vel->cc.maxmemory;
+    /* The fast read may be off by dalloc_used_memory_error() bytes,
+     * confirm with the exact one before evicting. */
+    if (dalloc_used_memory_fast() <= (size_t)maxmemory ||
+        dalloc_used_memory() <= (size_t)maxmemory)
+        return VR_OK;
+
+    update_stats_add(vel->stats, inline_evictions, 1);
+    return evictKeysUntil(vel, (size_t)maxmemory, 0);
+}
+
+/* Evict keys in the backend threads until the used memory is under
+ * maxmemory-low-watermark percent of maxmemory, for at most 
+ * BACKGROUND_EVICT_TIMELIMIT microseconds every call. */
+void backgroundEvictCycle(vr_eventloop *vel) {
+    long long maxmemory;
+    int watermark;
+    size_t target;
+
+    maxmemory = vel->cc.maxmemory;
+    conf_server_get(CONFIG_SOPN_LOWWATERMARK, &watermark);
+    if (maxmemory == 0 || watermark == 0 || watermark >= 100)
+        return;
+
+    target = (size_t)(maxmemory/100*watermark);
+    if (dalloc_used_memory() <= target)
+        return;
+
+    evictKeysUntil(vel, target, BACKGROUND_EVICT_TIMELIMIT);
+}
+
 /* The PING command. It works in a different way if the client is in
  * in Pub/Sub mode. */
 void pingCommand(client *c) {
@@ -842,6 +972,8 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
         size_t peak_memory = 0, peak_memory_for_one_worker;
         long long maxmemory;
         int maxmemory_policy;
+        slabStats slab;
+        char slab_hmem[64];
 
         /* Peak memory is updated from time to time by workerCron() so it
          * may happen that the instantaneous value is slightly bigger than
@@ -869,6 +1001,9 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
         bytesToHuman(used_memory_rss_hmem,vel->resident_set_size);
         bytesToHuman(maxmemory_hmem,maxmemory);
 
+        slabGetStats(&slab);
+        bytesToHuman(slab_hmem,slab.memory);
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Memory\r\n"
@@ -884,7 +1019,15 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
             "maxmemory_human:%s\r\n"
             "maxmemory_policy:%s\r\n"
             "mem_fragmentation_ratio:%.2f\r\n"
-            "mem_allocator:%s\r\n",
+            "mem_fragmentation_bytes:%lld\r\n"
+            "mem_allocator:%s\r\n"
+            "slab_memory:%zu\r\n"
+            "slab_memory_human:%s\r\n"
+            "slab_used_memory:%zu\r\n"
+            "slab_utilization:%.2f%%\r\n"
+            "slab_fragmentation_ratio:%.2f\r\n"
+            "slab_remote_frees:%lld\r\n"
+            "lazyfree_pending_objects:%llu\r\n",
             vr_used_memory,
             hmem,
             vel->resident_set_size,
@@ -897,10 +1040,64 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
             maxmemory_hmem,
             evict_policy,
             (float)vel->resident_set_size/vr_used_memory,
-            DMALLOC_LIB
+            (long long)vel->resident_set_size-(long long)vr_used_memory,
+            DMALLOC_LIB,
+            slab.memory,
+            slab_hmem,
+            slab.used,
+            slab.capacity ? (float)slab.used*100/(float)slab.capacity : 0,
+            slab.used ? (float)slab.memory/(float)slab.used : 0,
+            slab.remote_frees,
+            backends_lazyfree_pending()
             );
     }
 
+    /* Persistence */
+    if (allsections || defsections || !strcasecmp(section,"persistence")) {
+        int aof_rw_state = aofRewriteGetState();
+
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Persistence\r\n"
+            "loading:%d\r\n"
+            "rdb_changes_since_last_save:%lld\r\n"
+            "rdb_bgsave_in_progress:%d\r\n"
+            "rdb_last_save_time:%jd\r\n"
+            "rdb_last_bgsave_status:%s\r\n"
+            "rdb_last_bgsave_time_sec:%jd\r\n"
+            "aof_enabled:%d\r\n"
+            "aof_rewrite_in_progress:%d\r\n"
+            "aof_rewrite_scheduled:%d\r\n"
+            "aof_last_rewrite_time_sec:%jd\r\n"
+            "aof_current_rewrite_time_sec:%jd\r\n"
+            "aof_last_bgrewrite_status:%s\r\n"
+            "aof_last_write_status:%s\r\n",
+            server.loading,
+            rdbChangesSinceLastSave(),
+            rdbSaveInProgress(),
+            (intmax_t)server.lastsave,
+            (server.lastbgsave_status == VR_OK) ? "ok" : "err",
+            (intmax_t)server.rdb_save_time_last,
+            server.aof_state != AOF_OFF,
+            aof_rw_state >= AOF_RW_BASE,
+            aof_rw_state == AOF_RW_SCHEDULED,
+            (intmax_t)server.aof_rewrite_time_last,
+            (intmax_t)((aof_rw_state >= AOF_RW_BASE) ?
+                time(NULL)-server.aof_rewrite_time_start : -1),
+            (server.aof_lastbgrewrite_status == VR_OK) ? "ok" : "err",
+            (server.aof_last_write_status == VR_OK) ? "ok" : "err");
+
+        if (server.aof_state != AOF_OFF) {
+            info = sdscatprintf(info,
+                "aof_current_size:%lld\r\n"
+                "aof_base_size:%lld\r\n"
+                "aof_rewrite_buffer_length:%lu\r\n",
+                (long long)server.aof_current_size,
+                (long long)server.aof_rewrite_base_size,
+                aofRewriteBufferLength());
+        }
+    }
+
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
         uint32_t idx;
@@ -908,9 +1105,13 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
         long long stat_numconnections=0, stat_numcommands=0;
         long long stat_net_input_bytes=0, stat_net_output_bytes=0;
         long long stat_rejected_conn=0;
-        long long stat_expiredkeys=0;
+        long long stat_expiredkeys=0, stat_expire_lag=0;
         long long stat_evictedkeys=0;
         long long stat_keyspace_hits=0, stat_keyspace_misses=0;
+        long long stat_forwarded_commands=0;
+        long long stat_migrated_clients=0;
+        long long stat_inline_evictions=0;
+        long long stat_writes_saved=0;
         long long stat_numcommands_ops=0;
         float stat_net_input_bytes_ops=0, stat_net_output_bytes_ops=0;
 
@@ -935,6 +1136,14 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
             stat_keyspace_hits += stats_value;
             update_stats_get(stats, keyspace_misses, &stats_value);
             stat_keyspace_misses += stats_value;
+            update_stats_get(stats, forwarded_commands, &stats_value);
+            stat_forwarded_commands += stats_value;
+            update_stats_get(stats, migrated_clients, &stats_value);
+            stat_migrated_clients += stats_value;
+            update_stats_get(stats, inline_evictions, &stats_value);
+            stat_inline_evictions += stats_value;
+            update_stats_get(stats, writes_saved, &stats_value);
+            stat_writes_saved += stats_value;
             
             stat_numcommands_ops += getInstantaneousMetric(stats, STATS_METRIC_COMMAND);
             stat_net_input_bytes_ops += (float)getInstantaneousMetric(stats, STATS_METRIC_NET_INPUT)/1024;
@@ -947,8 +1156,17 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
 
             update_stats_get(stats, expiredkeys, &stats_value);
             stat_expiredkeys += stats_value;
+            update_stats_get(stats, evictedkeys, &stats_value);
+            stat_evictedkeys += stats_value;
         }
         update_stats_get(master.vel.stats, rejected_conn, &stat_rejected_conn);
+        if (server.active_expire_index) {
+            for (idx = 0; idx < (uint32_t)server.dbnum; idx ++) {
+                redisDb *db = darray_get(&server.dbs, idx);
+                if (db->expire_lag > stat_expire_lag)
+                    stat_expire_lag = db->expire_lag;
+            }
+        }
         
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
@@ -962,9 +1180,17 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
             "instantaneous_output_kbps:%.2f\r\n"
             "rejected_connections:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expire_reclaim_lag_ms:%lld\r\n"
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
-            "keyspace_misses:%lld\r\n",
+            "keyspace_misses:%lld\r\n"
+            "forwarded_commands:%lld\r\n"
+            "migrated_clients:%lld\r\n"
+            "inline_evictions:%lld\r\n"
+            "total_writes_saved:%lld\r\n"
+            "sync_full:%lld\r\n"
+            "sync_partial_ok:%lld\r\n"
+            "sync_partial_err:%lld\r\n",
             stat_numconnections,
             stat_numcommands,
             stat_numcommands_ops,
@@ -974,9 +1200,23 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
             stat_net_output_bytes_ops,
             stat_rejected_conn,
             stat_expiredkeys,
+            stat_expire_lag,
             stat_evictedkeys,
             stat_keyspace_hits,
-            stat_keyspace_misses);
+            stat_keyspace_misses,
+            stat_forwarded_commands,
+            stat_migrated_clients,
+            stat_inline_evictions,
+            stat_writes_saved,
+            repl.stat_sync_full,
+            repl.stat_sync_partial_ok,
+            repl.stat_sync_partial_err);
+    }
+
+    /* Replication */
+    if (allsections || defsections || !strcasecmp(section,"replication")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = replicationGetInfo(info);
     }
 
     /* CPU */
@@ -1008,7 +1248,7 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
                 db = darray_get(&server.dbs, (uint32_t)(j*server.dbinum+k));
                 lockDbRead(db);
                 keys = dictSize(db->dict);
-                vkeys = dictSize(db->expires);
+                vkeys = (long long)dbExpiresSize(db);
                 avg_ttl = db->avg_ttl;
                 unlockDb(db);
                 if (keys || vkeys) {
@@ -1041,7 +1281,7 @@ sds genVireInfoString(vr_eventloop *vel, char *section) {
                     db = darray_get(&server.dbs, (uint32_t)(j*server.dbinum+k));
                     lockDbRead(db);
                     keys_all += dictSize(db->dict);
-                    vkeys_all += dictSize(db->expires);
+                    vkeys_all += (long long)dbExpiresSize(db);
                     avg_ttl_all += db->avg_ttl;
                     if (db->avg_ttl > 0) nexist ++;
                     unlockDb(db);
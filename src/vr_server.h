@@ -13,6 +13,7 @@
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
+#define ACTIVE_EXPIRE_CYCLE_INDEX_BATCH 256 /* Keys expired per db lock */
 
 #define SCAN_TYPE_KEY   0
 #define SCAN_TYPE_HASH  1
@@ -47,6 +48,9 @@
 #define UNIT_SECONDS 0
 #define UNIT_MILLISECONDS 1
 
+/* Max microseconds a backend thread evicts keys in every cron call. */
+#define BACKGROUND_EVICT_TIMELIMIT 25000
+
 /* Hash table parameters */
 #define HASHTABLE_MIN_FILL        10      /* Minimal hash table fill 10% */
 
@@ -56,10 +60,13 @@
 #define run_with_period(_ms_, cronloops) if ((_ms_ <= 1000/server.hz) || !(cronloops%((_ms_)/(1000/server.hz))))
 
 /* Macro used to obtain the current LRU clock.
- * If the current resolution is lower than the frequency we refresh the
- * LRU clock (as it should be in production servers) we return the
- * precomputed value, otherwise we need to resort to a function call. */
-#define LRU_CLOCK() ((1000/server.hz <= LRU_CLOCK_RESOLUTION) ? server.lruclock : getLRUClock())
+ * If the current resolution is lower than the frequency the eventloop of
+ * this thread refreshes its LRU clock (as it should be in production
+ * servers) we return the precomputed value, otherwise we need to resort
+ * to a function call. */
+#define LRU_CLOCK() ((current_vel != NULL &&                             \
+    1000/current_vel->hz <= LRU_CLOCK_RESOLUTION) ?                      \
+    current_vel->lruclock : getLRUClock())
 
 /* The following structure represents a node in the server.ready_keys list,
  * where we accumulate all the keys that had clients blocked with a blocking
@@ -91,6 +98,12 @@ struct vr_server {
     int dbnum;                  /* Total number of DBs */
     int dblnum;                 /* Logical number of configured DBs */
     int dbinum;                 /* Number of internal DBs for per logical DB */
+    int db_optimistic_read;     /* Fast read only commands skip the db rwlock */
+    int worker_key_affinity;    /* Run commands in the worker owning the keys */
+    int active_expire_index;    /* Expire the keys by an index of the times */
+    int keyspace_open_addressing; /* Open addressing tables for the keys */
+    int keyspace_table_prealloc; /* Backends make the next keyspace tables */
+    int lazyfree_lazy_server_del; /* Backends free the big values deleted */
     
     dict *commands;             /* Command table */
     dict *orig_commands;        /* Command table before command renaming. */
@@ -336,10 +349,13 @@ int dictObjKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictListDestructor(void *privdata, void *val);
 
 int init_server(struct instance *nci);
+int loadDataFromDisk(void);
 
 unsigned int getLRUClock(void);
 
+int evictKeysUntil(vr_eventloop *vel, size_t target, long long timelimit);
 int freeMemoryIfNeeded(vr_eventloop *vel);
+void backgroundEvictCycle(vr_eventloop *vel);
 void pingCommand(struct client *c);
 int time_independent_strcmp(char *a, char *b);
 void authCommand(struct client *c) ;
@@ -0,0 +1,362 @@
+#include <sys/mman.h>
+
+#include <vr_core.h>
+
+/* ----------------------------------------------------------------------------
+ * Slab pools
+ *
+ * The small objects of the keyspace, robj headers, dict entries, embstr
+ * strings and short keys, are carved out of pages of SLAB_PAGE_SIZE bytes
+ * mapped on their own, every page holding slots of a single size class.
+ * Overwriting and deleting keys frees slots that are reused by the next
+ * objects of the same size, so the churn doesn't scatter the heap like it
+ * does with the general allocator, and the pages left empty go back to
+ * the system.
+ *
+ * Every worker and backend thread owns a pool and uses it with no lock.
+ * A slot freed by a thread not owning it, that is a key deleted by a
+ * worker but created by another one, is pushed on the lock free remote
+ * stack of the pool, drained by the owner when it needs slots and in its
+ * cron. The other threads, the master, the loaders and the dumpers, share
+ * a few pools protected by a mutex.
+ *
+ * The slots are accounted in used_memory like the dalloc() allocations,
+ * so maxmemory and the eviction still see them.
+ * ------------------------------------------------------------------------- */
+
+#define SLAB_PAGE_HEADER    64  /* Bytes before the first slot of a page */
+#define SLAB_CLASSES        5
+
+static const uint32_t slab_class_size[SLAB_CLASSES] = {24, 32, 48, 64, 80};
+
+/* The class of the slots of 'size' bytes, indexed by (size+7)/8. */
+static const uint8_t slab_size_class[SLAB_MAX_SIZE/8+1] = {
+    0, 0, 0, 0, 1, 2, 2, 3, 3, 4, 4
+};
+
+struct slabPool;
+
+typedef struct slabPage {
+    struct slabPool *pool;      /* Pool owning the page */
+    struct slabPage *prev;      /* Partial list of the class */
+    struct slabPage *next;
+    void *free;                 /* Freed slots */
+    char *bump;                 /* Slots never used start here */
+    char *end;
+    uint32_t size;              /* Size of the slots */
+    uint32_t used;              /* Slots in use */
+    int cls;
+    int partial;                /* Linked in the partial list? */
+} slabPage;
+
+typedef struct slabPool {
+    slabPage *partial[SLAB_CLASSES];    /* Pages with free slots */
+    slabPage *spare;            /* An empty page kept for the next class */
+    void *remote;               /* Slots freed by the other threads */
+    int shared;
+    pthread_mutex_t lock;       /* Only for the shared pools */
+
+    size_t pages;
+    size_t capacity;
+    size_t used;
+    long long remote_frees;
+
+    struct slabPool *next_pool;
+} slabPool;
+
+static __thread slabPool *slab_pool = NULL;
+
+static slabPool *slab_pools = NULL;     /* All the pools, for the stats */
+static pthread_mutex_t slab_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static slabPool *slab_shared[SLAB_SHARED_POOLS];
+static unsigned int slab_shared_next = 0;
+static pthread_once_t slab_shared_once = PTHREAD_ONCE_INIT;
+
+#define slab_atomic_get(_ptr) __atomic_load_n(_ptr,__ATOMIC_RELAXED)
+
+#define slabPageOf(_ptr)    \
+    ((slabPage*)((uintptr_t)(_ptr)&~((uintptr_t)SLAB_PAGE_SIZE-1)))
+
+static slabPool *slabPoolCreate(int locked) {
+    slabPool *pool = dzalloc(sizeof(*pool));
+
+    if (pool == NULL) return NULL;
+    pool->shared = locked;
+    if (locked) pthread_mutex_init(&pool->lock,NULL);
+
+    pthread_mutex_lock(&slab_pools_lock);
+    pool->next_pool = slab_pools;
+    slab_pools = pool;
+    pthread_mutex_unlock(&slab_pools_lock);
+    return pool;
+}
+
+static void slabSharedPoolsInit(void) {
+    int j;
+
+    for (j = 0; j < SLAB_SHARED_POOLS; j ++) {
+        slab_shared[j] = slabPoolCreate(1);
+        if (slab_shared[j] == NULL)
+            serverPanic("Can't create the shared slab pools");
+    }
+}
+
+/* Give the calling thread a pool of its own, for the threads living as
+ * long as the server that allocate most of the keyspace. */
+void slabPoolBind(void) {
+    slabPool *pool;
+
+    if (slab_pool != NULL && !slab_pool->shared) return;
+    pool = slabPoolCreate(0);
+    if (pool == NULL) {
+        log_warn("Create the slab pool of the thread failed, a shared one is used");
+        return;
+    }
+    slab_pool = pool;
+}
+
+static inline slabPool *slabPoolGet(void) {
+    if (slab_pool == NULL) {
+        unsigned int idx;
+
+        pthread_once(&slab_shared_once,slabSharedPoolsInit);
+        idx = __atomic_fetch_add(&slab_shared_next,1,__ATOMIC_RELAXED);
+        slab_pool = slab_shared[idx%SLAB_SHARED_POOLS];
+    }
+    return slab_pool;
+}
+
+static slabPage *slabPageMap(void) {
+    char *map, *page;
+    size_t head, tail;
+
+    /* Map twice the size to trim it to an aligned page. */
+    map = mmap(NULL,SLAB_PAGE_SIZE*2,PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (map == MAP_FAILED) {
+        log_error("mmap a slab page failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    page = (char*)(((uintptr_t)map+SLAB_PAGE_SIZE-1)&
+        ~((uintptr_t)SLAB_PAGE_SIZE-1));
+    head = (size_t)(page-map);
+    tail = SLAB_PAGE_SIZE-head;
+    if (head > 0) munmap(map,head);
+    if (tail > 0) munmap(page+SLAB_PAGE_SIZE,tail);
+    return (slabPage*)page;
+}
+
+static void slabPageInit(slabPool *pool, slabPage *page, int cls) {
+    page->pool = pool;
+    page->prev = page->next = NULL;
+    page->free = NULL;
+    page->bump = (char*)page+SLAB_PAGE_HEADER;
+    page->size = slab_class_size[cls];
+    page->end = (char*)page+SLAB_PAGE_HEADER+
+        (SLAB_PAGE_SIZE-SLAB_PAGE_HEADER)/page->size*page->size;
+    page->used = 0;
+    page->cls = cls;
+    page->partial = 0;
+}
+
+static inline void slabPartialLink(slabPool *pool, slabPage *page) {
+    page->prev = NULL;
+    page->next = pool->partial[page->cls];
+    if (page->next) page->next->prev = page;
+    pool->partial[page->cls] = page;
+    page->partial = 1;
+}
+
+static inline void slabPartialUnlink(slabPool *pool, slabPage *page) {
+    if (page->prev) page->prev->next = page->next;
+    else pool->partial[page->cls] = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+    page->partial = 0;
+}
+
+/* Return a slot to its page, the caller owns the pool. */
+static void slabFreeLocal(slabPool *pool, slabPage *page, void *ptr) {
+    page->used --;
+    pool->used -= page->size;
+
+    if (page->used == 0) {
+        if (page->partial) slabPartialUnlink(pool,page);
+        pool->capacity -= (size_t)(page->end-((char*)page+SLAB_PAGE_HEADER));
+        if (pool->spare == NULL) {
+            pool->spare = page;
+        } else {
+            munmap(page,SLAB_PAGE_SIZE);
+            pool->pages --;
+        }
+        return;
+    }
+
+    *(void**)ptr = page->free;
+    page->free = ptr;
+    if (!page->partial) slabPartialLink(pool,page);
+}
+
+/* Take back the slots freed by the other threads. */
+static void slabDrainRemote(slabPool *pool) {
+    void *ptr, *next;
+
+    if (slab_atomic_get(&pool->remote) == NULL) return;
+    ptr = __atomic_exchange_n(&pool->remote,NULL,__ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        next = *(void**)ptr;
+        slabFreeLocal(pool,slabPageOf(ptr),ptr);
+        ptr = next;
+    }
+}
+
+static void *slabAllocLocal(slabPool *pool, int cls) {
+    slabPage *page;
+    void *ptr;
+
+    page = pool->partial[cls];
+    if (page == NULL) {
+        slabDrainRemote(pool);
+        page = pool->partial[cls];
+    }
+    if (page == NULL) {
+        if (pool->spare != NULL) {
+            page = pool->spare;
+            pool->spare = NULL;
+        } else {
+            page = slabPageMap();
+            if (page == NULL) return NULL;
+            pool->pages ++;
+        }
+        slabPageInit(pool,page,cls);
+        pool->capacity += (size_t)(page->end-page->bump);
+        slabPartialLink(pool,page);
+    }
+
+    if (page->free != NULL) {
+        ptr = page->free;
+        page->free = *(void**)ptr;
+    } else {
+        ptr = page->bump;
+        page->bump += page->size;
+    }
+    page->used ++;
+    pool->used += page->size;
+
+    if (page->free == NULL && page->bump == page->end)
+        slabPartialUnlink(pool,page);
+    return ptr;
+}
+
+/* Allocate 'size' bytes, up to SLAB_MAX_SIZE, from the pool of the
+ * thread. The memory has to be released by slabFree(). */
+void *slabAlloc(size_t size) {
+    slabPool *pool = slabPoolGet();
+    int cls;
+    void *ptr;
+
+    ASSERT(size > 0 && size <= SLAB_MAX_SIZE);
+    cls = slab_size_class[(size+7)/8];
+
+    if (pool->shared) {
+        pthread_mutex_lock(&pool->lock);
+        ptr = slabAllocLocal(pool,cls);
+        pthread_mutex_unlock(&pool->lock);
+    } else {
+        ptr = slabAllocLocal(pool,cls);
+    }
+
+    if (ptr == NULL) return NULL;
+    dalloc_stat_alloc(slab_class_size[cls]);
+    return ptr;
+}
+
+void slabFree(void *ptr) {
+    slabPage *page;
+    slabPool *pool;
+    uint32_t size;
+    void *head;
+
+    if (ptr == NULL) return;
+
+    page = slabPageOf(ptr);
+    pool = page->pool;
+    size = page->size;
+
+    if (pool->shared) {
+        pthread_mutex_lock(&pool->lock);
+        slabFreeLocal(pool,page,ptr);
+        pthread_mutex_unlock(&pool->lock);
+    } else if (pool == slab_pool) {
+        slabFreeLocal(pool,page,ptr);
+    } else {
+        /* The page may go away as soon as the slot is pushed. */
+        head = slab_atomic_get(&pool->remote);
+        do {
+            *(void**)ptr = head;
+        } while (!__atomic_compare_exchange_n(&pool->remote,&head,ptr,1,
+            __ATOMIC_RELEASE,__ATOMIC_RELAXED));
+        __atomic_add_fetch(&pool->remote_frees,1,__ATOMIC_RELAXED);
+    }
+
+    dalloc_stat_free(size);
+}
+
+/* The size of the slot at 'ptr'. */
+size_t slabSize(void *ptr) {
+    return slabPageOf(ptr)->size;
+}
+
+/* Duplicate a short sds string in a slot, like sdsdup() does for the
+ * longer ones. The copy has to be released by slabSdsFree(). */
+sds slabSdsDup(const sds s) {
+    size_t len = sdslen(s);
+    struct sdshdr8 *sh;
+
+    if (len > SLAB_SDS_MAX_LEN) return sdsdup(s);
+
+    sh = slabAlloc(sizeof(struct sdshdr8)+len+1);
+    if (sh == NULL) return NULL;
+    sh->len = (uint8_t)len;
+    sh->alloc = (uint8_t)len;
+    sh->flags = SDS_TYPE_8;
+    memcpy(sh->buf,s,len);
+    sh->buf[len] = '\0';
+    return sh->buf;
+}
+
+void slabSdsFree(sds s) {
+    if (s == NULL) return;
+    if (sdslen(s) > SLAB_SDS_MAX_LEN) {
+        sdsfree(s);
+        return;
+    }
+    slabFree(sdsAllocPtr(s));
+}
+
+/* Called by the threads owning a pool in their cron, so that the slots
+ * freed by the other threads go back to the pages even when no object is
+ * created. The shared pools take the frees under their lock. */
+void slabCron(void) {
+    if (slab_pool != NULL && !slab_pool->shared)
+        slabDrainRemote(slab_pool);
+}
+
+void slabGetStats(slabStats *stats) {
+    slabPool *pool;
+
+    memset(stats,0,sizeof(*stats));
+
+    pthread_mutex_lock(&slab_pools_lock);
+    for (pool = slab_pools; pool != NULL; pool = pool->next_pool) {
+        stats->pages += slab_atomic_get(&pool->pages);
+        stats->capacity += slab_atomic_get(&pool->capacity);
+        stats->used += slab_atomic_get(&pool->used);
+        stats->remote_frees += slab_atomic_get(&pool->remote_frees);
+    }
+    pthread_mutex_unlock(&slab_pools_lock);
+
+    stats->memory = stats->pages*SLAB_PAGE_SIZE;
+}
@@ -0,0 +1,31 @@
+#ifndef _VR_SLAB_H_
+#define _VR_SLAB_H_
+
+#define SLAB_PAGE_SIZE      (64*1024)   /* Pages are aligned to their size */
+#define SLAB_MAX_SIZE       80          /* Biggest slot, embstr objects fit */
+#define SLAB_SHARED_POOLS   8           /* Pools of the threads not bound */
+
+/* The max length of an sds created by slabSdsDup() in a slot. */
+#define SLAB_SDS_MAX_LEN    (SLAB_MAX_SIZE-sizeof(struct sdshdr8)-1)
+
+typedef struct slabStats {
+    size_t pages;           /* Pages mapped */
+    size_t memory;          /* Bytes mapped */
+    size_t capacity;        /* Bytes of the slots of the pages */
+    size_t used;            /* Bytes of the slots in use */
+    long long remote_frees; /* Slots freed by a thread not owning them */
+} slabStats;
+
+void slabPoolBind(void);
+void slabCron(void);
+
+void *slabAlloc(size_t size);
+void slabFree(void *ptr);
+size_t slabSize(void *ptr);
+
+sds slabSdsDup(const sds s);
+void slabSdsFree(sds s);
+
+void slabGetStats(slabStats *stats);
+
+#endif
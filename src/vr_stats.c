@@ -22,7 +22,12 @@ vr_stats_init(vr_stats *stats)
     stats->sync_partial_err = 0;
     stats->net_input_bytes = 0;
     stats->net_output_bytes = 0;
+    stats->forwarded_commands = 0;
+    stats->migrated_clients = 0;
+    stats->inline_evictions = 0;
+    stats->writes_saved = 0;
     stats->peak_memory = 0;
+    memset(stats->inst_metric,0,sizeof(stats->inst_metric));
     
 #if !defined(STATS_ATOMIC_FIRST) || (!defined(__ATOMIC_RELAXED) && !defined(HAVE_ATOMIC))
     ret = pthread_spin_init(&stats->statslock, 0);
@@ -56,6 +61,10 @@ vr_stats_deinit(vr_stats *stats)
     stats->sync_partial_err = 0;
     stats->net_input_bytes = 0;
     stats->net_output_bytes = 0;
+    stats->forwarded_commands = 0;
+    stats->migrated_clients = 0;
+    stats->inline_evictions = 0;
+    stats->writes_saved = 0;
     
 #if !defined(STATS_ATOMIC_FIRST) || (!defined(__ATOMIC_RELAXED) && !defined(HAVE_ATOMIC))
     pthread_spin_destroy(&stats->statslock);
@@ -27,6 +27,10 @@ typedef struct vr_stats {
     long long sync_partial_err;/* Number of unaccepted PSYNC requests. */
     long long net_input_bytes; /* Bytes read from network. */
     long long net_output_bytes; /* Bytes written to network. */
+    long long forwarded_commands; /* Commands sent to the worker owning the keys */
+    long long migrated_clients; /* Hot clients moved to a cooler worker */
+    long long inline_evictions; /* Commands that had to evict keys over maxmemory */
+    long long writes_saved;    /* write() calls saved by writev() to the clients */
     size_t    peak_memory;     /* Max used memory record */
     
     /* The following two are used to track instantaneous metrics, like
@@ -149,7 +149,7 @@ int getGenericCommand(client *c) {
         addReply(c,shared.wrongtypeerr);
         return VR_ERROR;
     } else {
-        addReplyBulk(c,o);
+        addReplyBulkShared(c,o);
         return VR_OK;
     }
 }
@@ -168,7 +168,7 @@ void getCommand(client *c) {
     if (o->type != OBJ_STRING) {
         addReply(c,shared.wrongtypeerr);
     } else {
-        addReplyBulk(c,o);
+        addReplyBulkShared(c,o);
     }
     
     unlockDb(c->db);
@@ -196,7 +196,7 @@ void getsetCommand(client *c) {
             goto end;
         }
 
-        addReplyBulk(c,val);
+        addReplyBulkShared(c,val);
         dbOverwrite(c->db,key,dupStringObjectUnconstant(c->argv[2]));
         removeExpire(c->db,key);
     }
@@ -356,7 +356,7 @@ void mgetCommand(client *c) {
             if (o->type != OBJ_STRING) {
                 addReply(c,shared.nullbulk);
             } else {
-                addReplyBulk(c,o);
+                addReplyBulkShared(c,o);
             }
             unlockDb(c->db);
             update_stats_add(c->vel->stats, keyspace_hits, 1);
@@ -1,5 +1,9 @@
 #include <vr_core.h>
 
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
+
 int
 vr_thread_init(vr_thread *thread)
 {    
@@ -50,3 +54,102 @@ int vr_thread_start(vr_thread *thread)
 
     return VR_OK;
 }
+
+int
+vr_notifier_init(vr_notifier *nt)
+{
+    int fds[2];
+
+    nt->rfd = -1;
+    nt->wfd = -1;
+    nt->notified = 0;
+
+#ifdef HAVE_EVENTFD
+    fds[0] = eventfd(0, EFD_NONBLOCK);
+    if (fds[0] < 0) {
+        log_error("create eventfd failed: %s", strerror(errno));
+        return VR_ERROR;
+    }
+    fds[1] = fds[0];
+#else
+    if (pipe(fds) < 0) {
+        log_error("create pipe failed: %s", strerror(errno));
+        return VR_ERROR;
+    }
+
+    if (vr_set_nonblocking(fds[0]) < 0 || vr_set_nonblocking(fds[1]) < 0) {
+        log_error("set pipe %d %d nonblocking failed: %s", 
+            fds[0], fds[1], strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return VR_ERROR;
+    }
+#endif
+
+    nt->rfd = fds[0];
+    nt->wfd = fds[1];
+
+    return VR_OK;
+}
+
+void
+vr_notifier_deinit(vr_notifier *nt)
+{
+    if (nt->wfd >= 0 && nt->wfd != nt->rfd) {
+        close(nt->wfd);
+    }
+    if (nt->rfd >= 0) {
+        close(nt->rfd);
+    }
+
+    nt->rfd = -1;
+    nt->wfd = -1;
+    nt->notified = 0;
+}
+
+/* Safe to be called by any thread, after the work was queued. */
+void
+vr_notifier_notify(vr_notifier *nt)
+{
+    int notified;
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+
+#if defined(__ATOMIC_SEQ_CST)
+    notified = __atomic_exchange_n(&nt->notified, 1, __ATOMIC_SEQ_CST);
+#else
+    notified = __sync_lock_test_and_set(&nt->notified, 1);
+    __sync_synchronize();
+#endif
+    if (notified) return;
+
+    if (vr_write(nt->wfd, &one, sizeof(one)) != sizeof(one)) {
+        log_error("Notice the thread failed: %s", strerror(errno));
+    }
+}
+
+/* Called by the owner thread before handling the queued work. */
+void
+vr_notifier_consume(vr_notifier *nt)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t count;
+
+    vr_read(nt->rfd, &count, sizeof(count));
+#else
+    char buf[64];
+
+    while (vr_read(nt->rfd, buf, sizeof(buf)) > 0);
+#endif
+
+    /* The work queued after this point will notify again. */
+#if defined(__ATOMIC_SEQ_CST)
+    __atomic_store_n(&nt->notified, 0, __ATOMIC_SEQ_CST);
+#else
+    __sync_lock_release(&nt->notified);
+    __sync_synchronize();
+#endif
+}
@@ -11,8 +11,22 @@ typedef struct vr_thread {
     void *data;
 }vr_thread;
 
+/* Wakes up the event loop of a thread from the other threads. The wakeups
+ * are coalesced, just one is pending until the owner thread consumes it,
+ * so a batch of handoffs costs a single syscall. */
+typedef struct vr_notifier {
+    int rfd;        /* Polled by the owner thread */
+    int wfd;        /* Written by the other threads, the same as rfd with eventfd */
+    int notified;   /* A wakeup is pending? */
+}vr_notifier;
+
 int vr_thread_init(vr_thread *thread);
 void vr_thread_deinit(vr_thread *thread);
 int vr_thread_start(vr_thread *thread);
 
+int vr_notifier_init(vr_notifier *nt);
+void vr_notifier_deinit(vr_notifier *nt);
+void vr_notifier_notify(vr_notifier *nt);
+void vr_notifier_consume(vr_notifier *nt);
+
 #endif
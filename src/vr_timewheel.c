@@ -0,0 +1,219 @@
+#include <vr_core.h>
+
+/* ----------------------------------------------------------------------------
+ * Hierarchical timing wheel
+ *
+ * The timers are kept in TIMEWHEEL_LEVELS wheels of TIMEWHEEL_SLOTS slots.
+ * A slot of level 0 holds the timers of one millisecond, a slot of level
+ * N the timers of TIMEWHEEL_SLOTS^N milliseconds: a timer goes in the
+ * lowest level covering its distance from 'now', and when 'now' enters
+ * the range of a slot of an upper level its timers are cascaded to the
+ * lower levels. So adding, moving and deleting a timer is O(1), and the
+ * timers due are found without looking at the others.
+ *
+ * A bitmap of the non empty slots of every level lets timeWheelExpire()
+ * jump over the empty milliseconds instead of walking them one by one.
+ * ------------------------------------------------------------------------- */
+
+#define TIMEWHEEL_SPAN(_level) (1LL<<(TIMEWHEEL_SLOT_BITS*(_level)))
+#define TIMEWHEEL_MAX_AHEAD TIMEWHEEL_SPAN(TIMEWHEEL_LEVELS)
+
+#define timeWheelIndex(_t,_level)   \
+    ((int)(((_t)>>(TIMEWHEEL_SLOT_BITS*(_level)))&TIMEWHEEL_SLOT_MASK))
+
+timeWheel *timeWheelCreate(long long now) {
+    timeWheel *tw;
+    int level, idx;
+
+    tw = dalloc(sizeof(*tw));
+    if (tw == NULL) return NULL;
+
+    for (level = 0; level < TIMEWHEEL_LEVELS; level ++) {
+        for (idx = 0; idx < TIMEWHEEL_SLOTS; idx ++) {
+            timeWheelSlot *slot = &tw->slots[level][idx];
+            slot->prev = slot->next = (timeWheelNode*)slot;
+        }
+        tw->used[level] = 0;
+    }
+    tw->now = now;
+    tw->count = 0;
+    return tw;
+}
+
+/* Free the wheel with the timers still in it. */
+void timeWheelRelease(timeWheel *tw) {
+    timeWheelNode *node, *next;
+    int level, idx;
+
+    for (level = 0; level < TIMEWHEEL_LEVELS; level ++) {
+        for (idx = 0; idx < TIMEWHEEL_SLOTS; idx ++) {
+            timeWheelSlot *slot = &tw->slots[level][idx];
+
+            node = slot->next;
+            while (node != (timeWheelNode*)slot) {
+                next = node->next;
+                slabFree(node);
+                node = next;
+            }
+        }
+    }
+    dfree(tw);
+}
+
+/* Put the node in the slot of its expire time, the ones already due go
+ * in the slot of 'now', the ones too far are parked in the last slot
+ * and cascaded again later. */
+static void timeWheelLink(timeWheel *tw, timeWheelNode *node) {
+    timeWheelSlot *slot;
+    long long t = node->when;
+    int level, idx;
+
+    if (t < tw->now) t = tw->now;
+    if (t-tw->now >= TIMEWHEEL_MAX_AHEAD) t = tw->now+TIMEWHEEL_MAX_AHEAD-1;
+
+    for (level = 0; level < TIMEWHEEL_LEVELS-1; level ++) {
+        if (t-tw->now < TIMEWHEEL_SPAN(level+1)) break;
+    }
+    idx = timeWheelIndex(t,level);
+    slot = &tw->slots[level][idx];
+
+    node->prev = (timeWheelNode*)slot;
+    node->next = slot->next;
+    slot->next->prev = node;
+    slot->next = node;
+    tw->used[level] |= 1ULL<<idx;
+}
+
+static void timeWheelUnlink(timeWheel *tw, timeWheelNode *node) {
+    /* The last node of a slot has the slot head on both sides. */
+    if (node->prev == node->next) {
+        long off = (timeWheelSlot*)node->prev-&tw->slots[0][0];
+        tw->used[off/TIMEWHEEL_SLOTS] &= ~(1ULL<<(off%TIMEWHEEL_SLOTS));
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+/* Move 'now' to 't', cascading the upper slots whose range starts at 't'.
+ * The slots skipped on the way have to be empty. */
+static void timeWheelSetNow(timeWheel *tw, long long t) {
+    int level, idx;
+
+    tw->now = t;
+    if (timeWheelIndex(t,0) != 0) return;
+
+    for (level = 1; level < TIMEWHEEL_LEVELS; level ++) {
+        timeWheelSlot *slot;
+        timeWheelNode *node, *next;
+
+        idx = timeWheelIndex(t,level);
+        slot = &tw->slots[level][idx];
+        if (tw->used[level] & (1ULL<<idx)) {
+            node = slot->next;
+            slot->prev = slot->next = (timeWheelNode*)slot;
+            tw->used[level] &= ~(1ULL<<idx);
+            while (node != (timeWheelNode*)slot) {
+                next = node->next;
+                timeWheelLink(tw,node);
+                node = next;
+            }
+        }
+        if (idx != 0) break;
+    }
+}
+
+/* The first millisecond from 'now' with some work: a slot of level 0 to
+ * expire, or a slot of an upper level to cascade. */
+static long long timeWheelNextTick(timeWheel *tw) {
+    int level, idx, start, shift;
+    uint64_t bits;
+
+    for (level = 0; level < TIMEWHEEL_LEVELS; level ++) {
+        shift = TIMEWHEEL_SLOT_BITS*level;
+        idx = timeWheelIndex(tw->now,level);
+
+        /* The current slot of an upper level was already cascaded. */
+        start = level == 0 ? idx : idx+1;
+        bits = start < TIMEWHEEL_SLOTS ? tw->used[level]>>start : 0;
+        if (bits != 0) {
+            return ((tw->now>>shift)+(start-idx)+__builtin_ctzll(bits))<<shift;
+        }
+
+        /* Slots after the wrap, look again when the upper level moves. */
+        if (tw->used[level] != 0) {
+            shift += TIMEWHEEL_SLOT_BITS;
+            return ((tw->now>>shift)+1)<<shift;
+        }
+    }
+
+    return LLONG_MAX;
+}
+
+timeWheelNode *timeWheelAdd(timeWheel *tw, long long when, void *data) {
+    timeWheelNode *node;
+
+    node = slabAlloc(sizeof(*node));
+    if (node == NULL) return NULL;
+    node->when = when;
+    node->data = data;
+    timeWheelLink(tw,node);
+    tw->count ++;
+    return node;
+}
+
+void timeWheelUpdate(timeWheel *tw, timeWheelNode *node, long long when) {
+    timeWheelUnlink(tw,node);
+    node->when = when;
+    timeWheelLink(tw,node);
+}
+
+void timeWheelDelete(timeWheel *tw, timeWheelNode *node) {
+    timeWheelUnlink(tw,node);
+    tw->count --;
+    slabFree(node);
+}
+
+/* Call 'proc' for up to 'max' timers due at 'now', oldest first, and
+ * return how many. 'lag' is set to how late the oldest of them is, in
+ * milliseconds, or how late the timers left are if 'max' was hit. */
+unsigned long timeWheelExpire(timeWheel *tw, long long now, unsigned long max,
+                              timeWheelExpireProc *proc, void *privdata,
+                              long long *lag) {
+    unsigned long expired = 0;
+    timeWheelSlot *slot;
+    timeWheelNode *node;
+    long long next;
+
+    *lag = 0;
+    if (tw->count == 0) {
+        if (tw->now <= now) tw->now = now+1;
+        return 0;
+    }
+
+    while (tw->now <= now) {
+        next = timeWheelNextTick(tw);
+        if (next > now) {
+            timeWheelSetNow(tw,now+1);
+            break;
+        }
+        if (next != tw->now) timeWheelSetNow(tw,next);
+
+        slot = &tw->slots[0][timeWheelIndex(tw->now,0)];
+        while (slot->next != (timeWheelNode*)slot) {
+            node = slot->next;
+            if (expired == max) {
+                if (now-tw->now > *lag) *lag = now-tw->now;
+                return expired;
+            }
+            if (now-node->when > *lag) *lag = now-node->when;
+
+            proc(privdata,node);
+            if (slot->next == node) timeWheelDelete(tw,node);
+            expired ++;
+        }
+        timeWheelSetNow(tw,tw->now+1);
+    }
+
+    return expired;
+}
@@ -0,0 +1,44 @@
+#ifndef _VR_TIMEWHEEL_H_
+#define _VR_TIMEWHEEL_H_
+
+#define TIMEWHEEL_LEVELS    6   /* Up to 2^36 ms ahead, longer are parked */
+#define TIMEWHEEL_SLOT_BITS 6
+#define TIMEWHEEL_SLOTS     (1<<TIMEWHEEL_SLOT_BITS)
+#define TIMEWHEEL_SLOT_MASK (TIMEWHEEL_SLOTS-1)
+
+/* A timer, the links come first so a slot list head can be used as one. */
+typedef struct timeWheelNode {
+    struct timeWheelNode *prev;
+    struct timeWheelNode *next;
+    long long when;             /* Unix time in milliseconds */
+    void *data;
+} timeWheelNode;
+
+typedef struct timeWheelSlot {
+    timeWheelNode *prev;
+    timeWheelNode *next;
+} timeWheelSlot;
+
+typedef struct timeWheel {
+    timeWheelSlot slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+    uint64_t used[TIMEWHEEL_LEVELS];    /* Bitmap of the non empty slots */
+    long long now;              /* Next millisecond to expire */
+    unsigned long count;        /* Timers in the wheel */
+} timeWheel;
+
+/* Called for a timer that is due, it has to delete the timer. */
+typedef void timeWheelExpireProc(void *privdata, timeWheelNode *node);
+
+#define timeWheelSize(_tw) ((_tw)->count)
+
+timeWheel *timeWheelCreate(long long now);
+void timeWheelRelease(timeWheel *tw);
+
+timeWheelNode *timeWheelAdd(timeWheel *tw, long long when, void *data);
+void timeWheelUpdate(timeWheel *tw, timeWheelNode *node, long long when);
+void timeWheelDelete(timeWheel *tw, timeWheelNode *node);
+
+unsigned long timeWheelExpire(timeWheel *tw, long long now, unsigned long max,
+    timeWheelExpireProc *proc, void *privdata, long long *lag);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 
 /* Double expansion needed for stringification of macro values. */
 #define __xstr(s) __str(s)
@@ -63,6 +64,7 @@
 int vr_set_blocking(int sd);
 int vr_set_nonblocking(int sd);
 int vr_set_reuseaddr(int sd);
+int vr_set_reuseport(int sd);
 int vr_set_tcpnodelay(int sd);
 int vr_set_linger(int sd, int timeout);
 int vr_set_sndbuf(int sd, int size);
@@ -216,6 +218,13 @@ uint64_t intrev64(uint64_t v);
 #define intrev64ifbe(v) intrev64(v)
 #endif
 
+/* Define vr_fsync to fdatasync() in Linux and fsync() for all the rest */
+#ifdef __linux__
+#define vr_fsync fdatasync
+#else
+#define vr_fsync fsync
+#endif
+
 long long memtoll(const char *p, int *err);
 void bytesToHuman(char *s, unsigned long long n);
 
@@ -64,26 +64,116 @@ csui_free(struct connswapunit *item) {
     pthread_mutex_unlock(&csui_freelist_lock);
 }
 
+#if defined(__ATOMIC_RELAXED)
+#define csuq_noverflow_add(_q, _n) __atomic_add_fetch(&(_q)->noverflow, (_n), __ATOMIC_RELAXED)
+#define csuq_noverflow_get(_q) __atomic_load_n(&(_q)->noverflow, __ATOMIC_RELAXED)
+#else
+#define csuq_noverflow_add(_q, _n) __sync_add_and_fetch(&(_q)->noverflow, (_n))
+#define csuq_noverflow_get(_q) __sync_add_and_fetch(&(_q)->noverflow, 0)
+#endif
+
+#if defined(__ATOMIC_RELAXED)
+#define worker_load_get(_ptr) __atomic_load_n(_ptr, __ATOMIC_RELAXED)
+#define worker_load_set(_ptr, _n) __atomic_store_n(_ptr, (_n), __ATOMIC_RELAXED)
+#else
+#define worker_load_get(_ptr) __sync_add_and_fetch(_ptr, 0)
+#define worker_load_set(_ptr, _n) __sync_lock_test_and_set(_ptr, (_n))
+#endif
+
+int
+csuq_init(connswapqueue *q, long long size)
+{
+    q->ring = NULL;
+    q->overflow = NULL;
+    q->noverflow = 0;
+    pthread_mutex_init(&q->lock, NULL);
+
+    q->ring = dmtqueue_create();
+    if (q->ring == NULL || 
+        dmtqueue_init_with_mpscqueue(q->ring, size) != 0) {
+        log_error("create swap unit queue failed: out of memory");
+        return VR_ENOMEM;
+    }
+
+    q->overflow = dlistCreate();
+    if (q->overflow == NULL) {
+        log_error("create list failed: out of memory");
+        return VR_ENOMEM;
+    }
+
+    return VR_OK;
+}
+
 void
-csul_push(vr_worker *worker, struct connswapunit *su)
+csuq_deinit(connswapqueue *q)
+{
+    struct connswapunit *su;
+
+    if (q->ring != NULL) {
+        while ((su = dmtqueue_pop(q->ring)) != NULL) {
+            csui_free(su);
+        }
+        dmtqueue_destroy(q->ring);
+        q->ring = NULL;
+    }
+
+    if (q->overflow != NULL) {
+        while ((su = dlistPop(q->overflow)) != NULL) {
+            csui_free(su);
+        }
+        dlistRelease(q->overflow);
+        q->overflow = NULL;
+    }
+
+    pthread_mutex_destroy(&q->lock);
+}
+
+/* Safe to be called by any thread. */
+void
+csuq_push(connswapqueue *q, struct connswapunit *su)
 {
-    pthread_mutex_lock(&worker->csullock);
-    dlistPush(worker->csul, su);
-    pthread_mutex_unlock(&worker->csullock);
+    if (dmtqueue_push(q->ring, su) >= 0) {
+        return;
+    }
+
+    /* The ring is full, the consumer is far behind. */
+    pthread_mutex_lock(&q->lock);
+    dlistPush(q->overflow, su);
+    csuq_noverflow_add(q, 1);
+    pthread_mutex_unlock(&q->lock);
 }
 
+/* Must be called just by the owner thread. */
 struct connswapunit *
-csul_pop(vr_worker *worker)
+csuq_pop(connswapqueue *q)
 {
-    struct connswapunit *su = NULL;
+    struct connswapunit *su;
+
+    su = dmtqueue_pop(q->ring);
+    if (su != NULL) {
+        return su;
+    }
 
-    pthread_mutex_lock(&worker->csullock);
-    su = dlistPop(worker->csul);
-    pthread_mutex_unlock(&worker->csullock);
+    if (csuq_noverflow_get(q) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    su = dlistPop(q->overflow);
+    if (su != NULL) csuq_noverflow_add(q, -1);
+    pthread_mutex_unlock(&q->lock);
     
     return su;
 }
 
+/* Hand a connection swap unit to the worker, and wake it up. */
+void
+csul_push(vr_worker *worker, struct connswapunit *su)
+{
+    csuq_push(&worker->csul, su);
+    vr_notifier_notify(&worker->notifier);
+}
+
 int
 vr_worker_init(vr_worker *worker)
 {
@@ -96,10 +186,18 @@ vr_worker_init(vr_worker *worker)
     }
 
     worker->id = 0;
-    worker->socketpairs[0] = -1;
-    worker->socketpairs[1] = -1;
-    worker->csul = NULL;
-    pthread_mutex_init(&worker->csullock, NULL);
+    worker->notifier.rfd = -1;
+    worker->notifier.wfd = -1;
+    worker->csul.ring = NULL;
+    worker->csul.overflow = NULL;
+    darray_init(&worker->listens, 1, sizeof(vr_listen*));
+    worker->mailbox = NULL;
+    worker->returns = NULL;
+    worker->forwarding = 0;
+    worker->load = 0;
+    worker->load_epoch = 0;
+    worker->dispatched = 0;
+    worker->dispatched_epoch = 0;
     worker->current_db = 0;
     worker->timelimit_exit = 0;
     worker->last_fast_cycle = 0;
@@ -116,35 +214,29 @@ vr_worker_init(vr_worker *worker)
     worker->vel.thread.data = worker;
     worker->vel.cstable = commandStatsTableCreate();
 
-    status = socketpair(AF_LOCAL, SOCK_STREAM, 0, worker->socketpairs);
-    if (status < 0) {
-        log_error("create socketpairs failed: %s", strerror(errno));
+    status = vr_notifier_init(&worker->notifier);
+    if (status != VR_OK) {
         return VR_ERROR;
     }
-    status = vr_set_nonblocking(worker->socketpairs[0]);
-    if (status < 0) {
-        log_error("set socketpairs[0] %d nonblocking failed: %s", 
-            worker->socketpairs[0], strerror(errno));
-        close(worker->socketpairs[0]);
-        worker->socketpairs[0] = -1;
-        close(worker->socketpairs[1]);
-        worker->socketpairs[1] = -1;
-        return VR_ERROR;
+
+    /* Every client may be handed to this worker at the same time, the 
+     * overflow list takes the rest if maxclients is raised at runtime. */
+    status = csuq_init(&worker->csul, maxclients);
+    if (status != VR_OK) {
+        return status;
     }
-    status = vr_set_nonblocking(worker->socketpairs[1]);
-    if (status < 0) {
-        log_error("set socketpairs[1] %d nonblocking failed: %s", 
-            worker->socketpairs[1], strerror(errno));
-        close(worker->socketpairs[0]);
-        worker->socketpairs[0] = -1;
-        close(worker->socketpairs[1]);
-        worker->socketpairs[1] = -1;
-        return VR_ERROR;
+
+    worker->mailbox = dmtqueue_create();
+    if (worker->mailbox == NULL || 
+        dmtqueue_init_with_mpscqueue(worker->mailbox, WORKER_MAILBOX_SIZE) != 0) {
+        log_error("create mailbox failed: out of memory");
+        return VR_ENOMEM;
     }
 
-    worker->csul = dlistCreate();
-    if (worker->csul == NULL) {
-        log_error("create list failed: out of memory");
+    worker->returns = dmtqueue_create();
+    if (worker->returns == NULL || 
+        dmtqueue_init_with_mpscqueue(worker->returns, WORKER_MAILBOX_SIZE) != 0) {
+        log_error("create mailbox failed: out of memory");
         return VR_ENOMEM;
     }
     
@@ -160,18 +252,23 @@ vr_worker_deinit(vr_worker *worker)
 
     vr_eventloop_deinit(&worker->vel);
 
-    if (worker->socketpairs[0] > 0){
-        close(worker->socketpairs[0]);
-        worker->socketpairs[0] = -1;
+    vr_notifier_deinit(&worker->notifier);
+    csuq_deinit(&worker->csul);
+
+    while (darray_n(&worker->listens) > 0) {
+        vr_listen **vlisten = darray_pop(&worker->listens);
+        vr_listen_destroy(*vlisten);
     }
-    if (worker->socketpairs[1] > 0){
-        close(worker->socketpairs[1]);
-        worker->socketpairs[1] = -1;
+    darray_deinit(&worker->listens);
+
+    if (worker->mailbox != NULL) {
+        dmtqueue_destroy(worker->mailbox);
+        worker->mailbox = NULL;
     }
 
-    if (worker->csul != NULL) {
-        dlistRelease(worker->csul);
-        worker->csul = NULL;
+    if (worker->returns != NULL) {
+        dmtqueue_destroy(worker->returns);
+        worker->returns = NULL;
     }
 }
 
@@ -182,11 +279,348 @@ worker_get_next_idx(int curidx)
     return idx>=num_worker_threads?0:idx;
 }
 
+/* Return the idx of the worker owning the internal db 'dbidx', used 
+ * by the key affinity mode. */
+int
+worker_get_owner_idx(int dbidx)
+{
+    return dbidx%num_worker_threads;
+}
+
+/* With the key affinity mode every internal db is owned by one worker,
+ * and a command for the keys of a foreign internal db is sent to the 
+ * owner worker mailbox. The owner runs the command and sends the client
+ * back, the replies are written by the worker the client belongs to.
+ * In the meantime this worker does not read from the client or touch it.
+ *
+ * Commands with keys owned by different workers, and clients in special
+ * states, just run in this worker as usual.
+ *
+ * Return 1 if the command was forwarded, 0 if the caller should run it. */
+int
+worker_forward_command(client *c)
+{
+    struct redisCommand *cmd = c->cmd;
+    vr_worker *home, *owner;
+    int j, last, idx, owneridx = -1;
+    int sd;
+
+    if (cmd->firstkey <= 0 || cmd->getkeys_proc != NULL ||
+        cmd->flags&CMD_NOSCRIPT) {
+        return 0;
+    }
+
+    if (c->flags&(CLIENT_MULTI|CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PUBSUB|
+        CLIENT_LUA|CLIENT_BLOCKED|CLIENT_JUMP|CLIENT_CLOSE_ASAP) ||
+        c->conn == NULL || c->conn->sd <= 0) {
+        return 0;
+    }
+
+    /* The replies of the forwarded commands are written as soon as they
+     * are back, before the owner worker waits the AOF fsync. */
+    if (cmd->flags&CMD_WRITE && server.aof_state == AOF_ON &&
+        c->vel->cc.appendfsync == AOF_FSYNC_ALWAYS) {
+        return 0;
+    }
+
+    /* The replies must be written by this worker, so do not forward
+     * the client while the write handler is installed. */
+    if (clientHasPendingReplies(c) && !(c->flags&CLIENT_PENDING_WRITE)) {
+        return 0;
+    }
+
+    last = cmd->lastkey;
+    if (last < 0) last = c->argc+last;
+    for (j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+        idx = worker_get_owner_idx(getInternalDbIdxByKey(c,c->argv[j]));
+        if (owneridx == -1) {
+            owneridx = idx;
+        } else if (owneridx != idx) {
+            return 0;
+        }
+    }
+
+    if (owneridx == -1 || owneridx == c->curidx) {
+        return 0;
+    }
+
+    home = darray_get(&workers, (uint32_t)c->curidx);
+    if (home->forwarding >= WORKER_MAILBOX_SIZE) {
+        return 0;
+    }
+
+    owner = darray_get(&workers, (uint32_t)owneridx);
+    sd = c->conn->sd;
+
+    /* The pipelined replies are written when the client is back. */
+    if (c->flags&CLIENT_PENDING_WRITE) {
+        dlistNode *ln = dlistSearchKey(home->vel.clients_pending_write,c);
+        ASSERT(ln != NULL);
+        dlistDelNode(home->vel.clients_pending_write,ln);
+    }
+
+    /* Flag the client as pending write, so the replies added by the
+     * owner worker do not put it in the owner pending write list. */
+    c->flags |= CLIENT_PENDING_WRITE;
+    c->forwarded = 1;
+    if (dmtqueue_push(owner->mailbox, c) < 0) {
+        /* The mailbox is full. */
+        c->forwarded = 0;
+        if (clientHasPendingReplies(c)) {
+            dlistAddNodeHead(home->vel.clients_pending_write,c);
+        } else {
+            c->flags &= ~CLIENT_PENDING_WRITE;
+        }
+        return 0;
+    }
+
+    /* The client belongs to the owner worker now. */
+    home->forwarding ++;
+    aeDeleteFileEvent(home->vel.el,sd,AE_READABLE);
+    update_stats_add(home->vel.stats, forwarded_commands, 1);
+    vr_notifier_notify(&owner->notifier);
+
+    return 1;
+}
+
+/* Run a command forwarded by another worker. */
+static void
+worker_run_forwarded(vr_worker *worker, client *c)
+{
+    vr_eventloop *vel = c->vel;
+    vr_worker *home = darray_get(&workers, (uint32_t)c->curidx);
+    int locked;
+
+    c->vel = &worker->vel;
+    worker->vel.current_client = c;
+    locked = dbLockCommand(c);
+    call(c,CMD_CALL_FULL);
+    if (locked) dbUnlockCommand();
+    c->woff = repl.master_repl_offset;
+    if (dlistLength(server.ready_keys))
+        handleClientsBlockedOnLists();
+    aofCallDone(&worker->vel);
+    worker->vel.current_client = NULL;
+    c->vel = vel;
+
+    /* This never fails, as the home worker limits the number 
+     * of its forwarded clients to the size of the queue. */
+    dmtqueue_push(home->returns, c);
+    vr_notifier_notify(&home->notifier);
+}
+
+/* Give our client back its events, after it was handled by other
+ * workers. The command is done, write the replies and go on with
+ * the next pipelined command. */
+static void
+worker_client_resume(vr_worker *worker, client *c)
+{
+    vr_eventloop *vel = &worker->vel;
+
+    c->forwarded = 0;
+    c->flags &= ~CLIENT_PENDING_WRITE;
+
+    /* freeClientAsync() called by the owner worker just flags it. */
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        dlistAddNodeTail(vel->clients_to_close,c);
+
+    if (c->close_on_return) {
+        freeClient(c);
+        return;
+    }
+
+    /* Write the reply now, so the next pipelined command can be 
+     * forwarded too. */
+    if (clientHasPendingReplies(c)) {
+        if (writeToClient(c->conn->sd,c,0) == VR_ERROR) return;
+        if (clientHasPendingReplies(c)) {
+            c->flags |= CLIENT_PENDING_WRITE;
+            dlistAddNodeHead(vel->clients_pending_write,c);
+        }
+    }
+
+    resetClient(c);
+    if (aeCreateFileEvent(vel->el,c->conn->sd,AE_READABLE,
+        readQueryFromClient,c) == AE_ERR)
+    {
+        freeClient(c);
+        return;
+    }
+
+    /* Handle the remain query buffer */
+    if (processInputBuffer(c) == VR_EAGAIN) return;
+    if (c->flags&CLIENT_JUMP) {
+        dispatch_conn_exist(c,c->taridx);
+    }
+}
+
+/* Our client is back from the owner worker. */
+static void
+worker_forward_return(vr_worker *worker, client *c)
+{
+    worker->forwarding --;
+    worker_client_resume(worker,c);
+}
+
+#if defined(__ATOMIC_ACQ_REL)
+#define worker_fanout_answer(_f) __atomic_sub_fetch(&(_f)->pending, 1, __ATOMIC_ACQ_REL)
+#else
+#define worker_fanout_answer(_f) __sync_sub_and_fetch(&(_f)->pending, 1)
+#endif
+
+/* Run 'proc' in all the workers at the same time, and 'done' in the
+ * client worker with all their results when the last one answered.
+ * The commands looking at the state of every worker (CLIENT LIST, 
+ * CLIENT KILL, COMMAND STATS) use this, the command latency is the 
+ * slowest worker latency instead of the sum of all of them.
+ *
+ * The client stays in its worker as a forwarded client while waiting,
+ * it is not read, written or freed until the results are merged. With
+ * just one worker, or inside MULTI and scripts, the reply can not wait
+ * and just the current worker is visited, the other results are NULL.
+ *
+ * Return VR_ERROR if out of memory, 'done' is not called then. */
+int
+worker_fanout(client *c, workerFanoutProc *proc, 
+    workerFanoutDone *done, void *privdata)
+{
+    vr_worker *home, *worker;
+    struct workerfanout *fanout;
+    struct connswapunit *su;
+    uint32_t j, n = (uint32_t)darray_n(&workers);
+
+    fanout = dalloc(sizeof(*fanout) + sizeof(void*)*n);
+    if (fanout == NULL) {
+        return VR_ERROR;
+    }
+    fanout->c = c;
+    fanout->proc = proc;
+    fanout->done = done;
+    fanout->privdata = privdata;
+    fanout->pending = (int)n;
+
+    if (n == 1 || c->flags&(CLIENT_MULTI|CLIENT_LUA)) {
+        for (j = 0; j < n; j ++) {
+            worker = darray_get(&workers, j);
+            fanout->results[j] = (&worker->vel == c->vel) ? 
+                proc(worker,c,privdata) : NULL;
+        }
+        done(c,privdata,fanout->results);
+        dfree(fanout);
+        return VR_OK;
+    }
+
+    home = darray_get(&workers, (uint32_t)c->curidx);
+
+    /* The replies are written when the client is resumed. */
+    if (c->flags&CLIENT_PENDING_WRITE) {
+        dlistNode *ln = dlistSearchKey(home->vel.clients_pending_write,c);
+        ASSERT(ln != NULL);
+        dlistDelNode(home->vel.clients_pending_write,ln);
+    }
+    c->flags |= CLIENT_PENDING_WRITE;
+    c->forwarded = 1;
+    aeDeleteFileEvent(home->vel.el,c->conn->sd,AE_READABLE|AE_WRITABLE);
+
+    for (j = 0; j < n; j ++) {
+        worker = darray_get(&workers, j);
+        su = csui_new();
+        if (su == NULL) {
+            /* Answer for this worker, as it will never run the proc. */
+            log_error("Failed to allocate memory for connection swap object");
+            fanout->results[j] = NULL;
+            if (worker_fanout_answer(fanout) == 0) {
+                done(c,privdata,fanout->results);
+                dfree(fanout);
+                worker_client_resume(home,c);
+            }
+            continue;
+        }
+        su->type = CONNSWAP_FANOUT;
+        su->num = (int)j;
+        su->data = fanout;
+        csul_push(worker, su);
+    }
+
+    return VR_OK;
+}
+
+/* Run our part of a scatter gather request, the last worker 
+ * answering sends it back to the client worker. */
+static void
+worker_fanout_run(vr_worker *worker, struct workerfanout *fanout)
+{
+    vr_worker *home;
+    struct connswapunit *su;
+
+    fanout->results[worker->id] = fanout->proc(worker,fanout->c,fanout->privdata);
+    if (worker_fanout_answer(fanout) > 0) return;
+
+    home = darray_get(&workers, (uint32_t)fanout->c->curidx);
+    su = csui_new();
+    if (su == NULL) {
+        /* This never happens but for the out of memory, and the
+         * client worker is the only one able to go on. */
+        serverPanic("Failed to allocate memory for connection swap object");
+    }
+    su->type = CONNSWAP_FANOUT_DONE;
+    su->num = home->id;
+    su->data = fanout;
+    csul_push(home, su);
+}
+
+/* All the workers answered, merge their results. */
+static void
+worker_fanout_done(vr_worker *worker, struct workerfanout *fanout)
+{
+    client *c = fanout->c;
+
+    fanout->done(c,fanout->privdata,fanout->results);
+    dfree(fanout);
+    worker_client_resume(worker,c);
+}
+
+/* Pick the worker for a new connection, called just by the master.
+ * With the least-loaded policy the worker with the lowest published
+ * load wins. The clients given to a worker since it last published its
+ * load count too, so a burst of connections is not sent to the same 
+ * worker before its cron notices them. Ties go round robin. */
+static int
+dispatch_select_worker(void)
+{
+    int policy, j, tid, best = -1;
+    long long epoch, score, best_score = 0;
+    vr_worker *worker;
+
+    conf_server_get(CONFIG_SOPN_DISPATCHP,&policy);
+    if (policy != DISPATCH_LEAST_LOADED || num_worker_threads <= 1) {
+        return (last_worker_thread + 1) % num_worker_threads;
+    }
+
+    for (j = 1; j <= num_worker_threads; j ++) {
+        tid = (last_worker_thread + j) % num_worker_threads;
+        worker = darray_get(&workers, (uint32_t)tid);
+
+        epoch = worker_load_get(&worker->load_epoch);
+        if (epoch != worker->dispatched_epoch) {
+            worker->dispatched_epoch = epoch;
+            worker->dispatched = 0;
+        }
+
+        score = worker_load_get(&worker->load) + worker->dispatched;
+        if (best < 0 || score < best_score) {
+            best = tid;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
 void
 dispatch_conn_new(vr_listen *vlisten, int sd)
 {
     struct connswapunit *su = csui_new();
-    char buf[1];
     vr_worker *worker;
 
     if (su == NULL) {
@@ -196,122 +630,214 @@ dispatch_conn_new(vr_listen *vlisten, int sd)
         return ;
     }
     
-    int tid = (last_worker_thread + 1) % num_worker_threads;
+    int tid = dispatch_select_worker();
     worker = darray_get(&workers, (uint32_t)tid);
 
     last_worker_thread = tid;
+    worker->dispatched ++;
 
+    su->type = CONNSWAP_NEW;
     su->num = sd;
     su->data = vlisten;
 
     csul_push(worker, su);
-
-    buf[0] = 'c';
-    if (vr_write(worker->socketpairs[0], buf, 1) != 1) {
-        log_error("Notice the worker failed.");
-    }
     
     update_curr_clients_add(1);
 }
 
+/* A new connection dispatched by the master. */
 static void
-thread_event_process(aeEventLoop *el, int fd, void *privdata, int mask) {
-
+worker_conn_new(vr_worker *worker, int sd, vr_listen *vlisten)
+{
     rstatus_t status;
-    vr_worker *worker = privdata;
-    char buf[1];
-    int sd;
-    vr_listen *vlisten;
     struct conn *conn;
-    struct connswapunit *csu;
     client *c;
 
-    ASSERT(el == worker->vel.el);
-    ASSERT(fd == worker->socketpairs[1]);
+    conn = conn_get(worker->vel.cb);
+    if (conn == NULL) {
+        log_error("get conn for c %d failed: %s", 
+            sd, strerror(errno));
+        status = close(sd);
+        if (status < 0) {
+            log_error("close c %d failed, ignored: %s", sd, strerror(errno));
+        }
+        return;
+    }
+    conn->sd = sd;
 
-    if (vr_read(fd, buf, 1) != 1) {
-        log_warn("Can't read for worker(id:%d) socketpairs[1](%d)", 
-            worker->vel.thread.id, fd);
-        buf[0] = 'c';
+    status = vr_set_nonblocking(conn->sd);
+    if (status < 0) {
+        log_error("set nonblock on c %d failed: %s", 
+            conn->sd, strerror(errno));
+        conn_put(conn);
+        return;
     }
-    
-    switch (buf[0]) {
-    case 'c':
-        csu = csul_pop(worker);
-        if (csu == NULL) {
-            return;
-        }
-        sd = csu->num;
-        vlisten = csu->data;
-        csui_free(csu);
-        conn = conn_get(worker->vel.cb);
-        if (conn == NULL) {
-            log_error("get conn for c %d failed: %s", 
-                sd, strerror(errno));
-            status = close(sd);
-            if (status < 0) {
-                log_error("close c %d failed, ignored: %s", sd, strerror(errno));
-            }
-            return;
-        }
-        conn->sd = sd;
-    
-        status = vr_set_nonblocking(conn->sd);
+
+    if (vlisten->info.family == AF_INET || vlisten->info.family == AF_INET6) {
+        status = vr_set_tcpnodelay(conn->sd);
         if (status < 0) {
-            log_error("set nonblock on c %d failed: %s", 
+            log_warn("set tcpnodelay on c %d failed, ignored: %s",
                 conn->sd, strerror(errno));
-            conn_put(conn);
-            return;
         }
+    }
+
+    c = createClient(&worker->vel, conn);
+    if (c == NULL) {
+        log_error("Create client failed");
+        conn_put(conn);
+        return;
+    }
+    c->curidx = worker->id;
+    status = aeCreateFileEvent(worker->vel.el, conn->sd, AE_READABLE, 
+        readQueryFromClient, c);
+    if (status == AE_ERR) {
+        log_error("Unrecoverable error creating worker ipfd file event.");
+        return;
+    }
+
+    update_stats_add(c->vel->stats, numconnections, 1);
+}
+
+/* A client jumped from another worker to continue its command. */
+static void
+worker_conn_jump(vr_worker *worker, client *c)
+{
+    c->vel = &worker->vel;
+    c->curidx = worker->id;
+    c->steps ++;
+    c->cmd->proc(c);
     
-        if (vlisten->info.family == AF_INET || vlisten->info.family == AF_INET6) {
-            status = vr_set_tcpnodelay(conn->sd);
-            if (status < 0) {
-                log_warn("set tcpnodelay on c %d failed, ignored: %s",
-                    conn->sd, strerror(errno));
-            }
+    if (c->flags&CLIENT_JUMP) {
+        dispatch_conn_exist(c,c->taridx);
+    } else {
+        resetClient(c);
+        linkClientToEventloop(c,c->vel);
+    }
+}
+
+/* An idle client moved here by a hotter worker, see worker_migrate_hot_client(). */
+static void
+worker_conn_migrate(vr_worker *worker, client *c)
+{
+    c->conn->cb = worker->vel.cb;
+    c->conn->cb->ncurr_conn ++;
+    c->curidx = worker->id;
+    linkClientToEventloop(c,&worker->vel);
+}
+
+/* With worker-reuseport every worker accepts on its own listeners, 
+ * and the kernel balances the connections between the workers. */
+static void
+worker_client_accept(aeEventLoop *el, int fd, void *privdata, int mask) {
+    vr_worker *worker = privdata;
+    vr_listen **vlisten = NULL;
+    uint32_t j;
+    int sd;
+
+    ASSERT(el == worker->vel.el);
+
+    for (j = 0; j < darray_n(&worker->listens); j ++) {
+        vlisten = darray_get(&worker->listens, j);
+        if ((*vlisten)->sd == fd) break;
+    }
+    ASSERT(j < darray_n(&worker->listens));
+
+    while((sd = vr_listen_accept(*vlisten)) > 0) {
+        update_curr_clients_add(1);
+        worker_conn_new(worker, sd, *vlisten);
+    }
+}
+
+static int
+setup_worker_listens(vr_worker *worker)
+{
+    rstatus_t status;
+    uint32_t j;
+    sds *host, listen_str;
+    vr_listen **vlisten;
+
+    for (j = 0; j < darray_n(&cserver->binds); j ++) {
+        host = darray_get(&cserver->binds,j);
+        listen_str = sdsdup(*host);
+        listen_str = sdscatfmt(listen_str, ":%i", cserver->port);
+        vlisten = darray_push(&worker->listens);
+        *vlisten = vr_listen_create(listen_str);
+        if (*vlisten == NULL) {
+            darray_pop(&worker->listens);
+            log_error("Create listen %s failed", listen_str);
+            sdsfree(listen_str);
+            return VR_ERROR;
         }
+        sdsfree(listen_str);
 
-        c = createClient(&worker->vel, conn);
-        if (c == NULL) {
-            log_error("Create client failed");
-            conn_put(conn);
-            return;
+        (*vlisten)->reuseport = 1;
+        status = vr_listen_begin(*vlisten);
+        if (status != VR_OK) {
+            log_error("Begin listen to %s with SO_REUSEPORT failed", 
+                (*vlisten)->name);
+            return VR_ERROR;
         }
-        c->curidx = worker->id;
-        status = aeCreateFileEvent(worker->vel.el, conn->sd, AE_READABLE, 
-            readQueryFromClient, c);
+
+        status = aeCreateFileEvent(worker->vel.el, (*vlisten)->sd, AE_READABLE, 
+            worker_client_accept, worker);
         if (status == AE_ERR) {
             log_error("Unrecoverable error creating worker ipfd file event.");
-            return;
+            return VR_ERROR;
         }
+    }
 
-        update_stats_add(c->vel->stats, numconnections, 1);
-        
-        break;
-    case 'j':
-        csu = csul_pop(worker);
-        if (csu == NULL) {
-            return;
-        }
-        c = csu->data;
+    return VR_OK;
+}
+
+/* Handle everything queued for this worker since the last wakeup. */
+static void
+thread_event_process(aeEventLoop *el, int fd, void *privdata, int mask) {
+    vr_worker *worker = privdata;
+    struct connswapunit *csu;
+    int type, num;
+    void *data;
+    client *c;
+
+    ASSERT(el == worker->vel.el);
+    ASSERT(fd == worker->notifier.rfd);
+
+    vr_notifier_consume(&worker->notifier);
+
+    while ((csu = csuq_pop(&worker->csul)) != NULL) {
+        type = csu->type;
+        num = csu->num;
+        data = csu->data;
         csui_free(csu);
-        c->vel = &worker->vel;
-        c->curidx = worker->id;
-        c->steps ++;
-        c->cmd->proc(c);
-        
-        if (c->flags&CLIENT_JUMP) {
-            dispatch_conn_exist(c,c->taridx);
-        } else {
-            resetClient(c);
-            linkClientToEventloop(c,c->vel);
+
+        switch (type) {
+        case CONNSWAP_NEW:
+            worker_conn_new(worker, num, data);
+            break;
+        case CONNSWAP_JUMP:
+            worker_conn_jump(worker, data);
+            break;
+        case CONNSWAP_MIGRATE:
+            worker_conn_migrate(worker, data);
+            break;
+        case CONNSWAP_FANOUT:
+            worker_fanout_run(worker, data);
+            break;
+        case CONNSWAP_FANOUT_DONE:
+            worker_fanout_done(worker, data);
+            break;
+        default:
+            log_error("unknown connection swap unit type %d for worker(id:%d)", 
+                type, worker->vel.thread.id);
+            break;
         }
-        break;
-    default:
-        log_error("read error char '%c' for worker(id:%d) socketpairs[1](%d)", 
-            buf[0], worker->vel.thread.id, worker->socketpairs[1]);
-        break;
+    }
+
+    while ((c = dmtqueue_pop(worker->returns)) != NULL) {
+        worker_forward_return(worker,c);
+    }
+
+    while ((c = dmtqueue_pop(worker->mailbox)) != NULL) {
+        worker_run_forwarded(worker,c);
     }
 }
 
@@ -319,14 +845,23 @@ static int
 setup_worker(vr_worker *worker)
 {
     rstatus_t status;
+    int reuseport;
     
-    status = aeCreateFileEvent(worker->vel.el, worker->socketpairs[1], AE_READABLE, 
+    status = aeCreateFileEvent(worker->vel.el, worker->notifier.rfd, AE_READABLE, 
         thread_event_process, worker);
     if (status == AE_ERR) {
         log_error("Unrecoverable error creating worker ipfd file event.");
         return VR_ERROR;
     }
 
+    conf_server_get(CONFIG_SOPN_REUSEPORT,&reuseport);
+    if (reuseport) {
+        status = setup_worker_listens(worker);
+        if (status != VR_OK) {
+            return VR_ERROR;
+        }
+    }
+
     aeSetBeforeSleepProc(worker->vel.el, worker_before_sleep, worker);
 
     /* Create the serverCron() time event, that's our main way to process
@@ -343,6 +878,14 @@ static void *
 worker_thread_run(void *args)
 {
     vr_worker *worker = args;
+
+    vr_eventloop_bind(&worker->vel);
+
+    /* Reader slot for the optimistic db read mode */
+    dbReaderSlotSet(worker->id);
+
+    /* Slab pool for the keyspace objects created by this worker */
+    slabPoolBind();
     
     /* vire worker run */
     aeMain(worker->vel.el);
@@ -423,6 +966,86 @@ workers_deinit(void)
 /* This function gets called every time Redis is entering the
  * main loop of the event driven library, that is, before to sleep
  * for ready file descriptors. */
+/* Publish the load of this worker for dispatch_conn_new(), the 
+ * operations per second plus the clients it serves. */
+static void
+worker_publish_load(vr_worker *worker)
+{
+    vr_eventloop *vel = &worker->vel;
+    long long load;
+
+    load = getInstantaneousMetric(vel->stats, STATS_METRIC_COMMAND);
+    load += (long long)dlistLength(vel->clients);
+    load += (long long)dlistLength(vel->clients_pending_write);
+
+    worker_load_set(&worker->load, load);
+    worker_load_set(&worker->load_epoch, worker->load_epoch+1);
+}
+
+#define WORKER_MIGRATE_SKIP_FLAGS (CLIENT_SLAVE|CLIENT_MASTER|CLIENT_MONITOR|  \
+    CLIENT_PUBSUB|CLIENT_BLOCKED|CLIENT_UNBLOCKED|CLIENT_JUMP|CLIENT_LUA|       \
+    CLIENT_CLOSE_ASAP|CLIENT_CLOSE_AFTER_REPLY)
+
+/* A long lived client pinned to a busy worker keeps it busy whatever the
+ * master does with the new connections. If this worker is much hotter than
+ * the coolest one, move the client that ran the most commands since the
+ * last check there, as long as moving it does not just swap the roles.
+ * The client replies are flushed first, it is not moved if they can not
+ * be written at once. */
+static void
+worker_migrate_hot_client(vr_worker *worker)
+{
+    vr_eventloop *vel = &worker->vel;
+    vr_worker *other;
+    dlistIter di;
+    dlistNode *ln;
+    client *c, *hottest = NULL;
+    long long myload, coolest_load = -1, load;
+    int coolest = -1;
+    uint32_t j;
+
+    myload = worker_load_get(&worker->load);
+    for (j = 0; j < darray_n(&workers); j ++) {
+        other = darray_get(&workers, j);
+        if (other == worker) continue;
+        load = worker_load_get(&other->load);
+        if (coolest < 0 || load < coolest_load) {
+            coolest = (int)j;
+            coolest_load = load;
+        }
+    }
+
+    dlistRewind(vel->clients,&di);
+    while ((ln = dlistNext(&di)) != NULL) {
+        c = dlistNodeValue(ln);
+        if (!(c->flags&WORKER_MIGRATE_SKIP_FLAGS) && !c->forwarded &&
+            c->conn->sd > 0 && c != vel->current_client &&
+            (hottest == NULL || c->ops > hottest->ops)) {
+            hottest = c;
+        }
+    }
+
+    if (coolest >= 0 && hottest != NULL && 
+        myload >= WORKER_MIGRATE_MIN_LOAD && myload >= coolest_load*2 &&
+        hottest->ops < myload-coolest_load &&
+        (!clientHasPendingReplies(hottest) ||
+        (writeToClient(hottest->conn->sd,hottest,0) == VR_OK &&
+        !clientHasPendingReplies(hottest)))) {
+        log_debug(LOG_VERB, "migrate client %d from worker %d to worker %d",
+            hottest->conn->sd, worker->id, coolest);
+        hottest->ops = 0;
+        hottest->conn->cb->ncurr_conn --;
+        dispatch_conn_migrate(hottest, coolest);
+        update_stats_add(vel->stats, migrated_clients, 1);
+    }
+
+    dlistRewind(vel->clients,&di);
+    while ((ln = dlistNext(&di)) != NULL) {
+        c = dlistNodeValue(ln);
+        c->ops = 0;
+    }
+}
+
 void
 worker_before_sleep(struct aeEventLoop *eventLoop, void *private_data) {
     vr_worker *worker = private_data;
@@ -432,6 +1055,13 @@ worker_before_sleep(struct aeEventLoop *eventLoop, void *private_data) {
 
     ASSERT(eventLoop == worker->vel.el);
 
+    /* Queue the AOF records of this loop, and wait them to be on
+     * disk with appendfsync always before replying. */
+    aofBeforeSleep(&worker->vel);
+
+    /* Send the snapshot and the stream to the slaves of this loop. */
+    replicationBeforeSleep(&worker->vel);
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWrites(&worker->vel);
 
@@ -452,6 +1082,7 @@ worker_cron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     vel->unixtime = time(NULL);
     vel->mstime = vr_msec_now();
+    vel->lruclock = getLRUClock() & LRU_CLOCK_MAX;
 
     run_with_period(100, vel->cronloops) {
         long long stats_value;
@@ -461,6 +1092,7 @@ worker_cron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         trackInstantaneousMetric(vel->stats,STATS_METRIC_NET_INPUT,stats_value);
         update_stats_get(vel->stats,net_output_bytes,&stats_value);
         trackInstantaneousMetric(vel->stats,STATS_METRIC_NET_OUTPUT,stats_value);
+        worker_publish_load(worker);
     }
 
     /* Sample the RSS here since this is a relatively slow call. */
@@ -475,15 +1107,30 @@ worker_cron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         update_stats_set(vel->stats, peak_memory, stat_used_memory);
     }*/
 
+    /* Keep alive and time out the slaves of this loop. */
+    replicationWorkerCron(vel);
+
     /* Close clients that need to be closed asynchronous */
     freeClientsInAsyncFreeQueue(vel);
 
     //databasesCron(worker);
 
+    /* Take back the slab slots freed by the other threads */
+    slabCron();
+
     /* Update the config cache */
     run_with_period(1000, vel->cronloops) {
         conf_cache_update(&vel->cc);
     }
+
+    /* Move a hot client to a cooler worker */
+    run_with_period(1000, vel->cronloops) {
+        int migrate;
+        conf_server_get(CONFIG_SOPN_MIGRATEHOT,&migrate);
+        if (migrate && darray_n(&workers) > 1) {
+            worker_migrate_hot_client(worker);
+        }
+    }
     
     vel->cronloops ++;
     return 1000/vel->hz;
@@ -1,15 +1,45 @@
 #ifndef _VR_WORKER_H_
 #define _VR_WORKER_H_
 
+/* Max commands waiting in the mailbox of a worker, and max clients of
+ * a worker running on the other workers at the same time. */
+#define WORKER_MAILBOX_SIZE 1024
+
+/* A worker moves its hottest client away just if its load is at least
+ * this and twice the load of the coolest worker. */
+#define WORKER_MIGRATE_MIN_LOAD 1000
+
+/* Connection swap unit queue, a bounded lock-free ring with many producers
+ * and the owner thread as the single consumer. When the ring is full the
+ * units go to the overflow list guarded by the lock, so a push never fails. */
+typedef struct connswapqueue {
+    dmtqueue *ring;
+    dlist *overflow;
+    pthread_mutex_t lock;       /* overflow list locker */
+    int noverflow;              /* Number of units in the overflow list */
+}connswapqueue;
+
 typedef struct vr_worker {
 
     int id;
     vr_eventloop vel;
     
-    int socketpairs[2];         /*0: belong to master thread, 1: belong to myself*/
+    vr_notifier notifier;       /* Wakes up this worker for the queues below */
     
-    dlist *csul;    /* Connect swap unit list */
-    pthread_mutex_t csullock;   /* swap unit list locker */
+    connswapqueue csul;         /* Connect swap unit queue */
+
+    struct darray listens;      /* type: vr_listen, own listeners with worker-reuseport */
+
+    /* Key affinity, see worker_forward_command() */
+    dmtqueue *mailbox;          /* Clients forwarded by other workers to run a command */
+    dmtqueue *returns;          /* Our clients sent back by the owner workers */
+    int forwarding;             /* Our clients running on other workers now */
+
+    /* Load balancing, see dispatch_conn_new() */
+    long long load;             /* Load published by this worker cron */
+    long long load_epoch;       /* Bumped every time the load is published */
+    long long dispatched;       /* Clients given by the master since the last load */
+    long long dispatched_epoch; /* The load epoch 'dispatched' is counted from */
 
     /* Some global state in order to continue the work incrementally 
        * across calls for activeExpireCycle() to expire some keys. */
@@ -24,12 +54,34 @@ typedef struct vr_worker {
     unsigned int rehash_db;
 }vr_worker;
 
+#define CONNSWAP_NEW    0   /* num: the new connection sd, data: vr_listen */
+#define CONNSWAP_JUMP   1   /* num: the target worker idx, data: client */
+#define CONNSWAP_MIGRATE 2  /* num: the target worker idx, data: idle client */
+#define CONNSWAP_FANOUT 3   /* data: workerfanout to run in this worker */
+#define CONNSWAP_FANOUT_DONE 4  /* data: workerfanout answered by all the workers */
+
 struct connswapunit {
+    int type;
     int num;
     void *data;
     struct connswapunit *next;
 };
 
+/* Scatter gather request, see worker_fanout(). The proc runs in every
+ * worker thread and returns the part of the result of that worker, the
+ * done callback runs in the client worker once all of them answered. */
+typedef void *workerFanoutProc(vr_worker *worker, struct client *c, void *privdata);
+typedef void workerFanoutDone(struct client *c, void *privdata, void **results);
+
+typedef struct workerfanout {
+    struct client *c;           /* The client waiting for the results */
+    workerFanoutProc *proc;
+    workerFanoutDone *done;
+    void *privdata;             /* Shared by all the procs */
+    int pending;                /* Workers that did not answer yet */
+    void *results[];            /* The proc result of every worker, by worker id */
+} workerfanout;
+
 extern struct darray workers;
 
 int workers_init(uint32_t worker_count);
@@ -40,10 +92,18 @@ void workers_deinit(void);
 struct connswapunit *csui_new(void);
 void csui_free(struct connswapunit *item);
 
+int csuq_init(connswapqueue *q, long long size);
+void csuq_deinit(connswapqueue *q);
+void csuq_push(connswapqueue *q, struct connswapunit *su);
+struct connswapunit *csuq_pop(connswapqueue *q);
+
 void csul_push(vr_worker *worker, struct connswapunit *su);
-struct connswapunit *csul_pop(vr_worker *worker);
 
 int worker_get_next_idx(int curidx);
+int worker_get_owner_idx(int dbidx);
+
+int worker_forward_command(struct client *c);
+int worker_fanout(struct client *c, workerFanoutProc *proc, workerFanoutDone *done, void *privdata);
 
 void dispatch_conn_new(vr_listen *vlisten, int sd);
 
@@ -62,6 +62,7 @@ static struct config {
     int threads_count;
     int protocol;
     int noinline;
+    int workers;
 } config;
 
 typedef struct benchmark_thread {
@@ -898,6 +899,10 @@ int parseOptions(int argc, const char **argv) {
             config.protocol = TEST_CMD_PROTOCOL_MEMCACHE;
         } else if (!strcmp(argv[i],"--noinline")) {
             config.noinline = 1;
+        } else if (!strcmp(argv[i],"--workers")) {
+            if (lastarg) goto invalid;
+            config.workers = atoi(argv[++i]);
+            if (config.workers <= 0) config.workers = 1;
         } else if (!strcmp(argv[i],"--help")) {
             exit_status = 0;
             goto usage;
@@ -952,7 +957,9 @@ usage:
 "                    The type names are like 'server,string,hash,list,set,sortedset'.\n"
 " -I                 Idle mode. Just open N idle connections and wait.\n"
 " -m                 Use memcached protocol. This option is used for testing memcached.\n"
-" --noinline         Not test redis inline commands.\n\n"
+" --noinline         Not test redis inline commands.\n"
+" --workers <num>    Worker threads count of the server, used by the read_scaling\n"
+"                    test (default is the same as the server default).\n\n"
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
 "   $ vire-benchmark\n\n"
@@ -964,6 +971,8 @@ usage:
 "   $ vire-benchmark -t ping,set,get -n 100000 --csv\n\n"
 " Benchmark a specific command line:\n"
 "   $ vire-benchmark -r 10000 -n 10000 eval 'return redis.call(\"ping\")' 0\n\n"
+" Show how GET/HGET/SISMEMBER scale with the busy workers of a 8 threads server:\n"
+"   $ vire-benchmark -t read_scaling --workers 8 -P 16 -n 1000000\n\n"
 " Fill a list with 10000 random elements:\n"
 "   $ vire-benchmark -r 10000 -n 10000 lpush mylist __rand_field__\n\n"
 " On user specified command lines __rand_key__ and __rand_field__ are replaced\n"
@@ -1057,6 +1066,61 @@ void retrieval_random_keys_to_original() {
     random_keys_temporarily_stats = 0;
 }
 
+/* Run the fast read only commands GET, HGET and SISMEMBER with 1, 2,
+ * 4 ... up to config.workers connections. The server dispatches the new
+ * connections to the workers round robin, so every step keeps one more
+ * group of workers busy reading, and the throughput of the steps shows
+ * how the reads scale with the worker count. Compare the results of the
+ * server with db-optimistic-read on and off. */
+static void benchmark_read_scaling(char *data)
+{
+    int numclients_original = config.numclients;
+    int threads_original = config.threads_count;
+    int n, len;
+    char *cmd;
+    char title[64];
+
+    /* Populate the keyspace first. */
+    config.numclients = numclients_original;
+    set_requests_temporarily(config.randomkeys_keyspacelen);
+    len = redisFormatCommand(&cmd,"SET mystring:__rand_key__ %s",data);
+    benchmark("SET (needed to benchmark read scaling)",cmd,len);
+    free(cmd);
+    len = redisFormatCommand(&cmd,"HSET myhash:__rand_key__ field %s",data);
+    benchmark("HSET (needed to benchmark read scaling)",cmd,len);
+    free(cmd);
+    len = redisFormatCommand(&cmd,"SADD myset:__rand_key__ %s",data);
+    benchmark("SADD (needed to benchmark read scaling)",cmd,len);
+    free(cmd);
+    retrieval_requests_to_original();
+
+    for (n = 1; ; n *= 2) {
+        if (n > config.workers) n = config.workers;
+        config.numclients = n;
+        config.threads_count = n < threads_original ? n : threads_original;
+
+        len = redisFormatCommand(&cmd,"GET mystring:__rand_key__");
+        snprintf(title,sizeof(title),"GET (%d workers)",n);
+        benchmark(title,cmd,len);
+        free(cmd);
+
+        len = redisFormatCommand(&cmd,"HGET myhash:__rand_key__ field");
+        snprintf(title,sizeof(title),"HGET (%d workers)",n);
+        benchmark(title,cmd,len);
+        free(cmd);
+
+        len = redisFormatCommand(&cmd,"SISMEMBER myset:__rand_key__ %s",data);
+        snprintf(title,sizeof(title),"SISMEMBER (%d workers)",n);
+        benchmark(title,cmd,len);
+        free(cmd);
+
+        if (n >= config.workers) break;
+    }
+
+    config.numclients = numclients_original;
+    config.threads_count = threads_original;
+}
+
 static int test_redis(int argc, const char **argv)
 {
     int i;
@@ -1378,6 +1442,10 @@ static int test_redis(int argc, const char **argv)
             free(cmd);
         }
 
+        /* Just run when it was selected explicitly, it is a long test. */
+        if (config.tests != NULL && test_is_selected("read_scaling"))
+            benchmark_read_scaling(data);
+
         if (!config.csv) printf("\n");
     } while(config.loop);
 
@@ -1471,6 +1539,7 @@ int main(int argc, const char **argv) {
     config.threads_count = 2;
     config.protocol = TEST_CMD_PROTOCOL_REDIS;
     config.noinline = 0;
+    config.workers = (int)(sysconf(_SC_NPROCESSORS_ONLN)>6?6:sysconf(_SC_NPROCESSORS_ONLN));
 
     i = parseOptions(argc,argv);
     argc -= i;
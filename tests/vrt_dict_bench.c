@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include <vr_core.h>
+
+/* Microbenchmark of the keyspace tables: the chained dict and the open
+ * addressing one of dictCreateOpen(), with sds keys and the hash of the
+ * keyspace. SET adds the keys to an empty table, growing it, SET-XX
+ * replaces their values, GET finds them and GET-MISS looks for keys not
+ * there, all in random order. The memory per key is the one of the table
+ * and of the entries, the keys are the same for both. */
+
+#define DICT_BENCH_TRIALS 3
+
+static int keys = 1000000;
+static int rounds = 3;
+
+static struct option long_options[] = {
+    { "help",           no_argument,        NULL,   'h' },
+    { "keys",           required_argument,  NULL,   'n' },
+    { "rounds",         required_argument,  NULL,   'r' },
+    { NULL,             0,                  NULL,    0  }
+};
+
+static char short_options[] = "hn:r:";
+
+static void
+dict_bench_usage(void)
+{
+    printf("Usage: vire-dict-bench [-h] [-n keys] [-r rounds]" CRLF
+        "Options:" CRLF
+        "  -h, --help             : this help" CRLF
+        "  -n, --keys=N           : keys in the table (default: 1000000)" CRLF
+        "  -r, --rounds=N         : times the keys are looked up (default: 3)" CRLF);
+}
+
+static unsigned int
+dict_bench_hash(const void *key)
+{
+    return dictGenHashFunction((const unsigned char *)key, (int)sdslen((sds)key));
+}
+
+static int
+dict_bench_compare(void *privdata, const void *key1, const void *key2)
+{
+    size_t l1, l2;
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+/* The keys belong to the benchmark, they are not freed by the tables. */
+static dictType benchDictType = {
+    dict_bench_hash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dict_bench_compare,         /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+struct dict_bench_result {
+    double set_ns;
+    double setxx_ns;
+    double get_ns;
+    double miss_ns;
+    double bytes_per_key;
+};
+
+static sds *
+dict_bench_keys(int n, const char *prefix)
+{
+    sds *k = dalloc(sizeof(sds)*(size_t)n);
+    int j;
+
+    for (j = 0; j < n; j ++) {
+        sds s = sdscatprintf(sdsempty(),"%s:%010d",prefix,j);
+
+        k[j] = slabSdsDup(s);
+        sdsfree(s);
+    }
+    return k;
+}
+
+/* Fisher-Yates, so the lookups miss the caches as the real ones do. */
+static void
+dict_bench_shuffle(sds *k, int n)
+{
+    int j, r;
+    sds tmp;
+
+    for (j = n-1; j > 0; j --) {
+        r = rand()%(j+1);
+        tmp = k[j];
+        k[j] = k[r];
+        k[r] = tmp;
+    }
+}
+
+static double
+dict_bench_ns(long long start, long long ops)
+{
+    return (double)(dusec_now()-start)*1000/(double)ops;
+}
+
+/* Returns -1 if a lookup went wrong. */
+static int
+dict_bench_run(int open_addressing, sds *present, sds *absent, sds *order,
+               struct dict_bench_result *res)
+{
+    dict *d;
+    size_t mem;
+    long long start, found = 0;
+    int r, j;
+
+    mem = dalloc_used_memory();
+    d = open_addressing ? dictCreateOpen(&benchDictType,NULL) :
+               dictCreate(&benchDictType,NULL);
+
+    start = dusec_now();
+    for (j = 0; j < keys; j ++) {
+        if (dictAdd(d,present[j],present[j]) != DICT_OK) return -1;
+    }
+    res->set_ns = dict_bench_ns(start,keys);
+
+    /* Let the last rehashing complete, as the backends do. */
+    while (dictRehash(d,100));
+    res->bytes_per_key = (double)(dalloc_used_memory()-mem)/(double)keys;
+
+    start = dusec_now();
+    for (j = 0; j < keys; j ++) dictReplace(d,order[j],order[j]);
+    res->setxx_ns = dict_bench_ns(start,keys);
+
+    start = dusec_now();
+    for (r = 0; r < rounds; r ++) {
+        for (j = 0; j < keys; j ++) {
+            if (dictFetchValue(d,order[j]) == order[j]) found ++;
+        }
+    }
+    res->get_ns = dict_bench_ns(start,(long long)keys*rounds);
+
+    start = dusec_now();
+    for (r = 0; r < rounds; r ++) {
+        for (j = 0; j < keys; j ++) {
+            if (dictFind(d,absent[j]) != NULL) found = -1;
+        }
+    }
+    res->miss_ns = dict_bench_ns(start,(long long)keys*rounds);
+
+    dictRelease(d);
+    return found == (long long)keys*rounds ? 0 : -1;
+}
+
+static void
+dict_bench_best(struct dict_bench_result *best, struct dict_bench_result *res)
+{
+    if (best->set_ns < 0 || res->set_ns < best->set_ns)
+        best->set_ns = res->set_ns;
+    if (best->setxx_ns < 0 || res->setxx_ns < best->setxx_ns)
+        best->setxx_ns = res->setxx_ns;
+    if (best->get_ns < 0 || res->get_ns < best->get_ns)
+        best->get_ns = res->get_ns;
+    if (best->miss_ns < 0 || res->miss_ns < best->miss_ns)
+        best->miss_ns = res->miss_ns;
+    best->bytes_per_key = res->bytes_per_key;
+}
+
+static void
+dict_bench_print(const char *name, struct dict_bench_result *res,
+                 struct dict_bench_result *base)
+{
+    printf("%-8s SET %7.2f ns  SET-XX %7.2f ns  GET %7.2f ns  "
+        "GET-MISS %7.2f ns  %6.2f bytes/key",
+        name, res->set_ns, res->setxx_ns, res->get_ns, res->miss_ns,
+        res->bytes_per_key);
+    if (base != NULL) {
+        printf("  (GET %.2fx, %.0f%% memory)", base->get_ns/res->get_ns,
+            res->bytes_per_key*100/base->bytes_per_key);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct dict_bench_result chained, flat, res;
+    sds *present, *absent, *order;
+    int c;
+
+    opterr = 0;
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1) break;
+
+        switch (c) {
+        case 'n':
+            keys = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            dict_bench_usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (keys <= 0 || rounds <= 0) {
+        dict_bench_usage();
+        return 1;
+    }
+
+    present = dict_bench_keys(keys,"key");
+    absent = dict_bench_keys(keys,"nokey");
+    order = dalloc(sizeof(sds)*(size_t)keys);
+    memcpy(order,present,sizeof(sds)*(size_t)keys);
+    dict_bench_shuffle(order,keys);
+    dict_bench_shuffle(absent,keys);
+
+    /* The best of a few interleaved trials. */
+    chained.set_ns = chained.setxx_ns = chained.get_ns = chained.miss_ns = -1;
+    flat = chained;
+    for (c = 0; c < DICT_BENCH_TRIALS; c ++) {
+        if (dict_bench_run(0,present,absent,order,&res) != 0) goto err;
+        dict_bench_best(&chained,&res);
+        if (dict_bench_run(1,present,absent,order,&res) != 0) goto err;
+        dict_bench_best(&flat,&res);
+    }
+
+    printf("%d keys, %d rounds of lookups\n", keys, rounds);
+    dict_bench_print("chained",&chained,NULL);
+    dict_bench_print("open",&flat,&chained);
+    return 0;
+
+err:
+    printf("lookups went wrong\n");
+    return 1;
+}
@@ -0,0 +1,810 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include <hiredis.h>
+
+#include <vrt_util.h>
+#include <vrt_public.h>
+#include <vrt_persist.h>
+
+#define ERRMSG_MAX_LEN LOG_MAX_LEN-100
+static char errmsg[ERRMSG_MAX_LEN];
+
+#define TEST_PERSIST_KEYS           1000    /* Keys written by every step */
+#define TEST_PERSIST_WAIT_ROUNDS    100     /* 100ms each */
+#define TEST_PERSIST_MULTI_ROUNDS   20
+#define TEST_PERSIST_MULTI_PADS     64      /* Other keys of every DEL */
+#define TEST_PERSIST_MULTI_BIG      300000  /* Elements of the big list */
+#define TEST_PERSIST_MULTI_WAIT     5000    /* Microseconds */
+
+/* Write 'prefix:<j>' for j in [start,end) in the db, with a hash and a
+ * counter of them, pipelined. */
+static int persist_test_write(redisContext *ctx, int db, char *prefix,
+    int start, int end)
+{
+    redisReply *reply;
+    int j, count = 0;
+
+    redisAppendCommand(ctx, "select %d", db);
+    count ++;
+    for (j = start; j < end; j ++) {
+        redisAppendCommand(ctx, "set %s:%d %d", prefix, j, j);
+        redisAppendCommand(ctx, "hset %s:hash %d %d", prefix, j, j);
+        redisAppendCommand(ctx, "incr %s:counter", prefix);
+        count += 3;
+    }
+
+    for (j = 0; j < count; j ++) {
+        if (redisGetReply(ctx, (void **)&reply) != REDIS_OK ||
+            reply == NULL) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "write %s to db %d failed",
+                prefix, db);
+            return 0;
+        }
+        if (reply->type == REDIS_REPLY_ERROR) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "write %s to db %d replied %s",
+                prefix, db, reply->str);
+            freeReplyObject(reply);
+            return 0;
+        }
+        freeReplyObject(reply);
+    }
+
+    return 1;
+}
+
+/* Check the keys written by persist_test_write() for [0,end), and that
+ * the counter is 'counter'. */
+static int persist_test_check(redisContext *ctx, int db, char *prefix,
+    int end, long long counter)
+{
+    redisReply *reply = NULL;
+    int j;
+
+    reply = redisCommand(ctx, "select %d", db);
+    if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "select db %d failed", db);
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+
+    for (j = 0; j < end; j ++) {
+        redisAppendCommand(ctx, "get %s:%d", prefix, j);
+    }
+    for (j = 0; j < end; j ++) {
+        if (redisGetReply(ctx, (void **)&reply) != REDIS_OK ||
+            reply == NULL) {
+            reply = NULL;
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "get %s:%d failed", prefix, j);
+            goto error;
+        }
+        if (reply->type != REDIS_REPLY_STRING || atoi(reply->str) != j) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "%s:%d in db %d is lost",
+                prefix, j, db);
+            goto error;
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+
+    reply = redisCommand(ctx, "hlen %s:hash", prefix);
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER ||
+        reply->integer != end) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "hlen %s:hash in db %d is %lld, not %d",
+            prefix, db, reply && reply->type == REDIS_REPLY_INTEGER ?
+            reply->integer : -1, end);
+        goto error;
+    }
+    freeReplyObject(reply);
+
+    reply = redisCommand(ctx, "get %s:counter", prefix);
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING ||
+        atoll(reply->str) != counter) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "%s:counter in db %d is %s, not %lld",
+            prefix, db, reply && reply->type == REDIS_REPLY_STRING ?
+            reply->str : "nil", counter);
+        goto error;
+    }
+    freeReplyObject(reply);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    return 0;
+}
+
+/* Kill the instance and wait it is gone, so it can be run again on the
+ * same dir and port. */
+static void persist_test_kill(vire_instance *vi)
+{
+    int pid = vi->pid;
+
+    vire_server_stop(vi);
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+static int persist_test_restart(vire_instance *vi)
+{
+    persist_test_kill(vi);
+    if (vire_server_run(vi) != VRT_OK) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "restart vire failed");
+        return 0;
+    }
+
+    return 1;
+}
+
+static long long persist_test_info(redisContext *ctx, char *section, char *name)
+{
+    redisReply *reply;
+    long long value;
+
+    reply = redisCommand(ctx, "info %s", section);
+    if (reply == NULL) return -1;
+    value = get_longlong_from_info_reply(reply, name);
+    freeReplyObject(reply);
+    return value;
+}
+
+/* Wait the slave to have all the stream of the master. */
+static int persist_test_wait_slave(vire_instance *master, vire_instance *slave)
+{
+    long long master_offset, slave_offset;
+    int j;
+
+    for (j = 0; j < TEST_PERSIST_WAIT_ROUNDS; j ++) {
+        master_offset = persist_test_info(master->ctx, "replication",
+            "master_repl_offset");
+        slave_offset = persist_test_info(slave->ctx, "replication",
+            "slave_repl_offset");
+        if (master_offset > 0 && slave_offset == master_offset &&
+            persist_test_info(slave->ctx, "replication",
+            "master_sync_in_progress") == 0) {
+            return 1;
+        }
+        usleep(100000);
+    }
+
+    vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "slave is at %lld, master at %lld",
+        slave_offset, master_offset);
+    return 0;
+}
+
+static int persist_test_wait_rewrite(vire_instance *vi)
+{
+    int j;
+
+    for (j = 0; j < TEST_PERSIST_WAIT_ROUNDS; j ++) {
+        if (persist_test_info(vi->ctx, "persistence",
+                "aof_rewrite_in_progress") == 0 &&
+            persist_test_info(vi->ctx, "persistence",
+                "aof_rewrite_scheduled") == 0) {
+            return 1;
+        }
+        usleep(100000);
+    }
+
+    vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "aof rewrite did not finish");
+    return 0;
+}
+
+struct persist_test_writer {
+    vire_instance *vi;
+    int db;
+    char *prefix;
+    int ok;
+};
+
+/* Write the keys of the writer in steps, so the main thread can do
+ * something in between. */
+static void *persist_test_writer_run(void *arg)
+{
+    struct persist_test_writer *w = arg;
+    redisContext *ctx;
+    int j;
+
+    ctx = redisConnect(w->vi->host, w->vi->port);
+    if (ctx == NULL || ctx->err) {
+        if (ctx) redisFree(ctx);
+        return NULL;
+    }
+
+    for (j = 0; j < TEST_PERSIST_KEYS; j += 100) {
+        if (!persist_test_write(ctx, w->db, w->prefix, j, j+100)) {
+            redisFree(ctx);
+            return NULL;
+        }
+    }
+
+    redisFree(ctx);
+    w->ok = 1;
+    return NULL;
+}
+
+/* Send the commands appended to the context, without reading the
+ * replies. */
+static int persist_test_send(redisContext *ctx)
+{
+    int done = 0;
+
+    while (!done) {
+        if (redisBufferWrite(ctx, &done) != REDIS_OK) return 0;
+    }
+
+    return 1;
+}
+
+/* A DEL of many keys is replayed from the AOF in the order it was done
+ * against a SET of its first key. An LRANGE of a big list holds the read
+ * lock of one internal db, so the DEL stops at the key of that db after
+ * deleting its first key, and the SET of the first key is done then. */
+static int persist_test_multi_key_order(void)
+{
+    char *MESSAGE = "AOF multi key write order test";
+    vire_instance *vi;
+    redisContext *reader = NULL, *setter = NULL;
+    redisReply *reply = NULL;
+    char **argv = NULL;
+    size_t *argvlen = NULL;
+    sds *live = NULL;
+    int argc = TEST_PERSIST_MULTI_PADS+2;
+    int j, k;
+
+    vi = start_one_vire_instance_with_options(
+        "internal-dbs-per-databases 8\nappendonly yes\nappendfsync always");
+    if (vi == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+
+    argv = malloc(sizeof(char*)*(size_t)argc);
+    argvlen = malloc(sizeof(size_t)*(size_t)argc);
+    live = calloc((size_t)TEST_PERSIST_MULTI_ROUNDS, sizeof(sds));
+    argv[0] = sdsnew("del");
+    argv[1] = sdsempty();
+    for (k = 2; k < argc; k ++) {
+        argv[k] = sdscatfmt(sdsempty(), "r_pad_%i", k);
+    }
+    for (k = 0; k < argc; k ++) {
+        argvlen[k] = sdslen(argv[k]);
+    }
+
+    /* Every connection runs in its own worker. */
+    reader = redisConnect(vi->host, vi->port);
+    setter = redisConnect(vi->host, vi->port);
+    if (reader == NULL || reader->err || setter == NULL || setter->err) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "connect to vire failed");
+        goto error;
+    }
+
+    for (j = 0; j < TEST_PERSIST_MULTI_BIG; j += 1000) {
+        for (k = 0; k < 1000; k ++) {
+            redisAppendCommand(vi->ctx, "rpush r_big %d", j+k);
+        }
+        for (k = 0; k < 1000; k ++) {
+            if (redisGetReply(vi->ctx, (void **)&reply) != REDIS_OK ||
+                reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+                vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "rpush r_big failed");
+                goto error;
+            }
+            freeReplyObject(reply);
+            reply = NULL;
+        }
+    }
+
+    for (j = 0; j < TEST_PERSIST_MULTI_ROUNDS; j ++) {
+        reply = redisCommand(vi->ctx, "set r_%d old", j);
+        if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "set r_%d failed", j);
+            goto error;
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+
+        redisAppendCommand(reader, "lrange r_big 0 -1");
+        if (!persist_test_send(reader)) goto error;
+        usleep(TEST_PERSIST_MULTI_WAIT);
+
+        sdsclear(argv[1]);
+        argv[1] = sdscatfmt(argv[1], "r_%i", j);
+        argvlen[1] = sdslen(argv[1]);
+        redisAppendCommandArgv(vi->ctx, argc, (const char **)argv, argvlen);
+        if (!persist_test_send(vi->ctx)) goto error;
+        usleep(TEST_PERSIST_MULTI_WAIT);
+
+        reply = redisCommand(setter, "set r_%d new", j);
+        if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "set r_%d failed", j);
+            goto error;
+        }
+        freeReplyObject(reply);
+
+        if (redisGetReply(vi->ctx, (void **)&reply) != REDIS_OK ||
+            reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "del r_%d failed", j);
+            goto error;
+        }
+        freeReplyObject(reply);
+        if (redisGetReply(reader, (void **)&reply) != REDIS_OK ||
+            reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "lrange r_big failed");
+            goto error;
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+
+    for (j = 0; j < TEST_PERSIST_MULTI_ROUNDS; j ++) {
+        reply = redisCommand(vi->ctx, "get r_%d", j);
+        if (reply == NULL) goto error;
+        live[j] = reply->type == REDIS_REPLY_STRING ?
+            sdsnewlen(reply->str, (size_t)reply->len) : NULL;
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+
+    if (!persist_test_restart(vi)) goto error;
+
+    for (j = 0; j < TEST_PERSIST_MULTI_ROUNDS; j ++) {
+        reply = redisCommand(vi->ctx, "get r_%d", j);
+        if (reply == NULL) goto error;
+        if ((reply->type == REDIS_REPLY_STRING) != (live[j] != NULL) ||
+            (live[j] != NULL && strcmp(reply->str, live[j]))) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "r_%d is %s after the restart, but was %s",
+                j, reply->type == REDIS_REPLY_STRING ? reply->str : "nil",
+                live[j] ? live[j] : "nil");
+            goto error;
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+
+    for (k = 0; k < argc; k ++) sdsfree(argv[k]);
+    for (j = 0; j < TEST_PERSIST_MULTI_ROUNDS; j ++) sdsfree(live[j]);
+    free(argv);
+    free(argvlen);
+    free(live);
+    redisFree(reader);
+    redisFree(setter);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    for (k = 0; k < argc; k ++) sdsfree(argv[k]);
+    for (j = 0; j < TEST_PERSIST_MULTI_ROUNDS; j ++) sdsfree(live[j]);
+    free(argv);
+    free(argvlen);
+    free(live);
+    if (reader) redisFree(reader);
+    if (setter) redisFree(setter);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
+static int persist_test_save_restart(void)
+{
+    char *MESSAGE = "SAVE and restart test";
+    vire_instance *vi;
+    redisReply *reply = NULL;
+
+    vi = start_one_vire_instance_with_options(
+        "databases 4\ninternal-dbs-per-databases 4\nrdb-threads 2");
+    if (vi == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+
+    if (!persist_test_write(vi->ctx, 0, "save", 0, TEST_PERSIST_KEYS) ||
+        !persist_test_write(vi->ctx, 3, "save", 0, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    reply = redisCommand(vi->ctx, "save");
+    if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "save failed");
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+
+    if (!persist_test_restart(vi) ||
+        !persist_test_check(vi->ctx, 0, "save", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(vi->ctx, 3, "save", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
+/* The last command in the file is an INCR of the counter of db 1, cut
+ * it in the middle. The replay loads everything before it and truncates
+ * the file there, so the writes after the restart are replayed too. */
+static int persist_test_aof_truncated(void)
+{
+    char *MESSAGE = "AOF replay with a truncated tail test";
+    vire_instance *vi;
+    redisReply *reply = NULL;
+    sds aof_file = NULL;
+    struct stat st;
+
+    vi = start_one_vire_instance_with_options(
+        "internal-dbs-per-databases 4\nappendonly yes\nappendfsync always");
+    if (vi == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+    aof_file = sdscatfmt(sdsempty(), "%s/appendonly.aof", vi->dir);
+
+    if (!persist_test_write(vi->ctx, 0, "aof", 0, TEST_PERSIST_KEYS) ||
+        !persist_test_write(vi->ctx, 1, "aof", 0, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    persist_test_kill(vi);
+    if (stat(aof_file, &st) < 0 || truncate(aof_file, st.st_size-3) < 0) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "truncate %s failed: %s",
+            aof_file, strerror(errno));
+        goto error;
+    }
+    if (vire_server_run(vi) != VRT_OK) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "restart vire failed");
+        goto error;
+    }
+
+    if (!persist_test_check(vi->ctx, 0, "aof", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(vi->ctx, 1, "aof", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS-1)) {
+        goto error;
+    }
+
+    reply = redisCommand(vi->ctx, "incr aof:counter");
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "incr failed");
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+
+    if (!persist_test_restart(vi) ||
+        !persist_test_check(vi->ctx, 1, "aof", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    sdsfree(aof_file);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    sdsfree(aof_file);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
+static int persist_test_bgrewriteaof(void)
+{
+    char *MESSAGE = "BGREWRITEAOF with concurrent writes test";
+    vire_instance *vi;
+    redisReply *reply = NULL;
+    struct persist_test_writer w;
+    pthread_t writer;
+    int writer_started = 0;
+
+    vi = start_one_vire_instance_with_options(
+        "internal-dbs-per-databases 4\nappendonly yes\nappendfsync always");
+    if (vi == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+
+    if (!persist_test_write(vi->ctx, 0, "base", 0, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    w.vi = vi;
+    w.db = 1;
+    w.prefix = "diff";
+    w.ok = 0;
+    if (pthread_create(&writer, NULL, persist_test_writer_run, &w) != 0) {
+        goto error;
+    }
+    writer_started = 1;
+
+    reply = redisCommand(vi->ctx, "bgrewriteaof");
+    if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "bgrewriteaof failed");
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+
+    pthread_join(writer, NULL);
+    writer_started = 0;
+    if (!w.ok) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "concurrent writes failed");
+        goto error;
+    }
+
+    /* Then append to the new file. */
+    if (!persist_test_wait_rewrite(vi) ||
+        !persist_test_write(vi->ctx, 2, "after", 0, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    if (!persist_test_restart(vi) ||
+        !persist_test_check(vi->ctx, 0, "base", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(vi->ctx, 1, "diff", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(vi->ctx, 2, "after", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    if (writer_started) pthread_join(writer, NULL);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
+/* A slave gets the data with a full resync, and once its link is killed
+ * the writes done meanwhile with a partial resync. */
+static int persist_test_sync_psync(void)
+{
+    char *MESSAGE = "SYNC and PSYNC resync test";
+    vire_instance *master, *slave = NULL;
+    redisReply *reply = NULL;
+    char options[128];
+
+    master = start_one_vire_instance_with_options(
+        "internal-dbs-per-databases 4\nrdb-threads 2");
+    if (master == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+
+    if (!persist_test_write(master->ctx, 0, "full", 0, TEST_PERSIST_KEYS) ||
+        !persist_test_write(master->ctx, 2, "full", 0, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    snprintf(options, sizeof(options),
+        "internal-dbs-per-databases 4\nslaveof %s %d",
+        master->host, master->port);
+    slave = start_one_vire_instance_with_options(options);
+    if (slave == NULL) {
+        test_log_error("Run vire instance failed");
+        goto error;
+    }
+
+    if (!persist_test_write(master->ctx, 1, "stream", 0, TEST_PERSIST_KEYS) ||
+        !persist_test_wait_slave(master, slave) ||
+        !persist_test_check(slave->ctx, 0, "full", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(slave->ctx, 2, "full", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(slave->ctx, 1, "stream", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    reply = redisCommand(master->ctx, "client kill type slave");
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER ||
+        reply->integer != 1) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "kill the slave link failed");
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+
+    if (!persist_test_write(master->ctx, 3, "partial", 0, TEST_PERSIST_KEYS) ||
+        !persist_test_wait_slave(master, slave) ||
+        !persist_test_check(slave->ctx, 3, "partial", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS) ||
+        !persist_test_check(slave->ctx, 1, "stream", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    if (persist_test_info(master->ctx, "stats", "sync_full") != 1 ||
+        persist_test_info(master->ctx, "stats", "sync_partial_ok") != 1) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "the slave did not resync partially");
+        goto error;
+    }
+
+    vire_instance_destroy(slave);
+    vire_instance_destroy(master);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    if (slave) vire_instance_destroy(slave);
+    vire_instance_destroy(master);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
+/* Count the DEL commands in the AOF of the instance. */
+static long long persist_test_aof_dels(vire_instance *vi)
+{
+    sds aof_file, buf = sdsempty();
+    char chunk[4096], *p;
+    long long count = 0;
+    ssize_t nread;
+    int fd;
+
+    aof_file = sdscatfmt(sdsempty(), "%s/appendonly.aof", vi->dir);
+    fd = open(aof_file, O_RDONLY);
+    sdsfree(aof_file);
+    if (fd < 0) {
+        sdsfree(buf);
+        return -1;
+    }
+    while ((nread = read(fd, chunk, sizeof(chunk))) > 0)
+        buf = sdscatlen(buf, chunk, (size_t)nread);
+    close(fd);
+
+    for (p = buf; (p = strstr(p, "$3\r\nDEL\r\n")) != NULL; p ++)
+        count ++;
+    sdsfree(buf);
+    return count;
+}
+
+/* The master deletes the expired keys in the backends, the slave and the
+ * AOF only see them gone by the DELs the master propagates. */
+static int persist_test_expire_propagate(void)
+{
+    char *MESSAGE = "Expired keys propagation test";
+    vire_instance *master, *slave = NULL;
+    redisReply *reply = NULL;
+    char options[128];
+    long long dbsize = -1, dels;
+    int j;
+
+    master = start_one_vire_instance_with_options(
+        "internal-dbs-per-databases 4\nappendonly yes");
+    if (master == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+
+    snprintf(options, sizeof(options),
+        "internal-dbs-per-databases 4\nslaveof %s %d",
+        master->host, master->port);
+    slave = start_one_vire_instance_with_options(options);
+    if (slave == NULL) {
+        test_log_error("Run vire instance failed");
+        goto error;
+    }
+
+    if (!persist_test_write(master->ctx, 0, "live", 0, TEST_PERSIST_KEYS))
+        goto error;
+    for (j = 0; j < TEST_PERSIST_KEYS; j ++)
+        redisAppendCommand(master->ctx, "psetex expire:%d 100 %d", j, j);
+    for (j = 0; j < TEST_PERSIST_KEYS; j ++) {
+        if (redisGetReply(master->ctx, (void **)&reply) != REDIS_OK ||
+            reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "psetex failed");
+            goto error;
+        }
+        freeReplyObject(reply);
+    }
+    reply = NULL;
+
+    /* The counter and the hash are the two other keys. */
+    for (j = 0; j < TEST_PERSIST_WAIT_ROUNDS; j ++) {
+        usleep(100000);
+        reply = redisCommand(slave->ctx, "dbsize");
+        if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+            vrt_scnprintf(errmsg, ERRMSG_MAX_LEN, "dbsize failed");
+            goto error;
+        }
+        dbsize = reply->integer;
+        freeReplyObject(reply);
+        reply = NULL;
+        if (dbsize == TEST_PERSIST_KEYS+2) break;
+    }
+    if (dbsize != TEST_PERSIST_KEYS+2) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN,
+            "the slave has %lld keys, expected %d", dbsize, TEST_PERSIST_KEYS+2);
+        goto error;
+    }
+
+    if (!persist_test_wait_slave(master, slave) ||
+        !persist_test_check(slave->ctx, 0, "live", TEST_PERSIST_KEYS, TEST_PERSIST_KEYS)) {
+        goto error;
+    }
+
+    persist_test_kill(master);
+    dels = persist_test_aof_dels(master);
+    if (dels != TEST_PERSIST_KEYS) {
+        vrt_scnprintf(errmsg, ERRMSG_MAX_LEN,
+            "the AOF has %lld DELs, expected %d", dels, TEST_PERSIST_KEYS);
+        goto error;
+    }
+
+    vire_instance_destroy(slave);
+    vire_instance_destroy(master);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    if (slave) vire_instance_destroy(slave);
+    vire_instance_destroy(master);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
+int persist_test(void)
+{
+    int ok_count = 0, all_count = 0;
+
+    errmsg[0] = '\0';
+
+    ok_count+=persist_test_multi_key_order(); all_count++;
+    ok_count+=persist_test_save_restart(); all_count++;
+    ok_count+=persist_test_aof_truncated(); all_count++;
+    ok_count+=persist_test_bgrewriteaof(); all_count++;
+    ok_count+=persist_test_sync_psync(); all_count++;
+    ok_count+=persist_test_expire_propagate(); all_count++;
+
+    return ok_count==all_count?1:0;
+}
@@ -0,0 +1,7 @@
+#ifndef _VRT_PERSIST_H_
+#define _VRT_PERSIST_H_
+
+int persist_test(void);
+
+
+#endif
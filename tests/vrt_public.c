@@ -32,12 +32,17 @@ static sds workdir = NULL;
 
 static int vireport = 55556; /* The available port for vire to start */
 
+/* Worker threads of the instances, the same on every host, so the tests
+ * run commands of different clients at the same time. */
+#define VIRE_TEST_THREADS "4"
+
 void set_execute_file(char *file)
 {
     execute_file = file;
 }
 
-static sds vire_conf_create(char *dir, int port)
+/* The 'options' are more config lines for the instance, or NULL. */
+static sds vire_conf_create(char *dir, int port, char *options)
 {
     sds conf_file;
     int fd;
@@ -57,6 +62,17 @@ static sds vire_conf_create(char *dir, int port)
     line = sdscatfmt(line,"port %i\n",port);
     write(fd, line, sdslen(line));
 
+    /* The data files of the instance stay in its own dir. */
+    sdsclear(line);
+    line = sdscatfmt(line,"dir %s\n",dir);
+    write(fd, line, sdslen(line));
+
+    if (options != NULL) {
+        sdsclear(line);
+        line = sdscatfmt(line,"%s\n",options);
+        write(fd, line, sdslen(line));
+    }
+
     sdsclear(line);
     line = sdscatfmt(line,"\n");
     write(fd, line, sdslen(line));
@@ -66,7 +82,7 @@ static sds vire_conf_create(char *dir, int port)
     return conf_file;
 }
 
-vire_instance *vire_instance_create(int port)
+static vire_instance *vire_instance_create_with_options(int port, char *options)
 {
     vire_instance *vi;
 
@@ -90,7 +106,7 @@ vire_instance *vire_instance_create(int port)
         return NULL;
     }
 
-    vi->conf_file = vire_conf_create(vi->dir, port);
+    vi->conf_file = vire_conf_create(vi->dir, port, options);
     if (vi->conf_file == NULL) {
         vire_instance_destroy(vi);
         return NULL;
@@ -109,6 +125,11 @@ vire_instance *vire_instance_create(int port)
     return vi;
 }
 
+vire_instance *vire_instance_create(int port)
+{
+    return vire_instance_create_with_options(port, NULL);
+}
+
 void vire_instance_destroy(vire_instance *vi)
 {
     if (vi->running) {
@@ -155,7 +176,8 @@ int vire_server_run(vire_instance *vi)
         return VRT_ERROR;
     } else if (pid == 0) {
         ret = execl(execute_file,"vire","-c",vi->conf_file,
-            "-p",vi->pid_file,"-o",vi->log_file,"-v","8",NULL);
+            "-p",vi->pid_file,"-o",vi->log_file,"-v","8",
+            "-T",VIRE_TEST_THREADS,NULL);
         if (ret < 0) {
             test_log_error("Execl the vire server failed: %s", strerror(errno));
             return VRT_ERROR;
@@ -281,12 +303,18 @@ static int get_next_port(void)
 }
 
 vire_instance *start_one_vire_instance(void)
+{
+    return start_one_vire_instance_with_options(NULL);
+}
+
+/* Start an instance with more config lines, 'options' may be NULL. */
+vire_instance *start_one_vire_instance_with_options(char *options)
 {
     int ret;
     int retry = 0;
     vire_instance *vi;
     
-    vi = vire_instance_create(get_next_port());
+    vi = vire_instance_create_with_options(get_next_port(), options);
     if (vi == NULL) {
         return NULL;
     }
@@ -294,7 +322,7 @@ vire_instance *start_one_vire_instance(void)
     ret = vire_server_run(vi);
     while (ret != VRT_OK && retry++ < 10) {
         vire_instance_destroy(vi);
-        vi = vire_instance_create(get_next_port());
+        vi = vire_instance_create_with_options(get_next_port(), options);
         if (vi == NULL) {
             return NULL;
         }
@@ -110,6 +110,7 @@ int create_work_dir(void);
 int destroy_work_dir(void);
 
 vire_instance *start_one_vire_instance(void);
+vire_instance *start_one_vire_instance_with_options(char *options);
 
 void show_test_result(int result,char *test_content,char *errmsg);
 
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include <sds.h>
+
+#include <dutil.h>
+
+#include <vr_resp.h>
+
+/* Microbenchmark of the RESP multibulk tokenizer: a pipelined buffer of
+ * commands is tokenized by the strchr()/string2ll() loop the incremental
+ * parser uses, and by respParseMultibulk(). Only the tokenizing is timed,
+ * no argument objects are created. */
+
+#define RESP_BENCH_MAX_ARGLEN (1024*32-1)
+
+#define RESP_BENCH_TRIALS 5
+
+static int commands = 10000;
+static int rounds = 200;
+
+static struct option long_options[] = {
+    { "help",           no_argument,        NULL,   'h' },
+    { "commands",       required_argument,  NULL,   'n' },
+    { "rounds",         required_argument,  NULL,   'r' },
+    { NULL,             0,                  NULL,    0  }
+};
+
+static char short_options[] = "hn:r:";
+
+static void
+resp_bench_usage(void)
+{
+    printf("Usage: vire-resp-bench [-h] [-n commands] [-r rounds]" CRLF
+        "Options:" CRLF
+        "  -h, --help             : this help" CRLF
+        "  -n, --commands=N       : commands in the pipelined buffer (default: 10000)" CRLF
+        "  -r, --rounds=N         : times the buffer is tokenized (default: 200)" CRLF);
+}
+
+/* Same as string2ll() in the server. */
+static int
+legacy_string2ll(const char *s, size_t slen, long long *value)
+{
+    const char *p = s;
+    size_t plen = 0;
+    int negative = 0;
+    unsigned long long v;
+
+    if (plen == slen) return 0;
+    if (slen == 1 && p[0] == '0') {
+        if (value != NULL) *value = 0;
+        return 1;
+    }
+    if (p[0] == '-') {
+        negative = 1;
+        p++; plen++;
+        if (plen == slen) return 0;
+    }
+    if (p[0] >= '1' && p[0] <= '9') {
+        v = (unsigned long long)(p[0]-'0');
+        p++; plen++;
+    } else if (p[0] == '0' && slen == 1) {
+        *value = 0;
+        return 1;
+    } else {
+        return 0;
+    }
+    while (plen < slen && p[0] >= '0' && p[0] <= '9') {
+        if (v > (ULLONG_MAX / 10)) return 0;
+        v *= 10;
+        if (v > (ULLONG_MAX - (unsigned long long)(p[0]-'0'))) return 0;
+        v += (unsigned long long)(p[0]-'0');
+        p++; plen++;
+    }
+    if (plen < slen) return 0;
+    if (negative) {
+        if (v > ((unsigned long long)(-(LLONG_MIN+1))+1)) return 0;
+        if (value != NULL) *value = -(long long)v;
+    } else {
+        if (v > LLONG_MAX) return 0;
+        if (value != NULL) *value = (long long)v;
+    }
+    return 1;
+}
+
+/* The tokenizing done by processMultibulkBuffer() before the fast path. */
+static int
+legacy_parse(const char *buf, size_t len, respArg *args, int *argc,
+    size_t *used)
+{
+    const char *newline;
+    size_t pos;
+    long long ll, count, j;
+
+    newline = strchr(buf,'\r');
+    if (newline == NULL || (size_t)(newline-buf) > len-2) return -1;
+    if (!legacy_string2ll(buf+1,(size_t)(newline-(buf+1)),&count)) return -1;
+    if (count > RESP_MAX_FAST_ARGS) return -1;
+    pos = (size_t)(newline-buf)+2;
+
+    for (j = 0; j < count; j ++) {
+        newline = strchr(buf+pos,'\r');
+        if (newline == NULL || (size_t)(newline-buf) > len-2) return -1;
+        if (buf[pos] != '$') return -1;
+        if (!legacy_string2ll(buf+pos+1,(size_t)(newline-(buf+pos+1)),&ll))
+            return -1;
+        pos += (size_t)(newline-(buf+pos))+2;
+        if (len-pos < (size_t)ll+2) return -1;
+        args[j].offset = pos;
+        args[j].len = (size_t)ll;
+        pos += (size_t)ll+2;
+    }
+
+    *argc = (int)count;
+    *used = pos;
+    return 0;
+}
+
+static sds
+resp_bench_add_command(sds buf, int argc, const char **argv)
+{
+    int j;
+
+    buf = sdscatprintf(buf,"*%d\r\n",argc);
+    for (j = 0; j < argc; j ++)
+        buf = sdscatprintf(buf,"$%zu\r\n%s\r\n",strlen(argv[j]),argv[j]);
+    return buf;
+}
+
+/* A pipeline of SET, GET and a 10 keys MGET, with 16 bytes values. */
+static sds
+resp_bench_build(int n)
+{
+    sds buf = sdsempty();
+    char keys[11][32];
+    const char *argv[11];
+    int i, j;
+
+    for (i = 0; i < n; i ++) {
+        for (j = 0; j < 11; j ++) {
+            snprintf(keys[j],sizeof(keys[j]),"key:%08d",(i*11+j)%100000);
+            argv[j] = keys[j];
+        }
+        switch (i%3) {
+        case 0:
+            argv[0] = "SET"; argv[2] = "value-0123456789";
+            buf = resp_bench_add_command(buf,3,argv);
+            break;
+        case 1:
+            argv[0] = "GET";
+            buf = resp_bench_add_command(buf,2,argv);
+            break;
+        default:
+            argv[0] = "MGET";
+            buf = resp_bench_add_command(buf,11,argv);
+            break;
+        }
+    }
+    return buf;
+}
+
+/* Tokenize the whole buffer 'rounds' times, returning the nanoseconds
+ * per command, or -1 on a parsing error. 'sum' lets the results be
+ * compared. */
+static double
+resp_bench_run(sds buf, int legacy, unsigned long long *sum)
+{
+    respArg args[RESP_MAX_FAST_ARGS];
+    size_t used, pos;
+    int argc, r, j, ret;
+    long long start, parsed = 0;
+
+    *sum = 0;
+    start = dusec_now();
+    for (r = 0; r < rounds; r ++) {
+        pos = 0;
+        while (pos < sdslen(buf)) {
+            if (legacy) {
+                ret = legacy_parse(buf+pos,sdslen(buf)-pos,args,&argc,&used);
+            } else {
+                ret = respParseMultibulk(buf+pos,sdslen(buf)-pos,
+                    RESP_BENCH_MAX_ARGLEN,args,RESP_MAX_FAST_ARGS,&argc,&used);
+            }
+            if (ret != 0) return -1;
+            for (j = 0; j < argc; j ++)
+                *sum += pos+args[j].offset+args[j].len;
+            pos += used;
+            parsed ++;
+        }
+    }
+
+    return (double)(dusec_now()-start)*1000/(double)parsed;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long legacy_sum, fast_sum;
+    double legacy_ns, fast_ns;
+    sds buf;
+    int c;
+
+    opterr = 0;
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1) break;
+
+        switch (c) {
+        case 'n':
+            commands = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            resp_bench_usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (commands <= 0 || rounds <= 0) {
+        resp_bench_usage();
+        return 1;
+    }
+
+    /* The best of a few interleaved trials. */
+    buf = resp_bench_build(commands);
+    legacy_ns = fast_ns = -1;
+    for (c = 0; c < RESP_BENCH_TRIALS; c ++) {
+        double ns;
+
+        ns = resp_bench_run(buf,1,&legacy_sum);
+        if (ns >= 0 && (legacy_ns < 0 || ns < legacy_ns)) legacy_ns = ns;
+        ns = resp_bench_run(buf,0,&fast_sum);
+        if (ns >= 0 && (fast_ns < 0 || ns < fast_ns)) fast_ns = ns;
+        if (ns < 0 || legacy_ns < 0 || legacy_sum != fast_sum) {
+            printf("tokenizers disagree on the pipelined buffer\n");
+            sdsfree(buf);
+            return 1;
+        }
+    }
+
+    printf("pipeline: %d commands, %zu bytes, %d rounds\n",
+        commands, sdslen(buf), rounds);
+    printf("strchr/string2ll : %.2f ns/command\n", legacy_ns);
+    printf("respParseMultibulk: %.2f ns/command (%.2fx)\n",
+        fast_ns, legacy_ns/fast_ns);
+
+    sdsfree(buf);
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <pthread.h>
 
 #include <hiredis.h>
 
@@ -1296,6 +1297,73 @@ error:
     return 0;
 }
 
+static int simple_test_cmd_unlink(vire_instance *vi)
+{
+    char *key = "test_cmd_unlink-key";
+    char *value = "test_cmd_unlink-value";
+    char *MESSAGE = "UNLINK simple test";
+    redisReply * reply = NULL;
+    struct test_hash_member **thms = NULL;
+
+    reply = redisCommand(vi->ctx, "set %s %s", key, value);
+    if (reply == NULL || reply->type != REDIS_REPLY_STATUS || 
+        reply->len != 2 || strcmp(reply->str,"OK")) {
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = redisCommand(vi->ctx, "unlink %s %s", key, key);
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || 
+        reply->integer != 1) {
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = redisCommand(vi->ctx, "exists %s", key);
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || 
+        reply->integer != 0) {
+        goto error;
+    }
+    freeReplyObject(reply);
+
+    /* A big value, freed by the backends */
+    thms = simple_test_hash_init(vi,key,TEST_HASH_ENCODED_HT,TEST_HASH_ENCODED_CAUSED_BY_FILED);
+    if (thms == NULL) {
+        goto error;
+    }
+    reply = redisCommand(vi->ctx, "unlink %s", key);
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || 
+        reply->integer != 1) {
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = redisCommand(vi->ctx, "hget %s %s", key, thms[0]->field);
+    if (reply == NULL || reply->type != REDIS_REPLY_NIL) {
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = redisCommand(vi->ctx, "unlink %s", key);
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || 
+        reply->integer != 0) {
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+    test_hash_members_destroy(thms);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    if (thms) test_hash_members_destroy(thms);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
 static int simple_test_cmd_pfadd_pfcount(vire_instance *vi)
 {
     char *key = "test_cmd_pfadd_pfcount-key";
@@ -1351,6 +1419,125 @@ error:
     return 0;
 }
 
+#define TEST_LOCK_BATCH_ROUNDS 200
+
+struct test_lock_batch_writer {
+    vire_instance *vi;
+    char *key;
+    int ok;
+};
+
+static void *simple_test_lock_batch_writer_run(void *arg)
+{
+    struct test_lock_batch_writer *w = arg;
+    redisContext *ctx;
+    redisReply *reply;
+    int j;
+
+    ctx = redisConnect(w->vi->host, w->vi->port);
+    if (ctx == NULL || ctx->err) {
+        if (ctx) redisFree(ctx);
+        return NULL;
+    }
+
+    for (j = 0; j < TEST_LOCK_BATCH_ROUNDS; j ++) {
+        reply = redisCommand(ctx, "set %s %d", w->key, j);
+        if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+            if (reply) freeReplyObject(reply);
+            redisFree(ctx);
+            return NULL;
+        }
+        freeReplyObject(reply);
+    }
+
+    redisFree(ctx);
+    w->ok = 1;
+    return NULL;
+}
+
+/* A pipelined GET keeps an optimistic read slot of the db for the next
+ * command, the KEYS after it must not run in that slot, and the writer
+ * must still get in between the batches. */
+static int simple_test_lock_batch_get_keys(void)
+{
+    char *key = "test_lock_batch-key";
+    char *MESSAGE = "Lock batch GET KEYS pipeline test";
+    vire_instance *vi;
+    redisReply *reply = NULL;
+    struct test_lock_batch_writer w;
+    pthread_t writer;
+    int writer_started = 0;
+    int j, k;
+
+    vi = start_one_vire_instance_with_options("db-optimistic-read yes");
+    if (vi == NULL) {
+        test_log_error("Run vire instance failed");
+        return 0;
+    }
+
+    reply = redisCommand(vi->ctx, "set %s %d", key, 0);
+    if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+        goto error;
+    }
+    freeReplyObject(reply);
+    reply = NULL;
+
+    w.vi = vi;
+    w.key = key;
+    w.ok = 0;
+    if (pthread_create(&writer, NULL, simple_test_lock_batch_writer_run, &w) != 0) {
+        goto error;
+    }
+    writer_started = 1;
+
+    for (j = 0; j < TEST_LOCK_BATCH_ROUNDS; j ++) {
+        redisAppendCommand(vi->ctx, "get %s", key);
+        redisAppendCommand(vi->ctx, "keys %s", key);
+        redisAppendCommand(vi->ctx, "get %s", key);
+        for (k = 0; k < 3; k ++) {
+            if (redisGetReply(vi->ctx, (void **)&reply) != REDIS_OK || 
+                reply == NULL) {
+                reply = NULL;
+                goto error;
+            }
+            if (k == 1) {
+                if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 1 || 
+                    reply->element[0]->type != REDIS_REPLY_STRING || 
+                    strcmp(reply->element[0]->str, key)) {
+                    goto error;
+                }
+            } else if (reply->type != REDIS_REPLY_STRING) {
+                goto error;
+            }
+            freeReplyObject(reply);
+            reply = NULL;
+        }
+    }
+
+    pthread_join(writer, NULL);
+    writer_started = 0;
+    if (!w.ok) {
+        goto error;
+    }
+
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_OK,MESSAGE,errmsg);
+
+    return 1;
+
+error:
+
+    if (reply) freeReplyObject(reply);
+    if (writer_started) pthread_join(writer, NULL);
+    vire_instance_destroy(vi);
+
+    show_test_result(VRT_TEST_ERR,MESSAGE,errmsg);
+    errmsg[0] = '\0';
+
+    return 0;
+}
+
 int simple_test(void)
 {
     vire_instance *vi;
@@ -1386,10 +1573,15 @@ int simple_test(void)
     ok_count+=simple_test_cmd_hget_hset(vi); all_count++;
     ok_count+=simple_test_cmd_hlen(vi); all_count++;
     ok_count+=simple_test_cmd_hdel(vi); all_count++;
+    /* Keys */
+    ok_count+=simple_test_cmd_unlink(vi); all_count++;
     /* HyperLogLog */
     ok_count+=simple_test_cmd_pfadd_pfcount(vi); all_count++;
     
     vire_instance_destroy(vi);
 
+    /* Db lock batch */
+    ok_count+=simple_test_lock_batch_get_keys(); all_count++;
+
     return ok_count==all_count?1:0;
 }
@@ -12,6 +12,7 @@
 #include <vrt_util.h>
 #include <vrt_public.h>
 #include <vrt_simple.h>
+#include <vrt_persist.h>
 
 struct config {
     char *pid_filename;
@@ -139,6 +140,7 @@ main(int argc, char **argv)
     test_log_out("Testing Vire version %s \n", VR_VERSION_STRING);
     
     ok_count+=simple_test(); all_count++;
+    ok_count+=persist_test(); all_count++;
     
 clean:
     destroy_work_dir();